@@ -0,0 +1,787 @@
+// Benchmark of the FALCONN core used by falconnr: build time, query
+// throughput and recall for each combination of LSH family, low-level
+// storage and distance function, on synthetic data or on datasets in the
+// fvecs format (such as SIFT and GloVe). See README.md for the options.
+//
+// The results are written as a single JSON document so that runs can be
+// compared by the performance regression scripts.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "falconn/lsh_nn_table.h"
+
+using falconn::DenseVector;
+using falconn::DistanceFunction;
+using falconn::InstrumentationLevel;
+using falconn::LSHConstructionParameters;
+using falconn::LSHFamily;
+using falconn::LSHNearestNeighborQuery;
+using falconn::LSHNearestNeighborTable;
+using falconn::PlainArrayPointSet;
+using falconn::QueryInstrumentation;
+using falconn::StorageHashTable;
+
+typedef DenseVector<float> Point;
+
+namespace {
+
+class BenchmarkError : public std::runtime_error {
+ public:
+  BenchmarkError(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+// Points stored row by row, as expected by PlainArrayPointSet
+struct Dataset {
+  int_fast64_t num_points = 0;
+  int_fast32_t dimension = 0;
+  std::vector<float> data;
+
+  const float* row(int_fast64_t ii) const {
+    return data.data() + ii * dimension;
+  }
+};
+
+struct Options {
+  std::string name = "synthetic";
+  std::string base_file;
+  std::string query_file;
+  std::string groundtruth_file;
+  std::string output_file;
+  int_fast64_t num_points = 100000;
+  int_fast32_t dimension = 128;
+  int_fast64_t num_queries = 1000;
+  int_fast32_t k = 10;
+  int_fast32_t l = 10;
+  int_fast32_t num_hash_bits = -1;
+  bool normalize = false;
+  uint64_t seed = 409556018;
+  std::vector<int> threads = {1};
+  std::vector<int> num_probes;
+  std::vector<int> pipeline_depths = {0};
+  // One in this many queries is measured, none with 0
+  int_fast64_t sample_period = 1;
+  std::vector<LSHFamily> families = {LSHFamily::Hyperplane,
+                                     LSHFamily::CrossPolytope};
+  std::vector<StorageHashTable> storages = {
+      StorageHashTable::FlatHashTable, StorageHashTable::BitPackedFlatHashTable,
+      StorageHashTable::STLHashTable, StorageHashTable::LinearProbingHashTable,
+      StorageHashTable::CompressedFlatHashTable,
+      StorageHashTable::InlineFlatHashTable};
+  std::vector<DistanceFunction> distances = {
+      DistanceFunction::EuclideanSquared,
+      DistanceFunction::NegativeInnerProduct};
+};
+
+typedef std::chrono::high_resolution_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::duration<double>>(
+             Clock::now() - start)
+      .count();
+}
+
+std::vector<std::string> split(const std::string& list) {
+  std::vector<std::string> result;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) {
+      result.push_back(item);
+    }
+  }
+  return result;
+}
+
+std::vector<int> parse_int_list(const std::string& list) {
+  std::vector<int> result;
+  for (const std::string& item : split(list)) {
+    result.push_back(std::stoi(item));
+  }
+  return result;
+}
+
+const char* family_name(LSHFamily family) {
+  switch (family) {
+    case LSHFamily::Hyperplane:
+      return "hyperplane";
+    case LSHFamily::CrossPolytope:
+      return "cross_polytope";
+    default:
+      return "unknown";
+  }
+}
+
+const char* storage_name(StorageHashTable storage) {
+  switch (storage) {
+    case StorageHashTable::FlatHashTable:
+      return "flat";
+    case StorageHashTable::BitPackedFlatHashTable:
+      return "bit_packed_flat";
+    case StorageHashTable::STLHashTable:
+      return "stl";
+    case StorageHashTable::LinearProbingHashTable:
+      return "linear_probing";
+    case StorageHashTable::CompressedFlatHashTable:
+      return "compressed_flat";
+    case StorageHashTable::InlineFlatHashTable:
+      return "inline_flat";
+    default:
+      return "unknown";
+  }
+}
+
+const char* distance_name(DistanceFunction distance) {
+  switch (distance) {
+    case DistanceFunction::EuclideanSquared:
+      return "euclidean_squared";
+    case DistanceFunction::NegativeInnerProduct:
+      return "negative_inner_product";
+    default:
+      return "unknown";
+  }
+}
+
+template <typename T, typename NameFunction>
+std::vector<T> parse_choices(const std::string& list,
+                             const std::vector<T>& all, NameFunction name) {
+  std::vector<T> result;
+  for (const std::string& item : split(list)) {
+    bool found = false;
+    for (T choice : all) {
+      if (item == name(choice)) {
+        result.push_back(choice);
+        found = true;
+      }
+    }
+    if (!found) {
+      throw BenchmarkError("unknown choice: " + item);
+    }
+  }
+  return result;
+}
+
+void usage() {
+  std::cerr
+      << "usage: falconn_bench [options]\n"
+         "  --synthetic N,D        random data (default 100000,128)\n"
+         "  --base FILE.fvecs      data points\n"
+         "  --queries FILE.fvecs   query points (default: perturbed data)\n"
+         "  --groundtruth FILE.ivecs  nearest neighbors of the queries\n"
+         "  --name NAME            dataset name in the output\n"
+         "  --num-queries Q        number of queries (default 1000)\n"
+         "  --k K                  neighbors per query (default 10)\n"
+         "  --l L                  number of tables (default 10)\n"
+         "  --bits B               hash bits per table (default log2(N)-2)\n"
+         "  --num-probes P1,P2,... probes per query (default L)\n"
+         "  --threads T1,T2,...    thread counts (default 1)\n"
+         "  --pipeline-depths D1,... queries prefetched ahead (default 0)\n"
+         "  --sample-period S      measure one in S queries, none with 0\n"
+         "                         (default 1)\n"
+         "  --families F1,...      hyperplane,cross_polytope\n"
+         "  --storage S1,...       flat,bit_packed_flat,stl,\n"
+         "                         linear_probing,compressed_flat,\n"
+         "                         inline_flat\n"
+         "  --distances D1,...     euclidean_squared,negative_inner_product\n"
+         "  --normalize            scale points and queries to unit length\n"
+         "  --seed S               randomness seed\n"
+         "  --output FILE.json     output file (default standard output)\n";
+}
+
+Options parse_options(int argc, char** argv) {
+  Options options;
+  for (int ii = 1; ii < argc; ++ii) {
+    std::string arg = argv[ii];
+    if (arg == "--normalize") {
+      options.normalize = true;
+      continue;
+    }
+    if (arg == "--help") {
+      usage();
+      std::exit(0);
+    }
+    if (ii + 1 >= argc) {
+      throw BenchmarkError("missing value for " + arg);
+    }
+    std::string value = argv[++ii];
+    if (arg == "--synthetic") {
+      std::vector<int> size = parse_int_list(value);
+      if (size.size() != 2) {
+        throw BenchmarkError("--synthetic needs N,D");
+      }
+      options.num_points = size[0];
+      options.dimension = size[1];
+    } else if (arg == "--base") {
+      options.base_file = value;
+    } else if (arg == "--queries") {
+      options.query_file = value;
+    } else if (arg == "--groundtruth") {
+      options.groundtruth_file = value;
+    } else if (arg == "--name") {
+      options.name = value;
+    } else if (arg == "--num-queries") {
+      options.num_queries = std::stoll(value);
+    } else if (arg == "--k") {
+      options.k = std::stoi(value);
+    } else if (arg == "--l") {
+      options.l = std::stoi(value);
+    } else if (arg == "--bits") {
+      options.num_hash_bits = std::stoi(value);
+    } else if (arg == "--num-probes") {
+      options.num_probes = parse_int_list(value);
+    } else if (arg == "--threads") {
+      options.threads = parse_int_list(value);
+    } else if (arg == "--pipeline-depths") {
+      options.pipeline_depths = parse_int_list(value);
+    } else if (arg == "--sample-period") {
+      options.sample_period = std::stoll(value);
+    } else if (arg == "--families") {
+      options.families =
+          parse_choices(value, options.families, family_name);
+    } else if (arg == "--storage") {
+      options.storages =
+          parse_choices(value, options.storages, storage_name);
+    } else if (arg == "--distances") {
+      options.distances =
+          parse_choices(value, options.distances, distance_name);
+    } else if (arg == "--seed") {
+      options.seed = std::stoull(value);
+    } else if (arg == "--output") {
+      options.output_file = value;
+    } else {
+      throw BenchmarkError("unknown option " + arg);
+    }
+  }
+  if (options.k < 1 || options.l < 1 || options.num_queries < 1) {
+    throw BenchmarkError("--k, --l and --num-queries must be positive");
+  }
+  if (options.sample_period < 0) {
+    throw BenchmarkError("--sample-period cannot be negative");
+  }
+  for (int num_threads : options.threads) {
+    if (num_threads < 1) {
+      throw BenchmarkError("thread counts must be positive");
+    }
+  }
+  for (int depth : options.pipeline_depths) {
+    if (depth < 0) {
+      throw BenchmarkError("pipeline depths cannot be negative");
+    }
+  }
+  if (options.num_probes.empty()) {
+    options.num_probes.push_back(options.l);
+  }
+  return options;
+}
+
+// Reads the vectors of an fvecs or ivecs file: each vector is stored as its
+// dimension (a 32-bit integer) followed by that many 32-bit values.
+template <typename T>
+void read_vecs(const std::string& filename, int_fast64_t max_vectors,
+               int_fast32_t* dimension, std::vector<T>* values) {
+  std::ifstream input(filename, std::ios::binary);
+  if (!input) {
+    throw BenchmarkError("cannot open " + filename);
+  }
+  values->clear();
+  *dimension = -1;
+  int32_t d;
+  int_fast64_t count = 0;
+  while ((max_vectors < 0 || count < max_vectors) &&
+         input.read(reinterpret_cast<char*>(&d), sizeof(d))) {
+    if (d <= 0 || (*dimension >= 0 && d != *dimension)) {
+      throw BenchmarkError("inconsistent dimensions in " + filename);
+    }
+    *dimension = d;
+    size_t start = values->size();
+    values->resize(start + d);
+    if (!input.read(reinterpret_cast<char*>(values->data() + start),
+                    d * sizeof(T))) {
+      throw BenchmarkError("truncated file " + filename);
+    }
+    ++count;
+  }
+  if (count == 0) {
+    throw BenchmarkError("no vectors in " + filename);
+  }
+}
+
+Dataset read_fvecs(const std::string& filename, int_fast64_t max_vectors) {
+  Dataset result;
+  read_vecs(filename, max_vectors, &result.dimension, &result.data);
+  result.num_points = result.data.size() / result.dimension;
+  return result;
+}
+
+void normalize(Dataset* dataset) {
+  for (int_fast64_t ii = 0; ii < dataset->num_points; ++ii) {
+    Eigen::Map<Point> row(dataset->data.data() + ii * dataset->dimension,
+                          dataset->dimension);
+    float norm = row.norm();
+    if (norm > 0.0f) {
+      row /= norm;
+    }
+  }
+}
+
+// Random points on the unit sphere
+Dataset make_points(int_fast64_t num_points, int_fast32_t dimension,
+                    std::mt19937_64* gen) {
+  std::normal_distribution<float> gaussian;
+  Dataset result;
+  result.num_points = num_points;
+  result.dimension = dimension;
+  result.data.resize(num_points * dimension);
+  for (float& x : result.data) {
+    x = gaussian(*gen);
+  }
+  normalize(&result);
+  return result;
+}
+
+// Queries close to randomly chosen data points: each is a data point moved
+// by about a quarter of the typical distance between points.
+Dataset make_queries(const Dataset& data, int_fast64_t num_queries,
+                     std::mt19937_64* gen) {
+  std::normal_distribution<float> gaussian;
+  std::uniform_int_distribution<int_fast64_t> pick(0, data.num_points - 1);
+  Dataset result;
+  result.num_points = num_queries;
+  result.dimension = data.dimension;
+  result.data.resize(num_queries * data.dimension);
+  float norm = 0.0f;
+  for (int_fast32_t jj = 0; jj < 4 && jj < data.num_points; ++jj) {
+    norm += Eigen::Map<const Point>(data.row(jj), data.dimension).norm() / 4;
+  }
+  float noise = 0.25f * norm / std::sqrt(static_cast<float>(data.dimension));
+  for (int_fast64_t ii = 0; ii < num_queries; ++ii) {
+    const float* source = data.row(pick(*gen));
+    for (int_fast32_t jj = 0; jj < data.dimension; ++jj) {
+      result.data[ii * data.dimension + jj] =
+          source[jj] + noise * gaussian(*gen);
+    }
+  }
+  return result;
+}
+
+// Runs f(begin, end) on num_threads threads over [0, count)
+void parallel_for(int num_threads, int_fast64_t count,
+                  std::function<void(int, int_fast64_t, int_fast64_t)> f) {
+  std::vector<std::thread> threads;
+  for (int tt = 0; tt < num_threads; ++tt) {
+    int_fast64_t begin = count * tt / num_threads;
+    int_fast64_t end = count * (tt + 1) / num_threads;
+    threads.push_back(std::thread(f, tt, begin, end));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+double distance(DistanceFunction function, const float* p, const float* q,
+                int_fast32_t dimension) {
+  Eigen::Map<const Point> x(p, dimension);
+  Eigen::Map<const Point> y(q, dimension);
+  if (function == DistanceFunction::NegativeInnerProduct) {
+    return -x.dot(y);
+  }
+  return (x - y).squaredNorm();
+}
+
+// The k nearest data points of each query by linear scan, k per query
+std::vector<int32_t> brute_force_neighbors(const Dataset& data,
+                                           const Dataset& queries,
+                                           DistanceFunction function, int k,
+                                           int num_threads) {
+  std::vector<int32_t> result(queries.num_points * k);
+  parallel_for(
+      num_threads, queries.num_points,
+      [&](int, int_fast64_t begin, int_fast64_t end) {
+        std::vector<std::pair<double, int32_t>> scored(data.num_points);
+        for (int_fast64_t qq = begin; qq < end; ++qq) {
+          for (int_fast64_t ii = 0; ii < data.num_points; ++ii) {
+            scored[ii] = std::make_pair(
+                distance(function, data.row(ii), queries.row(qq),
+                         data.dimension),
+                static_cast<int32_t>(ii));
+          }
+          std::partial_sort(scored.begin(), scored.begin() + k, scored.end());
+          for (int jj = 0; jj < k; ++jj) {
+            result[qq * k + jj] = scored[jj].second;
+          }
+        }
+      });
+  return result;
+}
+
+// Resident set size of this process, or -1 where it cannot be determined
+int_fast64_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  int_fast64_t size, resident;
+  if (statm >> size >> resident) {
+#ifdef __linux__
+    return resident * static_cast<int_fast64_t>(sysconf(_SC_PAGESIZE));
+#endif
+  }
+  return -1;
+}
+
+// Minimal JSON output: objects and arrays keep track of their commas
+class JsonWriter {
+ public:
+  explicit JsonWriter(std::ostream* out) : out_(*out) {
+    out_ << std::setprecision(6);
+  }
+
+  JsonWriter& begin_object(const char* key = nullptr) {
+    return open(key, '{');
+  }
+  JsonWriter& end_object() { return close('}'); }
+  JsonWriter& begin_array(const char* key = nullptr) { return open(key, '['); }
+  JsonWriter& end_array() { return close(']'); }
+
+  template <typename T>
+  JsonWriter& value(const char* key, const T& x) {
+    separate(key);
+    out_ << x;
+    return *this;
+  }
+
+  JsonWriter& value(const char* key, const std::string& x) {
+    separate(key);
+    out_ << '"';
+    for (char c : x) {
+      if (c == '"' || c == '\\') {
+        out_ << '\\';
+      }
+      out_ << c;
+    }
+    out_ << '"';
+    return *this;
+  }
+
+  JsonWriter& value(const char* key, const char* x) {
+    return value(key, std::string(x));
+  }
+
+  JsonWriter& value(const char* key, bool x) {
+    separate(key);
+    out_ << (x ? "true" : "false");
+    return *this;
+  }
+
+  JsonWriter& value(const char* key, double x) {
+    separate(key);
+    if (std::isfinite(x)) {
+      out_ << x;
+    } else {
+      out_ << "null";
+    }
+    return *this;
+  }
+
+ private:
+  std::ostream& out_;
+  std::vector<bool> first_;
+
+  void separate(const char* key) {
+    if (!first_.empty()) {
+      if (!first_.back()) {
+        out_ << ",";
+      }
+      first_.back() = false;
+      out_ << "\n" << std::string(2 * first_.size(), ' ');
+    }
+    if (key != nullptr) {
+      out_ << '"' << key << "\": ";
+    }
+  }
+
+  JsonWriter& open(const char* key, char bracket) {
+    separate(key);
+    out_ << bracket;
+    first_.push_back(true);
+    return *this;
+  }
+
+  JsonWriter& close(char bracket) {
+    bool empty = first_.back();
+    first_.pop_back();
+    if (!empty) {
+      out_ << "\n" << std::string(2 * first_.size(), ' ');
+    }
+    out_ << bracket;
+    if (first_.empty()) {
+      out_ << "\n";
+    }
+    return *this;
+  }
+};
+
+double recall_at_k(const std::vector<int32_t>& found,
+                   const int32_t* truth, int k) {
+  int matches = 0;
+  for (int jj = 0; jj < k; ++jj) {
+    if (std::find(found.begin(), found.end(), truth[jj]) != found.end()) {
+      ++matches;
+    }
+  }
+  return static_cast<double>(matches) / k;
+}
+
+LSHConstructionParameters table_parameters(const Options& options,
+                                           const Dataset& data,
+                                           LSHFamily family,
+                                           StorageHashTable storage,
+                                           DistanceFunction distance) {
+  LSHConstructionParameters params = falconn::get_default_parameters<Point>(
+      data.num_points, data.dimension, distance, true);
+  params.lsh_family = family;
+  params.storage_hash_table = storage;
+  params.l = options.l;
+  params.seed = options.seed;
+
+  int_fast32_t num_hash_bits = options.num_hash_bits;
+  if (num_hash_bits < 1) {
+    // as in get_default_parameters
+    num_hash_bits = 1;
+    while ((int_fast64_t(1) << (num_hash_bits + 2)) <= data.num_points) {
+      ++num_hash_bits;
+    }
+  }
+  falconn::compute_number_of_hash_functions<Point>(num_hash_bits, &params);
+  return params;
+}
+
+// Builds the table once for each thread count, then measures the queries
+// with each number of probes
+void run_configuration(const Options& options, const Dataset& data,
+                       const Dataset& queries,
+                       const std::vector<int32_t>& truth, LSHFamily family,
+                       StorageHashTable storage, DistanceFunction distance,
+                       JsonWriter* json) {
+  PlainArrayPointSet<float> points;
+  points.data = data.data.data();
+  points.num_points = data.num_points;
+  points.dimension = data.dimension;
+  // Unsupported or too large combinations (such as a flat hash table with
+  // many hash bits) are reported in the output instead of ending the benchmark.
+  LSHConstructionParameters params;
+  std::unique_ptr<LSHNearestNeighborTable<Point>> table;
+  std::vector<double> build_seconds;
+  int_fast64_t index_bytes = -1;
+  std::string error;
+  try {
+    params = table_parameters(options, data, family, storage, distance);
+    for (int num_threads : options.threads) {
+      table.reset();
+      params.num_setup_threads = num_threads;
+      int_fast64_t resident_before = resident_bytes();
+      Clock::time_point start = Clock::now();
+      table = falconn::construct_table<Point>(points, params);
+      build_seconds.push_back(seconds_since(start));
+      if (resident_before >= 0 && index_bytes < 0) {
+        index_bytes = resident_bytes() - resident_before;
+      }
+    }
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+
+  json->begin_object()
+      .value("family", family_name(family))
+      .value("storage", storage_name(storage))
+      .value("distance", distance_name(distance))
+      .value("k", params.k)
+      .value("l", params.l);
+  if (family == LSHFamily::CrossPolytope) {
+    json->value("last_cp_dimension", params.last_cp_dimension);
+  }
+  if (!error.empty()) {
+    json->value("error", error).end_object();
+    return;
+  }
+
+  json->begin_array("build");
+  for (size_t ii = 0; ii < build_seconds.size(); ++ii) {
+    json->begin_object()
+        .value("threads", options.threads[ii])
+        .value("seconds", build_seconds[ii])
+        .end_object();
+  }
+  json->end_array();
+  json->value("index_resident_bytes", index_bytes);
+
+  int k = options.k;
+  json->begin_array("queries");
+  for (int num_probes : options.num_probes) {
+    for (int num_threads : options.threads) {
+      for (int depth : options.pipeline_depths) {
+        QueryInstrumentation instrumentation;
+        if (options.sample_period == 0) {
+          instrumentation.level = InstrumentationLevel::None;
+        } else {
+          instrumentation.sample_period = options.sample_period;
+        }
+        std::vector<std::unique_ptr<LSHNearestNeighborQuery<Point>>> objects;
+        for (int tt = 0; tt < num_threads; ++tt) {
+          objects.push_back(table->construct_query_object(num_probes));
+          objects.back()->set_instrumentation(instrumentation);
+        }
+        std::vector<double> recall(queries.num_points);
+        Clock::time_point start = Clock::now();
+        // With a pipeline depth, each query is prefetched that many queries
+        // ahead of its search.
+        parallel_for(
+            num_threads, queries.num_points,
+            [&](int thread, int_fast64_t begin, int_fast64_t end) {
+              std::vector<int32_t> found;
+              Point ahead;
+              for (int_fast64_t qq = begin; qq < std::min(end, begin + depth);
+                   ++qq) {
+                ahead = Eigen::Map<const Point>(queries.row(qq),
+                                                queries.dimension);
+                objects[thread]->prefetch(ahead);
+              }
+              for (int_fast64_t qq = begin; qq < end; ++qq) {
+                if (qq + depth < end && depth > 0) {
+                  ahead = Eigen::Map<const Point>(queries.row(qq + depth),
+                                                  queries.dimension);
+                  objects[thread]->prefetch(ahead);
+                }
+                Eigen::Map<const Point> q(queries.row(qq), queries.dimension);
+                objects[thread]->find_k_nearest_neighbors(q, k, &found);
+                recall[qq] = recall_at_k(found, truth.data() + qq * k, k);
+              }
+            });
+        double elapsed = seconds_since(start);
+
+        double candidates = 0.0;
+        for (auto& object : objects) {
+          candidates += object->get_query_statistics()
+                            .average_num_unique_candidates;
+        }
+        double mean_recall = 0.0;
+        for (double r : recall) {
+          mean_recall += r / queries.num_points;
+        }
+        json->begin_object()
+            .value("num_probes", num_probes)
+            .value("threads", num_threads)
+            .value("pipeline_depth", depth)
+            .value("qps", queries.num_points / elapsed)
+            .value("recall_at_k", mean_recall)
+            .value("average_unique_candidates", candidates / num_threads)
+            .end_object();
+      }
+    }
+  }
+  json->end_array();
+  json->end_object();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  try {
+    Options options = parse_options(argc, argv);
+    std::mt19937_64 gen(options.seed);
+
+    Dataset data, queries;
+    if (!options.base_file.empty()) {
+      data = read_fvecs(options.base_file, -1);
+    } else {
+      data = make_points(options.num_points, options.dimension, &gen);
+    }
+    if (!options.query_file.empty()) {
+      queries = read_fvecs(options.query_file, options.num_queries);
+      if (queries.dimension != data.dimension) {
+        throw BenchmarkError("queries and data differ in dimension");
+      }
+    } else {
+      queries = make_queries(data, options.num_queries, &gen);
+    }
+    if (options.normalize) {
+      normalize(&data);
+      normalize(&queries);
+    }
+
+    std::vector<int32_t> groundtruth;
+    if (!options.groundtruth_file.empty()) {
+      std::vector<int32_t> rows;
+      int_fast32_t gt_k;
+      read_vecs(options.groundtruth_file, queries.num_points, &gt_k, &rows);
+      if (gt_k < options.k ||
+          static_cast<int_fast64_t>(rows.size()) < queries.num_points * gt_k) {
+        throw BenchmarkError("ground truth has too few neighbors or queries");
+      }
+      for (int_fast64_t qq = 0; qq < queries.num_points; ++qq) {
+        groundtruth.insert(groundtruth.end(), rows.begin() + qq * gt_k,
+                           rows.begin() + qq * gt_k + options.k);
+      }
+    }
+    int max_threads =
+        *std::max_element(options.threads.begin(), options.threads.end());
+
+    std::ostream* out = &std::cout;
+    std::ofstream file;
+    if (!options.output_file.empty()) {
+      file.open(options.output_file);
+      if (!file) {
+        throw BenchmarkError("cannot write " + options.output_file);
+      }
+      out = &file;
+    }
+
+    JsonWriter json(out);
+    json.begin_object()
+        .value("benchmark", "falconn_bench")
+        .begin_object("dataset")
+        .value("name", options.name)
+        .value("num_points", data.num_points)
+        .value("dimension", data.dimension)
+        .value("num_queries", queries.num_points)
+        .value("normalized", options.normalize)
+        .end_object()
+        .value("k", options.k)
+        .begin_array("results");
+    for (DistanceFunction distance : options.distances) {
+      std::vector<int32_t> truth = groundtruth;
+      if (truth.empty()) {
+        truth = brute_force_neighbors(data, queries, distance, options.k,
+                                      max_threads);
+      }
+      for (LSHFamily family : options.families) {
+        for (StorageHashTable storage : options.storages) {
+          run_configuration(options, data, queries, truth, family, storage,
+                            distance, &json);
+        }
+      }
+    }
+    json.end_array().end_object();
+  } catch (const std::exception& e) {
+    std::cerr << "falconn_bench: " << e.what() << std::endl;
+    usage();
+    return 1;
+  }
+  return 0;
+}
@@ -9,10 +9,12 @@ using namespace Rcpp;
 
 RcppExport SEXP _rcpp_module_boot_mod_params();
 RcppExport SEXP _rcpp_module_boot_mod_table();
+RcppExport SEXP _rcpp_module_boot_mod_sharded();
 
 static const R_CallMethodDef CallEntries[] = {
     {"_rcpp_module_boot_mod_params", (DL_FUNC) &_rcpp_module_boot_mod_params, 0},
     {"_rcpp_module_boot_mod_table", (DL_FUNC) &_rcpp_module_boot_mod_table, 0},
+    {"_rcpp_module_boot_mod_sharded", (DL_FUNC) &_rcpp_module_boot_mod_sharded, 0},
     {NULL, NULL, 0}
 };
 
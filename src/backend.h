@@ -0,0 +1,1266 @@
+/// \file backend.h
+/// \brief Precision-specific FALCONN tables behind a common interface
+///
+/// LshNnTable is exposed to R with a single set of methods, but the
+/// underlying FALCONN table is typed by its point type. The classes
+/// here hide that type: TableBackend takes queries as QueryVector views
+/// of double coordinates (as found in R vectors and matrices, dense or
+/// sparse), and TypedTableBackend and SparseTableBackend convert them
+/// to the table's point type.
+///
+/// All query methods take a thread index selecting one of the query
+/// objects reserved with reserve_query_objects(); calls with distinct
+/// thread indices may run concurrently. Index 0 is used for queries
+/// made directly from R.
+///
+/// Static tables (TypedTableBackend for dense data, SparseTableBackend
+/// for sparse data) are built once over the data; dynamic tables
+/// (DynamicTableBackend) also support inserting and removing points,
+/// which must not happen while a batch query runs.
+/// ReplicatedTableBackend keeps a copy of a static table on each NUMA
+/// node.
+
+#ifndef FALCONNR_BACKEND_H
+#define FALCONNR_BACKEND_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <RcppEigen.h>
+#include "falconnr.h"
+#include "columns.h"
+#include "brute_force.h"
+#include "knn_graph.h"
+#include "numa.h"
+#include "parallel.h"
+#include "vector_file.h"
+
+namespace falconnr {
+
+typedef std::vector<int32_t> KeyVector;
+
+class TableBackend {
+  public:
+    virtual ~TableBackend() {}
+
+    virtual std::string precision() const = 0;
+    virtual bool        is_dynamic() const = 0;
+    virtual bool        is_sparse() const = 0;
+
+    // Number of points in the table, and whether a 0-based index
+    // belongs to one of them
+    virtual int         size() const = 0;
+    virtual bool        contains(int index) const = 0;
+
+    // Add a point (dimension() coordinates), returning its 0-based
+    // index, or remove the point with the given index; only
+    // supported by dynamic tables
+    virtual int32_t insert(const double* p) = 0;
+    virtual void    remove(int index) = 0;
+
+    // Make sure at least num_threads query objects exist
+    virtual void    reserve_query_objects(int num_threads) = 0;
+
+    // Start loading the hash buckets of q, to be queried next (or after
+    // a few other prefetched points) with the same thread index; see
+    // LSHNearestNeighborQuery::prefetch
+    virtual void    prefetch(int thread_index, const QueryVector& q) = 0;
+
+    virtual int32_t find_nearest_neighbor(int thread_index,
+                                          const QueryVector& q) = 0;
+    // If distances is not null, it receives the distances of the
+    // neighbors found, in the same order, as computed by the query
+    virtual void    find_k_nearest_neighbors(int thread_index,
+                                             const QueryVector& q, int k,
+                                             KeyVector* result,
+                                             std::vector<double>* distances) = 0;
+    // As find_k_nearest_neighbors, stopping at the given limits;
+    // returns true if a limit cut the query short
+    virtual bool    find_k_nearest_neighbors_bounded(
+                        int thread_index, const QueryVector& q, int k,
+                        const falconn::QueryLimits& limits,
+                        KeyVector* result) = 0;
+    // As find_k_nearest_neighbors, over the points the filter accepts,
+    // probing up to max_num_probes times to find k of them (see
+    // LSHNearestNeighborQuery::find_k_nearest_neighbors_filtered)
+    virtual void    find_k_nearest_neighbors_filtered(
+                        int thread_index, const QueryVector& q, int k,
+                        const falconn::KeyFilter& filter, int max_num_probes,
+                        KeyVector* result, std::vector<double>* distances) = 0;
+    virtual void    find_near_neighbors(int thread_index,
+                                        const QueryVector& q, double radius,
+                                        KeyVector* result,
+                                        std::vector<double>* distances) = 0;
+    virtual void    get_candidates_with_duplicates(int thread_index,
+                                                   const QueryVector& q,
+                                                   KeyVector* result) = 0;
+    virtual void    get_unique_candidates(int thread_index,
+                                          const QueryVector& q,
+                                          KeyVector* result) = 0;
+
+    // The hash of q in each hash table, and the unique candidates in
+    // the buckets of given hashes, which are those of the queries with
+    // these hashes for one probe per table and no maximum number of
+    // candidates (see LSHNearestNeighborQuery::get_hashes)
+    virtual void    get_hashes(int thread_index, const QueryVector& q,
+                               std::vector<uint64_t>* result) = 0;
+    virtual void    get_unique_candidates_by_hashes(
+                        int thread_index, const std::vector<uint64_t>& hashes,
+                        KeyVector* result) = 0;
+
+    // The first num_candidates candidates of q in the order the maximum
+    // number of candidates takes them, with or without duplicates; the
+    // remaining probes are not walked
+    virtual void    get_first_candidates(int thread_index,
+                                         const QueryVector& q,
+                                         int num_candidates, bool unique,
+                                         KeyVector* result) = 0;
+
+    // 1-based position of the point with the given 0-based index among
+    // the candidates of q in that order, counting duplicates, or -1 if
+    // it is not among the first max_num_candidates (all if negative)
+    virtual int64_t get_candidate_position(int thread_index,
+                                           const QueryVector& q, int32_t key,
+                                           int64_t max_num_candidates) = 0;
+
+    // Number of probes after which the point with the given 0-based
+    // index is first a candidate for q, or -1 if it is not within
+    // max_num_probes probes
+    virtual int64_t get_num_probes_to_find(int thread_index,
+                                           const QueryVector& q, int32_t key,
+                                           int64_t max_num_probes) = 0;
+
+    // Exact k nearest neighbors of each query among all points of the
+    // table (see brute_force.h), written to out as 0-based indices,
+    // one row per query
+    virtual void    brute_force_knn(const DenseColumns& queries,
+                                    bool squared_euclidean, int k,
+                                    int num_threads, int32_t* out) = 0;
+
+    // The k nearest neighbors of each point among the points sharing
+    // one of its buckets (see knn_graph.h), written to out as 0-based
+    // indices, one row per index (for a dynamic table, up to the
+    // largest index ever used, with no neighbors for removed points)
+    virtual void    knn_graph(int num_tables, bool squared_euclidean, int k,
+                              int max_bucket_size, uint64_t seed,
+                              int num_threads, std::vector<int32_t>* out) = 0;
+
+    // Number of points in each non-empty bucket of one of the hash
+    // tables (0-based)
+    virtual void    get_bucket_sizes(int table,
+                                     std::vector<int_fast64_t>* sizes) const = 0;
+
+    // Exact distances from q to the points with the given 0-based
+    // indices (see point_distance and sparse_point_distance in
+    // brute_force.h)
+    virtual void    distances(const QueryVector& q, const KeyVector& keys,
+                              bool squared_euclidean,
+                              std::vector<double>* out) const = 0;
+
+    virtual void    set_num_probes(int num_probes) = 0;
+    virtual int     get_num_probes() const = 0;
+    virtual void    set_max_num_candidates(int num_candidates) = 0;
+    virtual int     get_max_num_candidates() const = 0;
+
+    // Write the coordinates of a data point (0-based index) to out,
+    // advancing stride elements per coordinate
+    virtual void    copy_point(int index, double* out, size_t stride) const = 0;
+
+    // Append the 0-based indices and values of the nonzero coordinates
+    // of a data point to indices and values
+    virtual void    copy_nonzeros(int index, std::vector<int>* indices,
+                                  std::vector<double>* values) const = 0;
+
+    // Write the table (but not the data) to a file, see load constructor
+    virtual void    save(const std::string& filename) const = 0;
+
+    // Statistics of the queries made since the last reset, combined
+    // over all query objects; neither may run during a batch query
+    virtual falconn::QueryStatistics get_query_statistics() const = 0;
+    virtual void    reset_query_statistics() = 0;
+
+    // What the query objects, including those reserved later, measure
+    // about their queries; query object i is numbered
+    // instrumentation.query_object + i * stride in trace records. Must
+    // not be called during a batch query.
+    virtual void    set_instrumentation(
+        const falconn::QueryInstrumentation& instrumentation, int stride) = 0;
+
+    // Bytes used by the table, by component, including the data held
+    // for it and the scratch of all query objects; must not be called
+    // during a batch query
+    virtual falconn::MemoryUsage get_memory_usage() const = 0;
+};
+
+// Statistics of several query objects (or tables) combined
+//
+// Each average is over the measured queries that went through its
+// phase, which are counted by the histogram of the phase, so the
+// averages of the parts are weighted by these counts.
+//
+inline void add_weighted_average(double* sum, int_fast64_t* count,
+                                 double average,
+                                 const falconn::QueryHistogram& histogram) {
+    *sum += histogram.count() * average;
+    *count += histogram.count();
+}
+
+inline double weighted_average(double sum, int_fast64_t count) {
+    return count > 0 ? sum / count : 0.0;
+}
+
+inline falconn::QueryStatistics combine_query_statistics(
+    const std::vector<falconn::QueryStatistics>& parts) {
+    falconn::QueryStatistics result;
+    int_fast64_t counts[6] = {0, 0, 0, 0, 0, 0};
+    for ( const auto& current : parts ) {
+        add_weighted_average(&result.average_total_query_time, &counts[0],
+                             current.average_total_query_time,
+                             current.total_query_time_histogram);
+        add_weighted_average(&result.average_lsh_time, &counts[1],
+                             current.average_lsh_time,
+                             current.lsh_time_histogram);
+        add_weighted_average(&result.average_hash_table_time, &counts[2],
+                             current.average_hash_table_time,
+                             current.hash_table_time_histogram);
+        add_weighted_average(&result.average_distance_time, &counts[3],
+                             current.average_distance_time,
+                             current.distance_time_histogram);
+        add_weighted_average(&result.average_num_candidates, &counts[4],
+                             current.average_num_candidates,
+                             current.num_candidates_histogram);
+        add_weighted_average(&result.average_num_unique_candidates, &counts[5],
+                             current.average_num_unique_candidates,
+                             current.num_unique_candidates_histogram);
+        result.merge_histograms(current);
+        result.num_queries += current.num_queries;
+        result.num_cache_result_hits += current.num_cache_result_hits;
+        result.num_cache_candidate_hits += current.num_cache_candidate_hits;
+        result.num_cache_misses += current.num_cache_misses;
+    }
+    result.average_total_query_time =
+        weighted_average(result.average_total_query_time, counts[0]);
+    result.average_lsh_time = weighted_average(result.average_lsh_time, counts[1]);
+    result.average_hash_table_time =
+        weighted_average(result.average_hash_table_time, counts[2]);
+    result.average_distance_time =
+        weighted_average(result.average_distance_time, counts[3]);
+    result.average_num_candidates =
+        weighted_average(result.average_num_candidates, counts[4]);
+    result.average_num_unique_candidates =
+        weighted_average(result.average_num_unique_candidates, counts[5]);
+    return result;
+}
+
+// Storage for the coordinates of the data points
+//
+// Double data is indexed in place: the R matrix is kept (and thus
+// protected) for the lifetime of the table and marked as not mutable,
+// so later modification on the R side duplicates it instead of
+// changing the indexed data. Data of any other coordinate type is
+// converted once, at construction. Data given as raw coordinates are
+// always copied, without using the R API, so that a table can keep
+// its own copy on the NUMA node of the thread building it.
+//
+// Data read from a vector file (see vector_file.h) are used in place
+// when the file is a flat array of the coordinate type, keeping the
+// file mapped, and converted once otherwise.
+//
+template <typename CoordinateType>
+class PointData {
+  public:
+    PointData() : _data(nullptr) {}
+    explicit PointData(const Rcpp::NumericMatrix& matrix)
+        : _values(matrix.begin(), matrix.end()), _data(_values.data()) {}
+    PointData(const double* values, size_t count)
+        : _values(values, values + count), _data(_values.data()) {}
+    explicit PointData(const std::shared_ptr<const VectorFile>& file)
+        : _data(file->flat_data<CoordinateType>()) {
+        if ( _data != nullptr ) {
+            _file = file;
+        } else {
+            file->copy_points(&_values);
+            _data = _values.data();
+        }
+    }
+
+    const CoordinateType* data() const { return _data; }
+
+    // The pages of a mapped file are counted as well, as they are
+    // read in by the queries
+    size_t memory_usage() const {
+        return _file ? _file->size()
+                     : _values.capacity() * sizeof(CoordinateType);
+    }
+
+  private:
+    std::vector<CoordinateType>       _values;
+    std::shared_ptr<const VectorFile> _file;
+    const CoordinateType*             _data;
+};
+
+template <>
+class PointData<double> {
+  public:
+    PointData() : _data(nullptr) {}
+    explicit PointData(const Rcpp::NumericMatrix& matrix)
+        : _matrix(matrix), _data(matrix.begin()) {
+        MARK_NOT_MUTABLE(_matrix);
+    }
+    PointData(const double* values, size_t count)
+        : _copy(values, values + count), _data(_copy.data()) {}
+    explicit PointData(const std::shared_ptr<const VectorFile>& file)
+        : _data(file->flat_data<double>()) {
+        if ( _data != nullptr ) {
+            _file = file;
+        } else {
+            file->copy_points(&_copy);
+            _data = _copy.data();
+        }
+    }
+
+    const double* data() const { return _data; }
+
+    // The matrix is R's memory (and the file the page cache's), but
+    // either is kept alive by the table
+    size_t memory_usage() const {
+        if ( _file ) {
+            return _file->size();
+        }
+        return _copy.empty() ? static_cast<size_t>(_matrix.size()) * sizeof(double)
+                             : _copy.capacity() * sizeof(double);
+    }
+
+  private:
+    Rcpp::NumericMatrix               _matrix;
+    std::vector<double>               _copy;
+    std::shared_ptr<const VectorFile> _file;
+    const double*                     _data;
+};
+
+template <typename CoordinateType>
+struct PrecisionName;
+
+template <>
+struct PrecisionName<double> {
+    static std::string name() { return "double"; }
+};
+
+template <>
+struct PrecisionName<float> {
+    static std::string name() { return "float"; }
+};
+
+// Queries, probing settings, and saving for a table of a given point
+// type; derived classes build the table over their data and convert
+// queries to the point type
+template <typename PointT>
+class BasicTableBackend : public TableBackend {
+  public:
+    typedef PointT                                                  PointType;
+    typedef typename falconn::PointTypeTraits<PointType>::ScalarType
+                                                                    CoordinateType;
+    typedef falconn::LSHNearestNeighborTable<PointType>             Table;
+    typedef falconn::LSHNearestNeighborQuery<PointType>             Query;
+
+    std::string precision() const {
+        return PrecisionName<CoordinateType>::name();
+    }
+
+    bool is_dynamic() const {
+        return false;
+    }
+
+    bool is_sparse() const {
+        return false;
+    }
+
+    int size() const {
+        return _num_points;
+    }
+
+    bool contains(int index) const {
+        return index >= 0 && index < _num_points;
+    }
+
+    int32_t insert(const double*) {
+        Rcpp::stop("points can only be inserted into dynamic tables");
+        return -1;
+    }
+
+    void remove(int) {
+        Rcpp::stop("points can only be removed from dynamic tables");
+    }
+
+    void reserve_query_objects(int num_threads) {
+        while ( static_cast<int>(_queries.size()) < num_threads ) {
+            _queries.push_back(_table->construct_query_object());
+            instrument(_queries.size() - 1);
+            _query_buffers.push_back(PointType());
+            _distance_buffers.push_back(std::vector<CoordinateType>());
+        }
+    }
+
+    // The query object copies the point, so the buffer is free again
+    // for the query running next
+    void prefetch(int thread_index, const QueryVector& q) {
+        _queries[thread_index]->prefetch(convert(thread_index, q));
+    }
+
+    int32_t find_nearest_neighbor(int thread_index, const QueryVector& q) {
+        return _queries[thread_index]->find_nearest_neighbor(
+            convert(thread_index, q));
+    }
+
+    void find_k_nearest_neighbors(int thread_index, const QueryVector& q, int k,
+                                  KeyVector* result,
+                                  std::vector<double>* distances) {
+        if ( distances == nullptr ) {
+            _queries[thread_index]->find_k_nearest_neighbors(
+                convert(thread_index, q), k, result);
+            return;
+        }
+        std::vector<CoordinateType>& found = _distance_buffers[thread_index];
+        _queries[thread_index]->find_k_nearest_neighbors(
+            convert(thread_index, q), k, result, &found);
+        distances->assign(found.begin(), found.end());
+    }
+
+    bool find_k_nearest_neighbors_bounded(int thread_index, const QueryVector& q,
+                                          int k, const falconn::QueryLimits& limits,
+                                          KeyVector* result) {
+        return _queries[thread_index]->find_k_nearest_neighbors_bounded(
+            convert(thread_index, q), k, limits, result);
+    }
+
+    void find_k_nearest_neighbors_filtered(int thread_index, const QueryVector& q,
+                                           int k, const falconn::KeyFilter& filter,
+                                           int max_num_probes, KeyVector* result,
+                                           std::vector<double>* distances) {
+        if ( distances == nullptr ) {
+            _queries[thread_index]->find_k_nearest_neighbors_filtered(
+                convert(thread_index, q), k, filter, max_num_probes, result,
+                nullptr);
+            return;
+        }
+        std::vector<CoordinateType>& found = _distance_buffers[thread_index];
+        _queries[thread_index]->find_k_nearest_neighbors_filtered(
+            convert(thread_index, q), k, filter, max_num_probes, result, &found);
+        distances->assign(found.begin(), found.end());
+    }
+
+    void find_near_neighbors(int thread_index, const QueryVector& q,
+                             double radius, KeyVector* result,
+                             std::vector<double>* distances) {
+        if ( distances == nullptr ) {
+            _queries[thread_index]->find_near_neighbors(
+                convert(thread_index, q), static_cast<CoordinateType>(radius),
+                result);
+            return;
+        }
+        std::vector<CoordinateType>& found = _distance_buffers[thread_index];
+        _queries[thread_index]->find_near_neighbors(
+            convert(thread_index, q), static_cast<CoordinateType>(radius),
+            result, &found);
+        distances->assign(found.begin(), found.end());
+    }
+
+    void get_candidates_with_duplicates(int thread_index, const QueryVector& q,
+                                        KeyVector* result) {
+        _queries[thread_index]->get_candidates_with_duplicates(
+            convert(thread_index, q), result);
+    }
+
+    void get_unique_candidates(int thread_index, const QueryVector& q,
+                               KeyVector* result) {
+        _queries[thread_index]->get_unique_candidates(
+            convert(thread_index, q), result);
+    }
+
+    void get_hashes(int thread_index, const QueryVector& q,
+                    std::vector<uint64_t>* result) {
+        _queries[thread_index]->get_hashes(convert(thread_index, q), result);
+    }
+
+    void get_unique_candidates_by_hashes(int thread_index,
+                                         const std::vector<uint64_t>& hashes,
+                                         KeyVector* result) {
+        _queries[thread_index]->get_unique_candidates_by_hashes(hashes, result);
+    }
+
+    void get_first_candidates(int thread_index, const QueryVector& q,
+                              int num_candidates, bool unique,
+                              KeyVector* result) {
+        Query& query = *_queries[thread_index];
+        const PointType& point = convert(thread_index, q);
+        falconn::CandidateCursor<int32_t>& cursor =
+            unique ? query.get_unique_candidate_sequence(point)
+                   : query.get_candidate_sequence(point);
+        int32_t key;
+        result->clear();
+        while ( static_cast<int>(result->size()) < num_candidates
+                && cursor.next(&key) ) {
+            result->push_back(key);
+        }
+    }
+
+    int64_t get_candidate_position(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_candidates) {
+        falconn::CandidateCursor<int32_t>& cursor =
+            _queries[thread_index]->get_candidate_sequence(convert(thread_index, q));
+        int32_t candidate;
+        while ( (max_num_candidates < 0 || cursor.get_num_candidates() < max_num_candidates)
+                && cursor.next(&candidate) ) {
+            if ( candidate == key ) {
+                return cursor.get_num_candidates();
+            }
+        }
+        return -1;
+    }
+
+    int64_t get_num_probes_to_find(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_probes) {
+        return _queries[thread_index]->get_num_probes_to_find(
+            convert(thread_index, q), key, max_num_probes);
+    }
+
+    void set_num_probes(int num_probes) {
+        _table->set_num_probes(num_probes);
+        for ( auto& query : _queries ) {
+            query->set_num_probes(num_probes);
+        }
+    }
+
+    int get_num_probes() const {
+        return _table->get_num_probes();
+    }
+
+    void set_max_num_candidates(int num_candidates) {
+        _table->set_max_num_candidates(num_candidates);
+        for ( auto& query : _queries ) {
+            query->set_max_num_candidates(num_candidates);
+        }
+    }
+
+    int get_max_num_candidates() const {
+        return _table->get_max_num_candidates();
+    }
+
+    void get_bucket_sizes(int table, std::vector<int_fast64_t>* sizes) const {
+        _table->get_bucket_sizes(table, sizes);
+    }
+
+    void save(const std::string& filename) const {
+        _table->save(filename);
+    }
+
+    falconn::QueryStatistics get_query_statistics() const {
+        std::vector<falconn::QueryStatistics> parts;
+        for ( auto& query : _queries ) {
+            parts.push_back(query->get_query_statistics());
+        }
+        return combine_query_statistics(parts);
+    }
+
+    void reset_query_statistics() {
+        for ( auto& query : _queries ) {
+            query->reset_query_statistics();
+        }
+    }
+
+    void set_instrumentation(const falconn::QueryInstrumentation& instrumentation,
+                             int stride) {
+        _instrumentation = instrumentation;
+        _instrumentation_stride = stride;
+        for ( size_t index = 0; index < _queries.size(); ++index ) {
+            instrument(index);
+        }
+    }
+
+    falconn::MemoryUsage get_memory_usage() const {
+        falconn::MemoryUsage result = _table->get_memory_usage();
+        result.data_storage += data_memory_usage();
+        for ( auto& query : _queries ) {
+            result.query_scratch += query->get_memory_usage();
+        }
+        for ( auto& buffer : _distance_buffers ) {
+            result.query_scratch += buffer.capacity() * sizeof(CoordinateType);
+        }
+        return result;
+    }
+
+  protected:
+    int                                  _dimension;
+    int                                  _num_points;
+    std::unique_ptr<Table>               _table;
+    std::vector<std::unique_ptr<Query> > _queries;
+    std::vector<PointType>               _query_buffers;
+    std::vector<std::vector<CoordinateType> > _distance_buffers; // per thread
+    falconn::QueryInstrumentation        _instrumentation;
+    int                                  _instrumentation_stride = 1;
+
+    BasicTableBackend(int dimension, int num_points)
+        : _dimension(dimension), _num_points(num_points) {}
+
+    // The table refers to the data held by derived classes, so these
+    // must release it first
+    void release_table() {
+        _queries.clear();
+        _table.reset();
+    }
+
+    // Copy a query into the per-thread buffer, converting coordinates
+    virtual const PointType& convert(int thread_index, const QueryVector& q) = 0;
+
+    void instrument(size_t index) {
+        falconn::QueryInstrumentation instrumentation = _instrumentation;
+        instrumentation.query_object += static_cast<int_fast32_t>(
+            index * _instrumentation_stride);
+        _queries[index]->set_instrumentation(instrumentation);
+    }
+
+    // Bytes of the data points that derived classes hold for the table
+    virtual int_fast64_t data_memory_usage() const = 0;
+};
+
+template <typename CoordinateType>
+class TypedTableBackend
+    : public BasicTableBackend<falconn::DenseVector<CoordinateType> > {
+  public:
+    typedef BasicTableBackend<falconn::DenseVector<CoordinateType> > Base;
+    typedef typename Base::PointType                                 PointType;
+    typedef falconn::PlainArrayPointSet<CoordinateType>              DataPoints;
+
+    // Build a table over the columns of tDataMatrix
+    //
+    // @param tDataMatrix -- the data, one point per column
+    // @param params      -- the FALCONN construction parameters
+    //
+    TypedTableBackend(const Rcpp::NumericMatrix& tDataMatrix,
+                      const falconn::LSHConstructionParameters& params)
+        : Base(params.dimension, tDataMatrix.ncol()), _points(tDataMatrix) {
+        DataPoints data = {_points.data(),
+                           static_cast<int_fast32_t>(tDataMatrix.ncol()),
+                           this->_dimension};
+        this->_table = falconn::construct_table<PointType, int32_t, DataPoints>(
+            data, params);
+    }
+
+    // Build a table over its own copy of the columns of a matrix
+    //
+    // This does not use the R API, so it may run on a worker thread,
+    // e.g., one bound to the NUMA node that is to hold the table.
+    //
+    // @param tData  -- the data, one point per column
+    // @param params -- the FALCONN construction parameters
+    //
+    TypedTableBackend(const DenseColumns& tData,
+                      const falconn::LSHConstructionParameters& params)
+        : Base(params.dimension, tData.ncol()),
+          _points(tData[0].values,
+                  static_cast<size_t>(tData.nrow()) * tData.ncol()) {
+        DataPoints data = {_points.data(),
+                           static_cast<int_fast32_t>(tData.ncol()),
+                           this->_dimension};
+        this->_table = falconn::construct_table<PointType, int32_t, DataPoints>(
+            data, params);
+    }
+
+    // Build a table over the points of a vector file
+    //
+    // This does not use the R API. The file is kept mapped as the data
+    // of the table if it is a flat array of CoordinateType.
+    //
+    // @param file   -- the opened file
+    // @param params -- the FALCONN construction parameters
+    //
+    TypedTableBackend(const std::shared_ptr<const VectorFile>& file,
+                      const falconn::LSHConstructionParameters& params)
+        : Base(params.dimension, file->num_points()), _points(file) {
+        DataPoints data = {_points.data(),
+                           static_cast<int_fast32_t>(file->num_points()),
+                           this->_dimension};
+        this->_table = falconn::construct_table<PointType, int32_t, DataPoints>(
+            data, params);
+    }
+
+    // Load a table saved with save() for the same data
+    //
+    // The saved hash tables are memory-mapped rather than read, so this
+    // is fast and the file's pages are shared between processes.
+    //
+    // @param tDataMatrix -- the data the table was built for, one point
+    //                       per column
+    // @param filename    -- path of the saved table
+    //
+    TypedTableBackend(const Rcpp::NumericMatrix& tDataMatrix,
+                      const std::string& filename)
+        : Base(tDataMatrix.nrow(), tDataMatrix.ncol()), _points(tDataMatrix) {
+        DataPoints data = {_points.data(),
+                           static_cast<int_fast32_t>(tDataMatrix.ncol()),
+                           this->_dimension};
+        this->_table = falconn::load_table<PointType, int32_t, DataPoints>(
+            data, filename);
+    }
+
+    ~TypedTableBackend() {
+        this->release_table();
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        DenseDataTiles<CoordinateType> data(_points.data(), this->_dimension,
+                                            this->_num_points);
+        falconnr::brute_force_knn<CoordinateType>(
+            data, queries, squared_euclidean, k, num_threads, out);
+    }
+
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        DenseDataTiles<CoordinateType> data(_points.data(), this->_dimension,
+                                            this->_num_points);
+        falconnr::knn_graph<CoordinateType>(
+            data, *this->_table, num_tables, squared_euclidean, k,
+            max_bucket_size, seed, num_threads, out);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        out->resize(keys.size());
+        for ( size_t ii = 0; ii < keys.size(); ++ii ) {
+            (*out)[ii] = point_distance(
+                q, _points.data() + static_cast<size_t>(keys[ii]) * this->_dimension,
+                this->_dimension, squared_euclidean);
+        }
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        const CoordinateType* point =
+            _points.data() + static_cast<size_t>(index) * this->_dimension;
+        for ( int jj = 0; jj < this->_dimension; ++jj ) {
+            out[jj * stride] = point[jj];
+        }
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        const CoordinateType* point =
+            _points.data() + static_cast<size_t>(index) * this->_dimension;
+        for ( int jj = 0; jj < this->_dimension; ++jj ) {
+            if ( point[jj] != 0 ) {
+                indices->push_back(jj);
+                values->push_back(point[jj]);
+            }
+        }
+    }
+
+  protected:
+    PointData<CoordinateType> _points;
+
+    // For derived classes, which set up _table themselves
+    explicit TypedTableBackend(int dimension) : Base(dimension, 0) {}
+
+    int_fast64_t data_memory_usage() const {
+        return _points.memory_usage();
+    }
+
+    // Dense queries are copied; sparse ones are scattered into zeros. The
+    // FALCONN point type is an owning Eigen vector, so a query cannot be a
+    // view of the R vector; the buffer of the thread is reused, so the copy
+    // does not allocate once the buffer has the table's dimension.
+    const PointType& convert(int thread_index, const QueryVector& q) {
+        PointType& query = this->_query_buffers[thread_index];
+        if ( q.is_sparse() ) {
+            query.setZero(this->_dimension);
+            for ( int jj = 0; jj < q.nnz; ++jj ) {
+                query[q.indices[jj]] = static_cast<CoordinateType>(q.values[jj]);
+            }
+        } else {
+            query = Eigen::Map<const Eigen::VectorXd>(q.values, this->_dimension)
+                        .template cast<CoordinateType>();
+        }
+        return query;
+    }
+};
+
+template <typename CoordinateType>
+class DynamicTableBackend : public TypedTableBackend<CoordinateType> {
+  public:
+    typedef TypedTableBackend<CoordinateType>                       Base;
+    typedef typename Base::PointType                                PointType;
+    typedef typename Base::DataPoints                               DataPoints;
+    typedef falconn::LSHNearestNeighborDynamicTable<PointType>      DynamicTable;
+
+    // Build a dynamic table over the columns of tDataMatrix
+    //
+    // The table copies the data into its own growable storage, so the
+    // matrix is only read here.
+    //
+    // @param tDataMatrix -- the initial data, one point per column
+    // @param params      -- the FALCONN construction parameters
+    //
+    DynamicTableBackend(const Rcpp::NumericMatrix& tDataMatrix,
+                        const falconn::LSHConstructionParameters& params)
+        : Base(params.dimension) {
+        PointData<CoordinateType> initial(tDataMatrix);
+        DataPoints data = {initial.data(),
+                           static_cast<int_fast32_t>(tDataMatrix.ncol()),
+                           this->_dimension};
+        std::unique_ptr<DynamicTable> table =
+            falconn::construct_dynamic_table<PointType, int32_t, DataPoints>(
+                data, params);
+        _dynamic_table = table.get();
+        this->_table = std::move(table);
+    }
+
+    bool is_dynamic() const {
+        return true;
+    }
+
+    // Prefetching does nothing for dynamic tables, so skip converting
+    void prefetch(int, const QueryVector&) {}
+
+    int size() const {
+        return _dynamic_table->get_num_points();
+    }
+
+    bool contains(int index) const {
+        return _dynamic_table->contains(index);
+    }
+
+    int32_t insert(const double* p) {
+        return _dynamic_table->insert(this->convert(0, p));
+    }
+
+    void remove(int index) {
+        _dynamic_table->remove(index);
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        DynamicDataTiles<DynamicTable, CoordinateType> data(
+            *_dynamic_table, this->_dimension, num_threads);
+        falconnr::brute_force_knn<CoordinateType>(
+            data, queries, squared_euclidean, k, num_threads, out);
+    }
+
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        DynamicDataTiles<DynamicTable, CoordinateType> data(
+            *_dynamic_table, this->_dimension, num_threads);
+        falconnr::knn_graph<CoordinateType>(
+            data, *_dynamic_table, num_tables, squared_euclidean, k,
+            max_bucket_size, seed, num_threads, out);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        PointType point;
+        out->resize(keys.size());
+        for ( size_t ii = 0; ii < keys.size(); ++ii ) {
+            _dynamic_table->get_point(keys[ii], &point);
+            (*out)[ii] = point_distance(q, point.data(), this->_dimension,
+                                        squared_euclidean);
+        }
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        PointType point;
+        _dynamic_table->get_point(index, &point);
+        for ( int jj = 0; jj < this->_dimension; ++jj ) {
+            out[jj * stride] = point[jj];
+        }
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        PointType point;
+        _dynamic_table->get_point(index, &point);
+        for ( int jj = 0; jj < this->_dimension; ++jj ) {
+            if ( point[jj] != 0 ) {
+                indices->push_back(jj);
+                values->push_back(point[jj]);
+            }
+        }
+    }
+
+  private:
+    DynamicTable* _dynamic_table;     // owned by _table
+};
+
+template <typename CoordinateType>
+class SparseTableBackend
+    : public BasicTableBackend<falconn::SparseVector<CoordinateType> > {
+  public:
+    typedef BasicTableBackend<falconn::SparseVector<CoordinateType> > Base;
+    typedef typename Base::PointType                                  PointType;
+    typedef std::vector<PointType>                                    DataPoints;
+
+    // Build a table over the columns of a sparse matrix
+    //
+    // The nonzero entries are copied once into the table's sparse
+    // points; the data are never densified. This does not use the R
+    // API, so it may run on a worker thread.
+    //
+    // @param tData  -- the data, one point per column
+    // @param params -- the FALCONN construction parameters
+    //
+    SparseTableBackend(const SparseColumns& tData,
+                       const falconn::LSHConstructionParameters& params)
+        : Base(params.dimension, tData.ncol()) {
+        copy_points(tData);
+        this->_table = falconn::construct_table<PointType, int32_t, DataPoints>(
+            _points, params);
+    }
+
+    // Load a table saved with save() for the same data
+    //
+    // @param tData    -- the data the table was built for, one point
+    //                    per column
+    // @param filename -- path of the saved table
+    //
+    SparseTableBackend(const SparseColumns& tData, const std::string& filename)
+        : Base(tData.nrow(), tData.ncol()) {
+        copy_points(tData);
+        this->_table = falconn::load_table<PointType, int32_t, DataPoints>(
+            _points, filename);
+    }
+
+    ~SparseTableBackend() {
+        this->release_table();
+    }
+
+    bool is_sparse() const {
+        return true;
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        SparseDataTiles<PointType> data(_points);
+        falconnr::brute_force_knn<CoordinateType>(
+            data, queries, squared_euclidean, k, num_threads, out);
+    }
+
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        SparseDataTiles<PointType> data(_points);
+        falconnr::knn_graph<CoordinateType>(
+            data, *this->_table, num_tables, squared_euclidean, k,
+            max_bucket_size, seed, num_threads, out);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        out->resize(keys.size());
+        for ( size_t ii = 0; ii < keys.size(); ++ii ) {
+            (*out)[ii] = sparse_point_distance(q, _points[keys[ii]],
+                                               this->_dimension, squared_euclidean);
+        }
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        for ( int jj = 0; jj < this->_dimension; ++jj ) {
+            out[jj * stride] = 0.0;
+        }
+        for ( const auto& entry : _points[index] ) {
+            out[entry.first * stride] = entry.second;
+        }
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        for ( const auto& entry : _points[index] ) {
+            indices->push_back(entry.first);
+            values->push_back(entry.second);
+        }
+    }
+
+  protected:
+    DataPoints _points;
+
+    int_fast64_t data_memory_usage() const {
+        int_fast64_t result = _points.capacity() * sizeof(PointType);
+        for ( const auto& point : _points ) {
+            result += point.capacity() * sizeof(typename PointType::value_type);
+        }
+        return result;
+    }
+
+    void copy_points(const SparseColumns& tData) {
+        _points.resize(tData.ncol());
+        for ( int column = 0; column < tData.ncol(); ++column ) {
+            set_point(tData[column], &_points[column]);
+        }
+    }
+
+    // Sparse queries are copied; dense ones are reduced to their nonzeros
+    const PointType& convert(int thread_index, const QueryVector& q) {
+        PointType& query = this->_query_buffers[thread_index];
+        set_point(q, &query);
+        return query;
+    }
+
+    void set_point(const QueryVector& q, PointType* point) const {
+        point->clear();
+        if ( q.is_sparse() ) {
+            point->reserve(q.nnz);
+            for ( int jj = 0; jj < q.nnz; ++jj ) {
+                point->emplace_back(q.indices[jj],
+                                    static_cast<CoordinateType>(q.values[jj]));
+            }
+        } else {
+            for ( int jj = 0; jj < this->_dimension; ++jj ) {
+                if ( q.values[jj] != 0 ) {
+                    point->emplace_back(jj, static_cast<CoordinateType>(q.values[jj]));
+                }
+            }
+        }
+    }
+};
+
+// A static table replicated on each NUMA node
+//
+// Each replica is a complete table, data included, built on a thread
+// bound to its node so that its pages are local to the node. Query
+// thread i uses the replica of node i % num_nodes, and should run
+// bound to that node (see parallel_for_on_nodes), so that bucket
+// lookups and candidate distances only read local memory. The other
+// methods use the first replica.
+//
+class ReplicatedTableBackend : public TableBackend {
+  public:
+    typedef std::unique_ptr<TableBackend> ReplicaPtr;
+
+    // Build one replica per node
+    //
+    // @param build     -- callable returning a new ReplicaPtr, run
+    //                     once on each node; it must not use the R API
+    // @param num_nodes -- number of nodes, at least 1
+    //
+    template <typename Build>
+    ReplicatedTableBackend(Build build, int num_nodes)
+        : _replicas(num_nodes) {
+        parallel_for(num_nodes, num_nodes, 1, [&](int, int node) {
+            NodeBinding binding(node);
+            _replicas[node] = build();
+        });
+    }
+
+    std::string precision() const { return _replicas[0]->precision(); }
+    bool        is_dynamic() const { return false; }
+    bool        is_sparse() const { return _replicas[0]->is_sparse(); }
+    int         size() const { return _replicas[0]->size(); }
+    bool        contains(int index) const { return _replicas[0]->contains(index); }
+
+    int32_t insert(const double*) {
+        Rcpp::stop("points can only be inserted into dynamic tables");
+        return -1;
+    }
+
+    void remove(int) {
+        Rcpp::stop("points can only be removed from dynamic tables");
+    }
+
+    // Replica j serves the threads i with i % num_nodes == j, as its
+    // query objects i / num_nodes, created on its node
+    void reserve_query_objects(int num_threads) {
+        int num_nodes = static_cast<int>(_replicas.size());
+        for ( int node = 0; node < num_nodes; ++node ) {
+            int num_local = std::max(1, (num_threads - node + num_nodes - 1) / num_nodes);
+            NodeBinding binding(node);
+            _replicas[node]->reserve_query_objects(num_local);
+        }
+    }
+
+    void prefetch(int thread_index, const QueryVector& q) {
+        replica(thread_index).prefetch(local(thread_index), q);
+    }
+
+    int32_t find_nearest_neighbor(int thread_index, const QueryVector& q) {
+        return replica(thread_index).find_nearest_neighbor(local(thread_index), q);
+    }
+
+    void find_k_nearest_neighbors(int thread_index, const QueryVector& q, int k,
+                                  KeyVector* result,
+                                  std::vector<double>* distances) {
+        replica(thread_index).find_k_nearest_neighbors(local(thread_index), q, k,
+                                                       result, distances);
+    }
+
+    bool find_k_nearest_neighbors_bounded(int thread_index, const QueryVector& q,
+                                          int k, const falconn::QueryLimits& limits,
+                                          KeyVector* result) {
+        return replica(thread_index).find_k_nearest_neighbors_bounded(
+            local(thread_index), q, k, limits, result);
+    }
+
+    void find_k_nearest_neighbors_filtered(int thread_index, const QueryVector& q,
+                                           int k, const falconn::KeyFilter& filter,
+                                           int max_num_probes, KeyVector* result,
+                                           std::vector<double>* distances) {
+        replica(thread_index).find_k_nearest_neighbors_filtered(
+            local(thread_index), q, k, filter, max_num_probes, result, distances);
+    }
+
+    void find_near_neighbors(int thread_index, const QueryVector& q,
+                             double radius, KeyVector* result,
+                             std::vector<double>* distances) {
+        replica(thread_index).find_near_neighbors(local(thread_index), q, radius,
+                                                  result, distances);
+    }
+
+    void get_candidates_with_duplicates(int thread_index, const QueryVector& q,
+                                        KeyVector* result) {
+        replica(thread_index).get_candidates_with_duplicates(local(thread_index),
+                                                             q, result);
+    }
+
+    void get_unique_candidates(int thread_index, const QueryVector& q,
+                               KeyVector* result) {
+        replica(thread_index).get_unique_candidates(local(thread_index), q, result);
+    }
+
+    void get_hashes(int thread_index, const QueryVector& q,
+                    std::vector<uint64_t>* result) {
+        replica(thread_index).get_hashes(local(thread_index), q, result);
+    }
+
+    void get_unique_candidates_by_hashes(int thread_index,
+                                         const std::vector<uint64_t>& hashes,
+                                         KeyVector* result) {
+        replica(thread_index).get_unique_candidates_by_hashes(
+            local(thread_index), hashes, result);
+    }
+
+    void get_first_candidates(int thread_index, const QueryVector& q,
+                              int num_candidates, bool unique,
+                              KeyVector* result) {
+        replica(thread_index).get_first_candidates(local(thread_index), q,
+                                                   num_candidates, unique, result);
+    }
+
+    int64_t get_candidate_position(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_candidates) {
+        return replica(thread_index).get_candidate_position(
+            local(thread_index), q, key, max_num_candidates);
+    }
+
+    int64_t get_num_probes_to_find(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_probes) {
+        return replica(thread_index).get_num_probes_to_find(
+            local(thread_index), q, key, max_num_probes);
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        _replicas[0]->brute_force_knn(queries, squared_euclidean, k,
+                                      num_threads, out);
+    }
+
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        _replicas[0]->knn_graph(num_tables, squared_euclidean, k,
+                                max_bucket_size, seed, num_threads, out);
+    }
+
+    void get_bucket_sizes(int table, std::vector<int_fast64_t>* sizes) const {
+        _replicas[0]->get_bucket_sizes(table, sizes);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        _replicas[0]->distances(q, keys, squared_euclidean, out);
+    }
+
+    void set_num_probes(int num_probes) {
+        for ( auto& replica : _replicas ) {
+            replica->set_num_probes(num_probes);
+        }
+    }
+
+    int get_num_probes() const {
+        return _replicas[0]->get_num_probes();
+    }
+
+    void set_max_num_candidates(int num_candidates) {
+        for ( auto& replica : _replicas ) {
+            replica->set_max_num_candidates(num_candidates);
+        }
+    }
+
+    int get_max_num_candidates() const {
+        return _replicas[0]->get_max_num_candidates();
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        _replicas[0]->copy_point(index, out, stride);
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        _replicas[0]->copy_nonzeros(index, indices, values);
+    }
+
+    void save(const std::string& filename) const {
+        _replicas[0]->save(filename);
+    }
+
+    falconn::QueryStatistics get_query_statistics() const {
+        std::vector<falconn::QueryStatistics> parts;
+        for ( auto& replica : _replicas ) {
+            parts.push_back(replica->get_query_statistics());
+        }
+        return combine_query_statistics(parts);
+    }
+
+    void reset_query_statistics() {
+        for ( auto& replica : _replicas ) {
+            replica->reset_query_statistics();
+        }
+    }
+
+    // Query object i of replica j serves thread i * num_nodes + j
+    void set_instrumentation(const falconn::QueryInstrumentation& instrumentation,
+                             int stride) {
+        int num_nodes = static_cast<int>(_replicas.size());
+        for ( int node = 0; node < num_nodes; ++node ) {
+            falconn::QueryInstrumentation local = instrumentation;
+            local.query_object += node * stride;
+            _replicas[node]->set_instrumentation(local, stride * num_nodes);
+        }
+    }
+
+    // The components are those of the first replica; the others, with
+    // their query scratch, count as numa_replicas
+    falconn::MemoryUsage get_memory_usage() const {
+        falconn::MemoryUsage result = _replicas[0]->get_memory_usage();
+        for ( size_t node = 1; node < _replicas.size(); ++node ) {
+            result.numa_replicas += _replicas[node]->get_memory_usage().total();
+        }
+        return result;
+    }
+
+  private:
+    std::vector<ReplicaPtr> _replicas;     // one per node
+
+    TableBackend& replica(int thread_index) {
+        return *_replicas[thread_index % _replicas.size()];
+    }
+
+    int local(int thread_index) const {
+        return thread_index / static_cast<int>(_replicas.size());
+    }
+};
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
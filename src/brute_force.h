@@ -0,0 +1,378 @@
+/// \file brute_force.h
+/// \brief Exact k-nearest-neighbor search by scanning all the data
+///
+/// The exact neighbors serve as ground truth for measuring the recall
+/// of a table and for tuning it. Queries are taken in blocks of up to
+/// kBruteForceQueryBlock (fewer in high dimension, so that a block
+/// takes at most kBruteForceMaxBlockBytes) and the data in tiles of
+/// kBruteForceDataTile points; the inner products of a block with a tile come from one
+/// matrix product (for dense data) or one pass over the nonzeros of
+/// the tile (for sparse data), and a heap per query keeps the k best
+/// points seen so far. The blocks of queries are spread across worker
+/// threads, each scanning all the data.
+///
+/// Both distance functions of the tables reduce to inner products:
+/// the negative inner product directly, and the squared Euclidean
+/// distance |x|^2 - 2 <q, x> + |q|^2, of which the last term does not
+/// change the order of the points for a query and is left out.
+/// Scores are computed in the precision of the table.
+
+#ifndef FALCONNR_BRUTE_FORCE_H
+#define FALCONNR_BRUTE_FORCE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <RcppEigen.h>
+#include "falconnr.h"
+#include "falconn/core/heap.h"
+#include "columns.h"
+#include "parallel.h"
+
+namespace falconnr {
+
+const int kBruteForceQueryBlock = 64;
+const int kBruteForceDataTile = 512;
+const size_t kBruteForceMaxBlockBytes = 1 << 22;
+
+template <typename CoordinateType>
+using ScoreMatrix =
+    Eigen::Matrix<CoordinateType, Eigen::Dynamic, Eigen::Dynamic>;
+
+// Data tiles over points stored contiguously, one after the other
+template <typename CoordinateType>
+class DenseDataTiles {
+  public:
+    DenseDataTiles(const CoordinateType* data, int dimension, int num_points)
+        : _data(data), _dimension(dimension), _num_points(num_points) {}
+
+    int  num_points() const { return _num_points; }
+    bool contains(int) const { return true; }
+
+    CoordinateType squared_norm(int index) const {
+        const CoordinateType* point = _data + static_cast<size_t>(index) * _dimension;
+        CoordinateType result = 0;
+        for ( int jj = 0; jj < _dimension; ++jj ) {
+            result += point[jj] * point[jj];
+        }
+        return result;
+    }
+
+    // Inner products of the queries (one per row) with the points
+    // [start, start + count), one column per point
+    void inner_products(int, int start, int count,
+                        const ScoreMatrix<CoordinateType>& queries,
+                        ScoreMatrix<CoordinateType>* products) {
+        Eigen::Map<const ScoreMatrix<CoordinateType> > tile(
+            _data + static_cast<size_t>(start) * _dimension, _dimension, count);
+        products->noalias() = queries * tile;
+    }
+
+    // Inner products of the points with the given indices with each
+    // other, one row and one column per point (see knn_graph.h)
+    void group_inner_products(int, const int32_t* indices, int count,
+                              ScoreMatrix<CoordinateType>* tile,
+                              ScoreMatrix<CoordinateType>* products) {
+        tile->resize(_dimension, count);
+        for ( int ii = 0; ii < count; ++ii ) {
+            tile->col(ii) = Eigen::Map<const Eigen::Matrix<CoordinateType, Eigen::Dynamic, 1> >(
+                _data + static_cast<size_t>(indices[ii]) * _dimension, _dimension);
+        }
+        products->noalias() = tile->transpose() * (*tile);
+    }
+
+  private:
+    const CoordinateType* _data;
+    int                   _dimension;
+    int                   _num_points;
+};
+
+// Data tiles over sparse points, each a vector of (index, value) pairs
+template <typename SparsePoint>
+class SparseDataTiles {
+  public:
+    typedef typename SparsePoint::value_type::second_type CoordinateType;
+
+    explicit SparseDataTiles(const std::vector<SparsePoint>& points)
+        : _points(points) {}
+
+    int  num_points() const { return static_cast<int>(_points.size()); }
+    bool contains(int) const { return true; }
+
+    CoordinateType squared_norm(int index) const {
+        CoordinateType result = 0;
+        for ( const auto& entry : _points[index] ) {
+            result += entry.second * entry.second;
+        }
+        return result;
+    }
+
+    void inner_products(int, int start, int count,
+                        const ScoreMatrix<CoordinateType>& queries,
+                        ScoreMatrix<CoordinateType>* products) {
+        products->setZero(queries.rows(), count);
+        for ( int ii = 0; ii < count; ++ii ) {
+            for ( const auto& entry : _points[start + ii] ) {
+                products->col(ii) += entry.second * queries.col(entry.first);
+            }
+        }
+    }
+
+    // Only the products above the diagonal are computed, each by
+    // merging the nonzeros of two points
+    void group_inner_products(int, const int32_t* indices, int count,
+                              ScoreMatrix<CoordinateType>*,
+                              ScoreMatrix<CoordinateType>* products) {
+        products->resize(count, count);
+        for ( int ii = 0; ii < count; ++ii ) {
+            const SparsePoint& first = _points[indices[ii]];
+            for ( int jj = ii + 1; jj < count; ++jj ) {
+                const SparsePoint& second = _points[indices[jj]];
+                CoordinateType product = 0;
+                auto left = first.begin();
+                auto right = second.begin();
+                while ( left != first.end() && right != second.end() ) {
+                    if ( left->first < right->first ) {
+                        ++left;
+                    } else if ( right->first < left->first ) {
+                        ++right;
+                    } else {
+                        product += left->second * right->second;
+                        ++left;
+                        ++right;
+                    }
+                }
+                (*products)(ii, jj) = product;
+            }
+        }
+    }
+
+  private:
+    const std::vector<SparsePoint>& _points;
+};
+
+// Data tiles over the points of a dynamic table, which are copied into
+// a tile of each thread; removed points are skipped
+template <typename DynamicTable, typename CoordinateType>
+class DynamicDataTiles {
+  public:
+    typedef falconn::DenseVector<CoordinateType> PointType;
+
+    DynamicDataTiles(const DynamicTable& table, int dimension, int num_threads)
+        : _table(table), _dimension(dimension),
+          _tiles(std::max(1, num_threads)), _points(std::max(1, num_threads)) {}
+
+    int  num_points() const { return static_cast<int>(_table.get_key_range()); }
+    bool contains(int index) const { return _table.contains(index); }
+
+    CoordinateType squared_norm(int index) {
+        _table.get_point(index, &_points[0]);
+        return _points[0].squaredNorm();
+    }
+
+    void inner_products(int thread_index, int start, int count,
+                        const ScoreMatrix<CoordinateType>& queries,
+                        ScoreMatrix<CoordinateType>* products) {
+        ScoreMatrix<CoordinateType>& tile = _tiles[thread_index];
+        PointType& point = _points[thread_index];
+        tile.resize(_dimension, count);
+        for ( int ii = 0; ii < count; ++ii ) {
+            if ( _table.contains(start + ii) ) {
+                _table.get_point(start + ii, &point);
+                tile.col(ii) = point;
+            } else {
+                tile.col(ii).setZero();
+            }
+        }
+        products->noalias() = queries * tile;
+    }
+
+    void group_inner_products(int thread_index, const int32_t* indices,
+                              int count, ScoreMatrix<CoordinateType>* tile,
+                              ScoreMatrix<CoordinateType>* products) {
+        PointType& point = _points[thread_index];
+        tile->resize(_dimension, count);
+        for ( int ii = 0; ii < count; ++ii ) {
+            _table.get_point(indices[ii], &point);
+            tile->col(ii) = point;
+        }
+        products->noalias() = tile->transpose() * (*tile);
+    }
+
+  private:
+    const DynamicTable&                      _table;
+    int                                      _dimension;
+    std::vector<ScoreMatrix<CoordinateType> > _tiles;
+    std::vector<PointType>                   _points;
+};
+
+// Exact distance from a query to one dense point, in double precision
+//
+// Used to rank the neighbors found by several tables against each
+// other, so unlike the scores above the squared Euclidean distance
+// includes |q|^2.
+//
+template <typename CoordinateType>
+double point_distance(const QueryVector& q, const CoordinateType* point,
+                      int dimension, bool squared_euclidean) {
+    double product = 0.0;
+    double point_norm = 0.0;
+    double query_norm = 0.0;
+    if ( q.is_sparse() ) {
+        for ( int jj = 0; jj < q.nnz; ++jj ) {
+            product += q.values[jj] * point[q.indices[jj]];
+            query_norm += q.values[jj] * q.values[jj];
+        }
+        if ( squared_euclidean ) {
+            for ( int jj = 0; jj < dimension; ++jj ) {
+                point_norm += static_cast<double>(point[jj]) * point[jj];
+            }
+        }
+    } else if ( squared_euclidean ) {
+        double result = 0.0;
+        for ( int jj = 0; jj < dimension; ++jj ) {
+            double difference = q.values[jj] - point[jj];
+            result += difference * difference;
+        }
+        return result;
+    } else {
+        for ( int jj = 0; jj < dimension; ++jj ) {
+            product += q.values[jj] * point[jj];
+        }
+    }
+    return squared_euclidean ? query_norm + point_norm - 2 * product : -product;
+}
+
+// Exact distance from a query to one sparse point, a vector of
+// (index, value) pairs in increasing order of index
+template <typename SparsePoint>
+double sparse_point_distance(const QueryVector& q, const SparsePoint& point,
+                      int dimension, bool squared_euclidean) {
+    double product = 0.0;
+    double point_norm = 0.0;
+    double query_norm = 0.0;
+    for ( const auto& entry : point ) {
+        point_norm += static_cast<double>(entry.second) * entry.second;
+    }
+    if ( q.is_sparse() ) {
+        auto entry = point.begin();
+        for ( int jj = 0; jj < q.nnz; ++jj ) {
+            while ( entry != point.end() && entry->first < q.indices[jj] ) {
+                ++entry;
+            }
+            if ( entry != point.end() && entry->first == q.indices[jj] ) {
+                product += q.values[jj] * entry->second;
+            }
+            query_norm += q.values[jj] * q.values[jj];
+        }
+    } else {
+        for ( const auto& entry : point ) {
+            product += q.values[entry.first] * entry.second;
+        }
+        for ( int jj = 0; jj < dimension; ++jj ) {
+            query_norm += q.values[jj] * q.values[jj];
+        }
+    }
+    return squared_euclidean ? query_norm + point_norm - 2 * product : -product;
+}
+
+// Run the search over the points of a data tile source
+//
+// @param data        -- one of the data tile sources above
+// @param queries     -- the queries, one per column
+// @param squared_euclidean -- true for the squared Euclidean distance,
+//                       false for the negative inner product
+// @param k           -- number of neighbors to find per query
+// @param num_threads -- number of worker threads
+// @param out         -- column-major matrix with one row per query and
+//                       k columns, receiving the 0-based indices of the
+//                       neighbors in order of increasing distance, and
+//                       -1 where there are fewer than k points
+//
+template <typename CoordinateType, typename DataTiles>
+void brute_force_knn(DataTiles& data, const DenseColumns& queries,
+                     bool squared_euclidean, int k, int num_threads,
+                     int32_t* out) {
+    typedef falconn::core::SimpleHeap<CoordinateType, int32_t> Heap;
+
+    int num_queries = queries.ncol();
+    int dimension = queries.nrow();
+    int num_points = data.num_points();
+
+    std::vector<CoordinateType> norms;
+    if ( squared_euclidean ) {
+        norms.resize(num_points);
+        for ( int ii = 0; ii < num_points; ++ii ) {
+            norms[ii] = data.contains(ii) ? data.squared_norm(ii) : 0;
+        }
+    }
+
+    size_t query_bytes = std::max<size_t>(1, dimension * sizeof(CoordinateType));
+    int max_block_size = static_cast<int>(std::max<size_t>(
+        1, std::min<size_t>(kBruteForceQueryBlock, kBruteForceMaxBlockBytes / query_bytes)));
+    int num_blocks = (num_queries + max_block_size - 1) / max_block_size;
+    parallel_for(num_blocks, num_threads, 1, [&](int thread_index, int block) {
+        int first = block * max_block_size;
+        int block_size = std::min(max_block_size, num_queries - first);
+
+        // One query per row, so a coordinate of all the queries is a column
+        ScoreMatrix<CoordinateType> block_queries(block_size, dimension);
+        for ( int jj = 0; jj < block_size; ++jj ) {
+            const double* query = queries[first + jj].values;
+            for ( int dd = 0; dd < dimension; ++dd ) {
+                block_queries(jj, dd) = static_cast<CoordinateType>(query[dd]);
+            }
+        }
+
+        // The heaps hold the negated scores, so the top is the worst point
+        std::vector<Heap> heaps(block_size);
+        std::vector<int>  sizes(block_size, 0);
+        for ( auto& heap : heaps ) {
+            heap.resize(k);
+            heap.reset();
+        }
+
+        ScoreMatrix<CoordinateType> products;
+        for ( int start = 0; start < num_points; start += kBruteForceDataTile ) {
+            int count = std::min(kBruteForceDataTile, num_points - start);
+            data.inner_products(thread_index, start, count, block_queries, &products);
+
+            for ( int ii = 0; ii < count; ++ii ) {
+                int32_t index = start + ii;
+                if ( !data.contains(index) ) {
+                    continue;
+                }
+                for ( int jj = 0; jj < block_size; ++jj ) {
+                    CoordinateType score = squared_euclidean
+                        ? norms[index] - 2 * products(jj, ii)
+                        : -products(jj, ii);
+                    if ( sizes[jj] < k ) {
+                        heaps[jj].insert(-score, index);
+                        ++sizes[jj];
+                    } else if ( score < -heaps[jj].min_key() ) {
+                        heaps[jj].replace_top(-score, index);
+                    }
+                }
+            }
+        }
+
+        for ( int jj = 0; jj < block_size; ++jj ) {
+            auto& items = heaps[jj].get_data();
+            std::sort(items.begin(), items.begin() + sizes[jj]);
+            int32_t* row = out + first + jj;
+            for ( int ii = 0; ii < k; ++ii ) {
+                row[static_cast<size_t>(ii) * num_queries] =
+                    ii < sizes[jj] ? items[sizes[jj] - ii - 1].data : -1;
+            }
+        }
+    });
+}
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
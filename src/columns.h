@@ -0,0 +1,117 @@
+/// \file columns.h
+/// \brief Views of R vectors and matrices as points for the tables
+///
+/// The tables take points one at a time as QueryVector views, which
+/// refer to either a dense R vector (or a column of a numeric matrix)
+/// or a sparse column of a Matrix::dgCMatrix. DenseColumns and
+/// SparseColumns give such views of the columns of a whole matrix.
+///
+/// The views hold raw pointers into the R objects, so they can be
+/// used from worker threads, but the R objects must be kept alive
+/// (protected) while the views are in use.
+
+#ifndef FALCONNR_COLUMNS_H
+#define FALCONNR_COLUMNS_H
+
+#include <Rcpp.h>
+
+namespace falconnr {
+
+// A point as passed from R: either dense, with one coordinate per
+// dimension, or sparse, with nnz (0-based index, value) entries in
+// increasing order of index
+struct QueryVector {
+    const double* values;
+    const int*    indices;     // nullptr for a dense point
+    int           nnz;
+
+    // A dense point, with coordinates the dimension of the table
+    QueryVector(const double* dense)
+        : values(dense), indices(nullptr), nnz(0) {}
+
+    // A sparse point
+    QueryVector(const double* values, const int* indices, int nnz)
+        : values(values), indices(indices), nnz(nnz) {}
+
+    bool is_sparse() const {
+        return indices != nullptr;
+    }
+};
+
+// The columns of a numeric matrix as dense points
+class DenseColumns {
+  public:
+    explicit DenseColumns(const Rcpp::NumericMatrix& matrix)
+        : _data(matrix.begin()), _nrow(matrix.nrow()), _ncol(matrix.ncol()) {}
+
+    // Columns of nrow values each, one after the other
+    DenseColumns(const double* data, int nrow, int ncol)
+        : _data(data), _nrow(nrow), _ncol(ncol) {}
+
+    int nrow() const { return _nrow; }
+    int ncol() const { return _ncol; }
+
+    QueryVector operator[](int column) const {
+        return QueryVector(_data + static_cast<size_t>(column) * _nrow);
+    }
+
+  private:
+    const double* _data;
+    int           _nrow;
+    int           _ncol;
+};
+
+// The columns of a Matrix::dgCMatrix as sparse points
+//
+// The slots are used as they are, without copying: i holds the
+// 0-based row indices of the nonzero entries, sorted within each
+// column, x their values, and p the 0-based offset of each column's
+// entries in i and x.
+class SparseColumns {
+  public:
+    explicit SparseColumns(const Rcpp::S4& matrix) {
+        if ( !matrix.is("dgCMatrix") ) {
+            Rcpp::stop("sparse data must be a dgCMatrix");
+        }
+        _i = matrix.slot("i");
+        _p = matrix.slot("p");
+        _x = matrix.slot("x");
+        Rcpp::IntegerVector dim = matrix.slot("Dim");
+        _nrow = dim[0];
+        _ncol = dim[1];
+        if ( _p.size() != _ncol + 1 || _i.size() != _x.size() ||
+             _p[_ncol] > _i.size() ) {
+            Rcpp::stop("invalid dgCMatrix");
+        }
+        _i_data = _i.begin();
+        _p_data = _p.begin();
+        _x_data = _x.begin();
+    }
+
+    int nrow() const { return _nrow; }
+    int ncol() const { return _ncol; }
+
+    QueryVector operator[](int column) const {
+        int start = _p_data[column];
+        return QueryVector(_x_data + start, _i_data + start,
+                           _p_data[column + 1] - start);
+    }
+
+  private:
+    Rcpp::IntegerVector _i;
+    Rcpp::IntegerVector _p;
+    Rcpp::NumericVector _x;
+    const int*          _i_data;
+    const int*          _p_data;
+    const double*       _x_data;
+    int                 _nrow;
+    int                 _ncol;
+};
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
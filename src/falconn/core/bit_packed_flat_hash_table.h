@@ -69,6 +69,13 @@ class BitPackedFlatHashTable {
       return *this;
     }
 
+    // Entries from here to end, and skipping entries, for splitting buckets
+    int_fast64_t distance_to(const Iterator& end) const {
+      return end.index_ - index_;
+    }
+
+    void advance(int_fast64_t num_entries) { index_ += num_entries; }
+
    private:
     ValueType index_;
     const BitPackedFlatHashTable* parent_;
@@ -133,6 +140,69 @@ class BitPackedFlatHashTable {
     return std::make_pair(Iterator(start, this), Iterator(end, this));
   }
 
+  // See FlatHashTable::prefetch_bucket
+  void prefetch_bucket(const KeyType& key) const { bucket_start_.prefetch(key); }
+
+  void prefetch_entries(const KeyType& key) const {
+    indices_.prefetch(bucket_start_.get(key));
+  }
+
+  // See FlatHashTable::for_each_bucket
+  template <typename Function>
+  void for_each_bucket(Function f) {
+    for (IndexType bb = 0; bb < num_buckets_ && entries_added_; ++bb) {
+      std::pair<Iterator, Iterator> bucket = retrieve(static_cast<KeyType>(bb));
+      if (bucket.first != bucket.second) {
+        f(bucket.first, bucket.second);
+      }
+    }
+  }
+
+  // Bytes of the bucket directory and of the point indices
+  int_fast64_t get_bucket_memory_usage() const {
+    return bucket_start_.get_memory_usage();
+  }
+
+  int_fast64_t get_entry_memory_usage() const {
+    return indices_.get_memory_usage();
+  }
+
+  // The same for a table with the given numbers of buckets and items
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t num_buckets,
+                                                   int_fast64_t num_items) {
+    return BitPackedVector<ValueType>::estimate_memory_usage(
+        num_buckets, log2ceil(num_items + 1));
+  }
+
+  static int_fast64_t estimate_entry_memory_usage(int_fast64_t num_items) {
+    return BitPackedVector<ValueType>::estimate_memory_usage(
+        num_items, log2ceil(num_items));
+  }
+
+  void serialize(BinaryWriter* output) const {
+    if (!entries_added_) {
+      throw BitPackedFlatHashTableError(
+          "Cannot serialize a table without entries.");
+    }
+    output->write_value<int64_t>(num_buckets_);
+    output->write_value<int64_t>(num_items_);
+    bucket_start_.serialize(output);
+    indices_.serialize(output);
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (entries_added_) {
+      throw BitPackedFlatHashTableError("Entries were already added.");
+    }
+    if (input->read_value<int64_t>() != num_buckets_ ||
+        input->read_value<int64_t>() != num_items_) {
+      throw BitPackedFlatHashTableError("Table shape in input does not match.");
+    }
+    bucket_start_.deserialize(input);
+    indices_.deserialize(input);
+    entries_added_ = true;
+  }
+
  private:
   IndexType num_buckets_ = 0;
   ValueType num_items_ = 0;
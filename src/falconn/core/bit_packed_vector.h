@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "../falconn_global.h"
+#include "serialization.h"
 
 namespace falconn {
 namespace core {
@@ -39,10 +40,7 @@ class BitPackedVector {
     if ((num_items_ * item_size_) % num_bits_per_package_ != 0) {
       num_data_packets_ += 1;
     }
-    data_.resize(num_data_packets_);
-    for (int_fast64_t ii = 0; ii < num_data_packets_; ++ii) {
-      data_[ii] = 0;
-    }
+    data_.assign(num_data_packets_, 0);
   }
 
   // For (potential) performance reasons, get() does no bounds checking.
@@ -142,13 +140,48 @@ class BitPackedVector {
     // printf("current state: %llx\n", data_[0]);
   }
 
+  // Brings the package holding the first bit of an item into the cache
+  void prefetch(IndexType index) const {
+    __builtin_prefetch(data_.data() + index * item_size_ / num_bits_per_package_,
+                       0, 1);
+  }
+
+  int_fast64_t get_memory_usage() const { return data_.get_memory_usage(); }
+
+  // Bytes of a vector with the given shape
+  static int_fast64_t estimate_memory_usage(int_fast64_t num_items,
+                                            int_fast64_t item_size) {
+    int_fast64_t bits_per_package = 8 * sizeof(StorageType);
+    return (num_items * item_size + bits_per_package - 1) / bits_per_package *
+           sizeof(StorageType);
+  }
+
+  void serialize(BinaryWriter* output) const {
+    output->write_value<int64_t>(num_items_);
+    output->write_value<int64_t>(item_size_);
+    data_.serialize(output);
+  }
+
+  // The vector must have been constructed with the same number of items and
+  // item size as the serialized one. Afterwards, the vector is read-only.
+  void deserialize(BinaryReader* input) {
+    if (input->read_value<int64_t>() != num_items_ ||
+        input->read_value<int64_t>() != item_size_) {
+      throw BitPackedVectorError("Vector shape in input does not match.");
+    }
+    data_.deserialize(input);
+    if (data_.size() != num_data_packets_) {
+      throw BitPackedVectorError("Vector data in input has the wrong size.");
+    }
+  }
+
  private:
   const int_fast64_t num_bits_per_package_ = 8 * sizeof(StorageType);
 
   int_fast64_t num_items_;
   int_fast64_t item_size_;
   int_fast64_t num_data_packets_;
-  std::vector<StorageType> data_;
+  ArrayStore<StorageType> data_;
 };
 
 }  // namespace core
@@ -0,0 +1,493 @@
+#ifndef __CANDIDATE_DISTANCES_H__
+#define __CANDIDATE_DISTANCES_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// The SIMD kernels are compiled with function-level target attributes and
+// selected at runtime, so the rest of the library needs no special compiler
+// flags. They are disabled on Windows, where GCC does not align the stack for
+// spilled AVX registers.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(_WIN32)
+#define FALCONN_X86_DISTANCE_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "cosine_distance.h"
+#include "data_storage.h"
+#include "euclidean_distance.h"
+#include "fixed_dimension.h"
+#include "prefetchers.h"
+
+// Evaluation of the distances between a query and all of its candidates.
+//
+// For dense points stored in a plain array (PlainArrayDataStorage and its
+// dynamic variant), the candidates are processed in blocks of
+// kDistanceBlockSize rows: the rows of upcoming blocks are prefetched, and
+// each block is compared with the query in a single pass over the query
+// coordinates, with AVX2 or AVX-512 kernels when the CPU supports them. Short
+// rows (fewer than kDistanceMinBlockedDimension coordinates), other data
+// storages and distance functions evaluate one candidate at a time
+// through the SubsequenceIterator, as before.
+//
+// Every kernel is also instantiated for the dimensions in PointDimensions,
+// which removes the loop remainders and lets the compiler unroll over the
+// coordinates. The kernel for the dimension of the data is selected on the
+// first distance computation.
+
+namespace falconn {
+namespace core {
+
+const int kDistanceBlockSize = 4;
+
+// Number of candidates between the one being compared and the one being
+// prefetched.
+const int kDistancePrefetchAhead = 8;
+
+// Only the start of long rows is prefetched; the hardware prefetcher picks up
+// the rest of a row once it is being read sequentially.
+const int kDistanceMaxPrefetchBytes = 1024;
+
+// Below this many coordinates a row fits in one cache line and the blocked
+// kernels are no faster than comparing one candidate at a time.
+const int kDistanceMinBlockedDimension = 32;
+
+enum class DenseDistanceKind { Other, EuclideanSquared, NegativeInnerProduct };
+
+template <typename DistanceFunction>
+struct DenseDistanceTraits {
+  static const DenseDistanceKind kind = DenseDistanceKind::Other;
+};
+
+template <typename CoordinateType>
+struct DenseDistanceTraits<EuclideanDistanceDense<CoordinateType>> {
+  static const DenseDistanceKind kind = DenseDistanceKind::EuclideanSquared;
+};
+
+template <typename CoordinateType>
+struct DenseDistanceTraits<CosineDistanceDense<CoordinateType>> {
+  static const DenseDistanceKind kind = DenseDistanceKind::NegativeInnerProduct;
+};
+
+namespace distance_kernels {
+
+// A block kernel writes the distances between the query q and the rows
+// rows[0], ..., rows[kDistanceBlockSize - 1] (each with dim coordinates) to
+// out.
+template <typename CoordinateType>
+using BlockKernel = void (*)(const CoordinateType* q,
+                             const CoordinateType* const* rows,
+                             int_fast64_t dim, CoordinateType* out);
+
+template <typename CoordinateType, DenseDistanceKind kKind, int kDim>
+void block_portable(const CoordinateType* q, const CoordinateType* const* rows,
+                    int_fast64_t dim, CoordinateType* out) {
+  typedef Eigen::Map<const Eigen::Matrix<CoordinateType, kDim, 1>>
+      ConstVectorMap;
+  const int_fast64_t d = kernel_dimension<kDim>(dim);
+  ConstVectorMap query(q, d);
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    ConstVectorMap row(rows[jj], d);
+    if (kKind == DenseDistanceKind::EuclideanSquared) {
+      out[jj] = (query - row).squaredNorm();
+    } else {
+      out[jj] = -query.dot(row);
+    }
+  }
+}
+
+#if defined(FALCONN_X86_DISTANCE_KERNELS)
+
+enum class SimdLevel { None, AVX2, AVX512 };
+
+inline SimdLevel detect_simd_level() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SimdLevel::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return SimdLevel::AVX2;
+  }
+  return SimdLevel::None;
+}
+
+inline SimdLevel simd_level() {
+  static const SimdLevel level = detect_simd_level();
+  return level;
+}
+
+// Write the horizontal sums of four accumulators to out[0..3], negated
+// unless kEuclidean.
+template <bool kEuclidean>
+__attribute__((target("avx2"))) inline void reduce4(const __m256* acc,
+                                                   float* out) {
+  __m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(acc[0], acc[1]),
+                               _mm256_hadd_ps(acc[2], acc[3]));
+  __m128 result = _mm_add_ps(_mm256_castps256_ps128(sums),
+                             _mm256_extractf128_ps(sums, 1));
+  if (!kEuclidean) {
+    result = _mm_sub_ps(_mm_setzero_ps(), result);
+  }
+  _mm_storeu_ps(out, result);
+}
+
+template <bool kEuclidean>
+__attribute__((target("avx2"))) inline void reduce4(const __m256d* acc,
+                                                   double* out) {
+  __m256d low = _mm256_hadd_pd(acc[0], acc[1]);
+  __m256d high = _mm256_hadd_pd(acc[2], acc[3]);
+  __m256d result = _mm256_add_pd(_mm256_permute2f128_pd(low, high, 0x21),
+                                 _mm256_blend_pd(low, high, 0xC));
+  if (!kEuclidean) {
+    result = _mm256_sub_pd(_mm256_setzero_pd(), result);
+  }
+  _mm256_storeu_pd(out, result);
+}
+
+template <DenseDistanceKind kKind, int kDim>
+__attribute__((target("avx2,fma"))) void block_avx2(const float* q,
+                                                    const float* const* rows,
+                                                    int_fast64_t dim,
+                                                    float* out) {
+  const bool euclidean = kKind == DenseDistanceKind::EuclideanSquared;
+  const int_fast64_t d = kernel_dimension<kDim>(dim);
+  __m256 acc[kDistanceBlockSize];
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    acc[jj] = _mm256_setzero_ps();
+  }
+  int_fast64_t ii = 0;
+  for (; ii + 8 <= d; ii += 8) {
+    __m256 x = _mm256_loadu_ps(q + ii);
+    for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+      __m256 y = _mm256_loadu_ps(rows[jj] + ii);
+      if (euclidean) {
+        __m256 diff = _mm256_sub_ps(x, y);
+        acc[jj] = _mm256_fmadd_ps(diff, diff, acc[jj]);
+      } else {
+        acc[jj] = _mm256_fmadd_ps(x, y, acc[jj]);
+      }
+    }
+  }
+  reduce4<euclidean>(acc, out);
+  if (kDim != Eigen::Dynamic && kDim % 8 == 0) {
+    return;
+  }
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    float tail = 0.0f;
+    for (int_fast64_t kk = ii; kk < d; ++kk) {
+      float diff = q[kk] - rows[jj][kk];
+      tail += euclidean ? diff * diff : q[kk] * rows[jj][kk];
+    }
+    out[jj] += euclidean ? tail : -tail;
+  }
+}
+
+template <DenseDistanceKind kKind, int kDim>
+__attribute__((target("avx2,fma"))) void block_avx2(const double* q,
+                                                    const double* const* rows,
+                                                    int_fast64_t dim,
+                                                    double* out) {
+  const bool euclidean = kKind == DenseDistanceKind::EuclideanSquared;
+  const int_fast64_t d = kernel_dimension<kDim>(dim);
+  __m256d acc[kDistanceBlockSize];
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    acc[jj] = _mm256_setzero_pd();
+  }
+  int_fast64_t ii = 0;
+  for (; ii + 4 <= d; ii += 4) {
+    __m256d x = _mm256_loadu_pd(q + ii);
+    for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+      __m256d y = _mm256_loadu_pd(rows[jj] + ii);
+      if (euclidean) {
+        __m256d diff = _mm256_sub_pd(x, y);
+        acc[jj] = _mm256_fmadd_pd(diff, diff, acc[jj]);
+      } else {
+        acc[jj] = _mm256_fmadd_pd(x, y, acc[jj]);
+      }
+    }
+  }
+  reduce4<euclidean>(acc, out);
+  if (kDim != Eigen::Dynamic && kDim % 4 == 0) {
+    return;
+  }
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    double tail = 0.0;
+    for (int_fast64_t kk = ii; kk < d; ++kk) {
+      double diff = q[kk] - rows[jj][kk];
+      tail += euclidean ? diff * diff : q[kk] * rows[jj][kk];
+    }
+    out[jj] += euclidean ? tail : -tail;
+  }
+}
+
+template <DenseDistanceKind kKind, int kDim>
+__attribute__((target("avx512f"))) void block_avx512(const float* q,
+                                                     const float* const* rows,
+                                                     int_fast64_t dim,
+                                                     float* out) {
+  const bool euclidean = kKind == DenseDistanceKind::EuclideanSquared;
+  const int_fast64_t d = kernel_dimension<kDim>(dim);
+  __m512 acc[kDistanceBlockSize];
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    acc[jj] = _mm512_setzero_ps();
+  }
+  int_fast64_t ii = 0;
+  for (; ii + 16 <= d; ii += 16) {
+    __m512 x = _mm512_loadu_ps(q + ii);
+    for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+      __m512 y = _mm512_loadu_ps(rows[jj] + ii);
+      if (euclidean) {
+        __m512 diff = _mm512_sub_ps(x, y);
+        acc[jj] = _mm512_fmadd_ps(diff, diff, acc[jj]);
+      } else {
+        acc[jj] = _mm512_fmadd_ps(x, y, acc[jj]);
+      }
+    }
+  }
+  if (ii < d) {
+    __mmask16 mask = static_cast<__mmask16>((1u << (d - ii)) - 1);
+    __m512 x = _mm512_maskz_loadu_ps(mask, q + ii);
+    for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+      __m512 y = _mm512_maskz_loadu_ps(mask, rows[jj] + ii);
+      if (euclidean) {
+        __m512 diff = _mm512_sub_ps(x, y);
+        acc[jj] = _mm512_fmadd_ps(diff, diff, acc[jj]);
+      } else {
+        acc[jj] = _mm512_fmadd_ps(x, y, acc[jj]);
+      }
+    }
+  }
+  __m256 halves[kDistanceBlockSize];
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    halves[jj] = _mm256_add_ps(
+        _mm512_castps512_ps256(acc[jj]),
+        _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(acc[jj]), 1)));
+  }
+  reduce4<euclidean>(halves, out);
+}
+
+template <DenseDistanceKind kKind, int kDim>
+__attribute__((target("avx512f"))) void block_avx512(const double* q,
+                                                     const double* const* rows,
+                                                     int_fast64_t dim,
+                                                     double* out) {
+  const bool euclidean = kKind == DenseDistanceKind::EuclideanSquared;
+  const int_fast64_t d = kernel_dimension<kDim>(dim);
+  __m512d acc[kDistanceBlockSize];
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    acc[jj] = _mm512_setzero_pd();
+  }
+  int_fast64_t ii = 0;
+  for (; ii + 8 <= d; ii += 8) {
+    __m512d x = _mm512_loadu_pd(q + ii);
+    for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+      __m512d y = _mm512_loadu_pd(rows[jj] + ii);
+      if (euclidean) {
+        __m512d diff = _mm512_sub_pd(x, y);
+        acc[jj] = _mm512_fmadd_pd(diff, diff, acc[jj]);
+      } else {
+        acc[jj] = _mm512_fmadd_pd(x, y, acc[jj]);
+      }
+    }
+  }
+  if (ii < d) {
+    __mmask8 mask = static_cast<__mmask8>((1u << (d - ii)) - 1);
+    __m512d x = _mm512_maskz_loadu_pd(mask, q + ii);
+    for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+      __m512d y = _mm512_maskz_loadu_pd(mask, rows[jj] + ii);
+      if (euclidean) {
+        __m512d diff = _mm512_sub_pd(x, y);
+        acc[jj] = _mm512_fmadd_pd(diff, diff, acc[jj]);
+      } else {
+        acc[jj] = _mm512_fmadd_pd(x, y, acc[jj]);
+      }
+    }
+  }
+  __m256d halves[kDistanceBlockSize];
+  for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+    halves[jj] = _mm256_add_pd(_mm512_castpd512_pd256(acc[jj]),
+                               _mm512_extractf64x4_pd(acc[jj], 1));
+  }
+  reduce4<euclidean>(halves, out);
+}
+
+#endif
+
+// The kernels of each instruction set, instantiated for a given dimension
+// (see FixedDimensions)
+template <typename CoordinateType, DenseDistanceKind kKind>
+struct PortableKernel {
+  template <int kDim>
+  static BlockKernel<CoordinateType> apply() {
+    return &block_portable<CoordinateType, kKind, kDim>;
+  }
+};
+
+// Returns the fastest kernel for the coordinate type, distance, dimension,
+// and CPU.
+template <typename CoordinateType, DenseDistanceKind kKind>
+struct BlockKernelSelector {
+  static BlockKernel<CoordinateType> select(int_fast64_t dim) {
+    return PointDimensions::dispatch<PortableKernel<CoordinateType, kKind>>(
+        dim);
+  }
+};
+
+#if defined(FALCONN_X86_DISTANCE_KERNELS)
+template <typename CoordinateType, DenseDistanceKind kKind>
+struct Avx2Kernel {
+  template <int kDim>
+  static BlockKernel<CoordinateType> apply() {
+    return &block_avx2<kKind, kDim>;
+  }
+};
+
+template <typename CoordinateType, DenseDistanceKind kKind>
+struct Avx512Kernel {
+  template <int kDim>
+  static BlockKernel<CoordinateType> apply() {
+    return &block_avx512<kKind, kDim>;
+  }
+};
+
+template <typename CoordinateType, DenseDistanceKind kKind>
+struct SimdBlockKernelSelector {
+  static BlockKernel<CoordinateType> select(int_fast64_t dim) {
+    switch (simd_level()) {
+      case SimdLevel::AVX512:
+        return PointDimensions::dispatch<Avx512Kernel<CoordinateType, kKind>>(
+            dim);
+      case SimdLevel::AVX2:
+        return PointDimensions::dispatch<Avx2Kernel<CoordinateType, kKind>>(
+            dim);
+      default:
+        return PointDimensions::dispatch<
+            PortableKernel<CoordinateType, kKind>>(dim);
+    }
+  }
+};
+
+template <DenseDistanceKind kKind>
+struct BlockKernelSelector<float, kKind>
+    : public SimdBlockKernelSelector<float, kKind> {};
+
+template <DenseDistanceKind kKind>
+struct BlockKernelSelector<double, kKind>
+    : public SimdBlockKernelSelector<double, kKind> {};
+#endif
+
+}  // namespace distance_kernels
+
+// The general case: one candidate at a time.
+template <typename DistanceFunction, typename DataStorage, typename KeyType,
+          typename DistanceType, typename Enable = void>
+class CandidateDistances {
+ public:
+  template <typename ComparisonPointType>
+  void compute(const ComparisonPointType& q, const DataStorage& data_storage,
+               const std::vector<KeyType>& keys,
+               std::vector<DistanceType>* distances) {
+    distances->resize(keys.size());
+    typename DataStorage::SubsequenceIterator iter =
+        data_storage.get_subsequence(keys);
+    for (size_t ii = 0; iter.is_valid(); ++iter, ++ii) {
+      (*distances)[ii] = dst_(q, iter.get_point());
+    }
+  }
+
+ private:
+  DistanceFunction dst_;
+};
+
+// Dense points in a plain array, with a distance the block kernels support.
+template <typename DistanceFunction, typename DataStorage, typename KeyType,
+          typename DistanceType>
+class CandidateDistances<
+    DistanceFunction, DataStorage, KeyType, DistanceType,
+    typename std::enable_if<
+        IsPlainArrayStorage<DataStorage>::value &&
+        DenseDistanceTraits<DistanceFunction>::kind !=
+            DenseDistanceKind::Other>::type> {
+ public:
+  typedef DistanceType CoordinateType;
+
+
+  void compute(const DenseVector<CoordinateType>& q,
+               const DataStorage& data_storage,
+               const std::vector<KeyType>& keys,
+               std::vector<DistanceType>* distances) {
+    const CoordinateType* data = data_storage.data();
+    const int_fast64_t dim = data_storage.dimension();
+    const int_fast64_t num_keys = keys.size();
+    distances->resize(num_keys);
+
+    if (dim < kDistanceMinBlockedDimension) {
+      typename DataStorage::SubsequenceIterator iter =
+          data_storage.get_subsequence(keys);
+      for (size_t ii = 0; iter.is_valid(); ++iter, ++ii) {
+        (*distances)[ii] = dst_(q, iter.get_point());
+      }
+      return;
+    }
+    if (dim != kernel_dim_) {
+      kernel_ = distance_kernels::BlockKernelSelector<
+          CoordinateType,
+          DenseDistanceTraits<DistanceFunction>::kind>::select(dim);
+      kernel_dim_ = dim;
+    }
+
+    for (int_fast64_t ii = 0; ii < std::min<int_fast64_t>(
+                                       num_keys, kDistancePrefetchAhead);
+         ++ii) {
+      prefetch_row(data + keys[ii] * dim, dim);
+    }
+
+    const CoordinateType* rows[kDistanceBlockSize];
+    CoordinateType block_distances[kDistanceBlockSize];
+    for (int_fast64_t start = 0; start < num_keys;
+         start += kDistanceBlockSize) {
+      int_fast64_t block_size =
+          std::min<int_fast64_t>(kDistanceBlockSize, num_keys - start);
+
+      int_fast64_t prefetch_end = std::min<int_fast64_t>(
+          num_keys, start + kDistancePrefetchAhead + kDistanceBlockSize);
+      for (int_fast64_t ii = start + kDistancePrefetchAhead; ii < prefetch_end;
+           ++ii) {
+        prefetch_row(data + keys[ii] * dim, dim);
+      }
+
+      // A partial last block repeats its last row.
+      for (int jj = 0; jj < kDistanceBlockSize; ++jj) {
+        int_fast64_t index = start + std::min<int_fast64_t>(jj, block_size - 1);
+        rows[jj] = data + keys[index] * dim;
+      }
+      kernel_(q.data(), rows, dim, block_distances);
+      std::copy(block_distances, block_distances + block_size,
+                distances->begin() + start);
+    }
+  }
+
+ private:
+  // The kernel for points of dimension kernel_dim_
+  distance_kernels::BlockKernel<CoordinateType> kernel_ = nullptr;
+  int_fast64_t kernel_dim_ = -1;
+  DistanceFunction dst_;
+  PlainArrayPrefetcher<CoordinateType> prefetcher_;
+
+  void prefetch_row(const CoordinateType* row, int_fast64_t dim) {
+    const int_fast64_t kCacheLine = 64 / sizeof(CoordinateType);
+    int_fast64_t length = std::min<int_fast64_t>(
+        dim, kDistanceMaxPrefetchBytes / sizeof(CoordinateType));
+    for (int_fast64_t ii = 0; ii < length; ii += kCacheLine) {
+      prefetcher_.prefetch(row + ii);
+    }
+  }
+};
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
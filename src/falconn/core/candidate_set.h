@@ -0,0 +1,231 @@
+#ifndef __CANDIDATE_SET_H__
+#define __CANDIDATE_SET_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Deduplication of the candidates retrieved for one query.
+//
+// The candidates of a query are the concatenated buckets of all probes, so
+// the same point usually appears several times. A CandidateSet remembers the
+// points seen since the last call to clear() and uses one of three
+// representations:
+//
+// - one 32-bit query stamp per point, for data sets of at most
+//   kCandidateSetMaxMarkedPoints points (the fastest, but O(n) memory);
+// - a bitmap with one bit per point, for data sets whose bitmap takes at
+//   most kCandidateSetMaxBitmapBytes. The bits are cleared after each query
+//   by walking the inserted keys, which are the query's unique candidates;
+// - otherwise an open-addressing hash set of (key, query stamp) slots that
+//   grows with the number of unique candidates of a query. If a query has
+//   so many unique candidates that the hash set would take more memory than
+//   the bitmap (more than about n / 128), the set moves to the bitmap.
+//
+// The scratch memory of a query object is therefore at most 4 MB for data
+// sets of up to 2^25 points and beyond that a small multiple of its largest
+// candidate set, never more than n / 8 bytes.
+
+namespace falconn {
+namespace core {
+
+// Data sets of up to this many points use one stamp per point (4 MB).
+const int_fast64_t kCandidateSetMaxMarkedPoints = 1 << 20;
+
+// Data sets whose bitmap takes up to this many bytes (2^25 points) use the
+// bitmap from the start.
+const int_fast64_t kCandidateSetMaxBitmapBytes = 1 << 22;
+
+// Smallest number of slots of the hash set
+const int_fast64_t kCandidateSetMinHashSlots = 256;
+
+template <typename KeyType>
+class CandidateSet {
+ public:
+  explicit CandidateSet(int_fast64_t n) { resize(n); }
+
+  // Adjusts the set to a data set of n points. Tables that grow (dynamic
+  // tables) call this before each query; a set never moves back to a
+  // representation for fewer points.
+  void resize(int_fast64_t n) {
+    n_ = n;
+    if (mode_ == Mode::Stamps) {
+      if (n <= kCandidateSetMaxMarkedPoints) {
+        if (static_cast<int_fast64_t>(stamps_.size()) < n) {
+          stamps_.resize(n, 0);
+        }
+        return;
+      }
+      std::vector<uint32_t>().swap(stamps_);
+      mode_ = initial_mode(n);
+    }
+    if (mode_ == Mode::Bitmap) {
+      bits_.resize(num_bitmap_words(n), 0);
+    }
+  }
+
+  // Starts the set of a new query
+  void clear() {
+    query_ += 1;
+    if (query_ == 0) {
+      // The stamps wrapped around, so old stamps could match again.
+      std::fill(stamps_.begin(), stamps_.end(), 0);
+      std::fill(slots_.begin(), slots_.end(), Slot());
+      query_ = 1;
+    }
+    num_inserted_ = 0;
+  }
+
+  // Adds a key and returns true if it was not in the set before
+  bool insert(KeyType key) {
+    if (mode_ == Mode::Stamps) {
+      if (stamps_[key] == query_) {
+        return false;
+      }
+      stamps_[key] = query_;
+      return true;
+    } else if (mode_ == Mode::HashSet) {
+      if (2 * (num_inserted_ + 1) > static_cast<int_fast64_t>(slots_.size())) {
+        grow_hash_set();
+        if (mode_ == Mode::Bitmap) {
+          return insert_bit(key);
+        }
+      }
+      return insert_slot(key);
+    } else {
+      return insert_bit(key);
+    }
+  }
+
+  // Called after each query with the keys inserted since clear() so the
+  // bitmap can be reset without touching all of it
+  void finish(const std::vector<KeyType>& inserted) {
+    if (mode_ == Mode::Bitmap) {
+      for (KeyType key : inserted) {
+        bits_[key / 64] = 0;
+      }
+    }
+  }
+
+  int_fast64_t get_memory_usage() const {
+    return stamps_.capacity() * sizeof(uint32_t) +
+           slots_.capacity() * sizeof(Slot) +
+           bits_.capacity() * sizeof(uint64_t);
+  }
+
+  // Memory used before the first query (the hash set and the bitmap only
+  // grow with the candidates of the queries)
+  static int_fast64_t estimate_memory_usage(int_fast64_t n) {
+    switch (initial_mode(n)) {
+      case Mode::Stamps:
+        return n * sizeof(uint32_t);
+      case Mode::Bitmap:
+        return num_bitmap_words(n) * sizeof(uint64_t);
+      default:
+        return 0;
+    }
+  }
+
+ private:
+  enum class Mode { Stamps, HashSet, Bitmap };
+
+  struct Slot {
+    KeyType key = 0;
+    uint32_t query = 0;
+  };
+
+  Mode mode_ = Mode::Stamps;
+  int_fast64_t n_ = 0;
+  uint32_t query_ = 0;
+  int_fast64_t num_inserted_ = 0;
+
+  std::vector<uint32_t> stamps_;
+
+  std::vector<Slot> slots_;
+  int shift_ = 64;
+
+  std::vector<uint64_t> bits_;
+
+  static int_fast64_t num_bitmap_words(int_fast64_t n) { return (n + 63) / 64; }
+
+  static Mode initial_mode(int_fast64_t n) {
+    if (n <= kCandidateSetMaxMarkedPoints) {
+      return Mode::Stamps;
+    } else if (num_bitmap_words(n) * static_cast<int_fast64_t>(
+                   sizeof(uint64_t)) <= kCandidateSetMaxBitmapBytes) {
+      return Mode::Bitmap;
+    }
+    return Mode::HashSet;
+  }
+
+  bool insert_slot(KeyType key) {
+    size_t mask = slots_.size() - 1;
+    size_t pos = slot_index(key);
+    while (slots_[pos].query == query_) {
+      if (slots_[pos].key == key) {
+        return false;
+      }
+      pos = (pos + 1) & mask;
+    }
+    slots_[pos].key = key;
+    slots_[pos].query = query_;
+    num_inserted_ += 1;
+    return true;
+  }
+
+  bool insert_bit(KeyType key) {
+    uint64_t bit = uint64_t(1) << (key % 64);
+    uint64_t& word = bits_[key / 64];
+    if (word & bit) {
+      return false;
+    }
+    word |= bit;
+    return true;
+  }
+
+  size_t slot_index(KeyType key) const {
+    // Fibonacci hashing; the top bits of the product are well mixed.
+    return static_cast<size_t>(
+        (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> shift_);
+  }
+
+  // Doubles the hash set, or moves this query's keys to the bitmap when the
+  // hash set would no longer be smaller than it
+  void grow_hash_set() {
+    int_fast64_t num_slots =
+        std::max<int_fast64_t>(kCandidateSetMinHashSlots,
+                               2 * static_cast<int_fast64_t>(slots_.size()));
+    int_fast64_t bitmap_words = num_bitmap_words(n_);
+    std::vector<Slot> old_slots;
+    old_slots.swap(slots_);
+
+    if (num_slots * static_cast<int_fast64_t>(sizeof(Slot)) >
+        bitmap_words * static_cast<int_fast64_t>(sizeof(uint64_t))) {
+      mode_ = Mode::Bitmap;
+      bits_.assign(bitmap_words, 0);
+      for (const Slot& slot : old_slots) {
+        if (slot.query == query_) {
+          insert_bit(slot.key);
+        }
+      }
+      return;
+    }
+
+    slots_.resize(num_slots);
+    shift_ = 64;
+    for (int_fast64_t size = num_slots; size > 1; size /= 2) {
+      shift_ -= 1;
+    }
+    num_inserted_ = 0;
+    for (const Slot& slot : old_slots) {
+      if (slot.query == query_) {
+        insert_slot(slot.key);
+      }
+    }
+  }
+};
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "hash_table_helpers.h"
+#include "serialization.h"
 
 namespace falconn {
 namespace core {
@@ -121,6 +122,76 @@ class BasicCompositeHashTable {
     return tables_[table]->retrieve(key);
   }
 
+  // Prefetches the directory entries of the buckets of the given keys (one
+  // vector per table, as for retrieve_bulk), and once these are cached, the
+  // first entries of the buckets
+  void prefetch_buckets(const std::vector<std::vector<KeyType>>& keys) const {
+    for (size_t table = 0; table < tables_.size(); ++table) {
+      for (const KeyType& key : keys[table]) {
+        core::prefetch_bucket(*tables_[table], key, 0);
+      }
+    }
+  }
+
+  void prefetch_entries(const std::vector<std::vector<KeyType>>& keys) const {
+    for (size_t table = 0; table < tables_.size(); ++table) {
+      for (const KeyType& key : keys[table]) {
+        core::prefetch_entries(*tables_[table], key, 0);
+      }
+    }
+  }
+
+  // Returns the entries of the non-empty buckets of one low-level hash
+  // table, one bucket after the other in entries; bucket ii takes
+  // entries[starts[ii]] up to entries[starts[ii + 1]]
+  void get_buckets(int_fast32_t table, std::vector<ValueType>* entries,
+                   std::vector<int_fast64_t>* starts) const {
+    if (table < 0 || table >= l_) {
+      throw CompositeHashTableError("Table index incorrect.");
+    }
+    typedef typename InnerHashTable::Iterator InnerIterator;
+    entries->clear();
+    starts->assign(1, 0);
+    tables_[table]->for_each_bucket(
+        [entries, starts](InnerIterator begin, InnerIterator end) {
+          for (; begin != end; ++begin) {
+            entries->push_back(*begin);
+          }
+          starts->push_back(entries->size());
+        });
+  }
+
+  // Returns the number of entries of each non-empty bucket of one
+  // low-level hash table, in the order of get_buckets
+  void get_bucket_sizes(int_fast32_t table,
+                        std::vector<int_fast64_t>* sizes) const {
+    if (table < 0 || table >= l_) {
+      throw CompositeHashTableError("Table index incorrect.");
+    }
+    typedef typename InnerHashTable::Iterator InnerIterator;
+    sizes->clear();
+    tables_[table]->for_each_bucket(
+        [sizes](InnerIterator begin, InnerIterator end) {
+          int_fast64_t size = 0;
+          for (; begin != end; ++begin) {
+            size += 1;
+          }
+          sizes->push_back(size);
+        });
+  }
+
+  // Returns the bytes of the bucket directory and of the entries of each
+  // low-level hash table
+  void get_memory_usage(std::vector<int_fast64_t>* buckets,
+                        std::vector<int_fast64_t>* entries) const {
+    buckets->resize(l_);
+    entries->resize(l_);
+    for (int_fast32_t ii = 0; ii < l_; ++ii) {
+      (*buckets)[ii] = tables_[ii]->get_bucket_memory_usage();
+      (*entries)[ii] = tables_[ii]->get_entry_memory_usage();
+    }
+  }
+
  protected:
   int_fast32_t l_;
   typename InnerHashTable::Factory* factory_;
@@ -150,12 +221,29 @@ class StaticCompositeHashTable
                                                                     factory) {}
 
   void add_entries_for_table(const std::vector<KeyType>& keys,
-                             int_fast32_t table) {
+                             int_fast32_t table, int_fast32_t num_threads = 1) {
     if (table < 0 || table >= this->l_) {
       throw CompositeHashTableError("Table index incorrect.");
     }
 
-    this->tables_[table]->add_entries(keys);
+    add_entries_to_table(this->tables_[table].get(), keys, num_threads, 0);
+  }
+
+  void serialize(BinaryWriter* output) const {
+    output->write_value<int64_t>(this->l_);
+    for (int_fast32_t ii = 0; ii < this->l_; ++ii) {
+      this->tables_[ii]->serialize(output);
+    }
+  }
+
+  // Fills all tables from the input instead of adding entries
+  void deserialize(BinaryReader* input) {
+    if (input->read_value<int64_t>() != this->l_) {
+      throw CompositeHashTableError("Number of tables in input does not match.");
+    }
+    for (int_fast32_t ii = 0; ii < this->l_; ++ii) {
+      this->tables_[ii]->deserialize(input);
+    }
   }
 };
 
@@ -168,6 +256,18 @@ class DynamicCompositeHashTable
       : BasicCompositeHashTable<KeyType, ValueType, InnerHashTable>(l,
                                                                     factory) {}
 
+  // Inserts the entries (keys[ii], ii) into the given table, for setting up
+  // a table with an initial set of points.
+  void add_entries_for_table(const std::vector<KeyType>& keys,
+                             int_fast32_t table) {
+    if (table < 0 || table >= this->l_) {
+      throw CompositeHashTableError("Table index incorrect.");
+    }
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
+      this->tables_[table]->insert(keys[ii], static_cast<ValueType>(ii));
+    }
+  }
+
   void insert(const std::vector<KeyType>& keys, ValueType value) {
     if (static_cast<int_fast32_t>(keys.size()) != this->l_) {
       throw CompositeHashTableError("Number of keys in insert incorrect.");
@@ -185,6 +285,10 @@ class DynamicCompositeHashTable
       (this->tables_[ii])->remove(keys[ii], value);
     }
   }
+
+  void serialize(BinaryWriter*) const {
+    throw CompositeHashTableError("Dynamic hash tables cannot be serialized.");
+  }
 };
 
 }  // namespace core
@@ -0,0 +1,395 @@
+#ifndef __COMPRESSED_FLAT_HASH_TABLE_H__
+#define __COMPRESSED_FLAT_HASH_TABLE_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "bit_packed_vector.h"
+#include "flat_hash_table.h"
+#include "hash_table_helpers.h"
+#include "math_helpers.h"
+#include "serialization.h"
+#include "thread_pool.h"
+
+namespace falconn {
+namespace core {
+
+class CompressedFlatHashTableError : public HashTableError {
+ public:
+  CompressedFlatHashTableError(const char* msg) : HashTableError(msg) {}
+};
+
+// Helpers for the group varint code of the compressed flat hash table. A
+// group holds up to four values: a control byte with two bits per value
+// giving its length in bytes minus one, followed by the low bytes of the
+// values, least significant first.
+namespace group_varint {
+
+const int_fast32_t kGroupSize = 4;
+
+// Bytes past the end of the stream that decoding may read, since each value
+// is read with a four-byte load
+const int_fast64_t kPadding = 3;
+
+// Masks keeping the low 1, 2, 3 or 4 bytes of a four-byte load
+const uint32_t kMasks[4] = {0xffu, 0xffffu, 0xffffffu, 0xffffffffu};
+
+inline int_fast32_t num_bytes(uint32_t value) {
+  return value < (1u << 8) ? 1 : value < (1u << 16) ? 2
+                                : value < (1u << 24) ? 3 : 4;
+}
+
+inline uint32_t load(const uint8_t* data) {
+  uint32_t value;
+  std::memcpy(&value, data, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap32(value);
+#endif
+  return value;
+}
+
+inline void store(uint32_t value, int_fast32_t num_bytes, uint8_t* data) {
+  for (int_fast32_t ii = 0; ii < num_bytes; ++ii) {
+    data[ii] = static_cast<uint8_t>(value >> (8 * ii));
+  }
+}
+
+// Bytes taken by the deltas of a sorted list of values (the first value is
+// its own delta)
+template <typename ValueType>
+int_fast64_t encoded_size(const ValueType* values, int_fast64_t num_values) {
+  int_fast64_t result = (num_values + kGroupSize - 1) / kGroupSize;
+  ValueType previous = 0;
+  for (int_fast64_t ii = 0; ii < num_values; ++ii) {
+    result += num_bytes(static_cast<uint32_t>(values[ii] - previous));
+    previous = values[ii];
+  }
+  return result;
+}
+
+// Writes the deltas of a sorted list of values, returning the end of the
+// written bytes
+template <typename ValueType>
+uint8_t* encode(const ValueType* values, int_fast64_t num_values,
+                uint8_t* output) {
+  ValueType previous = 0;
+  for (int_fast64_t start = 0; start < num_values; start += kGroupSize) {
+    uint8_t* control = output++;
+    *control = 0;
+    int_fast64_t end = std::min(num_values, start + kGroupSize);
+    for (int_fast64_t ii = start; ii < end; ++ii) {
+      uint32_t delta = static_cast<uint32_t>(values[ii] - previous);
+      int_fast32_t length = num_bytes(delta);
+      *control |= static_cast<uint8_t>((length - 1) << (2 * (ii - start)));
+      store(delta, length, output);
+      output += length;
+      previous = values[ii];
+    }
+  }
+  return output;
+}
+
+}  // namespace group_varint
+
+// A flat hash table whose buckets are compressed: the point indices of a
+// bucket, which are increasing, are stored as differences in the group
+// varint code above. For many points and small buckets, where consecutive
+// indices of a bucket are about num_buckets apart, this takes 1 to 3 bytes
+// per index instead of the 4 bytes of FlatHashTable or the log2(n) bits of
+// BitPackedFlatHashTable. The bucket directory is bit-packed.
+//
+// Buckets are decoded on the fly by the iterators, one group of four indices
+// at a time, with unaligned loads and masks rather than branches.
+template <typename KeyType, typename ValueType = int32_t,
+          typename IndexType = int32_t>
+class CompressedFlatHashTable {
+ public:
+  class Factory {
+   public:
+    Factory(IndexType num_buckets, ValueType num_items)
+        : num_buckets_(num_buckets), num_items_(num_items) {
+      if (num_buckets_ < 1) {
+        throw CompressedFlatHashTableError(
+            "Number of buckets must be at least 1.");
+      }
+      if (num_items_ < 1) {
+        throw CompressedFlatHashTableError(
+            "Number of items must be at least 1.");
+      }
+    }
+
+    CompressedFlatHashTable<KeyType, ValueType, IndexType>* new_hash_table() {
+      return new CompressedFlatHashTable<KeyType, ValueType, IndexType>(
+          num_buckets_, num_items_);
+    }
+
+   private:
+    IndexType num_buckets_ = 0;
+    ValueType num_items_ = 0;
+  };
+
+  class Iterator {
+   public:
+    Iterator()
+        : index_(0), end_(0), position_(0), next_(nullptr), previous_(0),
+          parent_(nullptr) {}
+
+    // index and end are positions among all entries of the table, and next
+    // points to the first group of the bucket
+    Iterator(ValueType index, ValueType end, const uint8_t* next,
+             const CompressedFlatHashTable* parent)
+        : index_(index), end_(end), position_(0), next_(next),
+          previous_(0), parent_(parent) {
+      if (index_ != end_) {
+        decode();
+      }
+    }
+
+    ValueType operator*() const { return values_[position_]; }
+
+    bool operator!=(const Iterator& iter) const {
+      if (parent_ != iter.parent_) {
+        return false;
+      } else {
+        return index_ != iter.index_;
+      }
+    }
+
+    bool operator==(const Iterator& iter) const { return !(*this != iter); }
+
+    Iterator& operator++() {
+      index_ += 1;
+      position_ += 1;
+      if (position_ == group_varint::kGroupSize && index_ != end_) {
+        decode();
+      }
+      return *this;
+    }
+
+   private:
+    ValueType index_;
+    ValueType end_;
+    int_fast32_t position_;
+    const uint8_t* next_;
+    ValueType previous_;
+    ValueType values_[group_varint::kGroupSize];
+    const CompressedFlatHashTable* parent_;
+
+    void decode() {
+      uint32_t control = *next_++;
+      int_fast32_t count = std::min<ValueType>(group_varint::kGroupSize,
+                                               end_ - index_);
+      for (int_fast32_t ii = 0; ii < count; ++ii) {
+        int_fast32_t length = (control >> (2 * ii)) & 3;
+        previous_ += static_cast<ValueType>(group_varint::load(next_) &
+                                            group_varint::kMasks[length]);
+        values_[ii] = previous_;
+        next_ += length + 1;
+      }
+      position_ = 0;
+    }
+  };
+
+  CompressedFlatHashTable(IndexType num_buckets, ValueType num_items)
+      : num_buckets_(num_buckets),
+        num_items_(num_items),
+        entry_start_(num_buckets, log2ceil(num_items + 1)),
+        byte_start_(num_buckets, log2ceil(max_num_bytes(num_items) + 1)) {
+    if (num_buckets_ < 1) {
+      throw CompressedFlatHashTableError(
+          "Number of buckets must be at least 1.");
+    }
+    if (num_items_ < 1) {
+      throw CompressedFlatHashTableError(
+          "Number of items must be at least 1.");
+    }
+  }
+
+  // The entries are first sorted into the buckets of a FlatHashTable, with
+  // the given number of threads, and the buckets are then encoded in
+  // parallel over ranges of buckets.
+  void add_entries(const std::vector<KeyType>& keys,
+                   int_fast32_t num_threads = 1) {
+    if (entries_added_) {
+      throw CompressedFlatHashTableError("Entries were already added.");
+    }
+    if (static_cast<ValueType>(keys.size()) != num_items_) {
+      throw CompressedFlatHashTableError(
+          "Incorrect number of items in add_entries.");
+    }
+    FlatHashTable<KeyType, ValueType, IndexType> sorted(num_buckets_);
+    sorted.add_entries(keys, num_threads);
+    entries_added_ = true;
+
+    num_threads = std::max<int_fast32_t>(
+        1, std::min<int_fast64_t>(num_threads,
+                                  num_items_ / kFlatHashTableMinEntriesPerThread));
+    auto bucket_range = [this, num_threads](int_fast32_t thread) {
+      return std::make_pair(
+          static_cast<int_fast64_t>(num_buckets_) * thread / num_threads,
+          static_cast<int_fast64_t>(num_buckets_) * (thread + 1) / num_threads);
+    };
+
+    std::vector<int_fast64_t> thread_bytes(num_threads + 1, 0);
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      std::pair<int_fast64_t, int_fast64_t> range = bucket_range(thread);
+      for (int_fast64_t bb = range.first; bb < range.second; ++bb) {
+        auto bucket = sorted.retrieve(static_cast<KeyType>(bb));
+        thread_bytes[thread + 1] += group_varint::encoded_size(
+            bucket.first, bucket.second - bucket.first);
+      }
+    });
+    for (int_fast32_t tt = 0; tt < num_threads; ++tt) {
+      thread_bytes[tt + 1] += thread_bytes[tt];
+    }
+
+    data_.assign(thread_bytes[num_threads] + group_varint::kPadding, 0);
+    // Neighboring threads may share a word of the bit-packed directory, so
+    // the directory is written afterwards
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      std::pair<int_fast64_t, int_fast64_t> range = bucket_range(thread);
+      uint8_t* output = data_.begin() + thread_bytes[thread];
+      for (int_fast64_t bb = range.first; bb < range.second; ++bb) {
+        auto bucket = sorted.retrieve(static_cast<KeyType>(bb));
+        output = group_varint::encode(bucket.first,
+                                      bucket.second - bucket.first, output);
+      }
+    });
+
+    int_fast64_t entry = 0;
+    int_fast64_t byte = 0;
+    for (int_fast64_t bb = 0; bb < num_buckets_; ++bb) {
+      auto bucket = sorted.retrieve(static_cast<KeyType>(bb));
+      entry_start_.set(bb, entry);
+      byte_start_.set(bb, byte);
+      entry += bucket.second - bucket.first;
+      byte += group_varint::encoded_size(bucket.first,
+                                         bucket.second - bucket.first);
+    }
+  }
+
+  std::pair<Iterator, Iterator> retrieve(const KeyType& key) const {
+    ValueType start = entry_start_.get(key);
+    ValueType end = num_items_;
+    if (static_cast<IndexType>(key) < num_buckets_ - 1) {
+      end = entry_start_.get(key + 1);
+    }
+    const uint8_t* data = data_.data() + byte_start_.get(key);
+    return std::make_pair(Iterator(start, end, data, this),
+                          Iterator(end, end, nullptr, this));
+  }
+
+  // See FlatHashTable::prefetch_bucket
+  void prefetch_bucket(const KeyType& key) const {
+    entry_start_.prefetch(key);
+    byte_start_.prefetch(key);
+  }
+
+  void prefetch_entries(const KeyType& key) const {
+    __builtin_prefetch(data_.data() + byte_start_.get(key), 0, 1);
+  }
+
+  // See FlatHashTable::for_each_bucket
+  template <typename Function>
+  void for_each_bucket(Function f) const {
+    for (IndexType bb = 0; bb < num_buckets_ && entries_added_; ++bb) {
+      std::pair<Iterator, Iterator> bucket = retrieve(static_cast<KeyType>(bb));
+      if (bucket.first != bucket.second) {
+        f(bucket.first, bucket.second);
+      }
+    }
+  }
+
+  // Bytes of the bucket directory and of the compressed point indices
+  int_fast64_t get_bucket_memory_usage() const {
+    return entry_start_.get_memory_usage() + byte_start_.get_memory_usage();
+  }
+
+  int_fast64_t get_entry_memory_usage() const {
+    return data_.get_memory_usage();
+  }
+
+  // The same for a table with the given numbers of buckets and items. The
+  // size of the compressed indices depends on the bucket sizes; the estimate
+  // assumes buckets of equal size with evenly spaced indices.
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t num_buckets,
+                                                   int_fast64_t num_items) {
+    return BitPackedVector<ValueType>::estimate_memory_usage(
+               num_buckets, log2ceil(num_items + 1)) +
+           BitPackedVector<ValueType>::estimate_memory_usage(
+               num_buckets, log2ceil(max_num_bytes(num_items) + 1));
+  }
+
+  static int_fast64_t estimate_entry_memory_usage(int_fast64_t num_buckets,
+                                                  int_fast64_t num_items) {
+    int_fast64_t num_full_buckets = std::min(num_buckets, num_items);
+    int_fast64_t gap = std::max<int_fast64_t>(
+        1, std::min(num_buckets, num_items) / 2);
+    int_fast64_t bytes_per_gap = group_varint::num_bytes(
+        static_cast<uint32_t>(std::min<int_fast64_t>(gap, UINT32_MAX)));
+    int_fast64_t items_per_bucket = num_items / num_full_buckets;
+    int_fast64_t groups_per_bucket =
+        (items_per_bucket + group_varint::kGroupSize - 1) /
+        group_varint::kGroupSize;
+    return num_items * bytes_per_gap + num_full_buckets * groups_per_bucket +
+           group_varint::kPadding;
+  }
+
+  void serialize(BinaryWriter* output) const {
+    if (!entries_added_) {
+      throw CompressedFlatHashTableError(
+          "Cannot serialize a table without entries.");
+    }
+    output->write_value<int64_t>(num_buckets_);
+    output->write_value<int64_t>(num_items_);
+    entry_start_.serialize(output);
+    byte_start_.serialize(output);
+    data_.serialize(output);
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (entries_added_) {
+      throw CompressedFlatHashTableError("Entries were already added.");
+    }
+    if (input->read_value<int64_t>() != num_buckets_ ||
+        input->read_value<int64_t>() != num_items_) {
+      throw CompressedFlatHashTableError(
+          "Table shape in input does not match.");
+    }
+    entry_start_.deserialize(input);
+    byte_start_.deserialize(input);
+    data_.deserialize(input);
+    if (data_.size() < group_varint::kPadding) {
+      throw CompressedFlatHashTableError(
+          "Compressed entries in input are too short.");
+    }
+    entries_added_ = true;
+  }
+
+ private:
+  IndexType num_buckets_ = 0;
+  ValueType num_items_ = 0;
+  bool entries_added_ = false;
+
+  // first entry and first byte of the respective hash bucket
+  BitPackedVector<ValueType> entry_start_;
+  BitPackedVector<int_fast64_t> byte_start_;
+  // group varint code of the point indices, followed by the padding
+  ArrayStore<uint8_t> data_;
+
+  // An upper bound on the bytes of the compressed indices, which fixes the
+  // width of the byte offsets before the entries are added: at most four
+  // bytes per index and a control byte per index (for buckets of one)
+  static int_fast64_t max_num_bytes(int_fast64_t num_items) {
+    return 5 * num_items;
+  }
+
+};
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
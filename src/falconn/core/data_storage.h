@@ -167,6 +167,10 @@ class ArrayDataStorage {
 
   int_fast64_t size() const { return data_.size(); }
 
+  // Bytes of the points owned by the storage (none, since the points belong
+  // to the caller)
+  int_fast64_t get_memory_usage() const { return 0; }
+
   SubsequenceIterator get_subsequence(const std::vector<KeyType>& keys) const {
     return SubsequenceIterator(keys, *this);
   }
@@ -322,6 +326,16 @@ class PlainArrayDataStorage<DenseVector<CoordinateType>, KeyType> {
 
   int_fast64_t size() const { return num_points_; }
 
+  // Bytes of the points owned by the storage (none, since the points belong
+  // to the caller)
+  int_fast64_t get_memory_usage() const { return 0; }
+
+  // The points, one row of dimension() coordinates each, for code that
+  // reads several rows at once (see CandidateDistances).
+  const CoordinateType* data() const { return data_; }
+
+  int_fast64_t dimension() const { return dim_; }
+
   SubsequenceIterator get_subsequence(const std::vector<KeyType>& keys) const {
     return SubsequenceIterator(keys, *this);
   }
@@ -330,12 +344,126 @@ class PlainArrayDataStorage<DenseVector<CoordinateType>, KeyType> {
     return FullSequenceIterator(*this);
   }
 
- private:
+ protected:
   const CoordinateType* data_;
   int_fast64_t num_points_;
   int_fast64_t dim_;
 };
 
+// A growable version of PlainArrayDataStorage that owns its points, for use
+// in dynamic LSH tables. The points are stored contiguously, and appending a
+// point takes amortized O(dimension) time. Appending may move the points, so
+// points obtained from an iterator are only valid until the next append.
+template <typename PointType, typename KeyType = int32_t>
+class DynamicArrayDataStorage {
+  DynamicArrayDataStorage() {
+    static_assert(FalseStruct<PointType>::value, "Point type not supported.");
+  }
+
+  template <typename PT>
+  struct FalseStruct : std::false_type {};
+};
+
+template <typename CoordinateType, typename KeyType>
+class DynamicArrayDataStorage<DenseVector<CoordinateType>, KeyType>
+    : public PlainArrayDataStorage<DenseVector<CoordinateType>, KeyType> {
+ public:
+  typedef PlainArrayDataStorage<DenseVector<CoordinateType>, KeyType> Base;
+  typedef typename Base::ConstVectorMap ConstVectorMap;
+  typedef typename Base::VectorMap VectorMap;
+
+  DynamicArrayDataStorage(int_fast64_t dim) : Base(nullptr, 0, dim) {}
+
+  void reserve(int_fast64_t num_points) {
+    values_.reserve(num_points * this->dim_);
+    this->data_ = values_.data();
+  }
+
+  template <typename Derived>
+  void append(const Eigen::MatrixBase<Derived>& point) {
+    if (point.size() != this->dim_) {
+      throw DataStorageError("Point dimension does not match the storage.");
+    }
+    size_t offset = values_.size();
+    values_.resize(offset + this->dim_);
+    VectorMap(values_.data() + offset, this->dim_) = point;
+    this->data_ = values_.data();
+    this->num_points_ += 1;
+  }
+
+  ConstVectorMap get_point(KeyType key) const {
+    return ConstVectorMap(this->data_ + key * this->dim_,
+                          static_cast<int>(this->dim_));
+  }
+
+  int_fast64_t get_memory_usage() const {
+    return values_.capacity() * sizeof(CoordinateType);
+  }
+
+ private:
+  std::vector<CoordinateType> values_;
+};
+
+// Whether DataStorage is (derived from) a PlainArrayDataStorage of dense
+// points, whose rows can be read directly.
+template <typename CoordinateType, typename KeyType>
+std::true_type is_plain_array_storage_helper(
+    const PlainArrayDataStorage<DenseVector<CoordinateType>, KeyType>*);
+
+std::false_type is_plain_array_storage_helper(...);
+
+template <typename DataStorage>
+struct IsPlainArrayStorage
+    : decltype(is_plain_array_storage_helper(
+          static_cast<const DataStorage*>(nullptr))) {};
+
+// The points [first, first + count) of a data storage, viewed as a data
+// storage of their own, so that ranges of the points can be hashed in
+// parallel. In general, the points are accessed through a subsequence of the
+// original storage. Plain arrays are simply offset, so that their ranges are
+// again plain arrays (see the specialization below).
+template <typename DataStorage, typename KeyType,
+          bool IsPlainArray = IsPlainArrayStorage<DataStorage>::value>
+class DataStorageRange {
+ public:
+  typedef typename DataStorage::SubsequenceIterator FullSequenceIterator;
+
+  DataStorageRange(const DataStorage& storage, int_fast64_t first,
+                   int_fast64_t count)
+      : storage_(storage), keys_(count) {
+    for (int_fast64_t ii = 0; ii < count; ++ii) {
+      keys_[ii] = static_cast<KeyType>(first + ii);
+    }
+  }
+
+  int_fast64_t size() const { return keys_.size(); }
+
+  FullSequenceIterator get_full_sequence() const {
+    return storage_.get_subsequence(keys_);
+  }
+
+ private:
+  const DataStorage& storage_;
+  std::vector<KeyType> keys_;
+};
+
+template <typename DataStorage, typename KeyType>
+class DataStorageRange<DataStorage, KeyType, true>
+    : public PlainArrayDataStorage<
+          DenseVector<typename DataStorage::ConstVectorMap::Scalar>, KeyType> {
+ public:
+  DataStorageRange(const DataStorage& storage, int_fast64_t first,
+                   int_fast64_t count)
+      : PlainArrayDataStorage<
+            DenseVector<typename DataStorage::ConstVectorMap::Scalar>,
+            KeyType>(storage.data() + first * storage.dimension(), count,
+                     storage.dimension()) {}
+};
+
+// The points of another data storage as transformed by a transformation (see
+// data_transformation.h), e.g., to hash them differently from how distances
+// are computed. Each point is transformed when the iterator reaches it, into
+// a point held by the iterator, so no transformed copy of the data is kept.
 template <typename PointType, typename Transformation,
           typename InnerDataStorage, typename KeyType = int32_t>
 class TransformedDataStorage {
@@ -348,8 +476,7 @@ class TransformedDataStorage {
     FullSequenceIterator() {}
 
     const PointType& get_point() {
-      tmp_point_ = iter_.get_point();
-      parent_->transformation_.apply(&tmp_point_);
+      parent_->transformation_.apply(iter_.get_point(), &tmp_point_);
       return tmp_point_;
     }
 
@@ -369,13 +496,12 @@ class TransformedDataStorage {
    public:
     SubsequenceIterator(const TransformedDataStorage& parent,
                         const std::vector<KeyType>& keys)
-        : parent_(&parent), iter_(parent.storage_.get_sub_sequence(keys)) {}
+        : parent_(&parent), iter_(parent.storage_.get_subsequence(keys)) {}
 
     SubsequenceIterator() {}
 
     const PointType& get_point() {
-      tmp_point_ = iter_.get_point();
-      parent_->transformation_->apply(&tmp_point_);
+      parent_->transformation_.apply(iter_.get_point(), &tmp_point_);
       return tmp_point_;
     }
 
@@ -398,18 +524,54 @@ class TransformedDataStorage {
   int_fast64_t size() const { return storage_.size(); }
 
   SubsequenceIterator get_subsequence(const std::vector<KeyType>& keys) const {
-    return SubsequenceIterator(keys, *this);
+    return SubsequenceIterator(*this, keys);
   }
 
   FullSequenceIterator get_full_sequence() const {
     return FullSequenceIterator(*this);
   }
 
+  const Transformation& get_transformation() const { return transformation_; }
+
+  const InnerDataStorage& get_inner_storage() const { return storage_; }
+
  private:
   const Transformation& transformation_;
   const InnerDataStorage& storage_;
 };
 
+// A range of transformed points is the transformed range of the inner
+// storage, so that ranges of a plain array are still read directly.
+template <typename PointType, typename Transformation,
+          typename InnerDataStorage, typename InnerKeyType, typename KeyType>
+class DataStorageRange<TransformedDataStorage<PointType, Transformation,
+                                              InnerDataStorage, InnerKeyType>,
+                       KeyType, false> {
+ public:
+  typedef DataStorageRange<InnerDataStorage, KeyType> InnerRange;
+  typedef TransformedDataStorage<PointType, Transformation, InnerRange,
+                                 KeyType>
+      RangeStorage;
+  typedef typename RangeStorage::FullSequenceIterator FullSequenceIterator;
+
+  DataStorageRange(const TransformedDataStorage<PointType, Transformation,
+                                                InnerDataStorage,
+                                                InnerKeyType>& storage,
+                   int_fast64_t first, int_fast64_t count)
+      : inner_(storage.get_inner_storage(), first, count),
+        storage_(storage.get_transformation(), inner_) {}
+
+  int_fast64_t size() const { return storage_.size(); }
+
+  FullSequenceIterator get_full_sequence() const {
+    return storage_.get_full_sequence();
+  }
+
+ private:
+  InnerRange inner_;
+  RangeStorage storage_;
+};
+
 }  // namespace core
 }  // namespace falconn
 
@@ -1,6 +1,8 @@
 #ifndef __DATA_TRANSFORMATION_H__
 #define __DATA_TRANSFORMATION_H__
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
 
 #include "../falconn_global.h"
@@ -14,10 +16,24 @@ class DataTransformationError : public FalconnError {
   DataTransformationError(const char* msg) : FalconnError(msg) {}
 };
 
+// A transformation transforms a point in place with apply(p), or into
+// another point with apply(p, out), as TransformedDataStorage does while
+// iterating over the data. apply_to_query(q, tmp) returns the transformed
+// query, which is q itself for the symmetric transformations below and tmp
+// for asymmetric ones, whose queries are transformed differently from the
+// data points.
+
 template <typename Point>
 class IdentityTransformation {
  public:
   void apply(Point*) const { return; }
+
+  template <typename InputPoint>
+  void apply(const InputPoint& p, Point* out) const {
+    *out = p;
+  }
+
+  const Point& apply_to_query(const Point& q, Point*) const { return q; }
 };
 
 template <typename Point>
@@ -27,6 +43,17 @@ class NormalizingTransformation {
     normalize(p);
     return;
   }
+
+  template <typename InputPoint>
+  void apply(const InputPoint& p, Point* out) const {
+    *out = p;
+    apply(out);
+  }
+
+  const Point& apply_to_query(const Point& q, Point* tmp) const {
+    apply(q, tmp);
+    return *tmp;
+  }
 };
 
 template <typename Point, typename DataStorage>
@@ -55,10 +82,75 @@ class CenteringTransformation {
     return;
   }
 
+  template <typename InputPoint>
+  void apply(const InputPoint& p, Point* out) const {
+    *out = p;
+    apply(out);
+  }
+
+  const Point& apply_to_query(const Point& q, Point* tmp) const {
+    apply(q, tmp);
+    return *tmp;
+  }
+
  private:
   Point center_;
 };
 
+// The asymmetric transformation for maximum inner product search (see
+// DataTransformation::AsymmetricMips): a data point p becomes
+// (p / M, sqrt(1 - |p|^2 / M^2)) and a query q becomes (q, 0), where M is the
+// largest norm of the data points. Only for dense points; the transformed
+// points have one more coordinate.
+template <typename Point>
+class AsymmetricMipsTransformation {
+ public:
+  typedef typename Point::Scalar Scalar;
+
+  template <typename DataStorage>
+  AsymmetricMipsTransformation(const DataStorage& data) {
+    double max_squared_norm = 0.0;
+    for (typename DataStorage::FullSequenceIterator iter =
+             data.get_full_sequence();
+         iter.is_valid(); ++iter) {
+      max_squared_norm = std::max<double>(max_squared_norm,
+                                          iter.get_point().squaredNorm());
+    }
+    if (max_squared_norm == 0.0) {
+      throw DataTransformationError(
+          "Cannot transform a data set whose points are all zero for "
+          "maximum inner product search.");
+    }
+    max_squared_norm_ = max_squared_norm;
+    scale_ = 1.0 / std::sqrt(max_squared_norm);
+  }
+
+  template <typename InputPoint>
+  void apply(const InputPoint& p, Point* out) const {
+    int_fast64_t dim = p.size();
+    out->resize(dim + 1);
+    out->head(dim) = p * static_cast<Scalar>(scale_);
+    // Rounding may leave the longest points just beyond the unit sphere
+    (*out)[dim] = static_cast<Scalar>(
+        std::sqrt(std::max(0.0, 1.0 - p.squaredNorm() / max_squared_norm_)));
+  }
+
+  const Point& apply_to_query(const Point& q, Point* tmp) const {
+    int_fast64_t dim = q.size();
+    tmp->resize(dim + 1);
+    tmp->head(dim) = q;
+    (*tmp)[dim] = 0;
+    return *tmp;
+  }
+
+  // The largest norm of the data points
+  double get_max_norm() const { return std::sqrt(max_squared_norm_); }
+
+ private:
+  double max_squared_norm_;
+  double scale_;
+};
+
 // First applies Transformation2, then Transformation1.
 template <typename Point, typename Transformation1, typename Transformation2>
 class ComposedTransformation {
@@ -73,6 +165,17 @@ class ComposedTransformation {
     transformation1_->apply(p);
   }
 
+  template <typename InputPoint>
+  void apply(const InputPoint& p, Point* out) const {
+    *out = p;
+    apply(out);
+  }
+
+  const Point& apply_to_query(const Point& q, Point* tmp) const {
+    apply(q, tmp);
+    return *tmp;
+  }
+
  private:
   std::unique_ptr<Transformation1> transformation1_;
   std::unique_ptr<Transformation2> transformation2_;
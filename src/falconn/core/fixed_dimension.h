@@ -0,0 +1,67 @@
+#ifndef __FIXED_DIMENSION_H__
+#define __FIXED_DIMENSION_H__
+
+#include <cstdint>
+#include <utility>
+
+#include "../eigen_wrapper.h"
+
+namespace falconn {
+namespace core {
+
+// Runtime dispatch to kernels instantiated for a compile-time dimension.
+//
+// A kernel is a class template Kernel with a static member function template
+// apply<kDim>. For kDim equal to Eigen::Dynamic, apply handles any dimension
+// (passed at runtime); for any other kDim, it may assume that the dimension
+// is exactly kDim, so that its loops have constant trip counts and can be
+// unrolled without remainder. FixedDimensions<kDims...>::dispatch<Kernel>
+// calls the instantiation for the runtime dimension if it is one of kDims,
+// and the Eigen::Dynamic one otherwise. Kernels are usually dispatched once,
+// when the object using them is constructed, by returning a function
+// pointer from apply.
+
+template <int... kDims>
+struct FixedDimensions;
+
+template <>
+struct FixedDimensions<> {
+  template <typename Kernel, typename... Args>
+  static auto dispatch(int_fast64_t, Args&&... args)
+      -> decltype(Kernel::template apply<Eigen::Dynamic>(
+          std::forward<Args>(args)...)) {
+    return Kernel::template apply<Eigen::Dynamic>(std::forward<Args>(args)...);
+  }
+};
+
+template <int kFirst, int... kRest>
+struct FixedDimensions<kFirst, kRest...> {
+  template <typename Kernel, typename... Args>
+  static auto dispatch(int_fast64_t dim, Args&&... args)
+      -> decltype(Kernel::template apply<Eigen::Dynamic>(
+          std::forward<Args>(args)...)) {
+    if (dim == kFirst) {
+      return Kernel::template apply<kFirst>(std::forward<Args>(args)...);
+    }
+    return FixedDimensions<kRest...>::template dispatch<Kernel>(
+        dim, std::forward<Args>(args)...);
+  }
+};
+
+// The dimensions of the embeddings most tables are built on
+typedef FixedDimensions<64, 96, 128, 256, 768> PointDimensions;
+
+// The rotation dimensions of the cross polytope hash for these points (the
+// next powers of two)
+typedef FixedDimensions<64, 128, 256, 1024> RotationDimensions;
+
+// The dimension a kernel instantiated for kDim works with
+template <int kDim>
+inline int_fast64_t kernel_dimension(int_fast64_t dim) {
+  return kDim == Eigen::Dynamic ? dim : kDim;
+}
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
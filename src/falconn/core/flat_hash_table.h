@@ -9,6 +9,8 @@
 #include <vector>
 
 #include "hash_table_helpers.h"
+#include "serialization.h"
+#include "thread_pool.h"
 
 namespace falconn {
 namespace core {
@@ -18,6 +20,12 @@ class FlatHashTableError : public HashTableError {
   FlatHashTableError(const char* msg) : HashTableError(msg) {}
 };
 
+// Below this many entries per thread, add_entries uses fewer threads.
+const int_fast64_t kFlatHashTableMinEntriesPerThread = 1 << 16;
+
+// Maximum number of partitions in the parallel version of add_entries.
+const int_fast64_t kFlatHashTableMaxNumPartitions = 1 << 12;
+
 template <typename KeyType, typename ValueType = int32_t,
           typename IndexType = int32_t>
 class FlatHashTable {
@@ -44,67 +52,212 @@ class FlatHashTable {
 
   // TODO: add version with explicit values array? (maybe not because the flat
   // hash table is arguably most useful for the static table setting?)
-  void add_entries(const std::vector<KeyType>& keys) {
+  //
+  // The entries are sorted into the buckets with a counting sort, so the
+  // indices within a bucket are increasing. With more than one thread, the
+  // keys are first partitioned by their high bits and the partitions are then
+  // sorted independently. The result does not depend on the number of
+  // threads.
+  void add_entries(const std::vector<KeyType>& keys,
+                   int_fast32_t num_threads = 1) {
     if (num_buckets_ <= 0) {
       throw FlatHashTableError("Non-positive number of buckets");
     }
     if (entries_added_) {
       throw FlatHashTableError("Entries were already added.");
     }
-    bucket_list_.resize(num_buckets_, std::make_pair(0, 0));
-
-    entries_added_ = true;
-
-    KeyComparator comp(keys);
-    indices_.resize(keys.size());
-    for (IndexType ii = 0; static_cast<size_t>(ii) < indices_.size(); ++ii) {
+    for (size_t ii = 0; ii < keys.size(); ++ii) {
       if (keys[ii] >= static_cast<KeyType>(num_buckets_) || keys[ii] < 0) {
         throw FlatHashTableError("Key value out of range.");
       }
-      indices_[ii] = ii;
     }
-    std::sort(indices_.begin(), indices_.end(), comp);
+    Bucket empty_bucket = {0, 0};
+    bucket_list_.assign(num_buckets_, empty_bucket);
+    indices_.resize(keys.size());
 
-    IndexType cur_index = 0;
-    while (cur_index < static_cast<IndexType>(indices_.size())) {
-      IndexType end_index = cur_index;
-      do {
-        end_index += 1;
-      } while (end_index < static_cast<IndexType>(indices_.size()) &&
-               keys[indices_[cur_index]] == keys[indices_[end_index]]);
+    entries_added_ = true;
+
+    int_fast64_t num_keys = keys.size();
+    num_threads = std::max<int_fast64_t>(
+        1, std::min<int_fast64_t>(
+               num_threads, num_keys / kFlatHashTableMinEntriesPerThread));
+    if (num_threads == 1) {
+      sort_partition(keys, nullptr, num_keys, 0, 0, num_buckets_);
+      return;
+    }
 
-      bucket_list_[keys[indices_[cur_index]]].first = cur_index;
-      bucket_list_[keys[indices_[cur_index]]].second = end_index - cur_index;
-      cur_index = end_index;
+    // Partition the entries by the high bits of their keys. Each thread
+    // counts and then places the entries of a contiguous range of the keys.
+    int_fast32_t shift = 0;
+    while (((static_cast<int_fast64_t>(num_buckets_) - 1) >> shift) >=
+           kFlatHashTableMaxNumPartitions) {
+      ++shift;
     }
+    int_fast64_t num_partitions =
+        ((static_cast<int_fast64_t>(num_buckets_) - 1) >> shift) + 1;
+    std::vector<std::vector<int_fast64_t>> offsets(
+        num_threads, std::vector<int_fast64_t>(num_partitions, 0));
+    auto key_range = [num_keys, num_threads](int_fast32_t thread) {
+      return std::make_pair(num_keys * thread / num_threads,
+                            num_keys * (thread + 1) / num_threads);
+    };
+
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      std::pair<int_fast64_t, int_fast64_t> range = key_range(thread);
+      std::vector<int_fast64_t>& counts = offsets[thread];
+      for (int_fast64_t ii = range.first; ii < range.second; ++ii) {
+        counts[keys[ii] >> shift] += 1;
+      }
+    });
+
+    std::vector<int_fast64_t> partition_start(num_partitions + 1);
+    int_fast64_t total = 0;
+    for (int_fast64_t pp = 0; pp < num_partitions; ++pp) {
+      partition_start[pp] = total;
+      for (int_fast32_t tt = 0; tt < num_threads; ++tt) {
+        int_fast64_t count = offsets[tt][pp];
+        offsets[tt][pp] = total;
+        total += count;
+      }
+    }
+    partition_start[num_partitions] = total;
+
+    std::vector<ValueType> partitioned(num_keys);
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      std::pair<int_fast64_t, int_fast64_t> range = key_range(thread);
+      std::vector<int_fast64_t>& next = offsets[thread];
+      for (int_fast64_t ii = range.first; ii < range.second; ++ii) {
+        partitioned[next[keys[ii] >> shift]++] = static_cast<ValueType>(ii);
+      }
+    });
+
+    // The partitions cover disjoint ranges of buckets and of entries, so they
+    // can be sorted concurrently. The threads take turns so that the large
+    // partitions of skewed keys are spread over the threads.
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      for (int_fast64_t pp = thread; pp < num_partitions; pp += num_threads) {
+        int_fast64_t first_bucket = pp << shift;
+        int_fast64_t end_bucket = std::min<int_fast64_t>(
+            (pp + 1) << shift, static_cast<int_fast64_t>(num_buckets_));
+        sort_partition(keys, partitioned.data() + partition_start[pp],
+                       partition_start[pp + 1] - partition_start[pp],
+                       partition_start[pp], first_bucket, end_bucket);
+      }
+    });
   }
 
   std::pair<Iterator, Iterator> retrieve(const KeyType& key) {
-    IndexType start = bucket_list_[key].first;
-    IndexType len = bucket_list_[key].second;
+    IndexType start = bucket_list_[key].start;
+    IndexType len = bucket_list_[key].length;
     // printf("retrieve for key %u\n", key);
     // printf("  start: %lld  len %lld\n", start, len);
-    return std::make_pair(&(indices_[start]), &(indices_[start + len]));
+    return std::make_pair(indices_.begin() + start,
+                          indices_.begin() + start + len);
+  }
+
+  // Brings the directory entry of a bucket into the cache, and once it is
+  // there, the first point indices of the bucket. Batches of queries issue
+  // these for upcoming queries so that the misses overlap.
+  void prefetch_bucket(const KeyType& key) const {
+    __builtin_prefetch(bucket_list_.data() + key, 0, 1);
+  }
+
+  void prefetch_entries(const KeyType& key) const {
+    __builtin_prefetch(indices_.data() + bucket_list_[key].start, 0, 1);
+  }
+
+  // Calls f(begin, end) with the entries of each non-empty bucket, in order
+  // of keys
+  template <typename Function>
+  void for_each_bucket(Function f) {
+    for (IndexType bb = 0; bb < num_buckets_ && entries_added_; ++bb) {
+      if (bucket_list_[bb].length > 0) {
+        std::pair<Iterator, Iterator> bucket = retrieve(static_cast<KeyType>(bb));
+        f(bucket.first, bucket.second);
+      }
+    }
+  }
+
+  // Bytes of the bucket directory and of the point indices
+  int_fast64_t get_bucket_memory_usage() const {
+    return bucket_list_.get_memory_usage();
+  }
+
+  int_fast64_t get_entry_memory_usage() const {
+    return indices_.get_memory_usage();
+  }
+
+  // The same for a table with the given numbers of buckets and entries
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t num_buckets) {
+    return num_buckets * sizeof(Bucket);
+  }
+
+  static int_fast64_t estimate_entry_memory_usage(int_fast64_t num_entries) {
+    return num_entries * sizeof(ValueType);
+  }
+
+  void serialize(BinaryWriter* output) const {
+    if (!entries_added_) {
+      throw FlatHashTableError("Cannot serialize a table without entries.");
+    }
+    output->write_value<int64_t>(num_buckets_);
+    bucket_list_.serialize(output);
+    indices_.serialize(output);
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (entries_added_) {
+      throw FlatHashTableError("Entries were already added.");
+    }
+    if (input->read_value<int64_t>() != num_buckets_) {
+      throw FlatHashTableError("Number of buckets in input does not match.");
+    }
+    bucket_list_.deserialize(input);
+    indices_.deserialize(input);
+    if (bucket_list_.size() != num_buckets_) {
+      throw FlatHashTableError("Bucket list in input has the wrong size.");
+    }
+    entries_added_ = true;
   }
 
  private:
+  struct Bucket {
+    IndexType start;
+    IndexType length;
+  };
+
   IndexType num_buckets_ = -1;
   bool entries_added_ = false;
-  // the pair contains start index and length
-  std::vector<std::pair<IndexType, IndexType>> bucket_list_;
+  ArrayStore<Bucket> bucket_list_;
   // point indices
-  std::vector<ValueType> indices_;
+  ArrayStore<ValueType> indices_;
 
-  class KeyComparator {
-   public:
-    KeyComparator(const std::vector<KeyType>& keys) : keys_(keys) {}
-
-    bool operator()(IndexType ii, IndexType jj) {
-      return keys_[ii] < keys_[jj];
+  // Sorts the entries, all of which have keys in [first_bucket, end_bucket),
+  // into their buckets. The entries are stored in indices_ starting at
+  // position first_entry. If entries is nullptr, the entries are
+  // 0, ..., num_entries - 1.
+  void sort_partition(const std::vector<KeyType>& keys,
+                      const ValueType* entries, int_fast64_t num_entries,
+                      int_fast64_t first_entry, int_fast64_t first_bucket,
+                      int_fast64_t end_bucket) {
+    for (int_fast64_t ii = 0; ii < num_entries; ++ii) {
+      ValueType entry = entries ? entries[ii] : static_cast<ValueType>(ii);
+      bucket_list_[keys[entry]].length += 1;
+    }
+    IndexType next = static_cast<IndexType>(first_entry);
+    for (int_fast64_t bb = first_bucket; bb < end_bucket; ++bb) {
+      bucket_list_[bb].start = next;
+      next += bucket_list_[bb].length;
+      bucket_list_[bb].length = 0;
     }
+    for (int_fast64_t ii = 0; ii < num_entries; ++ii) {
+      ValueType entry = entries ? entries[ii] : static_cast<ValueType>(ii);
+      Bucket& bucket = bucket_list_[keys[entry]];
+      indices_[bucket.start + bucket.length] = entry;
+      bucket.length += 1;
+    }
+  }
 
-    const std::vector<KeyType>& keys_;
-  };
 };
 
 }  // namespace core
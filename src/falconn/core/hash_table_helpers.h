@@ -1,6 +1,9 @@
 #ifndef __HASH_TABLE_HELPERS_H__
 #define __HASH_TABLE_HELPERS_H__
 
+#include <cstdint>
+#include <vector>
+
 #include "../falconn_global.h"
 
 namespace falconn {
@@ -11,6 +14,42 @@ class HashTableError : public FalconnError {
   HashTableError(const char* msg) : FalconnError(msg) {}
 };
 
+// Adds the entries to a static low-level hash table, with several threads if
+// the table supports this (i.e., its add_entries takes a number of threads).
+template <typename HashTable, typename KeyType>
+auto add_entries_to_table(HashTable* table, const std::vector<KeyType>& keys,
+                          int_fast32_t num_threads, int)
+    -> decltype(table->add_entries(keys, num_threads), void()) {
+  table->add_entries(keys, num_threads);
+}
+
+template <typename HashTable, typename KeyType>
+void add_entries_to_table(HashTable* table, const std::vector<KeyType>& keys,
+                          int_fast32_t, long) {
+  table->add_entries(keys);
+}
+
+// Prefetches the directory entry of a bucket, or its first entries, for the
+// low-level hash tables that support this (see FlatHashTable::prefetch_bucket)
+// and does nothing for the others.
+template <typename HashTable, typename KeyType>
+auto prefetch_bucket(const HashTable& table, const KeyType& key, int)
+    -> decltype(table.prefetch_bucket(key), void()) {
+  table.prefetch_bucket(key);
+}
+
+template <typename HashTable, typename KeyType>
+void prefetch_bucket(const HashTable&, const KeyType&, long) {}
+
+template <typename HashTable, typename KeyType>
+auto prefetch_entries(const HashTable& table, const KeyType& key, int)
+    -> decltype(table.prefetch_entries(key), void()) {
+  table.prefetch_entries(key);
+}
+
+template <typename HashTable, typename KeyType>
+void prefetch_entries(const HashTable&, const KeyType&, long) {}
+
 }  // namespace core
 }  // namespace falconn
 
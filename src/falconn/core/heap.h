@@ -64,6 +64,10 @@ class HeapBase {
 
   void resize(size_t new_size) { v_.resize(new_size); }
 
+  int_fast64_t get_memory_usage() const {
+    return v_.capacity() * sizeof(Item);
+  }
+
  protected:
   int_fast32_t lchild(int_fast32_t x) { return 2 * x + 1; }
 
@@ -1,11 +1,13 @@
 #ifndef __HYPERPLANE_HASH_H__
 #define __HYPERPLANE_HASH_H__
 
+#include <algorithm>
 #include <cstdint>
 #include <ctime>
 #include <iterator>
 #include <memory>
 #include <random>
+#include <type_traits>
 #include <vector>
 
 #include "../eigen_wrapper.h"
@@ -51,9 +53,8 @@ class HyperplaneHashBase {
     const Derived& parent_;
   };
 
-  // TODO: specialize template for faster batch hyperplane setup (if the batch
-  // vector type is also an Eigen matrix, we can just do a single matrix-matrix
-  // multiplication.)
+  // One point at a time. HyperplaneHashDense replaces this with a blocked
+  // version for dense points.
   template <typename BatchVectorType>
   class BatchHash {
    public:
@@ -77,6 +78,16 @@ class HyperplaneHashBase {
       }
     }
 
+    int_fast32_t get_num_tables_per_batch() const { return 1; }
+
+    void batch_hash_tables(const BatchVectorType& points,
+                           int_fast32_t first_table, int_fast32_t num_tables,
+                           std::vector<HashType>* res) {
+      for (int_fast32_t tt = 0; tt < num_tables; ++tt) {
+        batch_hash_single_table(points, first_table + tt, &res[tt]);
+      }
+    }
+
    private:
     const Derived& parent_;
     TransformedVectorType tmp_vector_;
@@ -92,6 +103,42 @@ class HyperplaneHashBase {
 
   const MatrixType& get_hyperplanes() const { return hyperplanes_; }
 
+  // Bytes of the hyperplanes
+  int_fast64_t get_memory_usage() const {
+    return hyperplanes_.size() * sizeof(CoordinateType);
+  }
+
+  // The same for a hash with the given parameters
+  static int_fast64_t estimate_memory_usage(int_fast64_t dim, int_fast32_t k,
+                                            int_fast32_t l) {
+    return dim * k * l * sizeof(CoordinateType);
+  }
+
+  // The hyperplanes are generated from the seed, but the standard library's
+  // normal distribution is implementation-defined, so they are stored
+  // explicitly to keep saved tables valid across platforms.
+  void serialize(BinaryWriter* output) const {
+    output->write_value<int64_t>(dim_);
+    output->write_value<int64_t>(k_);
+    output->write_value<int64_t>(l_);
+    output->write_array(hyperplanes_.data(), hyperplanes_.size());
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (input->read_value<int64_t>() != dim_ ||
+        input->read_value<int64_t>() != k_ ||
+        input->read_value<int64_t>() != l_) {
+      throw LSHFunctionError("Hyperplane hash parameters in input differ.");
+    }
+    int_fast64_t num_entries;
+    const CoordinateType* entries =
+        input->map_array<CoordinateType>(&num_entries);
+    if (num_entries != hyperplanes_.size()) {
+      throw LSHFunctionError("Hyperplanes in input have the wrong size.");
+    }
+    std::copy(entries, entries + num_entries, hyperplanes_.data());
+  }
+
   static HashType compute_hash_single_table(const TransformedVectorType& v) {
     HashType res = 0;
     for (int_fast32_t jj = 0; jj < v.size(); ++jj) {
@@ -348,6 +395,14 @@ class HyperplaneHashBase {
   };
 };
 
+// Number of points in a tile of the batch hash for dense points
+const int_fast64_t kHyperplaneBatchSize = 256;
+
+// The batch hash for dense points hashes several tables together until they
+// have this many hyperplanes, which keeps the matrix products efficient for
+// small k.
+const int_fast32_t kHyperplaneMinRowsPerBatch = 64;
+
 // Hash function implementation for the dense hyperplane hash.
 // The only functionality that has to be implemented here is the mapping from
 // an input point / vector to the result of multiplying with the hyperplanes
@@ -380,6 +435,114 @@ class HyperplaneHashDense
     // manually.
     *res = this->hyperplanes_.middleRows(l * this->k_, this->k_) * point;
   }
+
+  // Hashes the points in tiles of kHyperplaneBatchSize, for several tables at
+  // a time. Each tile is multiplied with the hyperplanes of the tables in a single
+  // matrix-matrix product, which Eigen blocks for the cache, and the sign
+  // bits of the products are then collected for all points of the tile at
+  // once (a loop over the points that the compiler vectorizes). Points in a
+  // plain array are multiplied in place; points in other data storages are
+  // first copied into the tile.
+  template <typename BatchVectorType>
+  class BatchHash {
+   public:
+    BatchHash(const HyperplaneHashDense& parent)
+        : parent_(parent), tile_(parent.dim_, kHyperplaneBatchSize) {}
+
+    int_fast32_t get_num_tables_per_batch() const {
+      int_fast32_t k = parent_.k_;
+      return std::min(parent_.l_, (kHyperplaneMinRowsPerBatch + k - 1) / k);
+    }
+
+    void batch_hash_single_table(const BatchVectorType& points, int_fast32_t l,
+                                 std::vector<HashType>* res) {
+      batch_hash_tables(points, l, 1, res);
+    }
+
+    // Hashes the points for tables first_table, ...,
+    // first_table + num_tables - 1, writing the hashes for each table to
+    // res[0], ..., res[num_tables - 1].
+    void batch_hash_tables(const BatchVectorType& points,
+                           int_fast32_t first_table, int_fast32_t num_tables,
+                           std::vector<HashType>* res) {
+      int_fast64_t nn = points.size();
+      for (int_fast32_t tt = 0; tt < num_tables; ++tt) {
+        if (static_cast<int_fast64_t>(res[tt].size()) != nn) {
+          res[tt].resize(nn);
+        }
+      }
+      int_fast32_t k = parent_.k_;
+      auto hyperplanes =
+          parent_.hyperplanes_.middleRows(first_table * k, num_tables * k);
+      projections_.resize(kHyperplaneBatchSize, num_tables * k);
+      TileSource<BatchVectorType> source(points, &tile_);
+
+      for (int_fast64_t start = 0; start < nn; start += kHyperplaneBatchSize) {
+        int_fast64_t count = std::min(kHyperplaneBatchSize, nn - start);
+        ConstMatrixMap tile(source.next(count), parent_.dim_, count);
+        projections_.topRows(count).noalias() =
+            tile.transpose() * hyperplanes.transpose();
+
+        for (int_fast32_t tt = 0; tt < num_tables; ++tt) {
+          HashType* hashes = res[tt].data() + start;
+          std::fill(hashes, hashes + count, 0);
+          for (int_fast32_t jj = 0; jj < k; ++jj) {
+            const CoordinateType* column = projections_.col(tt * k + jj).data();
+            for (int_fast64_t ii = 0; ii < count; ++ii) {
+              hashes[ii] = (hashes[ii] << 1) | (column[ii] >= 0.0);
+            }
+          }
+        }
+      }
+    }
+
+   private:
+    typedef Eigen::Matrix<CoordinateType, Eigen::Dynamic, Eigen::Dynamic,
+                          Eigen::ColMajor>
+        Matrix;
+    typedef Eigen::Map<const Matrix> ConstMatrixMap;
+
+    // Hands out the points tile by tile, as dim x count column-major blocks
+    template <typename Storage, typename Enable = void>
+    class TileSource {
+     public:
+      TileSource(const Storage& points, Matrix* tile)
+          : iter_(points.get_full_sequence()), tile_(tile) {}
+
+      const CoordinateType* next(int_fast64_t count) {
+        for (int_fast64_t ii = 0; ii < count; ++ii, ++iter_) {
+          tile_->col(ii) = iter_.get_point();
+        }
+        return tile_->data();
+      }
+
+     private:
+      typename Storage::FullSequenceIterator iter_;
+      Matrix* tile_;
+    };
+
+    template <typename Storage>
+    class TileSource<Storage, typename std::enable_if<
+                                  IsPlainArrayStorage<Storage>::value>::type> {
+     public:
+      TileSource(const Storage& points, Matrix*)
+          : next_(points.data()), dim_(points.dimension()) {}
+
+      const CoordinateType* next(int_fast64_t count) {
+        const CoordinateType* result = next_;
+        next_ += count * dim_;
+        return result;
+      }
+
+     private:
+      const CoordinateType* next_;
+      int_fast64_t dim_;
+    };
+
+    const HyperplaneHashDense& parent_;
+    Matrix tile_;
+    Matrix projections_;
+  };
 };
 
 // Hash function implementation for the sparse hyperplane hash.
@@ -0,0 +1,249 @@
+#ifndef __INLINE_FLAT_HASH_TABLE_H__
+#define __INLINE_FLAT_HASH_TABLE_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "flat_hash_table.h"
+#include "hash_table_helpers.h"
+#include "serialization.h"
+#include "thread_pool.h"
+
+namespace falconn {
+namespace core {
+
+class InlineFlatHashTableError : public HashTableError {
+ public:
+  InlineFlatHashTableError(const char* msg) : HashTableError(msg) {}
+};
+
+// A flat hash table whose buckets each take one cache line: a slot of 64
+// bytes holds the length of the bucket followed by its point indices when
+// they fit (15 for 32-bit indices), or by the position of the indices in an
+// overflow array when they do not. A probe of a small bucket therefore
+// touches a single cache line, where FlatHashTable reads a directory entry
+// and then the indices elsewhere. The slots take 64 bytes per bucket whether
+// the bucket is empty or not, so this pays off when there are not many more
+// buckets than points, most buckets are small, and the table is too large
+// for the cache; a table that fits into the cache is faster as a
+// FlatHashTable, whose directory is eight times smaller.
+template <typename KeyType, typename ValueType = int32_t,
+          typename IndexType = int32_t>
+class InlineFlatHashTable {
+ public:
+  class Factory {
+   public:
+    Factory(IndexType num_buckets, ValueType num_items)
+        : num_buckets_(num_buckets), num_items_(num_items) {
+      if (num_buckets_ < 1) {
+        throw InlineFlatHashTableError("Number of buckets must be at least 1.");
+      }
+      if (num_items_ < 1) {
+        throw InlineFlatHashTableError("Number of items must be at least 1.");
+      }
+    }
+
+    InlineFlatHashTable<KeyType, ValueType, IndexType>* new_hash_table() {
+      return new InlineFlatHashTable<KeyType, ValueType, IndexType>(
+          num_buckets_, num_items_);
+    }
+
+   private:
+    IndexType num_buckets_ = 0;
+    ValueType num_items_ = 0;
+  };
+
+  typedef const ValueType* Iterator;
+
+  // Values per slot, and point indices of a bucket stored in its slot
+  static const int_fast32_t kSlotSize = 64 / sizeof(ValueType);
+  static const int_fast32_t kInlineCapacity = kSlotSize - 1;
+
+  InlineFlatHashTable(IndexType num_buckets, ValueType num_items)
+      : num_buckets_(num_buckets), num_items_(num_items) {
+    if (num_buckets_ < 1) {
+      throw InlineFlatHashTableError("Number of buckets must be at least 1.");
+    }
+    if (num_items_ < 1) {
+      throw InlineFlatHashTableError("Number of items must be at least 1.");
+    }
+  }
+
+  // The entries are first sorted into the buckets of a FlatHashTable, with
+  // the given number of threads, and the buckets are then copied into their
+  // slots or the overflow array in parallel over ranges of buckets.
+  void add_entries(const std::vector<KeyType>& keys,
+                   int_fast32_t num_threads = 1) {
+    if (entries_added_) {
+      throw InlineFlatHashTableError("Entries were already added.");
+    }
+    if (static_cast<ValueType>(keys.size()) != num_items_) {
+      throw InlineFlatHashTableError(
+          "Incorrect number of items in add_entries.");
+    }
+    FlatHashTable<KeyType, ValueType, IndexType> sorted(num_buckets_);
+    sorted.add_entries(keys, num_threads);
+    entries_added_ = true;
+
+    num_threads = std::max<int_fast32_t>(
+        1, std::min<int_fast64_t>(num_threads,
+                                  num_items_ / kFlatHashTableMinEntriesPerThread));
+    auto bucket_range = [this, num_threads](int_fast32_t thread) {
+      return std::make_pair(
+          static_cast<int_fast64_t>(num_buckets_) * thread / num_threads,
+          static_cast<int_fast64_t>(num_buckets_) * (thread + 1) / num_threads);
+    };
+
+    std::vector<int_fast64_t> thread_overflow(num_threads + 1, 0);
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      std::pair<int_fast64_t, int_fast64_t> range = bucket_range(thread);
+      for (int_fast64_t bb = range.first; bb < range.second; ++bb) {
+        auto bucket = sorted.retrieve(static_cast<KeyType>(bb));
+        if (bucket.second - bucket.first > kInlineCapacity) {
+          thread_overflow[thread + 1] += bucket.second - bucket.first;
+        }
+      }
+    });
+    for (int_fast32_t tt = 0; tt < num_threads; ++tt) {
+      thread_overflow[tt + 1] += thread_overflow[tt];
+    }
+
+    slots_.resize(num_buckets_);
+    overflow_.resize(thread_overflow[num_threads]);
+    run_in_parallel(num_threads, [&](int_fast32_t thread) {
+      std::pair<int_fast64_t, int_fast64_t> range = bucket_range(thread);
+      int_fast64_t next = thread_overflow[thread];
+      for (int_fast64_t bb = range.first; bb < range.second; ++bb) {
+        auto bucket = sorted.retrieve(static_cast<KeyType>(bb));
+        ValueType length = static_cast<ValueType>(bucket.second - bucket.first);
+        ValueType* slot = slots_[bb].values;
+        slot[0] = length;
+        if (length <= kInlineCapacity) {
+          std::copy(bucket.first, bucket.second, slot + 1);
+        } else {
+          slot[1] = static_cast<ValueType>(next);
+          std::copy(bucket.first, bucket.second, overflow_.begin() + next);
+          next += length;
+        }
+      }
+    });
+  }
+
+  std::pair<Iterator, Iterator> retrieve(const KeyType& key) const {
+    const ValueType* slot = slots_[key].values;
+    ValueType length = slot[0];
+    const ValueType* start =
+        length <= kInlineCapacity ? slot + 1 : overflow_.data() + slot[1];
+    return std::make_pair(start, start + length);
+  }
+
+  // See FlatHashTable::prefetch_bucket. Only the buckets in the overflow
+  // array have entries elsewhere.
+  void prefetch_bucket(const KeyType& key) const {
+    __builtin_prefetch(slots_.data() + key, 0, 1);
+  }
+
+  void prefetch_entries(const KeyType& key) const {
+    const ValueType* slot = slots_[key].values;
+    if (slot[0] > kInlineCapacity) {
+      __builtin_prefetch(overflow_.data() + slot[1], 0, 1);
+    }
+  }
+
+  // See FlatHashTable::for_each_bucket
+  template <typename Function>
+  void for_each_bucket(Function f) const {
+    for (IndexType bb = 0; bb < num_buckets_ && entries_added_; ++bb) {
+      std::pair<Iterator, Iterator> bucket = retrieve(static_cast<KeyType>(bb));
+      if (bucket.first != bucket.second) {
+        f(bucket.first, bucket.second);
+      }
+    }
+  }
+
+  // Bytes of the slots, with the point indices of the small buckets, and of
+  // the point indices of the large buckets
+  int_fast64_t get_bucket_memory_usage() const {
+    return slots_.get_memory_usage();
+  }
+
+  int_fast64_t get_entry_memory_usage() const {
+    return overflow_.get_memory_usage();
+  }
+
+  // The same for a table with the given numbers of buckets and items. The
+  // size of the overflow array depends on the bucket sizes; the estimate
+  // assumes buckets of equal size.
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t num_buckets) {
+    return num_buckets * sizeof(Slot);
+  }
+
+  static int_fast64_t estimate_entry_memory_usage(int_fast64_t num_buckets,
+                                                  int_fast64_t num_items) {
+    int_fast64_t items_per_bucket = (num_items + num_buckets - 1) / num_buckets;
+    return items_per_bucket > kInlineCapacity ? num_items * sizeof(ValueType)
+                                              : 0;
+  }
+
+  void serialize(BinaryWriter* output) const {
+    if (!entries_added_) {
+      throw InlineFlatHashTableError(
+          "Cannot serialize a table without entries.");
+    }
+    output->write_value<int64_t>(num_buckets_);
+    output->write_value<int64_t>(num_items_);
+    slots_.serialize(output);
+    overflow_.serialize(output);
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (entries_added_) {
+      throw InlineFlatHashTableError("Entries were already added.");
+    }
+    if (input->read_value<int64_t>() != num_buckets_ ||
+        input->read_value<int64_t>() != num_items_) {
+      throw InlineFlatHashTableError("Table shape in input does not match.");
+    }
+    slots_.deserialize(input);
+    overflow_.deserialize(input);
+    if (slots_.size() != num_buckets_) {
+      throw InlineFlatHashTableError("Slots in input have the wrong size.");
+    }
+    entries_added_ = true;
+  }
+
+ private:
+  static_assert(64 % sizeof(ValueType) == 0,
+                "Point indices must evenly divide a cache line.");
+
+  // values[0] is the length of the bucket; values[1], ... are its point
+  // indices if it has at most kInlineCapacity of them, and values[1] is
+  // the position of its indices in overflow_ otherwise
+  struct Slot {
+    ValueType values[kSlotSize];
+  };
+
+  IndexType num_buckets_ = 0;
+  ValueType num_items_ = 0;
+  bool entries_added_ = false;
+
+  // Aligned so that each slot is one cache line
+  ArrayStore<Slot, CacheAlignedAllocator<Slot>> slots_;
+  // point indices of the buckets that do not fit into their slots
+  ArrayStore<ValueType> overflow_;
+};
+
+template <typename KeyType, typename ValueType, typename IndexType>
+const int_fast32_t
+    InlineFlatHashTable<KeyType, ValueType, IndexType>::kSlotSize;
+
+template <typename KeyType, typename ValueType, typename IndexType>
+const int_fast32_t
+    InlineFlatHashTable<KeyType, ValueType, IndexType>::kInlineCapacity;
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
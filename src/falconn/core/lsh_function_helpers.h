@@ -2,6 +2,7 @@
 #define __LSH_FUNCTION_HELPERS_H__
 
 #include "../falconn_global.h"
+#include "serialization.h"
 
 namespace falconn {
 namespace core {
@@ -84,8 +85,16 @@ class HashObjectQuery {
 
   std::pair<ProbingSequenceIterator, ProbingSequenceIterator>
   get_probing_sequence(const VectorType& point) {
+    return get_probing_sequence(point, -1);
+  }
+
+  // The first num_probes probes of the sequence, in the order in which
+  // get_probes_by_table() produces them, so a prefix of this sequence gives
+  // the probes for any smaller number of probes
+  std::pair<ProbingSequenceIterator, ProbingSequenceIterator>
+  get_probing_sequence(const VectorType& point, int_fast64_t num_probes) {
     hash_transformation_.apply(point, &transformed_vector_);
-    multiprobe_.setup_probing(transformed_vector_, -1);
+    multiprobe_.setup_probing(transformed_vector_, num_probes);
     return std::make_pair(ProbingSequenceIterator(this),
                           ProbingSequenceIterator(nullptr));
   }
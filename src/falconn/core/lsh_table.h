@@ -4,15 +4,19 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
-#include <future>
+#include <functional>
 #include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
-#include <thread>
+#include <utility>
 #include <vector>
 
 #include "../falconn_global.h"
+#include "candidate_set.h"
 #include "data_storage.h"
+#include "query_instrumentation.h"
+#include "thread_pool.h"
 
 namespace falconn {
 namespace core {
@@ -55,6 +59,385 @@ class BasicLSHTable {
   HashTable* hash_table_;
 };
 
+// Walks the probing sequence of a query point and returns the number of
+// probes after which the given key is first among the candidates, or -1 if
+// it is not found within max_num_probes probes. Since the probes for a
+// number of probes are a prefix of the sequence, this tells for every
+// number of probes up to max_num_probes whether a query finds the key, and
+// stops as soon as it does.
+template <typename LSHQuery, typename HashTable, typename PointType,
+          typename KeyType>
+int_fast64_t get_num_probes_to_find_key(LSHQuery* lsh_query,
+                                        const HashTable& hash_table,
+                                        const PointType& p, KeyType key,
+                                        int_fast64_t max_num_probes) {
+  if (max_num_probes <= 0) {
+    throw LSHTableError("Maximum number of probes must be at least 1.");
+  }
+  auto probes = lsh_query->get_probing_sequence(p, max_num_probes);
+  int_fast64_t num_probes = 0;
+  for (; probes.first != probes.second; ++probes.first) {
+    num_probes += 1;
+    auto bucket =
+        hash_table.retrieve_individual(probes.first->first,
+                                       probes.first->second);
+    for (; bucket.first != bucket.second; ++bucket.first) {
+      if (*bucket.first == key) {
+        return num_probes;
+      }
+    }
+    if (num_probes >= max_num_probes) {
+      break;
+    }
+  }
+  return -1;
+}
+
+// Candidates taken from one bucket at a time when a CandidateSequence
+// interleaves the buckets of several probes: a cache line of 32-bit keys.
+const int_fast64_t kCandidateInterleaveBlock = 16;
+
+// Splits a bucket at its part-th of num_parts parts: *bucket becomes the
+// entries from there on and *wrapped those before. Only buckets whose
+// iterators measure and skip entries in constant time are split: those
+// stored as arrays (e.g., of a FlatHashTable) and those of a
+// BitPackedFlatHashTable. The buckets of the STL, dynamic and compressed
+// tables start at their heads, as walking to the split would read the
+// entries a capped query may never need.
+template <typename Iterator>
+auto split_bucket(std::pair<Iterator, Iterator>* bucket,
+                  std::pair<Iterator, Iterator>* wrapped, int_fast64_t part,
+                  int_fast64_t num_parts, int)
+    -> decltype(bucket->first.distance_to(bucket->second),
+                bucket->first.advance(0), void()) {
+  int_fast64_t length = bucket->first.distance_to(bucket->second);
+  Iterator middle = bucket->first;
+  middle.advance(length * part / num_parts);
+  *wrapped = std::make_pair(bucket->first, middle);
+  bucket->first = middle;
+}
+
+template <typename Iterator>
+void split_bucket(std::pair<Iterator, Iterator>*,
+                  std::pair<Iterator, Iterator>*, int_fast64_t, int_fast64_t,
+                  long) {}
+
+template <typename Value>
+void split_bucket(std::pair<Value*, Value*>* bucket,
+                  std::pair<Value*, Value*>* wrapped, int_fast64_t part,
+                  int_fast64_t num_parts, int) {
+  Value* middle =
+      bucket->first + (bucket->second - bucket->first) * part / num_parts;
+  *wrapped = std::make_pair(bucket->first, middle);
+  bucket->first = middle;
+}
+
+// A lazy walk over the candidates of a query point: the probes are
+// generated one at a time by the multiprobe lookup of the LSH query, and
+// the bucket of a probe is only retrieved once it is needed. Callers that
+// stop early (e.g., after a maximum number of candidates, or once a filter
+// has accepted enough points) therefore neither generate nor retrieve the
+// remaining probes.
+//
+// The sequence keeps up to a window of buckets open and takes
+// kCandidateInterleaveBlock candidates from each in turn; a bucket that
+// runs out is replaced by the bucket of the next probe. With a window of
+// one, the candidates come in probe order. With one bucket per table, a
+// heavy bucket (of skewed data) gets its share of a maximum number of
+// candidates instead of all of it, while the candidates of the other
+// tables are taken alongside. Since a cluster of points shares a heavy
+// bucket in many tables, stored in the same order, the walk through a
+// bucket of table t (of l) then starts t/l of the way in and wraps around,
+// so that the tables contribute different points, for the storages that
+// can skip to that point in constant time (see split_bucket); the others
+// start at the head. Either way, the candidates of a sequence and their
+// order depend only on the query, not on where a caller stops.
+//
+// A sequence uses the LSH query object and, for unique candidates, the
+// candidate set of the table query that owns it, so it is only valid until
+// the next query with that object. finish() releases the candidate set; it
+// is called by start() and must be called before the set is used
+// otherwise.
+template <typename LSHQuery, typename HashTable, typename PointType,
+          typename KeyType>
+class CandidateSequence {
+ public:
+  CandidateSequence(LSHQuery* lsh_query, const HashTable* hash_table,
+                    CandidateSet<KeyType>* candidate_set)
+      : lsh_query_(lsh_query),
+        hash_table_(hash_table),
+        candidate_set_(candidate_set) {}
+
+  // Starts the walk over the candidates of p within the first num_probes
+  // probes, interleaving up to window buckets; with unique, each key is
+  // returned only once.
+  void start(const PointType& p, int_fast64_t num_probes, bool unique,
+             int_fast64_t window = 1) {
+    finish();
+    if (num_probes <= 0) {
+      throw LSHTableError("Number of probes must be at least 1.");
+    }
+    if (window <= 0) {
+      throw LSHTableError("Number of interleaved buckets must be at least 1.");
+    }
+    probes_ = lsh_query_->get_probing_sequence(p, num_probes);
+    max_num_probes_ = num_probes;
+    num_probes_ = 0;
+    num_candidates_ = 0;
+    open_buckets_.assign(std::min(window, num_probes), OpenBucket());
+    window_ = window;
+    cur_bucket_ = 0;
+    block_left_ = kCandidateInterleaveBlock;
+    unique_ = unique;
+    if (unique_) {
+      candidate_set_->clear();
+      unique_keys_.clear();
+      holds_candidate_set_ = true;
+    }
+  }
+
+  // Sets key to the next candidate and returns true, or returns false at
+  // the end of the sequence
+  bool next(KeyType* key) {
+    while (!open_buckets_.empty()) {
+      OpenBucket& open = open_buckets_[cur_bucket_];
+      Bucket& bucket = open.entries;
+      if (!(bucket.first != bucket.second)) {
+        // Empty buckets are skipped without using up the block.
+        if (open.wrapped.first != open.wrapped.second) {
+          bucket = open.wrapped;
+          open.wrapped = Bucket();
+        } else if (!retrieve_next_probe(&open)) {
+          open_buckets_.erase(open_buckets_.begin() + cur_bucket_);
+          next_bucket(0);
+        }
+        continue;
+      }
+      if (block_left_ == 0) {
+        next_bucket(1);
+        continue;
+      }
+      KeyType cur = *bucket.first;
+      ++bucket.first;
+      block_left_ -= 1;
+      num_candidates_ += 1;
+      if (!unique_) {
+        *key = cur;
+        return true;
+      }
+      if (candidate_set_->insert(cur)) {
+        unique_keys_.push_back(cur);
+        *key = cur;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void finish() {
+    if (holds_candidate_set_) {
+      candidate_set_->finish(unique_keys_);
+      holds_candidate_set_ = false;
+    }
+  }
+
+  // Number of probes whose buckets were retrieved so far
+  int_fast64_t get_num_probes() const { return num_probes_; }
+
+  // Number of candidates seen so far, counting duplicates
+  int_fast64_t get_num_candidates() const { return num_candidates_; }
+
+  int_fast64_t get_memory_usage() const {
+    return unique_keys_.capacity() * sizeof(KeyType) +
+           open_buckets_.capacity() * sizeof(OpenBucket);
+  }
+
+ private:
+  typedef decltype(std::declval<LSHQuery&>().get_probing_sequence(
+      std::declval<const PointType&>(), 1)) ProbeRange;
+  typedef decltype(std::declval<const HashTable&>().retrieve_individual(
+      std::declval<typename LSHQuery::HashType>(), 0)) Bucket;
+
+  LSHQuery* lsh_query_;
+  const HashTable* hash_table_;
+  CandidateSet<KeyType>* candidate_set_;
+
+  // The entries of a bucket left to walk: those from where the walk
+  // started on, then those before
+  struct OpenBucket {
+    Bucket entries;
+    Bucket wrapped;
+  };
+
+  ProbeRange probes_;
+  std::vector<OpenBucket> open_buckets_;  // in the order they are taken from
+  int_fast64_t window_ = 1;
+  size_t cur_bucket_ = 0;
+  int_fast64_t block_left_ = 0;  // candidates left for the current bucket
+  int_fast64_t max_num_probes_ = 0;
+  int_fast64_t num_probes_ = 0;
+  int_fast64_t num_candidates_ = 0;
+  bool unique_ = false;
+  bool holds_candidate_set_ = false;
+  std::vector<KeyType> unique_keys_;
+
+  // Moves on to the open bucket step places after the current one (step
+  // is 0 after the current one was closed) with a new block
+  void next_bucket(size_t step) {
+    cur_bucket_ += step;
+    if (cur_bucket_ >= open_buckets_.size()) {
+      cur_bucket_ = 0;
+    }
+    block_left_ = kCandidateInterleaveBlock;
+  }
+
+  bool retrieve_next_probe(OpenBucket* open) {
+    if (num_probes_ >= max_num_probes_ || probes_.first == probes_.second) {
+      return false;
+    }
+    // The first probe was generated by get_probing_sequence(); the others
+    // only here, when they are needed.
+    if (num_probes_ > 0) {
+      ++probes_.first;
+    }
+    if (probes_.first == probes_.second) {
+      return false;
+    }
+    int_fast64_t table = probes_.first->second;
+    open->entries = hash_table_->retrieve_individual(probes_.first->first,
+                                                     table);
+    open->wrapped = Bucket();
+    if (window_ > 1) {
+      split_bucket(&open->entries, &open->wrapped, table % window_, window_,
+                   0);
+    }
+    num_probes_ += 1;
+    return true;
+  }
+};
+
+// Retrieves at most max_num_candidates candidates (counting duplicates) of
+// p from a CandidateSequence, which generates only the probes needed and
+// interleaves one bucket per table, and reports the time spent and the
+// number of candidates seen, which it returns, to the recorder of a
+// measured query. As for get_probes_by_table(), there must be at least one
+// probe per table.
+template <typename Sequence, typename PointType, typename KeyType>
+int_fast64_t get_first_candidates(Sequence* sequence, const PointType& p,
+                                  int_fast64_t num_probes,
+                                  int_fast64_t num_tables,
+                                  int_fast64_t max_num_candidates, bool unique,
+                                  std::vector<KeyType>* result,
+                                  QueryRecorder* recorder) {
+  if (num_probes < num_tables) {
+    throw LSHTableError(
+        "Number of probes must be at least the number of tables.");
+  }
+  bool measured = recorder->measured();
+  QueryRecorder::Ticks start_time = measured ? recorder->now() : 0;
+
+  sequence->start(p, num_probes, unique, num_tables);
+
+  QueryRecorder::Ticks lsh_end_time = measured ? recorder->now() : 0;
+
+  // A unique candidate may come after duplicates beyond the maximum.
+  result->clear();
+  KeyType cur;
+  while (sequence->get_num_candidates() < max_num_candidates &&
+         sequence->next(&cur) &&
+         sequence->get_num_candidates() <= max_num_candidates) {
+    result->push_back(cur);
+  }
+  sequence->finish();
+
+  int_fast64_t num_candidates =
+      std::min(sequence->get_num_candidates(), max_num_candidates);
+  if (measured) {
+    recorder->add_lsh_time(CycleClock::seconds(start_time, lsh_end_time));
+    recorder->add_hash_table_time(recorder->seconds_since(lsh_end_time));
+    recorder->set_num_candidates(num_candidates);
+    if (unique) {
+      recorder->set_num_unique_candidates(result->size());
+    }
+  }
+  return num_candidates;
+}
+
+// Below this many points per thread, the points of a table are hashed with
+// fewer threads.
+const int_fast64_t kMinPointsPerSetupThread = 1 << 12;
+
+// Hashes the data points for the tables during setup. With more than one
+// thread, the points are split into contiguous ranges (see DataStorageRange)
+// that are hashed concurrently, so that the setup of a single table can use
+// several threads.
+template <typename LSH, typename HashType, typename KeyType,
+          typename DataStorageType>
+class SetupBatchHash {
+ public:
+  SetupBatchHash(const LSH& lsh, const DataStorageType& points,
+                 int_fast32_t num_threads)
+      : points_(points), bh_(lsh) {
+    int_fast64_t n = points.size();
+    num_threads = std::max<int_fast64_t>(
+        1, std::min<int_fast64_t>(num_threads, n / kMinPointsPerSetupThread));
+    if (num_threads == 1) {
+      return;
+    }
+    for (int_fast32_t tt = 0; tt < num_threads; ++tt) {
+      int_fast64_t first = n * tt / num_threads;
+      int_fast64_t end = n * (tt + 1) / num_threads;
+      range_starts_.push_back(first);
+      ranges_.emplace_back(new Range(points, first, end - first));
+      range_bhs_.emplace_back(new RangeBatchHash(lsh));
+    }
+    range_hashes_.resize(num_threads);
+  }
+
+  int_fast32_t get_num_tables_per_batch() const {
+    return bh_.get_num_tables_per_batch();
+  }
+
+  void batch_hash_tables(int_fast32_t first_table, int_fast32_t num_tables,
+                         std::vector<HashType>* res) {
+    if (ranges_.empty()) {
+      bh_.batch_hash_tables(points_, first_table, num_tables, res);
+      return;
+    }
+
+    for (int_fast32_t jj = 0; jj < num_tables; ++jj) {
+      res[jj].resize(points_.size());
+    }
+    run_in_parallel(static_cast<int_fast32_t>(ranges_.size()),
+                    [&](int_fast32_t range) {
+                      hash_range(range, first_table, num_tables, res);
+                    });
+  }
+
+ private:
+  typedef DataStorageRange<DataStorageType, KeyType> Range;
+  typedef typename LSH::template BatchHash<Range> RangeBatchHash;
+
+  void hash_range(size_t range, int_fast32_t first_table,
+                  int_fast32_t num_tables, std::vector<HashType>* res) {
+    std::vector<std::vector<HashType>>& hashes = range_hashes_[range];
+    hashes.resize(num_tables);
+    range_bhs_[range]->batch_hash_tables(*(ranges_[range]), first_table,
+                                         num_tables, hashes.data());
+    for (int_fast32_t jj = 0; jj < num_tables; ++jj) {
+      std::copy(hashes[jj].begin(), hashes[jj].end(),
+                res[jj].begin() + range_starts_[range]);
+    }
+  }
+
+  const DataStorageType& points_;
+  typename LSH::template BatchHash<DataStorageType> bh_;
+  std::vector<int_fast64_t> range_starts_;
+  std::vector<std::unique_ptr<Range>> ranges_;
+  std::vector<std::unique_ptr<RangeBatchHash>> range_bhs_;
+  std::vector<std::vector<std::vector<HashType>>> range_hashes_;
+};
+
 template <typename PointType,  // the type of the data points to be stored
           typename KeyType,    // must be integral for a static table
           typename LSH,        // the LSH family
@@ -66,7 +449,12 @@ class StaticLSHTable
                            StaticLSHTable<PointType, KeyType, LSH, HashType,
                                           HashTable, DataStorageType>> {
  public:
-  StaticLSHTable(LSH* lsh, HashTable* hash_table, const DataStorageType& points,
+  // The points are hashed from points, which is usually the data storage of
+  // the table but may also be a view of it, e.g., a TransformedDataStorage
+  // that transforms the points before they are hashed.
+  template <typename HashedDataStorage = DataStorageType>
+  StaticLSHTable(LSH* lsh, HashTable* hash_table,
+                 const HashedDataStorage& points,
                  int_fast32_t num_setup_threads)
       : BasicLSHTable<LSH, HashTable,
                       StaticLSHTable<PointType, KeyType, LSH, HashType,
@@ -77,100 +465,147 @@ class StaticLSHTable
       throw LSHTableError("Number of setup threads cannot be negative.");
     }
     if (num_setup_threads == 0) {
-      num_setup_threads = std::max(1u, std::thread::hardware_concurrency());
+      num_setup_threads = thread_pool().size();
     }
     int_fast32_t l = this->lsh_->get_l();
 
-    num_setup_threads = std::min(l, num_setup_threads);
-    int_fast32_t num_tables_per_thread = l / num_setup_threads;
-    int_fast32_t num_leftover_tables = l % num_setup_threads;
+    // Each table range is set up by its own task on the thread pool (see
+    // thread_pool.h). If there are more threads than tables, the remaining
+    // threads hash and sort the points within the tables.
+    int_fast32_t num_range_threads = std::min(l, num_setup_threads);
+    int_fast32_t num_threads_per_table = num_setup_threads / num_range_threads;
+    int_fast32_t num_tables_per_thread = l / num_range_threads;
+    int_fast32_t num_leftover_tables = l % num_range_threads;
 
-    std::vector<std::future<void>> thread_results;
-    int_fast32_t next_table_range_start = 0;
-
-    for (int_fast32_t ii = 0; ii < num_setup_threads; ++ii) {
-      int_fast32_t next_table_range_end =
-          next_table_range_start + num_tables_per_thread - 1;
-      if (ii < num_leftover_tables) {
-        next_table_range_end += 1;
-      }
-      thread_results.push_back(std::async(
-          std::launch::async, &StaticLSHTable::setup_table_range, this,
-          next_table_range_start, next_table_range_end, points));
-      next_table_range_start = next_table_range_end + 1;
+    std::vector<int_fast32_t> range_starts(num_range_threads + 1, 0);
+    for (int_fast32_t ii = 0; ii < num_range_threads; ++ii) {
+      range_starts[ii + 1] = range_starts[ii] + num_tables_per_thread +
+                             (ii < num_leftover_tables ? 1 : 0);
     }
 
-    for (int_fast32_t ii = 0; ii < num_setup_threads; ++ii) {
-      thread_results[ii].get();
-    }
+    run_in_parallel(num_range_threads, [&](int_fast32_t range) {
+      setup_table_range(range_starts[range], range_starts[range + 1] - 1,
+                        points, num_threads_per_table);
+    });
   }
 
-  // TODO: add query statistics back in
+  // Constructs the table around a low-level hash table whose entries were
+  // already filled in, e.g., by deserializing a saved table, so no hashing
+  // of the data points takes place.
+  StaticLSHTable(LSH* lsh, HashTable* hash_table, const DataStorageType& points)
+      : BasicLSHTable<LSH, HashTable,
+                      StaticLSHTable<PointType, KeyType, LSH, HashType,
+                                     HashTable, DataStorageType>>(lsh,
+                                                                  hash_table),
+        n_(points.size()) {}
+
   class Query {
    public:
+    typedef CandidateSequence<typename LSH::Query, HashTable, PointType,
+                              KeyType>
+        CandidateSequenceType;
+
     Query(const StaticLSHTable& parent)
         : parent_(parent),
-          is_candidate_(parent.n_),
-          lsh_query_(*(parent.lsh_)) {}
+          candidate_set_(parent.n_),
+          lsh_query_(*(parent.lsh_)),
+          candidate_sequence_(&lsh_query_, parent.hash_table_,
+                              &candidate_set_) {}
 
+    // With a maximum number of candidates, these take the candidates from
+    // a CandidateSequence, one bucket per table in turn, and stop at the
+    // maximum, so the remaining probes are never generated. Otherwise all
+    // probes are retrieved at once, table by table.
     void get_candidates_with_duplicates(const PointType& p,
                                         int_fast64_t num_probes,
                                         int_fast64_t max_num_candidates,
                                         std::vector<KeyType>* result) {
-      auto start_time = std::chrono::high_resolution_clock::now();
-      stats_num_queries_ += 1;
-
-      lsh_query_.get_probes_by_table(p, &tmp_probes_by_table_, num_probes);
+      QueryRecorder::Scope scope(&recorder_);
+      get_candidates_internal(p, num_probes, max_num_candidates, result);
+    }
 
-      auto lsh_end_time = std::chrono::high_resolution_clock::now();
-      auto elapsed_lsh =
-          std::chrono::duration_cast<std::chrono::duration<double>>(
-              lsh_end_time - start_time);
-      stats_.average_lsh_time += elapsed_lsh.count();
+    void get_unique_candidates(const PointType& p, int_fast64_t num_probes,
+                               int_fast64_t max_num_candidates,
+                               std::vector<KeyType>* result) {
+      QueryRecorder::Scope scope(&recorder_);
+      get_unique_candidates_internal(p, num_probes, max_num_candidates, result);
+    }
 
-      hash_table_iterators_ =
-          parent_.hash_table_->retrieve_bulk(tmp_probes_by_table_);
+    // Hashes p and prefetches the buckets of its probes, so that they are
+    // likely cached when p is queried with the same number of probes. Up
+    // to a few points may be prefetched ahead of the queries: they queue
+    // in order, and the query for the oldest one takes its probes (and the
+    // time spent computing them) from the queue and prefetches the first
+    // entries of the buckets of the next one. A query for any other point
+    // drops the queue.
+    void prefetch(const PointType& p, int_fast64_t num_probes) {
+      bool timed = recorder_.enabled();
+      QueryRecorder::Ticks start_time = timed ? recorder_.now() : 0;
 
-      int_fast64_t num_candidates = 0;
-      result->clear();
-      if (max_num_candidates < 0) {
-        max_num_candidates = std::numeric_limits<int_fast64_t>::max();
-      }
-      while (num_candidates < max_num_candidates &&
-             hash_table_iterators_.first != hash_table_iterators_.second) {
-        num_candidates += 1;
-        result->push_back(*(hash_table_iterators_.first));
-        ++hash_table_iterators_.first;
+      if (num_prefetched_ == prefetched_.size()) {
+        prefetched_.insert(prefetched_.begin() + first_prefetched_,
+                           PrefetchedQuery());
+        if (num_prefetched_ > 0) {
+          first_prefetched_ += 1;
+        }
       }
+      PrefetchedQuery& slot =
+          prefetched_[(first_prefetched_ + num_prefetched_) %
+                      prefetched_.size()];
+      num_prefetched_ += 1;
+      slot.point = p;
+      slot.num_probes = num_probes;
+      lsh_query_.get_probes_by_table(p, &slot.probes, num_probes);
+      parent_.hash_table_->prefetch_buckets(slot.probes);
 
-      auto hashing_end_time = std::chrono::high_resolution_clock::now();
-      auto elapsed_hashing =
-          std::chrono::duration_cast<std::chrono::duration<double>>(
-              hashing_end_time - lsh_end_time);
-      stats_.average_hash_table_time += elapsed_hashing.count();
+      slot.lsh_time = timed ? recorder_.seconds_since(start_time) : 0.0;
+    }
 
-      stats_.average_num_candidates += num_candidates;
+    // The hash of p in each table, i.e., its first probe there. The
+    // hashes determine the candidates of p with one probe per table (see
+    // get_unique_candidates_by_hashes), so they identify the queries that
+    // share these candidates. The time spent hashing is counted by the
+    // next call of get_unique_candidates_by_hashes.
+    void get_hashes(const PointType& p, std::vector<uint64_t>* result) {
+      bool timed = recorder_.enabled();
+      QueryRecorder::Ticks start_time = timed ? recorder_.now() : 0;
 
-      auto end_time = std::chrono::high_resolution_clock::now();
-      auto elapsed_total =
-          std::chrono::duration_cast<std::chrono::duration<double>>(end_time -
-                                                                    start_time);
-      stats_.average_total_query_time += elapsed_total.count();
+      num_prefetched_ = 0;
+      lsh_query_.get_probes_by_table(p, &tmp_probes_by_table_,
+                                     parent_.lsh_->get_l());
+      result->resize(tmp_probes_by_table_.size());
+      for (size_t ii = 0; ii < result->size(); ++ii) {
+        (*result)[ii] = tmp_probes_by_table_[ii][0];
+      }
+
+      hashes_lsh_time_ = timed ? recorder_.seconds_since(start_time) : 0.0;
     }
 
-    void get_unique_candidates(const PointType& p, int_fast64_t num_probes,
-                               int_fast64_t max_num_candidates,
-                               std::vector<KeyType>* result) {
-      auto start_time = std::chrono::high_resolution_clock::now();
-      stats_num_queries_ += 1;
+    // The unique candidates in the buckets with the given hashes, one per
+    // table as returned by get_hashes, in the order in which
+    // get_unique_candidates returns the candidates of a point with these
+    // hashes for one probe per table and no maximum number of candidates
+    void get_unique_candidates_by_hashes(const std::vector<uint64_t>& hashes,
+                                         std::vector<KeyType>* result) {
+      QueryRecorder::Scope scope(&recorder_);
+      QueryRecorder::Ticks start_time = scope.measured() ? recorder_.now() : 0;
 
-      get_unique_candidates_internal(p, num_probes, max_num_candidates, result);
+      num_prefetched_ = 0;
+      candidate_sequence_.finish();
+      tmp_probes_by_table_.resize(hashes.size());
+      for (size_t ii = 0; ii < hashes.size(); ++ii) {
+        tmp_probes_by_table_[ii].assign(1, static_cast<HashType>(hashes[ii]));
+      }
+      int_fast64_t num_candidates =
+          retrieve_unique_candidates(result);
 
-      auto end_time = std::chrono::high_resolution_clock::now();
-      auto elapsed_total =
-          std::chrono::duration_cast<std::chrono::duration<double>>(end_time -
-                                                                    start_time);
-      stats_.average_total_query_time += elapsed_total.count();
+      if (scope.measured()) {
+        recorder_.add_lsh_time(hashes_lsh_time_);
+        recorder_.add_hash_table_time(recorder_.seconds_since(start_time));
+        recorder_.set_num_candidates(num_candidates);
+        recorder_.set_num_unique_candidates(result->size());
+      }
+      hashes_lsh_time_ = 0.0;
     }
 
     /*void get_unique_sorted_candidates(const PointType& p,
@@ -187,102 +622,560 @@ class StaticLSHTable
       auto elapsed_total = std::chrono::duration_cast<
           std::chrono::duration<double>>(end_time - start_time);
       stats_.average_total_query_time += elapsed_total.count();
+      stats_.total_query_time_histogram.add(elapsed_total.count());
     }*/
 
-    void reset_query_statistics() {
-      stats_num_queries_ = 0;
-      stats_.average_total_query_time = 0.0;
-      stats_.average_lsh_time = 0.0;
-      stats_.average_hash_table_time = 0.0;
-      stats_.average_distance_time = 0.0;
-      stats_.average_num_candidates = 0.0;
-      stats_.average_num_unique_candidates = 0.0;
+    // The recorder of the queries of this object, which also brackets the
+    // queries of a nearest neighbor query built on it
+    QueryRecorder& recorder() { return recorder_; }
+
+    void set_instrumentation(const QueryInstrumentation& instrumentation) {
+      recorder_.set_instrumentation(instrumentation);
     }
 
+    void reset_query_statistics() { recorder_.reset_statistics(); }
+
     QueryStatistics get_query_statistics() {
-      QueryStatistics res = stats_;
-      if (stats_num_queries_ > 0) {
-        res.average_total_query_time /= stats_num_queries_;
-        res.average_lsh_time /= stats_num_queries_;
-        res.average_hash_table_time /= stats_num_queries_;
-        res.average_distance_time /= stats_num_queries_;
-        res.average_num_candidates /= stats_num_queries_;
-        res.average_num_unique_candidates /= stats_num_queries_;
+      return recorder_.get_statistics();
+    }
+
+    // See get_num_probes_to_find_key()
+    int_fast64_t get_num_probes_to_find(const PointType& p, KeyType key,
+                                        int_fast64_t max_num_probes) {
+      return get_num_probes_to_find_key(&lsh_query_, *(parent_.hash_table_), p,
+                                        key, max_num_probes);
+    }
+
+    // Bytes of the scratch memory of this query object: the set used to
+    // deduplicate candidates (with the keys a candidate sequence added to
+    // it) and the probes of each table. The per-query state of the LSH
+    // functions is small and not included.
+    int_fast64_t get_memory_usage() const {
+      int_fast64_t res = candidate_set_.get_memory_usage() +
+                         candidate_sequence_.get_memory_usage();
+      for (const std::vector<HashType>& probes : tmp_probes_by_table_) {
+        res += probes.capacity() * sizeof(HashType);
+      }
+      for (const PrefetchedQuery& slot : prefetched_) {
+        res += slot.get_memory_usage();
       }
       return res;
     }
 
-    // TODO: add void get_candidate_sequence(const PointType& p)
-    // TODO: add void get_unique_candidate_sequence(const PointType& p)
+    // Starts a lazy walk over the candidates of p within num_probes probes,
+    // with or without duplicates, interleaving one bucket per table or in
+    // probe order (see CandidateSequence). The sequence is owned by this
+    // query object and valid until its next query; the query statistics
+    // are not updated.
+    CandidateSequenceType& get_candidate_sequence(const PointType& p,
+                                                  int_fast64_t num_probes,
+                                                  bool interleaved = true) {
+      num_prefetched_ = 0;
+      candidate_sequence_.start(p, num_probes, false,
+                                interleaved ? parent_.lsh_->get_l() : 1);
+      return candidate_sequence_;
+    }
+
+    CandidateSequenceType& get_unique_candidate_sequence(
+        const PointType& p, int_fast64_t num_probes, bool interleaved = true) {
+      num_prefetched_ = 0;
+      candidate_sequence_.start(p, num_probes, true,
+                                interleaved ? parent_.lsh_->get_l() : 1);
+      return candidate_sequence_;
+    }
 
    private:
+    // A point passed to prefetch() and its probes
+    struct PrefetchedQuery {
+      PointType point;
+      int_fast64_t num_probes = 0;
+      std::vector<std::vector<HashType>> probes;
+      double lsh_time = 0.0;
+
+      int_fast64_t get_memory_usage() const {
+        int_fast64_t res = 0;
+        for (const std::vector<HashType>& table_probes : probes) {
+          res += table_probes.capacity() * sizeof(HashType);
+        }
+        return res;
+      }
+    };
+
     const StaticLSHTable& parent_;
-    int_fast32_t query_counter_ = 0;
-    std::vector<int32_t> is_candidate_;
+    CandidateSet<KeyType> candidate_set_;
     typename LSH::Query lsh_query_;
+    CandidateSequenceType candidate_sequence_;
     std::vector<std::vector<HashType>> tmp_probes_by_table_;
     std::pair<typename HashTable::Iterator, typename HashTable::Iterator>
         hash_table_iterators_;
 
-    QueryStatistics stats_;
-    int_fast64_t stats_num_queries_ = 0;
+    // A ring of prefetched queries, of which num_prefetched_ are queued
+    // from first_prefetched_ on
+    std::vector<PrefetchedQuery> prefetched_;
+    size_t first_prefetched_ = 0;
+    size_t num_prefetched_ = 0;
+
+    QueryRecorder recorder_;
+    double hashes_lsh_time_ = 0.0;  // of the last call of get_hashes
+
+    // Retrieves the buckets of tmp_probes_by_table_ and writes the unique
+    // keys in them to result, returning the number of keys with duplicates
+    int_fast64_t retrieve_unique_candidates(std::vector<KeyType>* result) {
+      hash_table_iterators_ =
+          parent_.hash_table_->retrieve_bulk(tmp_probes_by_table_);
+      candidate_set_.clear();
+      int_fast64_t num_candidates = 0;
+      result->clear();
+      while (hash_table_iterators_.first != hash_table_iterators_.second) {
+        num_candidates += 1;
+        KeyType cur = *(hash_table_iterators_.first);
+        if (candidate_set_.insert(cur)) {
+          result->push_back(cur);
+        }
+        ++hash_table_iterators_.first;
+      }
+      candidate_set_.finish(*result);
+      return num_candidates;
+    }
+
+    // Computes the probes of p into tmp_probes_by_table_, or takes them
+    // from the queue of prefetched queries, and returns the time spent
+    // computing them if the query is measured
+    double get_probes(const PointType& p, int_fast64_t num_probes) {
+      bool measured = recorder_.measured();
+      QueryRecorder::Ticks start_time = measured ? recorder_.now() : 0;
+      double lsh_time = 0.0;
+
+      if (num_prefetched_ > 0 &&
+          prefetched_[first_prefetched_].num_probes == num_probes &&
+          prefetched_[first_prefetched_].point == p) {
+        PrefetchedQuery& slot = prefetched_[first_prefetched_];
+        tmp_probes_by_table_.swap(slot.probes);
+        lsh_time = slot.lsh_time;
+        first_prefetched_ = (first_prefetched_ + 1) % prefetched_.size();
+        num_prefetched_ -= 1;
+        if (num_prefetched_ > 0) {
+          parent_.hash_table_->prefetch_entries(
+              prefetched_[first_prefetched_].probes);
+        }
+      } else {
+        num_prefetched_ = 0;
+        lsh_query_.get_probes_by_table(p, &tmp_probes_by_table_, num_probes);
+      }
+
+      return measured ? lsh_time + recorder_.seconds_since(start_time) : 0.0;
+    }
+
+    void get_candidates_internal(const PointType& p, int_fast64_t num_probes,
+                                 int_fast64_t max_num_candidates,
+                                 std::vector<KeyType>* result) {
+      if (max_num_candidates >= 0) {
+        num_prefetched_ = 0;
+        get_first_candidates(&candidate_sequence_, p, num_probes,
+                             parent_.lsh_->get_l(), max_num_candidates, false,
+                             result, &recorder_);
+        return;
+      }
+
+      bool measured = recorder_.measured();
+      double lsh_time = get_probes(p, num_probes);
+      QueryRecorder::Ticks lsh_end_time = measured ? recorder_.now() : 0;
+
+      hash_table_iterators_ =
+          parent_.hash_table_->retrieve_bulk(tmp_probes_by_table_);
+
+      int_fast64_t num_candidates = 0;
+      result->clear();
+      while (hash_table_iterators_.first != hash_table_iterators_.second) {
+        num_candidates += 1;
+        result->push_back(*(hash_table_iterators_.first));
+        ++hash_table_iterators_.first;
+      }
+
+      if (measured) {
+        recorder_.add_lsh_time(lsh_time);
+        recorder_.add_hash_table_time(recorder_.seconds_since(lsh_end_time));
+        recorder_.set_num_candidates(num_candidates);
+      }
+    }
 
     void get_unique_candidates_internal(const PointType& p,
                                         int_fast64_t num_probes,
                                         int_fast64_t max_num_candidates,
                                         std::vector<KeyType>* result) {
-      auto start_time = std::chrono::high_resolution_clock::now();
+      if (max_num_candidates >= 0) {
+        num_prefetched_ = 0;
+        get_first_candidates(&candidate_sequence_, p, num_probes,
+                             parent_.lsh_->get_l(), max_num_candidates, true,
+                             result, &recorder_);
+        return;
+      }
 
-      lsh_query_.get_probes_by_table(p, &tmp_probes_by_table_, num_probes);
+      candidate_sequence_.finish();
 
-      auto lsh_end_time = std::chrono::high_resolution_clock::now();
-      auto elapsed_lsh =
-          std::chrono::duration_cast<std::chrono::duration<double>>(
-              lsh_end_time - start_time);
-      stats_.average_lsh_time += elapsed_lsh.count();
+      bool measured = recorder_.measured();
+      double lsh_time = get_probes(p, num_probes);
+      QueryRecorder::Ticks lsh_end_time = measured ? recorder_.now() : 0;
 
       hash_table_iterators_ =
           parent_.hash_table_->retrieve_bulk(tmp_probes_by_table_);
-      query_counter_ += 1;
+      candidate_set_.clear();
 
       int_fast64_t num_candidates = 0;
       result->clear();
-      if (max_num_candidates < 0) {
-        max_num_candidates = std::numeric_limits<int_fast64_t>::max();
+      while (hash_table_iterators_.first != hash_table_iterators_.second) {
+        num_candidates += 1;
+        KeyType cur = *(hash_table_iterators_.first);
+        if (candidate_set_.insert(cur)) {
+          result->push_back(cur);
+        }
+
+        ++hash_table_iterators_.first;
+      }
+      candidate_set_.finish(*result);
+
+      if (measured) {
+        recorder_.add_lsh_time(lsh_time);
+        recorder_.add_hash_table_time(recorder_.seconds_since(lsh_end_time));
+        recorder_.set_num_candidates(num_candidates);
+        recorder_.set_num_unique_candidates(result->size());
+      }
+    }
+  };
+
+ private:
+  int_fast64_t n_;
+
+  template <typename HashedDataStorage>
+  void setup_table_range(int_fast32_t from, int_fast32_t to,
+                         const HashedDataStorage& points,
+                         int_fast32_t num_threads) {
+    SetupBatchHash<LSH, HashType, KeyType, HashedDataStorage> bh(
+        *(this->lsh_), points, num_threads);
+    // Some hash families hash the points for several tables in one pass.
+    std::vector<std::vector<HashType>> table_hashes(
+        bh.get_num_tables_per_batch());
+    for (int_fast32_t ii = from; ii <= to;
+         ii += static_cast<int_fast32_t>(table_hashes.size())) {
+      int_fast32_t num_tables = std::min<int_fast32_t>(
+          table_hashes.size(), to - ii + 1);
+      bh.batch_hash_tables(ii, num_tables, table_hashes.data());
+      for (int_fast32_t jj = 0; jj < num_tables; ++jj) {
+        this->hash_table_->add_entries_for_table(table_hashes[jj], ii + jj,
+                                                 num_threads);
       }
-      while (num_candidates < max_num_candidates &&
-             hash_table_iterators_.first != hash_table_iterators_.second) {
+    }
+  }
+};
+
+// An LSH table that supports inserting and removing points after it has been
+// set up. The low-level hash tables must support insert and remove (e.g.,
+// DynamicCompositeHashTable), and the data storage must grow with the points
+// (e.g., DynamicArrayDataStorage). Removed entries are tombstoned in the
+// low-level hash tables and compacted when these are rehashed.
+//
+// Inserting or removing points must not happen concurrently with queries.
+template <typename PointType,  // the type of the data points to be stored
+          typename KeyType,    // must be integral for a dynamic table
+          typename LSH,        // the LSH family
+          typename HashType,   // type returned by a set of k LSH functions
+          typename HashTable,  // the low-level hash tables
+          typename DataStorageType>
+class DynamicLSHTable
+    : public BasicLSHTable<LSH, HashTable,
+                           DynamicLSHTable<PointType, KeyType, LSH, HashType,
+                                           HashTable, DataStorageType>> {
+ public:
+  // Sets up the table for the points currently in the data storage, with
+  // keys 0, ..., points.size() - 1.
+  DynamicLSHTable(LSH* lsh, HashTable* hash_table,
+                  const DataStorageType& points, int_fast32_t num_setup_threads)
+      : BasicLSHTable<LSH, HashTable,
+                      DynamicLSHTable<PointType, KeyType, LSH, HashType,
+                                      HashTable, DataStorageType>>(lsh,
+                                                                   hash_table),
+        n_(points.size()) {
+    if (num_setup_threads < 0) {
+      throw LSHTableError("Number of setup threads cannot be negative.");
+    }
+    if (num_setup_threads == 0) {
+      num_setup_threads = thread_pool().size();
+    }
+    if (n_ == 0) {
+      return;
+    }
+    int_fast32_t l = this->lsh_->get_l();
+
+    // The low-level tables are independent, so each thread fills a range.
+    // If there are more threads than tables, the remaining threads hash the
+    // points within the tables.
+    int_fast32_t num_range_threads = std::min(l, num_setup_threads);
+    int_fast32_t num_threads_per_table = num_setup_threads / num_range_threads;
+    int_fast32_t num_tables_per_thread = l / num_range_threads;
+    int_fast32_t num_leftover_tables = l % num_range_threads;
+
+    std::vector<int_fast32_t> range_starts(num_range_threads + 1, 0);
+    for (int_fast32_t ii = 0; ii < num_range_threads; ++ii) {
+      range_starts[ii + 1] = range_starts[ii] + num_tables_per_thread +
+                             (ii < num_leftover_tables ? 1 : 0);
+    }
+
+    run_in_parallel(num_range_threads, [&](int_fast32_t range) {
+      setup_table_range(range_starts[range], range_starts[range + 1] - 1,
+                        points, num_threads_per_table);
+    });
+  }
+
+  // Adds the point p with the given key to all l tables.
+  void insert(const PointType& p, KeyType key) {
+    this->lsh_->hash(p, &tmp_hashes_);
+    this->hash_table_->insert(tmp_hashes_, key);
+    n_ = std::max<int_fast64_t>(n_, static_cast<int_fast64_t>(key) + 1);
+  }
+
+  // Removes the point p with the given key from all l tables. The point must
+  // be the one with which the key was inserted.
+  void remove(const PointType& p, KeyType key) {
+    this->lsh_->hash(p, &tmp_hashes_);
+    this->hash_table_->remove(tmp_hashes_, key);
+  }
+
+  // One more than the largest key inserted so far
+  int_fast64_t get_key_range() const { return n_; }
+
+  class Query {
+   public:
+    typedef CandidateSequence<typename LSH::Query, HashTable, PointType,
+                              KeyType>
+        CandidateSequenceType;
+
+    Query(const DynamicLSHTable& parent)
+        : parent_(parent),
+          candidate_set_(parent.n_),
+          lsh_query_(*(parent.lsh_)),
+          candidate_sequence_(&lsh_query_, parent.hash_table_,
+                              &candidate_set_) {}
+
+    // With a maximum number of candidates, these take the candidates from
+    // a CandidateSequence, as for static tables.
+    void get_candidates_with_duplicates(const PointType& p,
+                                        int_fast64_t num_probes,
+                                        int_fast64_t max_num_candidates,
+                                        std::vector<KeyType>* result) {
+      QueryRecorder::Scope scope(&recorder_);
+      get_candidates_internal(p, num_probes, max_num_candidates, result);
+    }
+
+    void get_unique_candidates(const PointType& p, int_fast64_t num_probes,
+                               int_fast64_t max_num_candidates,
+                               std::vector<KeyType>* result) {
+      QueryRecorder::Scope scope(&recorder_);
+
+      // Points inserted since the last query have keys beyond the set.
+      candidate_sequence_.finish();
+      candidate_set_.resize(parent_.n_);
+      if (max_num_candidates >= 0) {
+        get_first_candidates(&candidate_sequence_, p, num_probes,
+                             parent_.lsh_->get_l(), max_num_candidates, true,
+                             result, &recorder_);
+      } else {
+        get_candidates_internal(p, num_probes, max_num_candidates, result);
+        deduplicate(result);
+      }
+    }
+
+    // Dynamic tables may change between a prefetch and the query, so
+    // nothing is prefetched.
+    void prefetch(const PointType&, int_fast64_t) {}
+
+    // See the static table's Query
+    void get_hashes(const PointType& p, std::vector<uint64_t>* result) {
+      bool timed = recorder_.enabled();
+      QueryRecorder::Ticks start_time = timed ? recorder_.now() : 0;
+
+      lsh_query_.get_probes_by_table(p, &tmp_probes_by_table_,
+                                     parent_.lsh_->get_l());
+      result->resize(tmp_probes_by_table_.size());
+      for (size_t ii = 0; ii < result->size(); ++ii) {
+        (*result)[ii] = tmp_probes_by_table_[ii][0];
+      }
+
+      hashes_lsh_time_ = timed ? recorder_.seconds_since(start_time) : 0.0;
+    }
+
+    void get_unique_candidates_by_hashes(const std::vector<uint64_t>& hashes,
+                                         std::vector<KeyType>* result) {
+      QueryRecorder::Scope scope(&recorder_);
+      QueryRecorder::Ticks start_time = scope.measured() ? recorder_.now() : 0;
+
+      candidate_sequence_.finish();
+      candidate_set_.resize(parent_.n_);
+      tmp_probes_by_table_.resize(hashes.size());
+      for (size_t ii = 0; ii < hashes.size(); ++ii) {
+        tmp_probes_by_table_[ii].assign(1, static_cast<HashType>(hashes[ii]));
+      }
+      hash_table_iterators_ =
+          parent_.hash_table_->retrieve_bulk(tmp_probes_by_table_);
+      candidate_set_.clear();
+      int_fast64_t num_candidates = 0;
+      result->clear();
+      while (hash_table_iterators_.first != hash_table_iterators_.second) {
         num_candidates += 1;
-        int_fast64_t cur = *(hash_table_iterators_.first);
-        if (is_candidate_[cur] != query_counter_) {
-          is_candidate_[cur] = query_counter_;
+        KeyType cur = *(hash_table_iterators_.first);
+        if (candidate_set_.insert(cur)) {
           result->push_back(cur);
         }
+        ++hash_table_iterators_.first;
+      }
+      candidate_set_.finish(*result);
+
+      if (scope.measured()) {
+        recorder_.add_lsh_time(hashes_lsh_time_);
+        recorder_.add_hash_table_time(recorder_.seconds_since(start_time));
+        recorder_.set_num_candidates(num_candidates);
+        recorder_.set_num_unique_candidates(result->size());
+      }
+      hashes_lsh_time_ = 0.0;
+    }
+
+    // See the static table's Query; the sequence also covers points
+    // inserted since the last query.
+    CandidateSequenceType& get_candidate_sequence(const PointType& p,
+                                                  int_fast64_t num_probes,
+                                                  bool interleaved = true) {
+      candidate_sequence_.start(p, num_probes, false,
+                                interleaved ? parent_.lsh_->get_l() : 1);
+      return candidate_sequence_;
+    }
+
+    CandidateSequenceType& get_unique_candidate_sequence(
+        const PointType& p, int_fast64_t num_probes, bool interleaved = true) {
+      candidate_sequence_.finish();
+      candidate_set_.resize(parent_.n_);
+      candidate_sequence_.start(p, num_probes, true,
+                                interleaved ? parent_.lsh_->get_l() : 1);
+      return candidate_sequence_;
+    }
+
+    // See the static table's Query
+    QueryRecorder& recorder() { return recorder_; }
+
+    void set_instrumentation(const QueryInstrumentation& instrumentation) {
+      recorder_.set_instrumentation(instrumentation);
+    }
 
+    void reset_query_statistics() { recorder_.reset_statistics(); }
+
+    QueryStatistics get_query_statistics() {
+      return recorder_.get_statistics();
+    }
+
+    // See get_num_probes_to_find_key()
+    int_fast64_t get_num_probes_to_find(const PointType& p, KeyType key,
+                                        int_fast64_t max_num_probes) {
+      return get_num_probes_to_find_key(&lsh_query_, *(parent_.hash_table_), p,
+                                        key, max_num_probes);
+    }
+
+    // Bytes of the scratch memory of this query object: the set used to
+    // deduplicate candidates (with the keys a candidate sequence added to
+    // it) and the probes of each table. The per-query state of the LSH
+    // functions is small and not included.
+    int_fast64_t get_memory_usage() const {
+      int_fast64_t res = candidate_set_.get_memory_usage() +
+                         candidate_sequence_.get_memory_usage();
+      for (const std::vector<HashType>& probes : tmp_probes_by_table_) {
+        res += probes.capacity() * sizeof(HashType);
+      }
+      return res;
+    }
+
+   private:
+    const DynamicLSHTable& parent_;
+    CandidateSet<KeyType> candidate_set_;
+    typename LSH::Query lsh_query_;
+    CandidateSequenceType candidate_sequence_;
+    std::vector<std::vector<HashType>> tmp_probes_by_table_;
+    std::pair<typename HashTable::Iterator, typename HashTable::Iterator>
+        hash_table_iterators_;
+
+    QueryRecorder recorder_;
+    double hashes_lsh_time_ = 0.0;  // of the last call of get_hashes
+
+    void get_candidates_internal(const PointType& p, int_fast64_t num_probes,
+                                 int_fast64_t max_num_candidates,
+                                 std::vector<KeyType>* result) {
+      if (max_num_candidates >= 0) {
+        get_first_candidates(&candidate_sequence_, p, num_probes,
+                             parent_.lsh_->get_l(), max_num_candidates, false,
+                             result, &recorder_);
+        return;
+      }
+
+      bool measured = recorder_.measured();
+      QueryRecorder::Ticks start_time = measured ? recorder_.now() : 0;
+
+      lsh_query_.get_probes_by_table(p, &tmp_probes_by_table_, num_probes);
+
+      QueryRecorder::Ticks lsh_end_time = measured ? recorder_.now() : 0;
+
+      hash_table_iterators_ =
+          parent_.hash_table_->retrieve_bulk(tmp_probes_by_table_);
+
+      int_fast64_t num_candidates = 0;
+      result->clear();
+      while (hash_table_iterators_.first != hash_table_iterators_.second) {
+        num_candidates += 1;
+        result->push_back(*(hash_table_iterators_.first));
         ++hash_table_iterators_.first;
       }
 
-      auto hashing_end_time = std::chrono::high_resolution_clock::now();
-      auto elapsed_hashing =
-          std::chrono::duration_cast<std::chrono::duration<double>>(
-              hashing_end_time - lsh_end_time);
-      stats_.average_hash_table_time += elapsed_hashing.count();
+      if (measured) {
+        recorder_.add_lsh_time(CycleClock::seconds(start_time, lsh_end_time));
+        recorder_.add_hash_table_time(recorder_.seconds_since(lsh_end_time));
+        recorder_.set_num_candidates(num_candidates);
+      }
+    }
 
-      stats_.average_num_candidates += num_candidates;
-      stats_.average_num_unique_candidates += result->size();
+    // Removes the duplicates of the candidates in place, keeping the first
+    // occurrence of each key
+    void deduplicate(std::vector<KeyType>* result) {
+      candidate_set_.clear();
+      size_t num_unique = 0;
+      for (size_t ii = 0; ii < result->size(); ++ii) {
+        KeyType cur = (*result)[ii];
+        if (candidate_set_.insert(cur)) {
+          (*result)[num_unique++] = cur;
+        }
+      }
+      result->resize(num_unique);
+      candidate_set_.finish(*result);
+      if (recorder_.measured()) {
+        recorder_.set_num_unique_candidates(num_unique);
+      }
     }
   };
 
  private:
   int_fast64_t n_;
+  std::vector<HashType> tmp_hashes_;
 
   void setup_table_range(int_fast32_t from, int_fast32_t to,
-                         const DataStorageType& points) {
-    typename LSH::template BatchHash<DataStorageType> bh(*(this->lsh_));
-    std::vector<HashType> table_hashes;
-    for (int_fast32_t ii = from; ii <= to; ++ii) {
-      bh.batch_hash_single_table(points, ii, &table_hashes);
-      this->hash_table_->add_entries_for_table(table_hashes, ii);
+                         const DataStorageType& points,
+                         int_fast32_t num_threads) {
+    SetupBatchHash<LSH, HashType, KeyType, DataStorageType> bh(
+        *(this->lsh_), points, num_threads);
+    // Some hash families hash the points for several tables in one pass.
+    std::vector<std::vector<HashType>> table_hashes(
+        bh.get_num_tables_per_batch());
+    for (int_fast32_t ii = from; ii <= to;
+         ii += static_cast<int_fast32_t>(table_hashes.size())) {
+      int_fast32_t num_tables = std::min<int_fast32_t>(
+          table_hashes.size(), to - ii + 1);
+      bh.batch_hash_tables(ii, num_tables, table_hashes.data());
+      for (int_fast32_t jj = 0; jj < num_tables; ++jj) {
+        this->hash_table_->add_entries_for_table(table_hashes[jj], ii + jj);
+      }
     }
   }
 };
@@ -5,13 +5,16 @@
 #include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <limits>
 #include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "../falconn_global.h"
+#include "candidate_distances.h"
 #include "heap.h"
+#include "query_instrumentation.h"
 
 namespace falconn {
 namespace core {
@@ -35,62 +38,53 @@ class NearestNeighborQuery {
                                         const ComparisonPointType& q_comp,
                                         int_fast64_t num_probes,
                                         int_fast64_t max_num_candidates) {
-    auto start_time = std::chrono::high_resolution_clock::now();
-    stats_num_queries_ += 1;
+    QueryRecorder& recorder = table_query_->recorder();
+    QueryRecorder::Scope scope(&recorder);
 
     table_query_->get_unique_candidates(q, num_probes, max_num_candidates,
                                         &candidates_);
-    auto distance_start_time = std::chrono::high_resolution_clock::now();
+    QueryRecorder::Ticks distance_start_time =
+        scope.measured() ? recorder.now() : 0;
 
     // TODO: use nullptr for pointer types
     LSHTableKeyType best_key = -1;
 
     if (candidates_.size() > 0) {
-      typename DataStorage::SubsequenceIterator iter =
-          data_storage_.get_subsequence(candidates_);
+      distances_.compute(q_comp, data_storage_, candidates_,
+                         &candidate_distances_);
 
       best_key = candidates_[0];
-      DistanceType best_distance = dst_(q_comp, iter.get_point());
-      ++iter;
-
-      // printf("%d %f\n", candidates_[0], best_distance);
-
-      while (iter.is_valid()) {
-        DistanceType cur_distance = dst_(q_comp, iter.get_point());
-        // printf("%d %f\n", iter.get_key(), cur_distance);
-        if (cur_distance < best_distance) {
-          best_distance = cur_distance;
-          best_key = iter.get_key();
-          // printf("  is new best\n");
+      DistanceType best_distance = candidate_distances_[0];
+
+      for (size_t ii = 1; ii < candidates_.size(); ++ii) {
+        if (candidate_distances_[ii] < best_distance) {
+          best_distance = candidate_distances_[ii];
+          best_key = candidates_[ii];
         }
-        ++iter;
       }
     }
 
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto elapsed_distance =
-        std::chrono::duration_cast<std::chrono::duration<double>>(
-            end_time - distance_start_time);
-    auto elapsed_total =
-        std::chrono::duration_cast<std::chrono::duration<double>>(end_time -
-                                                                  start_time);
-    stats_.average_distance_time += elapsed_distance.count();
-    stats_.average_total_query_time += elapsed_total.count();
+    if (scope.measured()) {
+      recorder.add_distance_time(recorder.seconds_since(distance_start_time));
+    }
 
     return best_key;
   }
 
+  // If distances is not nullptr, it is set to the distances of the keys in
+  // result, which are computed anyway.
   void find_k_nearest_neighbors(const LSHTablePointType& q,
                                 const ComparisonPointType& q_comp,
                                 int_fast64_t k, int_fast64_t num_probes,
                                 int_fast64_t max_num_candidates,
-                                std::vector<LSHTableKeyType>* result) {
+                                std::vector<LSHTableKeyType>* result,
+                                std::vector<DistanceType>* distances = nullptr) {
     if (result == nullptr) {
       throw NearestNeighborQueryError("Results vector pointer is nullptr.");
     }
 
-    auto start_time = std::chrono::high_resolution_clock::now();
-    stats_num_queries_ += 1;
+    QueryRecorder& recorder = table_query_->recorder();
+    QueryRecorder::Scope scope(&recorder);
 
     std::vector<LSHTableKeyType>& res = *result;
     res.clear();
@@ -101,29 +95,25 @@ class NearestNeighborQuery {
     heap_.reset();
     heap_.resize(k);
 
-    auto distance_start_time = std::chrono::high_resolution_clock::now();
+    QueryRecorder::Ticks distance_start_time =
+        scope.measured() ? recorder.now() : 0;
 
-    typename DataStorage::SubsequenceIterator iter =
-        data_storage_.get_subsequence(candidates_);
+    distances_.compute(q_comp, data_storage_, candidates_,
+                       &candidate_distances_);
+    int_fast64_t num_candidates = candidates_.size();
 
-    int_fast64_t initially_inserted = 0;
-    for (; initially_inserted < k; ++initially_inserted) {
-      if (iter.is_valid()) {
-        heap_.insert_unsorted(-dst_(q_comp, iter.get_point()), iter.get_key());
-        ++iter;
-      } else {
-        break;
-      }
+    int_fast64_t initially_inserted = std::min(k, num_candidates);
+    for (int_fast64_t ii = 0; ii < initially_inserted; ++ii) {
+      heap_.insert_unsorted(-candidate_distances_[ii], candidates_[ii]);
     }
 
     if (initially_inserted >= k) {
       heap_.heapify();
-      while (iter.is_valid()) {
-        DistanceType cur_distance = dst_(q_comp, iter.get_point());
+      for (int_fast64_t ii = k; ii < num_candidates; ++ii) {
+        DistanceType cur_distance = candidate_distances_[ii];
         if (cur_distance < -heap_.min_key()) {
-          heap_.replace_top(-cur_distance, iter.get_key());
+          heap_.replace_top(-cur_distance, candidates_[ii]);
         }
-        ++iter;
       }
     }
 
@@ -133,90 +123,347 @@ class NearestNeighborQuery {
     for (int_fast64_t ii = 0; ii < initially_inserted; ++ii) {
       res[ii] = heap_.get_data()[initially_inserted - ii - 1].data;
     }
+    if (distances != nullptr) {
+      distances->resize(initially_inserted);
+      for (int_fast64_t ii = 0; ii < initially_inserted; ++ii) {
+        (*distances)[ii] = -heap_.get_data()[initially_inserted - ii - 1].key;
+      }
+    }
+
+    if (scope.measured()) {
+      recorder.add_distance_time(recorder.seconds_since(distance_start_time));
+    }
+  }
+
+  // Like find_k_nearest_neighbors, but walks the unique candidates lazily
+  // (see CandidateSequence) and computes their distances in blocks of
+  // kQueryLimitsDistanceBlock, stopping once a limit is reached. Returns
+  // true if the query stopped at a limit before it had seen all of its
+  // candidates, in which case the result holds the k best candidates seen
+  // so far.
+  bool find_k_nearest_neighbors_bounded(const LSHTablePointType& q,
+                                        const ComparisonPointType& q_comp,
+                                        int_fast64_t k, int_fast64_t num_probes,
+                                        int_fast64_t max_num_candidates,
+                                        const QueryLimits& limits,
+                                        std::vector<LSHTableKeyType>* result) {
+    if (result == nullptr) {
+      throw NearestNeighborQueryError("Results vector pointer is nullptr.");
+    }
+
+    QueryRecorder& recorder = table_query_->recorder();
+    QueryRecorder::Scope scope(&recorder);
+    bool measured = scope.measured();
+    QueryRecorder::Ticks start_time = measured ? recorder.now() : 0;
+    // Limits beyond a year are no limits (and would overflow the clock). The
+    // deadline is kept on the steady clock, which is only read with a time
+    // limit.
+    typedef std::chrono::steady_clock DeadlineClock;
+    bool limited_time = limits.max_seconds >= 0 && limits.max_seconds < 3.2e7;
+    DeadlineClock::time_point deadline;
+    if (limited_time) {
+      deadline = DeadlineClock::now() +
+                 std::chrono::duration_cast<DeadlineClock::duration>(
+                     std::chrono::duration<double>(limits.max_seconds));
+    }
+
+    std::vector<LSHTableKeyType>& res = *result;
+    res.clear();
+    heap_.reset();
+    heap_.resize(k);
+
+    bool limited_probes = limits.max_num_probes >= 0 &&
+                          limits.max_num_probes < num_probes;
+    if (limited_probes) {
+      num_probes = limits.max_num_probes;
+    }
+    if (num_probes == 0 || k == 0) {
+      if (measured) {
+        recorder.add_lsh_time(0.0);
+        recorder.add_hash_table_time(0.0);
+        recorder.add_distance_time(0.0);
+        recorder.set_num_candidates(0);
+        recorder.set_num_unique_candidates(0);
+      }
+      return limited_probes;
+    }
+    if (max_num_candidates < 0) {
+      max_num_candidates = std::numeric_limits<int_fast64_t>::max();
+    }
+    int_fast64_t max_num_distances = limits.max_num_distances;
+    if (max_num_distances < 0) {
+      max_num_distances = std::numeric_limits<int_fast64_t>::max();
+    }
+
+    auto& sequence = table_query_->get_unique_candidate_sequence(q, num_probes);
+    QueryRecorder::Ticks lsh_end_time = measured ? recorder.now() : 0;
+
+    // Takes the next unique candidate within the maximum number of
+    // candidates (which counts duplicates)
+    auto next_candidate = [&](LSHTableKeyType* key) {
+      return sequence.get_num_candidates() < max_num_candidates &&
+             sequence.next(key) &&
+             sequence.get_num_candidates() <= max_num_candidates;
+    };
+
+    bool truncated = false;
+    int_fast64_t num_distances = 0;
+    int_fast64_t num_inserted = 0;
+    double distance_time = 0.0;
+    LSHTableKeyType key;
+    while (true) {
+      int_fast64_t block_size = std::min(kQueryLimitsDistanceBlock,
+                                         max_num_distances - num_distances);
+      candidates_.clear();
+      bool exhausted = false;
+      while (static_cast<int_fast64_t>(candidates_.size()) < block_size) {
+        if (!next_candidate(&key)) {
+          exhausted = true;
+          break;
+        }
+        candidates_.push_back(key);
+      }
+
+      QueryRecorder::Ticks distance_start_time = measured ? recorder.now() : 0;
+      distances_.compute(q_comp, data_storage_, candidates_,
+                         &candidate_distances_);
+      for (size_t ii = 0; ii < candidates_.size(); ++ii) {
+        DistanceType cur_distance = candidate_distances_[ii];
+        if (num_inserted < k) {
+          heap_.insert(-cur_distance, candidates_[ii]);
+          num_inserted += 1;
+        } else if (cur_distance < -heap_.min_key()) {
+          heap_.replace_top(-cur_distance, candidates_[ii]);
+        }
+      }
+      num_distances += candidates_.size();
+      if (measured) {
+        distance_time += recorder.seconds_since(distance_start_time);
+      }
+
+      if (exhausted) {
+        // The sequence may have ended at the probe limit.
+        truncated = limited_probes && sequence.get_num_probes() >= num_probes;
+        break;
+      }
+      if (num_distances >= max_num_distances ||
+          (limited_time && DeadlineClock::now() >= deadline)) {
+        truncated = next_candidate(&key);
+        break;
+      }
+    }
+    int_fast64_t num_candidates =
+        std::min(sequence.get_num_candidates(), max_num_candidates);
+    sequence.finish();
+
+    res.resize(num_inserted);
+    std::sort(heap_.get_data().begin(),
+              heap_.get_data().begin() + num_inserted);
+    for (int_fast64_t ii = 0; ii < num_inserted; ++ii) {
+      res[ii] = heap_.get_data()[num_inserted - ii - 1].data;
+    }
 
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto elapsed_distance =
-        std::chrono::duration_cast<std::chrono::duration<double>>(
-            end_time - distance_start_time);
-    auto elapsed_total =
-        std::chrono::duration_cast<std::chrono::duration<double>>(end_time -
-                                                                  start_time);
-    stats_.average_distance_time += elapsed_distance.count();
-    stats_.average_total_query_time += elapsed_total.count();
+    if (measured) {
+      double lsh_time = CycleClock::seconds(start_time, lsh_end_time);
+      double hash_table_time =
+          recorder.seconds_since(lsh_end_time) - distance_time;
+      recorder.add_lsh_time(lsh_time);
+      recorder.add_hash_table_time(std::max(0.0, hash_table_time));
+      recorder.add_distance_time(distance_time);
+      recorder.set_num_candidates(num_candidates);
+      recorder.set_num_unique_candidates(num_distances);
+    }
+
+    return truncated;
+  }
+
+  // Like find_k_nearest_neighbors, but only over the candidates the filter
+  // accepts, which are picked out of the lazy walk over the unique
+  // candidates (see CandidateSequence), in probe order, before any distance
+  // is computed.
+  // Past the first num_probes probes, the walk goes on only while fewer
+  // than k candidates have been accepted, up to max_num_probes probes in
+  // all, so that a selective filter still finds k neighbors. At most
+  // max_num_candidates accepted candidates are ranked (all if negative).
+  void find_k_nearest_neighbors_filtered(
+      const LSHTablePointType& q, const ComparisonPointType& q_comp,
+      int_fast64_t k, int_fast64_t num_probes, int_fast64_t max_num_probes,
+      int_fast64_t max_num_candidates, const KeyFilter& filter,
+      std::vector<LSHTableKeyType>* result,
+      std::vector<DistanceType>* distances = nullptr) {
+    if (result == nullptr) {
+      throw NearestNeighborQueryError("Results vector pointer is nullptr.");
+    }
+
+    QueryRecorder& recorder = table_query_->recorder();
+    QueryRecorder::Scope scope(&recorder);
+    bool measured = scope.measured();
+    QueryRecorder::Ticks start_time = measured ? recorder.now() : 0;
+
+    std::vector<LSHTableKeyType>& res = *result;
+    res.clear();
+    heap_.reset();
+    heap_.resize(k);
+    if (distances != nullptr) {
+      distances->clear();
+    }
+    if (k <= 0) {
+      return;
+    }
+    if (max_num_probes < num_probes) {
+      max_num_probes = num_probes;
+    }
+    if (max_num_candidates < 0) {
+      max_num_candidates = std::numeric_limits<int_fast64_t>::max();
+    }
+
+    auto& sequence = table_query_->get_unique_candidate_sequence(
+        q, max_num_probes, false);
+    QueryRecorder::Ticks lsh_end_time = measured ? recorder.now() : 0;
+
+    int_fast64_t num_accepted = 0;
+    int_fast64_t num_inserted = 0;
+    double distance_time = 0.0;
+    LSHTableKeyType key;
+    bool done = false;
+    while (!done) {
+      candidates_.clear();
+      while (static_cast<int_fast64_t>(candidates_.size()) <
+             kQueryLimitsDistanceBlock) {
+        // A candidate of a probe beyond the first num_probes is only
+        // wanted while fewer than k have been accepted.
+        if (num_accepted >= max_num_candidates || !sequence.next(&key) ||
+            (num_accepted >= k && sequence.get_num_probes() > num_probes)) {
+          done = true;
+          break;
+        }
+        if (filter.accepts(key)) {
+          candidates_.push_back(key);
+          num_accepted += 1;
+        }
+      }
+
+      QueryRecorder::Ticks distance_start_time = measured ? recorder.now() : 0;
+      distances_.compute(q_comp, data_storage_, candidates_,
+                         &candidate_distances_);
+      for (size_t ii = 0; ii < candidates_.size(); ++ii) {
+        DistanceType cur_distance = candidate_distances_[ii];
+        if (num_inserted < k) {
+          heap_.insert(-cur_distance, candidates_[ii]);
+          num_inserted += 1;
+        } else if (cur_distance < -heap_.min_key()) {
+          heap_.replace_top(-cur_distance, candidates_[ii]);
+        }
+      }
+      if (measured) {
+        distance_time += recorder.seconds_since(distance_start_time);
+      }
+    }
+    int_fast64_t num_candidates = sequence.get_num_candidates();
+    sequence.finish();
+
+    res.resize(num_inserted);
+    std::sort(heap_.get_data().begin(),
+              heap_.get_data().begin() + num_inserted);
+    for (int_fast64_t ii = 0; ii < num_inserted; ++ii) {
+      res[ii] = heap_.get_data()[num_inserted - ii - 1].data;
+    }
+    if (distances != nullptr) {
+      distances->resize(num_inserted);
+      for (int_fast64_t ii = 0; ii < num_inserted; ++ii) {
+        (*distances)[ii] = -heap_.get_data()[num_inserted - ii - 1].key;
+      }
+    }
+
+    if (measured) {
+      double lsh_time = CycleClock::seconds(start_time, lsh_end_time);
+      double hash_table_time =
+          recorder.seconds_since(lsh_end_time) - distance_time;
+      recorder.add_lsh_time(lsh_time);
+      recorder.add_hash_table_time(std::max(0.0, hash_table_time));
+      recorder.add_distance_time(distance_time);
+      recorder.set_num_candidates(num_candidates);
+      recorder.set_num_unique_candidates(num_accepted);
+    }
   }
 
+  // If distances is not nullptr, it is set to the distances of the keys in
+  // result.
   void find_near_neighbors(const LSHTablePointType& q,
                            const ComparisonPointType& q_comp,
                            DistanceType threshold, int_fast64_t num_probes,
                            int_fast64_t max_num_candidates,
-                           std::vector<LSHTableKeyType>* result) {
+                           std::vector<LSHTableKeyType>* result,
+                           std::vector<DistanceType>* distances = nullptr) {
     if (result == nullptr) {
       throw NearestNeighborQueryError("Results vector pointer is nullptr.");
     }
 
-    auto start_time = std::chrono::high_resolution_clock::now();
-    stats_num_queries_ += 1;
+    QueryRecorder& recorder = table_query_->recorder();
+    QueryRecorder::Scope scope(&recorder);
 
     std::vector<LSHTableKeyType>& res = *result;
     res.clear();
+    if (distances != nullptr) {
+      distances->clear();
+    }
 
     table_query_->get_unique_candidates(q, num_probes, max_num_candidates,
                                         &candidates_);
-    auto distance_start_time = std::chrono::high_resolution_clock::now();
-
-    typename DataStorage::SubsequenceIterator iter =
-        data_storage_.get_subsequence(candidates_);
-    while (iter.is_valid()) {
-      DistanceType cur_distance = dst_(q_comp, iter.get_point());
-      if (cur_distance < threshold) {
-        res.push_back(iter.get_key());
+    QueryRecorder::Ticks distance_start_time =
+        scope.measured() ? recorder.now() : 0;
+
+    distances_.compute(q_comp, data_storage_, candidates_,
+                       &candidate_distances_);
+    for (size_t ii = 0; ii < candidates_.size(); ++ii) {
+      if (candidate_distances_[ii] < threshold) {
+        res.push_back(candidates_[ii]);
+        if (distances != nullptr) {
+          distances->push_back(candidate_distances_[ii]);
+        }
       }
-      ++iter;
-    }
-
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto elapsed_distance =
-        std::chrono::duration_cast<std::chrono::duration<double>>(
-            end_time - distance_start_time);
-    auto elapsed_total =
-        std::chrono::duration_cast<std::chrono::duration<double>>(end_time -
-                                                                  start_time);
-    stats_.average_distance_time += elapsed_distance.count();
-    stats_.average_total_query_time += elapsed_total.count();
+    }
+
+    if (scope.measured()) {
+      recorder.add_distance_time(recorder.seconds_since(distance_start_time));
+    }
   }
 
-  void reset_query_statistics() {
-    table_query_->reset_query_statistics();
-    stats_num_queries_ = 0;
-    stats_.average_total_query_time = 0.0;
-    stats_.average_lsh_time = 0.0;
-    stats_.average_hash_table_time = 0.0;
-    stats_.average_distance_time = 0.0;
-    stats_.average_num_candidates = 0.0;
-    stats_.average_num_unique_candidates = 0.0;
+  // The queries are recorded by the recorder of the LSH table query, so the
+  // statistics cover the queries made through either.
+  void set_instrumentation(const QueryInstrumentation& instrumentation) {
+    table_query_->set_instrumentation(instrumentation);
   }
 
+  void reset_query_statistics() { table_query_->reset_query_statistics(); }
+
   QueryStatistics get_query_statistics() {
-    QueryStatistics res = table_query_->get_query_statistics();
-    res.average_total_query_time = stats_.average_total_query_time;
-    res.average_distance_time = stats_.average_distance_time;
+    return table_query_->get_query_statistics();
+  }
 
-    if (stats_num_queries_ > 0) {
-      res.average_total_query_time /= stats_num_queries_;
-      res.average_distance_time /= stats_num_queries_;
-    }
-    return res;
+  int_fast64_t get_num_queries() const {
+    return table_query_->recorder().get_num_queries();
+  }
+
+  // Bytes of the scratch memory of this query: the buffers of the candidates
+  // and their distances and the heap for k-NN queries, which grow to the
+  // largest query so far, plus the scratch memory of the LSH table query.
+  int_fast64_t get_memory_usage() const {
+    return table_query_->get_memory_usage() +
+           candidates_.capacity() * sizeof(LSHTableKeyType) +
+           candidate_distances_.capacity() * sizeof(DistanceType) +
+           heap_.get_memory_usage();
   }
 
  private:
   LSHTableQuery* table_query_;
   const DataStorage& data_storage_;
   std::vector<LSHTableKeyType> candidates_;
-  DistanceFunction dst_;
+  std::vector<DistanceType> candidate_distances_;
+  CandidateDistances<DistanceFunction, DataStorage, LSHTableKeyType,
+                     DistanceType>
+      distances_;
   SimpleHeap<DistanceType, LSHTableKeyType> heap_;
-
-  QueryStatistics stats_;
-  int_fast64_t stats_num_queries_ = 0;
 };
 
 }  // namespace core
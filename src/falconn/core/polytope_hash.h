@@ -8,12 +8,14 @@
 #include <ctime>
 #include <memory>
 #include <random>
+#include <type_traits>
 #include <vector>
 
 #include "../eigen_wrapper.h"
 
 #include "../ffht/fht_header_only.h"
 #include "data_storage.h"
+#include "fixed_dimension.h"
 #include "heap.h"
 #include "incremental_sorter.h"
 #include "lsh_function_helpers.h"
@@ -74,10 +76,51 @@ struct FHTFunction<double> {
   }
 };
 
+// The transform of FHTFunction, computed with the butterflies of the
+// portable FFHT kernels in the same order (so the results are identical),
+// but for a dimension known at compile time. Without AVX, FFHT loops over
+// the levels and butterflies with runtime bounds; with the dimension fixed,
+// the compiler unrolls the inner levels and vectorizes the outer ones.
+template <typename ScalarType>
+struct FixedFHT {
+  typedef void (*Transform)(ScalarType*, int_fast32_t);
+
+  template <int kDim>
+  static Transform apply() {
+    return &transform<kDim>;
+  }
+
+  template <int kDim>
+  static void transform(ScalarType* data, int_fast32_t dim) {
+    if (kDim == Eigen::Dynamic) {
+      FHTFunction<ScalarType>::apply(data, dim);
+      return;
+    }
+    const int_fast32_t d = kernel_dimension<kDim>(dim);
+    for (int_fast32_t step = 1; step < d; step <<= 1) {
+      for (int_fast32_t jj = 0; jj < d; jj += 2 * step) {
+        for (int_fast32_t ii = jj; ii < jj + step; ++ii) {
+          ScalarType u = data[ii];
+          ScalarType v = data[ii + step];
+          data[ii] = u + v;
+          data[ii + step] = u - v;
+        }
+      }
+    }
+    const ScalarType scale = static_cast<ScalarType>(
+        1.0 / std::sqrt(static_cast<ScalarType>(d)));
+    for (int_fast32_t ii = 0; ii < d; ++ii) {
+      data[ii] *= scale;
+    }
+  }
+};
+
 template <typename ScalarType>
 class FHTHelper {
  public:
-  FHTHelper(int_fast32_t dim) : dim_(dim) {}
+  FHTHelper(int_fast32_t dim)
+      : dim_(dim),
+        transform_(RotationDimensions::dispatch<FixedFHT<ScalarType>>(dim)) {}
 
   int_fast32_t get_dim() { return dim_; }
 
@@ -99,7 +142,7 @@ class FHTHelper {
       std::memcpy(data, aligned_data_, dim_ * sizeof(ScalarType));
     }
 #else
-    FHTFunction<ScalarType>::apply(data, dim_);
+    transform_(data, dim_);
 #endif
   }
 
@@ -113,11 +156,121 @@ class FHTHelper {
 
  private:
   int_fast64_t dim_;
+  // Only used without AVX; the AVX kernels of FFHT are already specialized
+  // for each transform size.
+  typename FixedFHT<ScalarType>::Transform transform_;
 #ifdef __AVX__
   ScalarType* aligned_data_ = nullptr;
 #endif
 };
 
+// The interleaved transforms below only pay off when FFHT is compiled without
+// AVX. The AVX kernels already vectorize the transform of a single vector and
+// are faster than first interleaving the vectors.
+#ifdef __AVX__
+const bool kUseInterleavedFHT = false;
+#else
+const bool kUseInterleavedFHT = true;
+#endif
+
+// Number of vectors that InterleavedFHTHelper transforms at once. Eight
+// coordinates fill two SSE2 registers (one AVX register) for float and four
+// SSE2 registers for double.
+const int_fast32_t kInterleavedFHTBatchSize = 8;
+
+// Applies the normalized Hadamard transform of FHTFloat / FHTDouble to
+// kInterleavedFHTBatchSize vectors stored interleaved, i.e., coordinate ii
+// of vector bb is data[ii * kInterleavedFHTBatchSize + bb]. The butterflies
+// are the same as in the single-vector transform and are performed in the
+// same order, but each one operates on a whole column of the batch, which
+// Eigen vectorizes even when the FHT itself is compiled without AVX.
+template <typename ScalarType>
+class InterleavedFHTHelper {
+ public:
+  typedef Eigen::Array<ScalarType, kInterleavedFHTBatchSize, 1> ColumnType;
+  typedef Eigen::Map<ColumnType> ColumnMap;
+  typedef Eigen::Map<const ColumnType> ConstColumnMap;
+
+  typedef void (*Transform)(ScalarType*, int_fast32_t, ScalarType);
+
+  InterleavedFHTHelper(int_fast32_t dim)
+      : dim_(dim),
+        scale_(static_cast<ScalarType>(
+            1.0 / std::sqrt(static_cast<ScalarType>(dim)))),
+        transform_(RotationDimensions::dispatch<InterleavedFHTHelper>(dim)) {}
+
+  int_fast32_t get_dim() const { return dim_; }
+
+  void apply(ScalarType* data) const { transform_(data, dim_, scale_); }
+
+  // The transform for dimension kDim (see FixedDimensions)
+  template <int kDim>
+  static Transform apply() {
+    return &transform<kDim>;
+  }
+
+  template <int kDim>
+  static void transform(ScalarType* data, int_fast32_t dim, ScalarType scale) {
+    const int_fast32_t d = kernel_dimension<kDim>(dim);
+    for (int_fast32_t step = 1; step < d; step <<= 1) {
+      for (int_fast32_t jj = 0; jj < d; jj += 2 * step) {
+        for (int_fast32_t ii = jj; ii < jj + step; ++ii) {
+          ColumnMap u(data + ii * kInterleavedFHTBatchSize);
+          ColumnMap v(data + (ii + step) * kInterleavedFHTBatchSize);
+          ColumnType tmp = u;
+          u += v;
+          v = tmp - v;
+        }
+      }
+    }
+    for (int_fast32_t ii = 0; ii < d; ++ii) {
+      ColumnMap(data + ii * kInterleavedFHTBatchSize) *= scale;
+    }
+  }
+
+  // Computes decodeCP (see CrossPolytopeHashBase) for every vector of the
+  // batch, using the first dim coordinates. The index of the largest absolute
+  // value is tracked with masks instead of branches so that the loop over the
+  // batch vectorizes. This gives the same result as the sequential scan: the
+  // first coordinate attaining the maximum, with the sign of that coordinate.
+  template <typename HashType>
+  static void decode(const ScalarType* data, int_fast64_t dim,
+                     HashType* res) {
+    ScalarType best[kInterleavedFHTBatchSize];
+    IndexType best_index[kInterleavedFHTBatchSize];
+    for (int_fast32_t bb = 0; bb < kInterleavedFHTBatchSize; ++bb) {
+      best[bb] = std::abs(data[bb]);
+      best_index[bb] = 0;
+    }
+    for (IndexType ii = 1; ii < dim; ++ii) {
+      const ScalarType* column = data + ii * kInterleavedFHTBatchSize;
+      for (int_fast32_t bb = 0; bb < kInterleavedFHTBatchSize; ++bb) {
+        ScalarType cur = std::abs(column[bb]);
+        IndexType larger = -static_cast<IndexType>(cur > best[bb]);
+        best[bb] = cur > best[bb] ? cur : best[bb];
+        best_index[bb] = (best_index[bb] & ~larger) | (ii & larger);
+      }
+    }
+    for (int_fast32_t bb = 0; bb < kInterleavedFHTBatchSize; ++bb) {
+      int_fast64_t index = best_index[bb];
+      res[bb] = index;
+      if (data[index * kInterleavedFHTBatchSize + bb] < 0) {
+        res[bb] += dim;
+      }
+    }
+  }
+
+ private:
+  // An index type of the same width as ScalarType keeps the lanes of the
+  // comparisons and of the index updates in decode aligned.
+  typedef typename std::conditional<sizeof(ScalarType) == 4, int32_t,
+                                    int64_t>::type IndexType;
+
+  int_fast32_t dim_;
+  ScalarType scale_;
+  Transform transform_;
+};
+
 }  // namespace cp_hash_helpers
 
 // TODO: replace CoordinateType with a type trait of VectorT?
@@ -139,27 +292,44 @@ class CrossPolytopeHashBase {
   class HashTransformation {
    public:
     HashTransformation(const Derived& parent)
-        : parent_(parent), fht_helper_(parent.rotation_dim_) {}
+        : parent_(parent),
+          fht_helper_(parent.rotation_dim_),
+          interleaved_fht_helper_(parent.rotation_dim_),
+          interleaved_(parent.rotation_dim_ *
+                       cp_hash_helpers::kInterleavedFHTBatchSize) {}
 
     void apply(const VectorT& v, TransformedVectorType* result) {
-      parent_.compute_rotated_vectors(v, result, &fht_helper_);
+      if (cp_hash_helpers::kUseInterleavedFHT) {
+        parent_.compute_rotated_vectors(v, result, &fht_helper_,
+                                        &interleaved_fht_helper_,
+                                        interleaved_.data());
+      } else {
+        parent_.compute_rotated_vectors(v, result, &fht_helper_);
+      }
     }
 
    private:
     const Derived& parent_;
     cp_hash_helpers::FHTHelper<CoordinateType> fht_helper_;
+    cp_hash_helpers::InterleavedFHTHelper<CoordinateType>
+        interleaved_fht_helper_;
+    std::vector<CoordinateType> interleaved_;
   };
 
-  // TODO: Can the FHT rotations be faster by doing 8 rotations (AVX float
-  // register size) in parallel? If so, the table setup time could be made
-  // faster by using a batch FHT below.
+  // Without AVX, hashes the points in groups of kInterleavedFHTBatchSize. The
+  // embedded vectors of a group are stored interleaved so that the
+  // pseudo-random rotations and the decoding of all points in the group run
+  // together.
   template <typename BatchVectorType>
   class BatchHash {
    public:
     BatchHash(const Derived& parent)
         : parent_(parent),
           tmp_vector_(parent.rotation_dim_),
-          fht_helper_(parent.rotation_dim_) {}
+          fht_helper_(parent.rotation_dim_),
+          interleaved_fht_helper_(parent.rotation_dim_),
+          interleaved_(parent.k_ * parent.rotation_dim_ *
+                       cp_hash_helpers::kInterleavedFHTBatchSize) {}
 
     void batch_hash_single_table(const BatchVectorType& points, int_fast32_t l,
                                  std::vector<HashType>* res) {
@@ -167,7 +337,30 @@ class CrossPolytopeHashBase {
       if (static_cast<int_fast64_t>(res->size()) != nn) {
         res->resize(nn);
       }
+      if (cp_hash_helpers::kUseInterleavedFHT) {
+        hash_interleaved(points, l, res);
+      } else {
+        hash_per_point(points, l, res);
+      }
+    }
+
+    int_fast32_t get_num_tables_per_batch() const { return 1; }
+
+    void batch_hash_tables(const BatchVectorType& points,
+                           int_fast32_t first_table, int_fast32_t num_tables,
+                           std::vector<HashType>* res) {
+      for (int_fast32_t tt = 0; tt < num_tables; ++tt) {
+        batch_hash_single_table(points, first_table + tt, &res[tt]);
+      }
+    }
+
+   private:
+    typedef typename cp_hash_helpers::InterleavedFHTHelper<
+        CoordinateType>::ColumnMap ColumnMap;
 
+    void hash_per_point(const BatchVectorType& points, int_fast32_t l,
+                        std::vector<HashType>* res) {
+      int_fast64_t nn = points.size();
       typename BatchVectorType::FullSequenceIterator iter =
           points.get_full_sequence();
       for (int_fast64_t ii = 0; ii < nn; ++ii) {
@@ -204,14 +397,96 @@ class CrossPolytopeHashBase {
       }
     }
 
-   private:
+    void hash_interleaved(const BatchVectorType& points, int_fast32_t l,
+                          std::vector<HashType>* res) {
+      const int_fast32_t batch_size = cp_hash_helpers::kInterleavedFHTBatchSize;
+      const int_fast32_t k = parent_.k_;
+      const int_fast32_t dim = parent_.rotation_dim_;
+      const int_fast32_t num_rotations = parent_.num_rotations_;
+      int_fast64_t nn = points.size();
+
+      typename BatchVectorType::FullSequenceIterator iter =
+          points.get_full_sequence();
+      HashType decoded[cp_hash_helpers::kInterleavedFHTBatchSize];
+      for (int_fast64_t start = 0; start < nn; start += batch_size) {
+        int_fast64_t count = std::min(static_cast<int_fast64_t>(batch_size),
+                                      nn - start);
+        if (count < batch_size) {
+          std::fill(interleaved_.begin(), interleaved_.end(), 0);
+        }
+
+        // Embed the points and apply the first random signs while
+        // interleaving them.
+        for (int_fast64_t bb = 0; bb < count; ++bb) {
+          for (int_fast32_t jj = 0; jj < k; ++jj) {
+            parent_.embed(iter.get_point(), l, jj, &tmp_vector_);
+            const RotatedVectorType& signs =
+                parent_.random_signs_[(l * k + jj) * num_rotations];
+            CoordinateType* cur = &(interleaved_[jj * dim * batch_size]);
+            for (int_fast32_t ii = 0; ii < dim; ++ii) {
+              cur[ii * batch_size + bb] = tmp_vector_[ii] * signs[ii];
+            }
+          }
+          (*res)[start + bb] = 0;
+          ++iter;
+        }
+
+        for (int_fast32_t jj = 0; jj < k; ++jj) {
+          CoordinateType* cur = &(interleaved_[jj * dim * batch_size]);
+          int_fast32_t pattern = (l * k + jj) * num_rotations;
+          interleaved_fht_helper_.apply(cur);
+          for (int_fast32_t rot = 1; rot < num_rotations; ++rot) {
+            const RotatedVectorType& signs =
+                parent_.random_signs_[pattern + rot];
+            for (int_fast32_t ii = 0; ii < dim; ++ii) {
+              ColumnMap(cur + ii * batch_size) *= signs[ii];
+            }
+            interleaved_fht_helper_.apply(cur);
+          }
+
+          int_fast32_t cp_dim = dim;
+          int_fast32_t cp_log_dim = parent_.log_rotation_dim_;
+          if (jj == k - 1) {
+            cp_dim = parent_.last_cp_dim_;
+            cp_log_dim = parent_.last_cp_log_dim_;
+          }
+          cp_hash_helpers::InterleavedFHTHelper<CoordinateType>::decode(
+              cur, cp_dim, decoded);
+          for (int_fast64_t bb = 0; bb < count; ++bb) {
+            HashType& cur_hash = (*res)[start + bb];
+            cur_hash = (cur_hash << (cp_log_dim + 1)) | decoded[bb];
+          }
+        }
+      }
+    }
+
     const Derived& parent_;
     RotatedVectorType tmp_vector_;
     cp_hash_helpers::FHTHelper<CoordinateType> fht_helper_;
+    cp_hash_helpers::InterleavedFHTHelper<CoordinateType>
+        interleaved_fht_helper_;
+    std::vector<CoordinateType> interleaved_;
   };
 
   int_fast32_t get_l() const { return l_; }
 
+  // Bytes of the random signs of the rotations and of the embedding (the
+  // feature hashing of sparse vectors)
+  int_fast64_t get_memory_usage() const {
+    return random_signs_.size() *
+               (sizeof(RotatedVectorType) +
+                rotation_dim_ * sizeof(CoordinateType)) +
+           static_cast<const Derived*>(this)->get_embedding_memory_usage();
+  }
+
+  // The bytes of the random signs for a hash with the given parameters
+  static int_fast64_t estimate_rotation_memory_usage(
+      int_fast64_t rotation_dim, int_fast32_t k, int_fast32_t l,
+      int_fast32_t num_rotations) {
+    return static_cast<int_fast64_t>(k) * l * num_rotations *
+           (sizeof(RotatedVectorType) + rotation_dim * sizeof(CoordinateType));
+  }
+
   void reserve_transformed_vector_memory(TransformedVectorType* tv) const {
     tv->resize(k_ * l_);
     for (int_fast32_t ii = 0; ii < k_ * l_; ++ii) {
@@ -274,6 +549,46 @@ class CrossPolytopeHashBase {
     return res;
   }
 
+  // The random signs of the pseudo-random rotations (and, for sparse data,
+  // the feature hashing) are stored explicitly rather than regenerated from
+  // the seed, since the standard library's distributions are
+  // implementation-defined.
+  void serialize(BinaryWriter* output) const {
+    output->write_value<int64_t>(rotation_dim_);
+    output->write_value<int64_t>(k_);
+    output->write_value<int64_t>(l_);
+    output->write_value<int64_t>(num_rotations_);
+    output->write_value<int64_t>(last_cp_dim_);
+    std::vector<CoordinateType> signs;
+    signs.reserve(random_signs_.size() * rotation_dim_);
+    for (const RotatedVectorType& vec : random_signs_) {
+      signs.insert(signs.end(), vec.data(), vec.data() + rotation_dim_);
+    }
+    output->write_array(signs);
+    static_cast<const Derived*>(this)->serialize_embedding(output);
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (input->read_value<int64_t>() != rotation_dim_ ||
+        input->read_value<int64_t>() != k_ ||
+        input->read_value<int64_t>() != l_ ||
+        input->read_value<int64_t>() != num_rotations_ ||
+        input->read_value<int64_t>() != last_cp_dim_) {
+      throw LSHFunctionError("Cross polytope hash parameters in input differ.");
+    }
+    int_fast64_t num_signs;
+    const CoordinateType* signs = input->map_array<CoordinateType>(&num_signs);
+    if (num_signs !=
+        static_cast<int_fast64_t>(random_signs_.size()) * rotation_dim_) {
+      throw LSHFunctionError("Random signs in input have the wrong size.");
+    }
+    for (size_t ii = 0; ii < random_signs_.size(); ++ii) {
+      std::copy(signs + ii * rotation_dim_, signs + (ii + 1) * rotation_dim_,
+                random_signs_[ii].data());
+    }
+    static_cast<Derived*>(this)->deserialize_embedding(input);
+  }
+
  protected:
   CrossPolytopeHashBase(int_fast32_t rotation_dim, int_fast32_t k,
                         int_fast32_t l, int_fast32_t num_rotations,
@@ -399,6 +714,69 @@ class CrossPolytopeHashBase {
     }
   }
 
+  // Computes the same rotated vectors as above, but rotates the k * l
+  // embedded vectors kInterleavedFHTBatchSize at a time. The interleaved
+  // buffer must hold kInterleavedFHTBatchSize * rotation_dim_ entries. A
+  // single remaining vector is rotated on its own, since padding it to a full
+  // batch is slower.
+  void compute_rotated_vectors(
+      const VectorT& v, TransformedVectorType* result,
+      cp_hash_helpers::FHTHelper<CoordinateType>* fht,
+      const cp_hash_helpers::InterleavedFHTHelper<CoordinateType>*
+          interleaved_fht,
+      CoordinateType* interleaved) const {
+    const int_fast32_t batch_size = cp_hash_helpers::kInterleavedFHTBatchSize;
+    int_fast32_t num_vectors = k_ * l_;
+
+    for (int_fast32_t start = 0; start < num_vectors; start += batch_size) {
+      int_fast32_t count = std::min(batch_size, num_vectors - start);
+      if (count == 1) {
+        RotatedVectorType& cur_vec = (*result)[start];
+        static_cast<const Derived*>(this)->embed(v, start / k_, start % k_,
+                                                 &cur_vec);
+        for (int_fast32_t rot = 0; rot < num_rotations_; ++rot) {
+          cur_vec = cur_vec.cwiseProduct(
+              random_signs_[start * num_rotations_ + rot]);
+          fht->apply(cur_vec.data());
+        }
+        break;
+      }
+      if (count < batch_size) {
+        std::fill(interleaved, interleaved + rotation_dim_ * batch_size, 0);
+      }
+
+      for (int_fast32_t bb = 0; bb < count; ++bb) {
+        int_fast32_t cur = start + bb;
+        RotatedVectorType& cur_vec = (*result)[cur];
+        static_cast<const Derived*>(this)->embed(v, cur / k_, cur % k_,
+                                                 &cur_vec);
+        const RotatedVectorType& signs = random_signs_[cur * num_rotations_];
+        for (int_fast32_t ii = 0; ii < rotation_dim_; ++ii) {
+          interleaved[ii * batch_size + bb] = cur_vec[ii] * signs[ii];
+        }
+      }
+      interleaved_fht->apply(interleaved);
+
+      for (int_fast32_t rot = 1; rot < num_rotations_; ++rot) {
+        for (int_fast32_t bb = 0; bb < count; ++bb) {
+          const RotatedVectorType& signs =
+              random_signs_[(start + bb) * num_rotations_ + rot];
+          for (int_fast32_t ii = 0; ii < rotation_dim_; ++ii) {
+            interleaved[ii * batch_size + bb] *= signs[ii];
+          }
+        }
+        interleaved_fht->apply(interleaved);
+      }
+
+      for (int_fast32_t bb = 0; bb < count; ++bb) {
+        RotatedVectorType& cur_vec = (*result)[start + bb];
+        for (int_fast32_t ii = 0; ii < rotation_dim_; ++ii) {
+          cur_vec[ii] = interleaved[ii * batch_size + bb];
+        }
+      }
+    }
+  }
+
   // friend BatchHash;
   // Helper class for multiprobe LSH
   class MultiProbeLookup {
@@ -660,7 +1038,7 @@ class CrossPolytopeHashSparse
   void embed(const DerivedVectorT& v, int_fast32_t l, int_fast32_t k,
              HashedVectorT* res) const {
     res->setZero();
-    IndexType offset =
+    int_fast64_t offset =
         ((static_cast<int_fast64_t>(l) * this->k_) + k) * vector_dim_;
 
     for (IndexType ii = 0; ii < static_cast<IndexType>(v.size()); ++ii) {
@@ -672,6 +1050,37 @@ class CrossPolytopeHashSparse
     }
   }
 
+  int_fast64_t get_embedding_memory_usage() const {
+    return feature_hashing_index_.size() * sizeof(int) +
+           feature_hashing_coeff_.size() * sizeof(CoordinateType);
+  }
+
+  // Bytes of a hash with the given parameters (see get_memory_usage)
+  static int_fast64_t estimate_memory_usage(int_fast64_t vector_dim,
+                                            int_fast32_t k, int_fast32_t l,
+                                            int_fast32_t num_rotations,
+                                            int_fast32_t feature_hashing_dim) {
+    return CrossPolytopeHashSparse::estimate_rotation_memory_usage(
+               feature_hashing_dim, k, l, num_rotations) +
+           static_cast<int_fast64_t>(k) * l * vector_dim *
+               (sizeof(int) + sizeof(CoordinateType));
+  }
+
+  void serialize_embedding(BinaryWriter* output) const {
+    output->write_array(feature_hashing_index_);
+    output->write_array(feature_hashing_coeff_);
+  }
+
+  void deserialize_embedding(BinaryReader* input) {
+    size_t num_indices = feature_hashing_index_.size();
+    input->read_array(&feature_hashing_index_);
+    input->read_array(&feature_hashing_coeff_);
+    if (feature_hashing_index_.size() != num_indices ||
+        feature_hashing_coeff_.size() != num_indices) {
+      throw LSHFunctionError("Feature hashing in input has the wrong size.");
+    }
+  }
+
  private:
   const int_fast32_t vector_dim_;  // actual dimension of the vectors
   std::vector<int> feature_hashing_index_;
@@ -712,6 +1121,21 @@ class CrossPolytopeHashDense
     }
   }
 
+  // Dense vectors are embedded without randomness.
+  int_fast64_t get_embedding_memory_usage() const { return 0; }
+
+  // Bytes of a hash with the given parameters (see get_memory_usage)
+  static int_fast64_t estimate_memory_usage(int_fast64_t vector_dim,
+                                            int_fast32_t k, int_fast32_t l,
+                                            int_fast32_t num_rotations) {
+    return CrossPolytopeHashDense::estimate_rotation_memory_usage(
+        find_next_power_of_two(vector_dim), k, l, num_rotations);
+  }
+
+  void serialize_embedding(BinaryWriter*) const {}
+
+  void deserialize_embedding(BinaryReader*) {}
+
  private:
   const int_fast32_t vector_dim_;  // actual dimension of the vectors
 };
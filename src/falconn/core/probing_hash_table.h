@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "hash_table_helpers.h"
+#include "serialization.h"
 
 namespace falconn {
 namespace core {
@@ -133,6 +134,62 @@ class StaticLinearProbingHashTable {
     return std::make_pair(&(indices_[0]), &(indices_[0]));
   }
 
+  // Calls f(begin, end) with the entries of each non-empty bucket, in the
+  // order of the probing table
+  template <typename Function>
+  void for_each_bucket(Function f) const {
+    for (int_fast64_t ii = 0; ii < table_.size() && entries_added_; ++ii) {
+      if (table_[ii].length > 0) {
+        IndexType start = table_[ii].start;
+        f(&(indices_[start]), &(indices_[start + table_[ii].length]));
+      }
+    }
+  }
+
+  // Bytes of the probing table (the bucket directory) and of the point
+  // indices
+  int_fast64_t get_bucket_memory_usage() const {
+    return table_.get_memory_usage();
+  }
+
+  int_fast64_t get_entry_memory_usage() const {
+    return indices_.get_memory_usage();
+  }
+
+  // The same for a table with the given size and number of entries
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t table_size) {
+    return table_size * sizeof(TableEntry);
+  }
+
+  static int_fast64_t estimate_entry_memory_usage(int_fast64_t num_entries) {
+    return num_entries * sizeof(IndexType);
+  }
+
+  void serialize(BinaryWriter* output) const {
+    if (!entries_added_) {
+      throw StaticProbingHashTableError(
+          "Cannot serialize a table without entries.");
+    }
+    output->write_value<int64_t>(table_size_);
+    table_.serialize(output);
+    indices_.serialize(output);
+  }
+
+  void deserialize(BinaryReader* input) {
+    if (entries_added_) {
+      throw StaticProbingHashTableError("Entries already added.");
+    }
+    if (input->read_value<int64_t>() != table_size_) {
+      throw StaticProbingHashTableError("Table size in input does not match.");
+    }
+    table_.deserialize(input);
+    indices_.deserialize(input);
+    if (table_.size() != table_size_) {
+      throw StaticProbingHashTableError("Table in input has the wrong size.");
+    }
+    entries_added_ = true;
+  }
+
  private:
   // TODO: make the hash function a template argument
   IndexType hash(const KeyType& key) const {
@@ -167,9 +224,9 @@ class StaticLinearProbingHashTable {
   int_fast64_t table_size_ = 0;
   bool entries_added_ = false;
   // the pair contains start index and length
-  std::vector<TableEntry> table_;
+  ArrayStore<TableEntry> table_;
   // point indices
-  std::vector<IndexType> indices_;
+  ArrayStore<IndexType> indices_;
 
   // unsigned int to avoid negative values in the hash computation
   const uint_fast64_t kLargePrime = 2147483647;
@@ -438,6 +495,38 @@ class DynamicLinearProbingHashTable {
 
   IndexType get_table_size() { return table_.size(); }
 
+  // Calls f(begin, end) with the entries of each non-empty bucket, in order
+  // of keys. The entries of a bucket are spread over the probing table, so
+  // the keys are collected first.
+  template <typename Function>
+  void for_each_bucket(Function f) const {
+    std::vector<KeyType> keys;
+    for (const TableEntry& entry : table_) {
+      if (entry.state == kActive) {
+        keys.push_back(entry.key);
+      }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    for (const KeyType& key : keys) {
+      std::pair<Iterator, Iterator> bucket = retrieve(key);
+      f(bucket.first, bucket.second);
+    }
+  }
+
+  // The (key, value) pairs are stored in the probing table itself, so all
+  // of the memory is counted for the buckets.
+  int_fast64_t get_bucket_memory_usage() const {
+    return table_.capacity() * sizeof(TableEntry);
+  }
+
+  int_fast64_t get_entry_memory_usage() const { return 0; }
+
+  // The same for a table of the given size
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t table_size) {
+    return table_size * sizeof(TableEntry);
+  }
+
  private:
   IndexType hash(const KeyType& key) const { return hash(key, table_.size()); }
 
@@ -0,0 +1,260 @@
+#ifndef __QUERY_INSTRUMENTATION_H__
+#define __QUERY_INSTRUMENTATION_H__
+
+#include <chrono>
+#include <cstdint>
+
+#include "../falconn_global.h"
+
+namespace falconn {
+namespace core {
+
+// A cheap clock for timing the phases of queries: the time stamp counter on
+// x86, which has run at a constant rate on all CPUs for over a decade and
+// costs a fraction of a steady clock read, and the steady clock elsewhere.
+class CycleClock {
+ public:
+  typedef uint64_t Ticks;
+
+  static Ticks now() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  // Seconds from one reading to a later one. A thread that moves to a core
+  // whose counter is behind may see time go backwards; that counts as 0.
+  static double seconds(Ticks from, Ticks to) {
+    return to > from ? (to - from) * seconds_per_tick() : 0.0;
+  }
+
+  static double seconds_per_tick() {
+    static const double value = calibrate();
+    return value;
+  }
+
+ private:
+  // Counts the ticks during a millisecond of the steady clock (once per
+  // process)
+  static double calibrate() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    Ticks start_ticks = now();
+    Clock::time_point end;
+    do {
+      end = Clock::now();
+    } while (end - start < std::chrono::milliseconds(1));
+    Ticks end_ticks = now();
+    return std::chrono::duration_cast<std::chrono::duration<double>>(end -
+                                                                     start)
+               .count() /
+           (end_ticks - start_ticks);
+#else
+    return static_cast<double>(std::chrono::steady_clock::period::num) /
+           std::chrono::steady_clock::period::den;
+#endif
+  }
+};
+
+// Records the phases of the queries of one query object, as set by its
+// QueryInstrumentation, into its query statistics and, with
+// InstrumentationLevel::Trace, into a QueryTrace.
+//
+// A query is bracketed by begin() and end(), usually through a Scope.
+// Brackets nested inside a query, as when a nearest neighbor query
+// retrieves its candidates through the LSH table query, belong to the
+// enclosing query. begin() decides whether the query is measured; only a
+// measured query reads the clock and reports its phases, so an unmeasured
+// query costs a counter increment and a few well-predicted branches.
+class QueryRecorder {
+ public:
+  typedef CycleClock::Ticks Ticks;
+
+  // Brackets a query for its lifetime
+  class Scope {
+   public:
+    explicit Scope(QueryRecorder* recorder)
+        : recorder_(recorder), measured_(recorder->begin()) {}
+
+    ~Scope() { recorder_->end(); }
+
+    bool measured() const { return measured_; }
+
+   private:
+    QueryRecorder* recorder_;
+    bool measured_;
+  };
+
+  void set_instrumentation(const QueryInstrumentation& instrumentation) {
+    if (instrumentation.sample_period < 1) {
+      throw FalconnError("The sample period must be at least 1.");
+    }
+    instrumentation_ = instrumentation;
+    countdown_ = 1;
+    if (enabled()) {
+      CycleClock::seconds_per_tick();
+    }
+  }
+
+  const QueryInstrumentation& get_instrumentation() const {
+    return instrumentation_;
+  }
+
+  // Whether any queries are measured. Work done ahead of a query, such as
+  // prefetching it, is timed if so, since the query may be measured.
+  bool enabled() const {
+    return instrumentation_.level != InstrumentationLevel::None;
+  }
+
+  // Starts a query, or a part of the current one. Returns whether the query
+  // is measured.
+  bool begin() {
+    if (depth_++ > 0) {
+      return measured_;
+    }
+    num_queries_ += 1;
+    switch (instrumentation_.level) {
+      case InstrumentationLevel::None:
+        measured_ = false;
+        break;
+      case InstrumentationLevel::Sampled:
+        measured_ = --countdown_ == 0;
+        if (measured_) {
+          countdown_ = instrumentation_.sample_period;
+        }
+        break;
+      case InstrumentationLevel::Trace:
+        measured_ = true;
+        break;
+    }
+    if (measured_) {
+      record_ = QueryTraceRecord();
+      if (instrumentation_.level == InstrumentationLevel::Trace &&
+          instrumentation_.trace) {
+        record_.query_object = instrumentation_.query_object;
+        record_.start_time = instrumentation_.trace->seconds_since_creation();
+      }
+      start_ = now();
+    }
+    return measured_;
+  }
+
+  // Ends what the matching begin() started; at the end of a measured query,
+  // adds its phases to the statistics and to the trace
+  void end() {
+    if (--depth_ > 0 || !measured_) {
+      return;
+    }
+    record_.total_time = seconds_since(start_);
+    add_to_statistics(record_);
+    if (instrumentation_.level == InstrumentationLevel::Trace &&
+        instrumentation_.trace) {
+      instrumentation_.trace->push(record_);
+    }
+  }
+
+  // Whether a query is running and measured
+  bool measured() const { return depth_ > 0 && measured_; }
+
+  Ticks now() const { return CycleClock::now(); }
+
+  double seconds_since(Ticks start) const {
+    return CycleClock::seconds(start, now());
+  }
+
+  // The phases of the measured query, in seconds. A phase may be reported
+  // in several parts.
+  void add_lsh_time(double seconds) { add_time(&record_.lsh_time, seconds); }
+
+  void add_hash_table_time(double seconds) {
+    add_time(&record_.hash_table_time, seconds);
+  }
+
+  void add_distance_time(double seconds) {
+    add_time(&record_.distance_time, seconds);
+  }
+
+  void set_num_candidates(int_fast64_t num_candidates) {
+    record_.num_candidates = num_candidates;
+  }
+
+  void set_num_unique_candidates(int_fast64_t num_unique_candidates) {
+    record_.num_unique_candidates = num_unique_candidates;
+  }
+
+  int_fast64_t get_num_queries() const { return num_queries_; }
+
+  void reset_statistics() {
+    stats_ = QueryStatistics();
+    num_queries_ = 0;
+  }
+
+  // The averages are over the measured queries that went through each
+  // phase.
+  QueryStatistics get_statistics() const {
+    QueryStatistics res = stats_;
+    res.num_queries = num_queries_;
+    divide(&res.average_total_query_time, res.total_query_time_histogram);
+    divide(&res.average_lsh_time, res.lsh_time_histogram);
+    divide(&res.average_hash_table_time, res.hash_table_time_histogram);
+    divide(&res.average_distance_time, res.distance_time_histogram);
+    divide(&res.average_num_candidates, res.num_candidates_histogram);
+    divide(&res.average_num_unique_candidates,
+           res.num_unique_candidates_histogram);
+    return res;
+  }
+
+ private:
+  QueryInstrumentation instrumentation_;
+  int_fast64_t countdown_ = 1;
+
+  int depth_ = 0;
+  bool measured_ = false;
+  Ticks start_ = 0;
+  QueryTraceRecord record_;
+
+  // Sums of the phases of the measured queries and the number of queries
+  QueryStatistics stats_;
+  int_fast64_t num_queries_ = 0;
+
+  static void add_time(double* phase, double seconds) {
+    *phase = *phase < 0.0 ? seconds : *phase + seconds;
+  }
+
+  static void add(double* sum, QueryHistogram* histogram, double value) {
+    if (value >= 0.0) {
+      *sum += value;
+      histogram->add(value);
+    }
+  }
+
+  static void divide(double* sum, const QueryHistogram& histogram) {
+    if (histogram.count() > 0) {
+      *sum /= histogram.count();
+    }
+  }
+
+  void add_to_statistics(const QueryTraceRecord& record) {
+    add(&stats_.average_total_query_time, &stats_.total_query_time_histogram,
+        record.total_time);
+    add(&stats_.average_lsh_time, &stats_.lsh_time_histogram,
+        record.lsh_time);
+    add(&stats_.average_hash_table_time, &stats_.hash_table_time_histogram,
+        record.hash_table_time);
+    add(&stats_.average_distance_time, &stats_.distance_time_histogram,
+        record.distance_time);
+    add(&stats_.average_num_candidates, &stats_.num_candidates_histogram,
+        static_cast<double>(record.num_candidates));
+    add(&stats_.average_num_unique_candidates,
+        &stats_.num_unique_candidates_histogram,
+        static_cast<double>(record.num_unique_candidates));
+  }
+};
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
@@ -0,0 +1,360 @@
+#ifndef __SERIALIZATION_H__
+#define __SERIALIZATION_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../falconn_global.h"
+
+// Helpers for writing LSH tables to a binary file and reading them back.
+//
+// Arrays are written as their element count followed by the raw elements,
+// starting at an offset that is a multiple of kSerializationAlignment. On
+// load, the file is memory-mapped (where supported), and the large arrays of
+// the hash tables become views into the mapping instead of being copied, so
+// loading takes time proportional to the number of arrays rather than to
+// their size, and several processes loading the same file share its pages.
+//
+// The format stores values in native byte order and native type sizes; the
+// file header (see the wrapper) records these so that a mismatch is detected.
+
+namespace falconn {
+namespace core {
+
+class SerializationError : public FalconnError {
+ public:
+  SerializationError(const char* msg) : FalconnError(msg) {}
+};
+
+const int_fast64_t kSerializationAlignment = 64;
+
+// A read-only view of an entire file. On POSIX systems, the file is mapped
+// with mmap; elsewhere it is read into memory.
+class MappedFile {
+ public:
+  MappedFile(const std::string& filename) {
+#if !defined(_WIN32)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw SerializationError("Could not open file for reading.");
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+      close(fd);
+      throw SerializationError("Could not determine the file size.");
+    }
+    size_ = static_cast<size_t>(file_stat.st_size);
+    if (size_ > 0) {
+      void* mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+        close(fd);
+        throw SerializationError("Could not memory-map file.");
+      }
+      data_ = static_cast<const char*>(mapping);
+    }
+    close(fd);
+#else
+    std::FILE* input = std::fopen(filename.c_str(), "rb");
+    if (input == nullptr) {
+      throw SerializationError("Could not open file for reading.");
+    }
+    std::fseek(input, 0, SEEK_END);
+    size_ = static_cast<size_t>(std::ftell(input));
+    std::fseek(input, 0, SEEK_SET);
+    // Use 64-bit words so that the buffer is suitably aligned.
+    buffer_.resize((size_ + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    if (std::fread(buffer_.data(), 1, size_, input) != size_) {
+      std::fclose(input);
+      throw SerializationError("Could not read file.");
+    }
+    std::fclose(input);
+    data_ = reinterpret_cast<const char*>(buffer_.data());
+#endif
+  }
+
+  ~MappedFile() {
+#if !defined(_WIN32)
+    if (data_ != nullptr) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#if defined(_WIN32)
+  std::vector<uint64_t> buffer_;
+#endif
+};
+
+class BinaryWriter {
+ public:
+  BinaryWriter(const std::string& filename) {
+    output_ = std::fopen(filename.c_str(), "wb");
+    if (output_ == nullptr) {
+      throw SerializationError("Could not open file for writing.");
+    }
+  }
+
+  ~BinaryWriter() {
+    if (output_ != nullptr) {
+      std::fclose(output_);
+    }
+  }
+
+  BinaryWriter(const BinaryWriter&) = delete;
+  BinaryWriter& operator=(const BinaryWriter&) = delete;
+
+  template <typename T>
+  void write_value(const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be serialized.");
+    write_bytes(&value, sizeof(T));
+  }
+
+  template <typename T>
+  void write_array(const T* data, int_fast64_t num_elements) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable arrays can be serialized.");
+    write_value<int64_t>(num_elements);
+    pad_to_alignment();
+    write_bytes(data, sizeof(T) * num_elements);
+  }
+
+  template <typename T>
+  void write_array(const std::vector<T>& data) {
+    write_array(data.data(), data.size());
+  }
+
+  // Flushes and closes the file, reporting any write error.
+  void close() {
+    int status = std::fclose(output_);
+    output_ = nullptr;
+    if (status != 0) {
+      throw SerializationError("Error while closing the output file.");
+    }
+  }
+
+ private:
+  std::FILE* output_ = nullptr;
+  int_fast64_t offset_ = 0;
+
+  void write_bytes(const void* data, size_t num_bytes) {
+    if (num_bytes > 0 && std::fwrite(data, 1, num_bytes, output_) != num_bytes) {
+      throw SerializationError("Error while writing to the output file.");
+    }
+    offset_ += num_bytes;
+  }
+
+  void pad_to_alignment() {
+    static const char zeros[kSerializationAlignment] = {0};
+    int_fast64_t remainder = offset_ % kSerializationAlignment;
+    if (remainder != 0) {
+      write_bytes(zeros, kSerializationAlignment - remainder);
+    }
+  }
+};
+
+class BinaryReader {
+ public:
+  BinaryReader(std::shared_ptr<const MappedFile> file) : file_(file) {}
+
+  template <typename T>
+  T read_value() {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be deserialized.");
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  // Returns a pointer to an array stored in the file (valid as long as the
+  // file is), and sets *num_elements to its length.
+  template <typename T>
+  const T* map_array(int_fast64_t* num_elements) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable arrays can be deserialized.");
+    int64_t count = read_value<int64_t>();
+    if (count < 0) {
+      throw SerializationError("Negative array length in input file.");
+    }
+    skip_to_alignment();
+    if (static_cast<uint64_t>(count) >
+        (file_->size() - offset_) / std::max<size_t>(sizeof(T), 1)) {
+      throw SerializationError("Unexpected end of input file.");
+    }
+    *num_elements = count;
+    return reinterpret_cast<const T*>(take(sizeof(T) * count));
+  }
+
+  template <typename T>
+  void read_array(std::vector<T>* result) {
+    int_fast64_t num_elements;
+    const T* data = map_array<T>(&num_elements);
+    result->assign(data, data + num_elements);
+  }
+
+  const std::shared_ptr<const MappedFile>& file() const { return file_; }
+
+ private:
+  std::shared_ptr<const MappedFile> file_;
+  size_t offset_ = 0;
+
+  const char* take(size_t num_bytes) {
+    if (num_bytes > file_->size() - offset_) {
+      throw SerializationError("Unexpected end of input file.");
+    }
+    const char* result = file_->data() + offset_;
+    offset_ += num_bytes;
+    return result;
+  }
+
+  void skip_to_alignment() {
+    size_t remainder = offset_ % kSerializationAlignment;
+    if (remainder != 0) {
+      take(kSerializationAlignment - remainder);
+    }
+  }
+};
+
+// An allocator whose arrays start at a multiple of kSerializationAlignment,
+// as arrays in a mapped file do, so that arrays of cache-line-sized elements
+// keep each element in a single cache line whether they are built or loaded.
+template <typename T>
+class CacheAlignedAllocator {
+ public:
+  typedef T value_type;
+
+  CacheAlignedAllocator() {}
+
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+  // The allocation is padded for the alignment and for a pointer to its
+  // start, which is stored just before the returned array.
+  T* allocate(size_t num_elements) {
+    char* raw = static_cast<char*>(::operator new(
+        num_elements * sizeof(T) + kSerializationAlignment + sizeof(void*)));
+    uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) +
+                       kSerializationAlignment - 1) &
+                      ~static_cast<uintptr_t>(kSerializationAlignment - 1);
+    reinterpret_cast<void**>(start)[-1] = raw;
+    return reinterpret_cast<T*>(start);
+  }
+
+  void deallocate(T* data, size_t) {
+    ::operator delete(reinterpret_cast<void**>(data)[-1]);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T>&,
+                const CacheAlignedAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T>&,
+                const CacheAlignedAllocator<U>&) {
+  return false;
+}
+
+// A fixed-size array that either owns its elements (when a structure is
+// built in memory) or refers to an array in a memory-mapped file (when the
+// structure is loaded). Mapped arrays are read-only.
+template <typename T, typename Allocator = std::allocator<T>>
+class ArrayStore {
+ public:
+  ArrayStore() {}
+
+  ArrayStore(const ArrayStore& other)
+      : owned_(other.owned_), file_(other.file_), size_(other.size_) {
+    data_ = file_ ? other.data_ : owned_.data();
+  }
+
+  ArrayStore& operator=(const ArrayStore& other) {
+    owned_ = other.owned_;
+    file_ = other.file_;
+    size_ = other.size_;
+    data_ = file_ ? other.data_ : owned_.data();
+    return *this;
+  }
+
+  void assign(int_fast64_t num_elements, const T& value) {
+    owned_.assign(num_elements, value);
+    file_.reset();
+    data_ = owned_.data();
+    size_ = num_elements;
+  }
+
+  void resize(int_fast64_t num_elements) {
+    owned_.resize(num_elements);
+    file_.reset();
+    data_ = owned_.data();
+    size_ = num_elements;
+  }
+
+  // Writing through the non-const accessors is only valid for owned arrays.
+  T& operator[](int_fast64_t index) { return const_cast<T*>(data_)[index]; }
+
+  const T& operator[](int_fast64_t index) const { return data_[index]; }
+
+  T* begin() { return const_cast<T*>(data_); }
+
+  T* end() { return const_cast<T*>(data_) + size_; }
+
+  const T* begin() const { return data_; }
+
+  const T* end() const { return data_ + size_; }
+
+  const T* data() const { return data_; }
+
+  int_fast64_t size() const { return size_; }
+
+  bool is_mapped() const { return static_cast<bool>(file_); }
+
+  // Bytes of the elements; for a mapped array, these are pages of the file.
+  int_fast64_t get_memory_usage() const { return size_ * sizeof(T); }
+
+  void serialize(BinaryWriter* output) const {
+    output->write_array(data_, size_);
+  }
+
+  void deserialize(BinaryReader* input) {
+    std::vector<T, Allocator>().swap(owned_);
+    data_ = input->map_array<T>(&size_);
+    file_ = input->file();
+  }
+
+ private:
+  std::vector<T, Allocator> owned_;
+  std::shared_ptr<const MappedFile> file_;
+  const T* data_ = nullptr;
+  int_fast64_t size_ = 0;
+};
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
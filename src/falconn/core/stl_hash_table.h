@@ -5,6 +5,8 @@
 #include <utility>
 #include <vector>
 
+#include "serialization.h"
+
 namespace falconn {
 namespace core {
 
@@ -54,6 +56,70 @@ class STLHashTable {
     return std::make_pair(Iterator(tmp.first), Iterator(tmp.second));
   }
 
+  // Calls f(begin, end) with the entries of each non-empty bucket. Entries
+  // with equal keys are adjacent in the map.
+  template <typename Function>
+  void for_each_bucket(Function f) {
+    auto entry = internal_table_.begin();
+    while (entry != internal_table_.end()) {
+      auto bucket = internal_table_.equal_range(entry->first);
+      f(Iterator(bucket.first), Iterator(bucket.second));
+      entry = bucket.second;
+    }
+  }
+
+  // The bucket array and the nodes (one per entry) of the map. The nodes are
+  // counted at their size without allocator overhead, so this is a lower
+  // bound.
+  int_fast64_t get_bucket_memory_usage() const {
+    return internal_table_.bucket_count() * sizeof(void*);
+  }
+
+  int_fast64_t get_entry_memory_usage() const {
+    return internal_table_.size() *
+           (sizeof(void*) + sizeof(std::pair<const KeyType, ValueType>));
+  }
+
+  // The same for a table with the given number of entries, for which the
+  // map has about as many buckets as entries
+  static int_fast64_t estimate_bucket_memory_usage(int_fast64_t num_entries) {
+    return num_entries * sizeof(void*);
+  }
+
+  static int_fast64_t estimate_entry_memory_usage(int_fast64_t num_entries) {
+    return num_entries *
+           (sizeof(void*) + sizeof(std::pair<const KeyType, ValueType>));
+  }
+
+  // The node-based map cannot be memory-mapped, so the (key, value) pairs
+  // are written as two arrays and the map is rebuilt on load.
+  void serialize(BinaryWriter* output) const {
+    std::vector<KeyType> keys;
+    std::vector<ValueType> values;
+    keys.reserve(internal_table_.size());
+    values.reserve(internal_table_.size());
+    for (const auto& entry : internal_table_) {
+      keys.push_back(entry.first);
+      values.push_back(entry.second);
+    }
+    output->write_array(keys);
+    output->write_array(values);
+  }
+
+  void deserialize(BinaryReader* input) {
+    int_fast64_t num_keys, num_values;
+    const KeyType* keys = input->map_array<KeyType>(&num_keys);
+    const ValueType* values = input->map_array<ValueType>(&num_values);
+    if (num_keys != num_values) {
+      throw SerializationError("Inconsistent STL hash table in input.");
+    }
+    internal_table_.clear();
+    internal_table_.reserve(num_keys);
+    for (int_fast64_t ii = 0; ii < num_keys; ++ii) {
+      internal_table_.emplace(keys[ii], values[ii]);
+    }
+  }
+
  private:
   std::unordered_multimap<KeyType, ValueType> internal_table_;
 };
@@ -0,0 +1,288 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace falconn {
+namespace core {
+
+// A persistent pool of worker threads for the parallel parts of table setup
+// (and of anything else in the host application), so that these do not start
+// threads of their own.
+//
+// run(num_tasks, f) calls f(ii) for each ii in [0, num_tasks) and returns once
+// all calls have finished. The calling thread runs tasks as well, so a pool of
+// size s runs at most s tasks at a time, counting the caller. Each worker keeps
+// its own queue of tasks: it runs the newest task of its queue first and, when
+// that is empty, steals the oldest task of another queue. Threads outside the
+// pool share one more queue. A thread waiting for its tasks runs other tasks
+// meanwhile, so tasks may call run() themselves without deadlock.
+//
+// Tasks may depend on state of the thread that submitted them, e.g., its
+// memory policy. The pool itself knows nothing of this state, but a host can
+// set hooks (see set_state_hooks) with which the tasks of a batch run in the
+// state of the thread that submitted it.
+class ThreadPool {
+ public:
+  // Returns the state of the calling thread, 0 for the default state
+  typedef int_fast64_t (*CaptureState)();
+  // Switches the calling thread to a state and returns the previous one
+  typedef int_fast64_t (*ApplyState)(int_fast64_t);
+
+  explicit ThreadPool(int_fast32_t size) { start(size); }
+
+  ~ThreadPool() { stop(); }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Number of threads running tasks, counting the calling thread
+  int_fast32_t size() const {
+    return static_cast<int_fast32_t>(workers_.size()) + 1;
+  }
+
+  // Changes the number of threads (at least 1). This must not be called while
+  // tasks run.
+  void resize(int_fast32_t size) {
+    if (size != this->size()) {
+      stop();
+      start(size);
+    }
+  }
+
+  void set_state_hooks(CaptureState capture, ApplyState apply) {
+    capture_state_ = capture;
+    apply_state_ = apply;
+  }
+
+  // The first exception thrown by a task is rethrown once all tasks of the
+  // batch have finished.
+  template <typename Function>
+  void run(int_fast32_t num_tasks, Function f) {
+    if (num_tasks <= 1 || workers_.empty()) {
+      for (int_fast32_t ii = 0; ii < num_tasks; ++ii) {
+        f(ii);
+      }
+      return;
+    }
+
+    Batch batch;
+    batch.call = &call<Function>;
+    batch.body = &f;
+    batch.state = capture_state_ ? capture_state_() : 0;
+    batch.remaining = num_tasks;
+
+    size_t own = own_queue();
+    {
+      std::lock_guard<std::mutex> lock(queues_[own]->mutex);
+      for (int_fast32_t ii = num_tasks - 1; ii >= 1; --ii) {
+        queues_[own]->tasks.push_back(Task{&batch, ii});
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      num_queued_ += num_tasks - 1;
+    }
+    cv_.notify_all();
+
+    execute(Task{&batch, 0});
+    while (batch.remaining.load() > 0) {
+      if (!run_one(own)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] {
+          return batch.remaining.load() == 0 || num_queued_.load() > 0;
+        });
+      }
+    }
+    if (batch.error) {
+      std::rethrow_exception(batch.error);
+    }
+  }
+
+ private:
+  struct Batch {
+    void (*call)(void*, int_fast32_t);
+    void* body;
+    int_fast64_t state;
+    std::atomic<int_fast32_t> remaining;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+  };
+
+  struct Task {
+    Batch* batch;
+    int_fast32_t index;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // queues_[ii] belongs to worker ii; the last one to threads outside the pool
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<int_fast64_t> num_queued_{0};
+  bool stopping_ = false;
+  CaptureState capture_state_ = nullptr;
+  ApplyState apply_state_ = nullptr;
+
+  template <typename Function>
+  static void call(void* body, int_fast32_t index) {
+    (*static_cast<Function*>(body))(index);
+  }
+
+  // The pool and queue of the calling thread, if it is a worker
+  static const ThreadPool*& worker_pool() {
+    static thread_local const ThreadPool* pool = nullptr;
+    return pool;
+  }
+
+  static size_t& worker_queue() {
+    static thread_local size_t queue = 0;
+    return queue;
+  }
+
+  size_t own_queue() const {
+    return worker_pool() == this ? worker_queue() : queues_.size() - 1;
+  }
+
+  void start(int_fast32_t size) {
+    size = std::max<int_fast32_t>(1, size);
+    stopping_ = false;
+    queues_.clear();
+    for (int_fast32_t ii = 0; ii < size; ++ii) {
+      queues_.emplace_back(new Queue());
+    }
+    for (int_fast32_t ii = 0; ii + 1 < size; ++ii) {
+      workers_.push_back(std::thread(&ThreadPool::work, this, ii));
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+
+  void work(size_t index) {
+    worker_pool() = this;
+    worker_queue() = index;
+    while (true) {
+      if (run_one(index)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || num_queued_.load() > 0; });
+      if (stopping_) {
+        return;
+      }
+    }
+  }
+
+  // Runs the newest task of the given queue, or else the oldest task of
+  // another queue; returns false if there was none
+  bool run_one(size_t own) {
+    Task task;
+    if (take(own, true, &task)) {
+      execute(task);
+      return true;
+    }
+    for (size_t ii = 1; ii < queues_.size(); ++ii) {
+      if (take((own + ii) % queues_.size(), false, &task)) {
+        execute(task);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool take(size_t queue, bool newest, Task* task) {
+    std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+    std::deque<Task>& tasks = queues_[queue]->tasks;
+    if (tasks.empty()) {
+      return false;
+    }
+    if (newest) {
+      *task = tasks.back();
+      tasks.pop_back();
+    } else {
+      *task = tasks.front();
+      tasks.pop_front();
+    }
+    num_queued_ -= 1;
+    return true;
+  }
+
+  void execute(const Task& task) {
+    Batch& batch = *task.batch;
+    bool switched = batch.state != 0 && apply_state_ != nullptr;
+    int_fast64_t previous = switched ? apply_state_(batch.state) : 0;
+    try {
+      batch.call(batch.body, task.index);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(batch.error_mutex);
+      if (!batch.error) {
+        batch.error = std::current_exception();
+      }
+    }
+    if (switched) {
+      apply_state_(previous);
+    }
+    // The batch may be gone as soon as its last task is counted.
+    if (batch.remaining.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
+    }
+  }
+};
+
+// Number of threads of the shared pool when first used: the value of the
+// environment variable RCPP_PARALLEL_NUM_THREADS if it is a positive number
+// (the convention of R packages, see RcppParallel::setThreadOptions), and
+// otherwise the number of hardware threads
+inline int_fast32_t default_thread_pool_size() {
+  const char* value = std::getenv("RCPP_PARALLEL_NUM_THREADS");
+  if (value != nullptr) {
+    int_fast32_t size = std::atoi(value);
+    if (size > 0) {
+      return size;
+    }
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// The pool shared by all tables
+inline ThreadPool& thread_pool() {
+  static ThreadPool pool(default_thread_pool_size());
+  return pool;
+}
+
+// Runs f(ii) for each ii in [0, num_tasks) on the shared pool
+template <typename Function>
+void run_in_parallel(int_fast32_t num_tasks, Function f) {
+  thread_pool().run(num_tasks, f);
+}
+
+}  // namespace core
+}  // namespace falconn
+
+#endif
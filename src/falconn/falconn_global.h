@@ -1,6 +1,13 @@
 #ifndef __FALCONN_GLOBAL_H__
 #define __FALCONN_GLOBAL_H__
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
 #include <utility>
 #include <vector>
@@ -72,6 +79,99 @@ struct PointTypeTraits<SparseVector<CoordinateType, IndexT>> {
   typedef IndexT IndexType;
 };
 
+///
+/// Distribution of a nonnegative per-query quantity (a time in seconds or a
+/// number of candidates). The values are counted in logarithmically spaced
+/// buckets, kSubBuckets per power of two, so quantiles are exact up to a
+/// relative error of about 1 / (2 * kSubBuckets). The maximum is exact.
+///
+/// Histograms of the same quantity from different query objects can be
+/// combined with merge().
+///
+class QueryHistogram {
+ public:
+  static const int kSubBuckets = 8;
+  /// Values in [2^kMinExponent, 2^kMaxExponent), plus one bucket for
+  /// smaller values (including zero); larger values go into the last bucket.
+  static const int kMinExponent = -32;
+  static const int kMaxExponent = 32;
+  static const int kNumBuckets =
+      (kMaxExponent - kMinExponent) * kSubBuckets + 1;
+
+  QueryHistogram() { buckets_.fill(0); }
+
+  void add(double value) {
+    buckets_[bucket(value)] += 1;
+    count_ += 1;
+    max_ = std::max(max_, value);
+  }
+
+  void merge(const QueryHistogram& other) {
+    for (int ii = 0; ii < kNumBuckets; ++ii) {
+      buckets_[ii] += other.buckets_[ii];
+    }
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  int_fast64_t count() const { return count_; }
+
+  double max() const { return max_; }
+
+  ///
+  /// Returns the q-quantile (0 <= q <= 1) of the values added, or 0 for an
+  /// empty histogram. The value is the midpoint of the bucket containing the
+  /// quantile, capped at the maximum (and 0 for the bucket of values below
+  /// 2^kMinExponent).
+  ///
+  double quantile(double q) const {
+    if (count_ == 0) {
+      return 0.0;
+    }
+    int_fast64_t rank = static_cast<int_fast64_t>(std::ceil(q * count_));
+    rank = std::min(std::max<int_fast64_t>(rank, 1), count_);
+    int_fast64_t seen = 0;
+    int ii = 0;
+    for (; ii < kNumBuckets - 1; ++ii) {
+      seen += buckets_[ii];
+      if (seen >= rank) {
+        break;
+      }
+    }
+    if (ii == 0) {
+      return 0.0;
+    }
+    double lower = bucket_lower_bound(ii);
+    double upper = bucket_lower_bound(ii + 1);
+    return std::min(max_, (lower + upper) / 2.0);
+  }
+
+ private:
+  std::array<int_fast64_t, kNumBuckets> buckets_;
+  int_fast64_t count_ = 0;
+  double max_ = 0.0;
+
+  static int bucket(double value) {
+    if (!(value >= std::ldexp(1.0, kMinExponent))) {
+      return 0;
+    }
+    int exponent;
+    // value = mantissa * 2^exponent with 0.5 <= mantissa < 1
+    double mantissa = std::frexp(value, &exponent);
+    int sub = static_cast<int>((2.0 * mantissa - 1.0) * kSubBuckets);
+    int64_t index =
+        1 + static_cast<int64_t>(exponent - 1 - kMinExponent) * kSubBuckets +
+        std::min(sub, kSubBuckets - 1);
+    return static_cast<int>(std::min<int64_t>(index, kNumBuckets - 1));
+  }
+
+  static double bucket_lower_bound(int index) {
+    int exponent = kMinExponent + (index - 1) / kSubBuckets;
+    int sub = (index - 1) % kSubBuckets;
+    return std::ldexp(1.0 + static_cast<double>(sub) / kSubBuckets, exponent);
+  }
+};
+
 ///
 /// Data structure for point query statistics
 ///
@@ -100,6 +200,370 @@ struct QueryStatistics {
   /// Average number of *unique* candidates
   ///
   double average_num_unique_candidates = 0;
+
+  ///
+  /// Number of queries, including those whose phases were not measured
+  /// (see QueryInstrumentation). The averages and distributions are over
+  /// the measured queries only, which are counted by the histograms.
+  ///
+  int_fast64_t num_queries = 0;
+
+  ///
+  /// Distributions of the per-query values averaged above
+  ///
+  QueryHistogram total_query_time_histogram;
+  QueryHistogram lsh_time_histogram;
+  QueryHistogram hash_table_time_histogram;
+  QueryHistogram distance_time_histogram;
+  QueryHistogram num_candidates_histogram;
+  QueryHistogram num_unique_candidates_histogram;
+
+  ///
+  /// Queries answered from a cache in front of the query objects, by the
+  /// level that answered them (their results, or their candidates), and
+  /// queries that missed it. These are 0 unless the caller keeps such a
+  /// cache; the queries it answered are not among the queries averaged
+  /// above.
+  ///
+  int_fast64_t num_cache_result_hits = 0;
+  int_fast64_t num_cache_candidate_hits = 0;
+  int_fast64_t num_cache_misses = 0;
+
+  ///
+  /// Adds the histograms of other to the histograms of these statistics
+  /// (the averages are left unchanged)
+  ///
+  void merge_histograms(const QueryStatistics& other) {
+    total_query_time_histogram.merge(other.total_query_time_histogram);
+    lsh_time_histogram.merge(other.lsh_time_histogram);
+    hash_table_time_histogram.merge(other.hash_table_time_histogram);
+    distance_time_histogram.merge(other.distance_time_histogram);
+    num_candidates_histogram.merge(other.num_candidates_histogram);
+    num_unique_candidates_histogram.merge(
+        other.num_unique_candidates_histogram);
+  }
+};
+
+///
+/// What a query object measures about its queries (see
+/// QueryInstrumentation)
+///
+enum class InstrumentationLevel {
+  ///
+  /// Only the number of queries; no clock is read
+  ///
+  None,
+  ///
+  /// The phases of one in every sample_period queries, timed with the
+  /// cycle counter where there is one, go into the query statistics
+  ///
+  Sampled,
+  ///
+  /// The phases of every query go into the query statistics and, as a
+  /// QueryTraceRecord, into a QueryTrace
+  ///
+  Trace
+};
+
+///
+/// The phases of one query, as recorded in a QueryTrace. Times are in
+/// seconds; a phase the query did not go through is -1.
+///
+struct QueryTraceRecord {
+  ///
+  /// Identifier of the query object (see QueryInstrumentation)
+  ///
+  int_fast32_t query_object = 0;
+  ///
+  /// Start of the query, since the trace was created
+  ///
+  double start_time = 0.0;
+  double total_time = 0.0;
+  double lsh_time = -1.0;
+  double hash_table_time = -1.0;
+  double distance_time = -1.0;
+  int_fast64_t num_candidates = -1;
+  int_fast64_t num_unique_candidates = -1;
+};
+
+///
+/// A bounded lock-free queue of the trace records of any number of query
+/// objects, which add records concurrently with each other and with a
+/// reader taking them out. A record that finds the queue full is dropped
+/// (and counted).
+///
+/// The queue is the bounded multi-producer multi-consumer queue of Dmitry
+/// Vyukov: each slot carries a sequence number that tells a writer whether
+/// the slot is free and a reader whether it is filled, so that writers and
+/// readers only contend on the positions they claim.
+///
+class QueryTrace {
+ public:
+  ///
+  /// A queue for at least capacity records (rounded up to a power of two)
+  ///
+  explicit QueryTrace(int_fast64_t capacity)
+      : created_(std::chrono::steady_clock::now()) {
+    size_t size = 2;
+    while (size < static_cast<size_t>(std::max<int_fast64_t>(capacity, 2))) {
+      size *= 2;
+    }
+    slots_.reset(new Slot[size]);
+    mask_ = size - 1;
+    for (size_t ii = 0; ii < size; ++ii) {
+      slots_[ii].sequence.store(ii, std::memory_order_relaxed);
+    }
+  }
+
+  ///
+  /// Adds a record, or drops it if the queue is full. Returns whether the
+  /// record was added.
+  ///
+  bool push(const QueryTraceRecord& record) {
+    size_t pos = tail_.value.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & mask_];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.value.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        num_dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = tail_.value.load(std::memory_order_relaxed);
+      }
+    }
+    slot->record = record;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  ///
+  /// Takes the oldest record out of the queue. Returns false if the queue
+  /// is empty.
+  ///
+  bool pop(QueryTraceRecord* record) {
+    size_t pos = head_.value.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots_[pos & mask_];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.value.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.value.load(std::memory_order_relaxed);
+      }
+    }
+    *record = slot->record;
+    slot->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  ///
+  /// Appends the records in the queue to result, oldest first, and returns
+  /// their number
+  ///
+  int_fast64_t drain(std::vector<QueryTraceRecord>* result) {
+    int_fast64_t count = 0;
+    QueryTraceRecord record;
+    while (pop(&record)) {
+      result->push_back(record);
+      count += 1;
+    }
+    return count;
+  }
+
+  int_fast64_t get_capacity() const { return mask_ + 1; }
+
+  ///
+  /// Number of records dropped because the queue was full
+  ///
+  int_fast64_t get_num_dropped() const {
+    return num_dropped_.load(std::memory_order_relaxed);
+  }
+
+  ///
+  /// Seconds since the trace was created
+  ///
+  double seconds_since_creation() const {
+    return std::chrono::duration_cast<std::chrono::duration<double>>(
+               std::chrono::steady_clock::now() - created_)
+        .count();
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    QueryTraceRecord record;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  std::chrono::steady_clock::time_point created_;
+  // A counter padded to a cache line of its own
+  template <typename T>
+  struct Padded {
+    char before[64];
+    std::atomic<T> value{0};
+    char after[64];
+  };
+
+  // The positions of the writers and of the reader
+  Padded<size_t> tail_;
+  Padded<size_t> head_;
+  std::atomic<int_fast64_t> num_dropped_{0};
+};
+
+///
+/// The instrumentation of a query object (see
+/// LSHNearestNeighborQuery::set_instrumentation). By default, every query
+/// is measured.
+///
+struct QueryInstrumentation {
+  InstrumentationLevel level = InstrumentationLevel::Sampled;
+  ///
+  /// With InstrumentationLevel::Sampled, one in this many queries is
+  /// measured
+  ///
+  int_fast64_t sample_period = 1;
+  ///
+  /// With InstrumentationLevel::Trace, the queue the trace records go to,
+  /// which may be shared by several query objects
+  ///
+  std::shared_ptr<QueryTrace> trace;
+  ///
+  /// Identifies the query object in the trace records
+  ///
+  int_fast32_t query_object = 0;
+};
+
+///
+/// Limits on the work of a single query (see
+/// LSHNearestNeighborQuery::find_k_nearest_neighbors_bounded). A negative
+/// value means no limit. A query that reaches a limit returns the best
+/// candidates found so far.
+///
+struct QueryLimits {
+  ///
+  /// Wall-clock time of the query, in seconds, checked after each block of
+  /// kQueryLimitsDistanceBlock distance computations
+  ///
+  double max_seconds = -1.0;
+  ///
+  /// Number of probes, if smaller than the number of probes of the query
+  /// object
+  ///
+  int_fast64_t max_num_probes = -1;
+  ///
+  /// Number of distances computed (one per unique candidate)
+  ///
+  int_fast64_t max_num_distances = -1;
+};
+
+///
+/// Number of candidates whose distances a bounded query computes between
+/// checks of the time limit
+///
+const int_fast64_t kQueryLimitsDistanceBlock = 64;
+
+///
+/// The keys a filtered query may return (see
+/// LSHNearestNeighborQuery::find_k_nearest_neighbors_filtered): a view of
+/// a bitset over the keys, owned by the caller, who keeps it alive and
+/// unchanged during the query. Key i is accepted if bit i % 64 of word
+/// i / 64 is set; keys beyond the bitset are rejected.
+///
+/// A key map, if set, translates the keys of the table to those of the
+/// bitset first, for tables that know their points in another order.
+///
+class KeyFilter {
+ public:
+  KeyFilter() {}
+
+  KeyFilter(const uint64_t* words, int_fast64_t num_keys)
+      : words_(words), num_keys_(num_keys) {}
+
+  ///
+  /// This filter for a table whose key i is key key_map[i] of the bitset
+  ///
+  KeyFilter with_key_map(const int32_t* key_map) const {
+    KeyFilter result = *this;
+    result.key_map_ = key_map;
+    return result;
+  }
+
+  bool accepts(int_fast64_t key) const {
+    if (key_map_ != nullptr) {
+      key = key_map_[key];
+    }
+    return key >= 0 && key < num_keys_ &&
+           ((words_[key >> 6] >> (key & 63)) & 1) != 0;
+  }
+
+  int_fast64_t get_num_keys() const { return num_keys_; }
+
+ private:
+  const uint64_t* words_ = nullptr;
+  int_fast64_t num_keys_ = 0;
+  const int32_t* key_map_ = nullptr;
+};
+
+///
+/// Memory used by an LSH table, in bytes, broken down by component
+///
+struct MemoryUsage {
+  ///
+  /// Points stored by the table itself (0 for tables that refer to points
+  /// owned by the caller)
+  ///
+  int_fast64_t data_storage = 0;
+  ///
+  /// Parameters of the LSH functions: the hyperplanes, or the random signs
+  /// of the cross polytope rotations (and the feature hashing for sparse
+  /// points)
+  ///
+  int_fast64_t hash_functions = 0;
+  ///
+  /// For each low-level hash table, the bucket directory and the arrays of
+  /// point indices (for tables that store the indices in the buckets, all
+  /// of the memory is counted for the buckets). The arrays of a loaded table
+  /// are pages of the memory-mapped file.
+  ///
+  std::vector<int_fast64_t> hash_table_buckets;
+  std::vector<int_fast64_t> hash_table_entries;
+  ///
+  /// Per-query scratch memory of the query objects, most of it the sets
+  /// used to deduplicate candidates (four bytes per point and query object
+  /// for up to 2^20 points, otherwise growing with the candidates)
+  ///
+  int_fast64_t query_scratch = 0;
+  ///
+  /// Copies of the whole table, data included, kept by the caller on
+  /// other NUMA nodes (0 for a single table)
+  ///
+  int_fast64_t numa_replicas = 0;
+
+  int_fast64_t total() const {
+    int_fast64_t res =
+        data_storage + hash_functions + query_scratch + numa_replicas;
+    for (size_t ii = 0; ii < hash_table_buckets.size(); ++ii) {
+      res += hash_table_buckets[ii] + hash_table_entries[ii];
+    }
+    return res;
+  }
 };
 
 }  // namespace falconn
@@ -4,6 +4,7 @@
 #include <array>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <type_traits>
 #include <vector>
 
@@ -24,6 +25,351 @@ class LSHNearestNeighborTableError : public FalconnError {
   LSHNearestNeighborTableError(const char* msg) : FalconnError(msg) {}
 };
 
+///
+/// A lazy sequence of the candidates of a query point (see
+/// LSHNearestNeighborQuery::get_candidate_sequence).
+///
+template <typename KeyType = int32_t>
+class CandidateCursor {
+ public:
+  ///
+  /// Sets key to the next candidate and returns true, or returns false at
+  /// the end of the sequence.
+  ///
+  virtual bool next(KeyType* key) = 0;
+
+  ///
+  /// Returns the number of probes whose buckets were retrieved so far.
+  ///
+  virtual int_fast64_t get_num_probes() const = 0;
+
+  ///
+  /// Returns the number of candidates seen so far, counting duplicates
+  /// (also for a sequence of unique candidates).
+  ///
+  virtual int_fast64_t get_num_candidates() const = 0;
+
+  virtual ~CandidateCursor() {}
+};
+
+///
+/// Interface for a single query object. A query object owns all the per-query
+/// scratch memory (candidate buffers, heaps, multiprobe state), while the
+/// underlying LSH table is shared and read-only. Hence different query objects
+/// constructed from the same table can be used concurrently from different
+/// threads, but a single query object must only be used by one thread at a
+/// time.
+///
+/// The query objects are created with LSHNearestNeighborTable::
+/// construct_query_object() and must not outlive the table they were
+/// constructed from.
+///
+template <typename PointType, typename KeyType = int32_t>
+class LSHNearestNeighborQuery {
+ public:
+  ///
+  /// Sets the number of probes used for each query (see
+  /// LSHNearestNeighborTable::set_num_probes).
+  ///
+  virtual void set_num_probes(int_fast64_t num_probes) = 0;
+  ///
+  /// Returns the number of probes used for each query.
+  ///
+  virtual int_fast64_t get_num_probes() = 0;
+
+  ///
+  /// Sets the maximum number of candidates considered in each query (see
+  /// LSHNearestNeighborTable::set_max_num_candidates).
+  ///
+  virtual void set_max_num_candidates(int_fast64_t max_num_candidates) = 0;
+  ///
+  /// Returns the maximum number of candidates considered in each query.
+  ///
+  virtual int_fast64_t get_max_num_candidates() = 0;
+
+  ///
+  /// Finds the key of the closest candidate in the probing sequence for q.
+  ///
+  virtual KeyType find_nearest_neighbor(const PointType& q) = 0;
+
+  ///
+  /// Find the keys of the k closest candidates in the probing sequence for q.
+  /// The keys are returned in order of increasing distance to q.
+  ///
+  virtual void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
+                                        std::vector<KeyType>* result) = 0;
+
+  ///
+  /// Like find_k_nearest_neighbors, but also sets distances to the distances
+  /// between q and the points of the keys in result, in the same order. The
+  /// distances are those computed to rank the candidates.
+  ///
+  virtual void find_k_nearest_neighbors(
+      const PointType& q, int_fast64_t k, std::vector<KeyType>* result,
+      std::vector<typename PointTypeTraits<PointType>::ScalarType>*
+          distances) = 0;
+
+  ///
+  /// Like find_k_nearest_neighbors, but stops once the query reaches one of
+  /// the limits (on its time, probes, or distance computations). The
+  /// candidates are walked lazily (see get_candidate_sequence), and the
+  /// result holds the k closest candidates seen, in order of increasing
+  /// distance. Returns true if a limit stopped the query before it saw all
+  /// of its candidates.
+  ///
+  virtual bool find_k_nearest_neighbors_bounded(
+      const PointType& q, int_fast64_t k, const QueryLimits& limits,
+      std::vector<KeyType>* result) = 0;
+
+  ///
+  /// Like find_k_nearest_neighbors, but only returns keys that the filter
+  /// accepts. The filter is applied to the candidates as they are
+  /// retrieved, so no distance is computed for the others. If fewer than k
+  /// candidates are accepted within the probes of this query object, more
+  /// probes are made, up to max_num_probes in all, until k are. The
+  /// maximum number of candidates applies to the accepted candidates.
+  /// distances may be nullptr.
+  ///
+  virtual void find_k_nearest_neighbors_filtered(
+      const PointType& q, int_fast64_t k, const KeyFilter& filter,
+      int_fast64_t max_num_probes, std::vector<KeyType>* result,
+      std::vector<typename PointTypeTraits<PointType>::ScalarType>*
+          distances) = 0;
+
+  ///
+  /// Returns the keys corresponding to candidates in the probing sequence for q
+  /// that have distance at most threshold.
+  ///
+  virtual void find_near_neighbors(
+      const PointType& q,
+      typename PointTypeTraits<PointType>::ScalarType threshold,
+      std::vector<KeyType>* result) = 0;
+
+  ///
+  /// Like find_near_neighbors, but also sets distances to the distances
+  /// between q and the points of the keys in result, in the same order.
+  ///
+  virtual void find_near_neighbors(
+      const PointType& q,
+      typename PointTypeTraits<PointType>::ScalarType threshold,
+      std::vector<KeyType>* result,
+      std::vector<typename PointTypeTraits<PointType>::ScalarType>*
+          distances) = 0;
+
+  ///
+  /// Returns the keys of all candidates in the probing sequence for q,
+  /// including duplicates.
+  ///
+  virtual void get_candidates_with_duplicates(const PointType& q,
+                                              std::vector<KeyType>* result) = 0;
+
+  ///
+  /// Returns the keys of all candidates in the probing sequence for q,
+  /// without duplicates.
+  ///
+  virtual void get_unique_candidates(const PointType& q,
+                                     std::vector<KeyType>* result) = 0;
+
+  ///
+  /// Starts a lazy walk over the candidates of q, including duplicates.
+  /// Probes are generated in the order of the probing sequence and their
+  /// buckets retrieved only as the cursor advances, so a caller can stop as
+  /// soon as it has seen enough candidates. One bucket per hash table is
+  /// open at a time, and the candidates are taken from the open buckets in
+  /// turn, a few at a time, so that a heavy bucket does not crowd out the
+  /// other tables; this is also the order in which the maximum number of
+  /// candidates takes them. All probes up to the number of probes of this
+  /// query object are walked; the maximum number of candidates is ignored,
+  /// and the query statistics are not updated.
+  ///
+  /// The cursor belongs to this query object and is valid until the next
+  /// query made with it.
+  ///
+  virtual CandidateCursor<KeyType>& get_candidate_sequence(
+      const PointType& q) = 0;
+
+  ///
+  /// Like get_candidate_sequence, but returns each key once.
+  ///
+  virtual CandidateCursor<KeyType>& get_unique_candidate_sequence(
+      const PointType& q) = 0;
+
+  ///
+  /// Returns the smallest number of probes for which key is among the
+  /// candidates for q, or -1 if it is not found with max_num_probes probes.
+  /// The probing sequence is walked once and only until key is found, so
+  /// this tells whether q finds key for every number of probes up to
+  /// max_num_probes at the cost of at most one query with max_num_probes
+  /// probes. The maximum number of candidates is ignored, and the query
+  /// statistics are not updated.
+  ///
+  virtual int_fast64_t get_num_probes_to_find(const PointType& q, KeyType key,
+                                              int_fast64_t max_num_probes) = 0;
+
+  ///
+  /// Hashes q and prefetches the hash buckets of its probes, to be queried
+  /// next (or after a few other prefetched points) by this query object.
+  /// Batches of queries call this for the queries a few steps ahead so that
+  /// the cache misses of several queries overlap. The points prefetched and
+  /// not yet queried form a queue: querying its oldest point uses the probes
+  /// computed here, and querying any other point drops it. Prefetching does
+  /// nothing for dynamic tables and with a maximum number of candidates.
+  ///
+  virtual void prefetch(const PointType& q) = 0;
+
+  ///
+  /// Returns the hash of q in each table, i.e., its first probe there. The
+  /// hashes determine the candidates of q with one probe per table, so they
+  /// can serve as a key under which to cache these candidates (see
+  /// get_unique_candidates_by_hashes). Drops the queue of prefetched points.
+  ///
+  virtual void get_hashes(const PointType& q, std::vector<uint64_t>* hashes) = 0;
+
+  ///
+  /// Returns the unique candidates in the buckets with the given hashes,
+  /// one per table as returned by get_hashes. These are the unique
+  /// candidates of any point with these hashes for one probe per table and
+  /// no maximum number of candidates, in the same order. The query
+  /// statistics count this and the preceding get_hashes as one query.
+  ///
+  virtual void get_unique_candidates_by_hashes(
+      const std::vector<uint64_t>& hashes, std::vector<KeyType>* result) = 0;
+
+  ///
+  /// Resets the query statistics of this query object.
+  ///
+  virtual void reset_query_statistics() = 0;
+
+  ///
+  /// Returns the query statistics of this query object.
+  ///
+  virtual QueryStatistics get_query_statistics() = 0;
+
+  ///
+  /// Sets what this query object measures about its queries from now on
+  /// (see QueryInstrumentation). Query objects measure one query in each
+  /// by default, as with InstrumentationLevel::Sampled and a sample period
+  /// of 1.
+  ///
+  virtual void set_instrumentation(
+      const QueryInstrumentation& instrumentation) = 0;
+
+  ///
+  /// Returns the bytes of scratch memory held by this query object (see
+  /// MemoryUsage::query_scratch).
+  ///
+  virtual int_fast64_t get_memory_usage() const = 0;
+
+  ///
+  /// Virtual destructor.
+  ///
+  virtual ~LSHNearestNeighborQuery() {}
+};
+
+///
+/// A thread-safe pool of query objects. All methods can be called
+/// concurrently from any number of threads: each call acquires one of the
+/// query objects in the pool for its duration (spinning if all of them are in
+/// use). The number of query objects should usually be the number of threads
+/// issuing queries.
+///
+/// The query pools are created with LSHNearestNeighborTable::
+/// construct_query_pool() and must not outlive the table they were
+/// constructed from.
+///
+template <typename PointType, typename KeyType = int32_t>
+class LSHNearestNeighborQueryPool {
+ public:
+  ///
+  /// Sets the number of probes for all query objects in the pool. This must
+  /// not be called concurrently with queries.
+  ///
+  virtual void set_num_probes(int_fast64_t num_probes) = 0;
+  ///
+  /// Returns the number of probes used for each query.
+  ///
+  virtual int_fast64_t get_num_probes() = 0;
+
+  ///
+  /// Sets the maximum number of candidates for all query objects in the pool.
+  /// This must not be called concurrently with queries.
+  ///
+  virtual void set_max_num_candidates(int_fast64_t max_num_candidates) = 0;
+  ///
+  /// Returns the maximum number of candidates considered in each query.
+  ///
+  virtual int_fast64_t get_max_num_candidates() = 0;
+
+  ///
+  /// Returns the number of query objects in the pool.
+  ///
+  virtual int_fast64_t get_num_query_objects() = 0;
+
+  virtual KeyType find_nearest_neighbor(const PointType& q) = 0;
+
+  virtual void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
+                                        std::vector<KeyType>* result) = 0;
+
+  virtual void find_k_nearest_neighbors(
+      const PointType& q, int_fast64_t k, std::vector<KeyType>* result,
+      std::vector<typename PointTypeTraits<PointType>::ScalarType>*
+          distances) = 0;
+
+  virtual bool find_k_nearest_neighbors_bounded(
+      const PointType& q, int_fast64_t k, const QueryLimits& limits,
+      std::vector<KeyType>* result) = 0;
+
+  virtual void find_k_nearest_neighbors_filtered(
+      const PointType& q, int_fast64_t k, const KeyFilter& filter,
+      int_fast64_t max_num_probes, std::vector<KeyType>* result,
+      std::vector<typename PointTypeTraits<PointType>::ScalarType>*
+          distances) = 0;
+
+  virtual void find_near_neighbors(
+      const PointType& q,
+      typename PointTypeTraits<PointType>::ScalarType threshold,
+      std::vector<KeyType>* result) = 0;
+
+  virtual void find_near_neighbors(
+      const PointType& q,
+      typename PointTypeTraits<PointType>::ScalarType threshold,
+      std::vector<KeyType>* result,
+      std::vector<typename PointTypeTraits<PointType>::ScalarType>*
+          distances) = 0;
+
+  virtual void get_candidates_with_duplicates(const PointType& q,
+                                              std::vector<KeyType>* result) = 0;
+
+  virtual void get_unique_candidates(const PointType& q,
+                                     std::vector<KeyType>* result) = 0;
+
+  virtual int_fast64_t get_num_probes_to_find(const PointType& q, KeyType key,
+                                              int_fast64_t max_num_probes) = 0;
+
+  ///
+  /// Resets the query statistics of all query objects in the pool.
+  ///
+  virtual void reset_query_statistics() = 0;
+
+  ///
+  /// Returns the query statistics averaged over all query objects in the
+  /// pool (weighted by the number of queries each of them measured).
+  ///
+  virtual QueryStatistics get_query_statistics() = 0;
+
+  ///
+  /// Sets the instrumentation of all query objects in the pool, numbering
+  /// them in the trace records from 0.
+  ///
+  virtual void set_instrumentation(
+      const QueryInstrumentation& instrumentation) = 0;
+
+  ///
+  /// Virtual destructor.
+  ///
+  virtual ~LSHNearestNeighborQueryPool() {}
+};
+
 ///
 /// Common interface shared by all LSH table wrappers.
 ///
@@ -118,12 +464,125 @@ class LSHNearestNeighborTable {
   ///
   virtual QueryStatistics get_query_statistics() = 0;
 
+  ///
+  /// Returns the memory used by the table, by component. The query scratch
+  /// is that of the table's own query object (the methods above); query
+  /// objects constructed from the table report theirs separately.
+  ///
+  virtual MemoryUsage get_memory_usage() const = 0;
+
+  ///
+  /// Returns the buckets of one of the l hash tables, skipping empty ones.
+  /// The keys of all buckets are stored one bucket after the other in keys,
+  /// and bucket ii consists of (*keys)[(*bucket_starts)[ii]], ...,
+  /// (*keys)[(*bucket_starts)[ii + 1] - 1]. Every point of the table is in
+  /// exactly one bucket of each hash table, so this gives the points that
+  /// collide with each other without hashing them again.
+  ///
+  virtual void get_buckets(int_fast32_t table, std::vector<KeyType>* keys,
+                           std::vector<int_fast64_t>* bucket_starts) const = 0;
+
+  ///
+  /// Returns the number of keys in each bucket of one of the l hash tables,
+  /// skipping empty ones, in the order of get_buckets but without copying
+  /// the keys. The sizes show how skewed the buckets are: a query whose
+  /// probe lands in a heavy bucket retrieves all of its keys.
+  ///
+  virtual void get_bucket_sizes(int_fast32_t table,
+                                std::vector<int_fast64_t>* sizes) const = 0;
+
+  ///
+  /// Constructs a new query object for this table. The query object is
+  /// independent of the query state of the table itself (the methods above)
+  /// and of all other query objects, so several query objects can be used
+  /// concurrently from different threads.
+  ///
+  /// A negative num_probes or max_num_candidates means that the current
+  /// setting of the table is used.
+  ///
+  virtual std::unique_ptr<LSHNearestNeighborQuery<PointType, KeyType>>
+  construct_query_object(int_fast64_t num_probes = -1,
+                         int_fast64_t max_num_candidates = -1) const = 0;
+
+  ///
+  /// Constructs a thread-safe pool of num_query_objects query objects.
+  /// A value of 0 for num_query_objects means that the number of available
+  /// hardware threads is used (or 1 if this number cannot be determined).
+  ///
+  virtual std::unique_ptr<LSHNearestNeighborQueryPool<PointType, KeyType>>
+  construct_query_pool(int_fast64_t num_probes = -1,
+                       int_fast64_t max_num_candidates = -1,
+                       int_fast64_t num_query_objects = 0) const = 0;
+
+  ///
+  /// Writes the table to a binary file: the construction parameters, the
+  /// parameters of the hash functions, the low-level hash tables, and the
+  /// current number of probes and maximum number of candidates. The data
+  /// points are *not* included; see load_table.
+  ///
+  virtual void save(const std::string& filename) const = 0;
+
   ///
   /// Virtual destructor.
   ///
   virtual ~LSHNearestNeighborTable() {}
 };
 
+///
+/// Interface for an LSH table whose point set can change after it has been set
+/// up (see construct_dynamic_table). The table owns a copy of its points, and
+/// the key of a point is its insertion index: the initial points have keys
+/// 0, ..., n - 1 and inserted points get the next unused keys. Keys of removed
+/// points are not reused, so the keys of the other points never change.
+///
+/// Inserting and removing points invalidates no query objects, but must not
+/// happen concurrently with any query.
+///
+template <typename PointType, typename KeyType = int32_t>
+class LSHNearestNeighborDynamicTable
+    : public LSHNearestNeighborTable<PointType, KeyType> {
+ public:
+  ///
+  /// Adds a point to the table and returns its key. This takes amortized
+  /// O(l) low-level hash table operations (plus evaluating the hash
+  /// functions).
+  ///
+  virtual KeyType insert(const PointType& p) = 0;
+
+  ///
+  /// Removes the point with the given key from the table. The entries of the
+  /// point in the low-level hash tables are marked as deleted and reclaimed
+  /// when the tables are next rehashed; the coordinates of the point stay in
+  /// the table's storage so that the keys remain stable.
+  ///
+  virtual void remove(KeyType key) = 0;
+
+  ///
+  /// Returns whether the key belongs to a point currently in the table.
+  ///
+  virtual bool contains(KeyType key) const = 0;
+
+  ///
+  /// Returns the number of points currently in the table.
+  ///
+  virtual int_fast64_t get_num_points() const = 0;
+
+  ///
+  /// Returns one more than the largest key assigned so far.
+  ///
+  virtual int_fast64_t get_key_range() const = 0;
+
+  ///
+  /// Copies the point with the given key (which may have been removed).
+  ///
+  virtual void get_point(KeyType key, PointType* result) const = 0;
+
+  ///
+  /// Virtual destructor.
+  ///
+  virtual ~LSHNearestNeighborDynamicTable() {}
+};
+
 ///
 /// Supported LSH families.
 ///
@@ -213,12 +672,65 @@ enum class StorageHashTable {
   /// *linear probing* is used. This option is recommended if the number of
   /// bins is much higher than the number of points.
   ///
-  LinearProbingHashTable = 4
+  LinearProbingHashTable = 4,
+  ///
+  /// The same as FlatHashTable, but the points of a bucket are stored as
+  /// differences of consecutive indices in a variable-length byte code, which
+  /// is decoded while the bucket is retrieved. This option takes the least
+  /// space when the buckets hold many points.
+  ///
+  CompressedFlatHashTable = 5,
+  ///
+  /// The same as FlatHashTable, but each bucket takes one 64-byte cache line
+  /// that holds its points when there are at most 15 of them, so that
+  /// retrieving a small bucket costs a single cache miss. This option can be
+  /// the fastest when the tables are much larger than the processor cache
+  /// and the number of bins is about the number of points or lower, at the
+  /// cost of 64 bytes per bin.
+  ///
+  InlineFlatHashTable = 6
 };
 
-static const std::array<const char*, 5> kStorageHashTableStrings = {
+static const std::array<const char*, 7> kStorageHashTableStrings = {
     "unknown", "flat_hash_table", "bit_packed_flat_hash_table",
-    "stl_hash_table", "linear_probing_hash_table"};
+    "stl_hash_table", "linear_probing_hash_table",
+    "compressed_flat_hash_table", "inline_flat_hash_table"};
+
+///
+/// Supported transformations of the data points and queries before they are
+/// hashed. Distances are always computed between the original points.
+///
+enum class DataTransformation {
+  ///
+  /// The points and queries are hashed as they are.
+  ///
+  Identity = 0,
+
+  ///
+  /// Reduces maximum inner product search over points of any norm to
+  /// angular search, as proposed in
+  ///
+  /// "On Symmetric and Asymmetric LSHs for Inner Product Search",
+  /// Behnam Neyshabur, Nathan Srebro
+  /// ICML 2015
+  ///
+  /// Each data point p is scaled by 1 / M, where M is the largest norm of the
+  /// data points, and extended by the coordinate sqrt(1 - |p|^2 / M^2), so
+  /// that all points lie on the unit sphere; each query q is extended by 0.
+  /// The inner product of the extended vectors is then <p, q> / M, and the
+  /// points closest in angle to the extended query are those with the
+  /// largest inner products with q. The points are extended one at a time
+  /// while they are hashed, so the data is not copied, and the hash functions
+  /// have dimension one more than the points.
+  ///
+  /// Requires dense points, the negative inner product distance and a static
+  /// table.
+  ///
+  AsymmetricMips = 1
+};
+
+static const std::array<const char*, 2> kDataTransformationStrings = {
+    "identity", "asymmetric_mips"};
 
 ///
 /// Contains the parameters for constructing a LSH table wrapper. Not all fields
@@ -252,9 +764,10 @@ struct LSHConstructionParameters {
   StorageHashTable storage_hash_table = StorageHashTable::Unknown;
   ///
   /// Number of threads used to set up the hash table.
-  /// Zero indicates that FALCONN should use the maximum number of available
-  /// hardware threads (or 1 if this number cannot be determined).
-  /// The number of threads used is always at most the number of tables l.
+  /// Zero indicates that FALCONN should use all threads of its shared thread
+  /// pool (see core::thread_pool), which by default has one thread per
+  /// hardware thread. The setup runs on that pool, so no more threads than it
+  /// has run at once.
   ///
   int_fast32_t num_setup_threads = -1;
   ///
@@ -283,6 +796,10 @@ struct LSHConstructionParameters {
   /// The value -1 indicates that no feature hashing is performed.
   ///
   int_fast32_t feature_hashing_dimension = -1;
+  ///
+  /// Transformation of the points and queries before they are hashed.
+  ///
+  DataTransformation data_transformation = DataTransformation::Identity;
 };
 
 ///
@@ -369,6 +886,88 @@ template <typename PointType, typename KeyType = int32_t,
 std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> construct_table(
     const PointSet& points, const LSHConstructionParameters& params);
 
+///
+/// Function for constructing a dynamic LSH table wrapper, which supports
+/// inserting and removing points after construction. Only DenseVector points
+/// are supported. The initial points are copied into the table, so the points
+/// object need not outlive it; points may be empty. The low-level hash tables
+/// are linear probing hash tables that grow with the number of points, and
+/// params.storage_hash_table is ignored.
+///
+/// Dynamic tables cannot be saved.
+///
+/// The caller assumes ownership of the returned pointer.
+///
+template <typename PointType, typename KeyType = int32_t,
+          typename PointSet = std::vector<PointType>>
+std::unique_ptr<LSHNearestNeighborDynamicTable<PointType, KeyType>>
+construct_dynamic_table(const PointSet& points,
+                        const LSHConstructionParameters& params);
+
+///
+/// Predicts the memory usage (see LSHNearestNeighborTable::get_memory_usage)
+/// of a table constructed with construct_table, or with
+/// construct_dynamic_table if dynamic is true, for num_points points and the
+/// given parameters, without constructing it. The estimate is exact for the
+/// flat, bit-packed, and linear probing hash tables; for the STL hash table,
+/// it counts the nodes without allocator overhead. The query scratch is that
+/// of a single query object, not counting the buffers that grow with the
+/// number of candidates of the queries made.
+///
+template <typename PointType, typename KeyType = int32_t>
+MemoryUsage estimate_memory_usage(int_fast64_t num_points,
+                                  const LSHConstructionParameters& params,
+                                  bool dynamic = false);
+
+///
+/// Describes a table saved with LSHNearestNeighborTable::save, so that the
+/// matching PointType and KeyType can be chosen before calling load_table.
+///
+struct SavedTableInfo {
+  ///
+  /// Whether the table is for SparseVector (rather than DenseVector) points.
+  ///
+  bool sparse;
+  ///
+  /// Size in bytes of the coordinate type (4 for float, 8 for double).
+  ///
+  int_fast32_t coordinate_size;
+  ///
+  /// Size in bytes of the key type.
+  ///
+  int_fast32_t key_size;
+  LSHConstructionParameters params;
+  int_fast64_t num_points;
+  int_fast64_t num_probes;
+  int_fast64_t max_num_candidates;
+};
+
+///
+/// Reads the header of a saved table.
+///
+inline SavedTableInfo inspect_saved_table(const std::string& filename);
+
+///
+/// Function for loading an LSH table saved with LSHNearestNeighborTable::save.
+/// The points must be the same points (in the same order) for which the table
+/// was originally constructed; their number and dimension are checked against
+/// the file. PointType and KeyType must also match the saved table.
+///
+/// The file is memory-mapped where the platform supports it, and the
+/// low-level hash tables refer to the mapping directly instead of being
+/// copied, so loading a table is much faster than constructing it. (The STL
+/// hash table is the exception: it is rebuilt from the file.) The mapping is
+/// released when the table is destroyed.
+///
+/// The points object *must* stay valid for the lifetime of the LSH table.
+///
+/// The caller assumes ownership of the returned pointer.
+///
+template <typename PointType, typename KeyType = int32_t,
+          typename PointSet = std::vector<PointType>>
+std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> load_table(
+    const PointSet& points, const std::string& filename);
+
 }  // namespace falconn
 
 #include "wrapper/cpp_wrapper_impl.h"
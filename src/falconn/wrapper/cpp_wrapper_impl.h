@@ -1,19 +1,26 @@
 #ifndef __CPP_WRAPPER_IMPL_H__
 #define __CPP_WRAPPER_IMPL_H__
 
+#include <atomic>
+#include <limits>
+#include <thread>
 #include <type_traits>
 
 #include "../core/bit_packed_flat_hash_table.h"
+#include "../core/compressed_flat_hash_table.h"
 #include "../core/composite_hash_table.h"
 #include "../core/cosine_distance.h"
 #include "../core/data_storage.h"
+#include "../core/data_transformation.h"
 #include "../core/euclidean_distance.h"
 #include "../core/flat_hash_table.h"
 #include "../core/hyperplane_hash.h"
+#include "../core/inline_flat_hash_table.h"
 #include "../core/lsh_table.h"
 #include "../core/nn_query.h"
 #include "../core/polytope_hash.h"
 #include "../core/probing_hash_table.h"
+#include "../core/serialization.h"
 #include "../core/stl_hash_table.h"
 
 namespace falconn {
@@ -28,6 +35,7 @@ struct PointTypeTraitsInternal {};
 template <typename CoordinateType>
 class PointTypeTraitsInternal<DenseVector<CoordinateType>> {
  public:
+  static int32_t serialization_tag() { return 1; }
   typedef core::CosineDistanceDense<CoordinateType> CosineDistance;
   typedef core::EuclideanDistanceDense<CoordinateType> EuclideanDistance;
   template <typename HashType>
@@ -43,11 +51,19 @@ class PointTypeTraitsInternal<DenseVector<CoordinateType>> {
         params.last_cp_dimension, params.seed ^ 93384688));
     return std::move(res);
   }
+
+  template <typename HashType>
+  static int_fast64_t estimate_cp_hash_memory_usage(
+      const LSHConstructionParameters& params) {
+    return CPHash<HashType>::estimate_memory_usage(
+        params.dimension, params.k, params.l, params.num_rotations);
+  }
 };
 
 template <typename CoordinateType, typename IndexType>
 class PointTypeTraitsInternal<SparseVector<CoordinateType, IndexType>> {
  public:
+  static int32_t serialization_tag() { return 2; }
   typedef core::CosineDistanceSparse<CoordinateType, IndexType> CosineDistance;
   typedef core::EuclideanDistanceSparse<CoordinateType, IndexType>
       EuclideanDistance;
@@ -67,6 +83,14 @@ class PointTypeTraitsInternal<SparseVector<CoordinateType, IndexType>> {
         params.seed ^ 93384688));
     return std::move(res);
   }
+
+  template <typename HashType>
+  static int_fast64_t estimate_cp_hash_memory_usage(
+      const LSHConstructionParameters& params) {
+    return CPHash<HashType>::estimate_memory_usage(
+        params.dimension, params.k, params.l, params.num_rotations,
+        params.feature_hashing_dimension);
+  }
 };
 
 template <typename PointSet>
@@ -157,12 +181,13 @@ struct ComputeNumberOfHashFunctions<SparseVector<CoordinateType, IndexType>> {
             "Feature hashing dimension must be set to "
             "determine  the number of sparse cross polytope hash functions.");
       }
-      // TODO: add check here for power-of-two feature hashing dimension
-      // (or allow non-power-of-two feature hashing dimension in the CP hash)
-      int_fast32_t rotation_dim =
-          core::find_next_power_of_two(params->feature_hashing_dimension);
+      if (core::find_next_power_of_two(params->feature_hashing_dimension) !=
+          params->feature_hashing_dimension) {
+        throw LSHNNTableSetupError(
+            "Feature hashing dimension must be a power of two.");
+      }
       core::cp_hash_helpers::compute_k_parameters_for_bits(
-          rotation_dim, number_of_hash_bits, &(params->k),
+          params->feature_hashing_dimension, number_of_hash_bits, &(params->k),
           &(params->last_cp_dimension));
     } else {
       throw LSHNNTableSetupError(
@@ -316,26 +341,26 @@ struct GetDefaultParameters<SparseVector<CoordinateType>> {
 };
 
 template <typename PointType, typename KeyType, typename DistanceType,
-          typename DistanceFunction, typename LSHTable, typename LSHFunction,
-          typename HashTableFactory, typename CompositeHashTable,
-          typename NNQuery, typename DataStorage>
-class LSHNNTableWrapper : public LSHNearestNeighborTable<PointType, KeyType> {
+          typename LSHTable, typename NNQuery,
+          typename Transformation = core::IdentityTransformation<PointType>>
+class LSHNNQueryWrapper : public LSHNearestNeighborQuery<PointType, KeyType> {
  public:
-  LSHNNTableWrapper(std::unique_ptr<LSHFunction> lsh,
-                    std::unique_ptr<LSHTable> lsh_table,
-                    std::unique_ptr<HashTableFactory> hash_table_factory,
-                    std::unique_ptr<CompositeHashTable> composite_hash_table,
-                    std::unique_ptr<typename LSHTable::Query> query,
-                    std::unique_ptr<NNQuery> nn_query,
-                    std::unique_ptr<DataStorage> data_storage)
-      : lsh_(std::move(lsh)),
-        lsh_table_(std::move(lsh_table)),
-        hash_table_factory_(std::move(hash_table_factory)),
-        composite_hash_table_(std::move(composite_hash_table)),
-        query_(std::move(query)),
-        nn_query_(std::move(nn_query)),
-        data_storage_(std::move(data_storage)) {
-    num_probes_ = lsh_->get_l();
+  // The queries are hashed as transformed by transformation (see
+  // LSHConstructionParameters::data_transformation), but compared with the
+  // data points as they are.
+  template <typename DataStorage>
+  LSHNNQueryWrapper(const LSHTable& parent, const DataStorage& data_storage,
+                    int_fast64_t num_probes, int_fast64_t max_num_candidates,
+                    const Transformation& transformation = Transformation())
+      : transformation_(transformation),
+        num_probes_(num_probes),
+        max_num_candidates_(max_num_candidates) {
+    if (num_probes <= 0) {
+      throw LSHNearestNeighborTableError(
+          "Number of probes must be at least 1.");
+    }
+    query_.reset(new typename LSHTable::Query(parent));
+    nn_query_.reset(new NNQuery(query_.get(), data_storage));
   }
 
   void set_num_probes(int_fast64_t num_probes) {
@@ -355,30 +380,95 @@ class LSHNNTableWrapper : public LSHNearestNeighborTable<PointType, KeyType> {
   int_fast64_t get_max_num_candidates() { return max_num_candidates_; }
 
   KeyType find_nearest_neighbor(const PointType& q) {
-    return nn_query_->find_nearest_neighbor(q, q, num_probes_,
+    return nn_query_->find_nearest_neighbor(lsh_point(q), q, num_probes_,
                                             max_num_candidates_);
   }
 
   void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
                                 std::vector<KeyType>* result) {
-    nn_query_->find_k_nearest_neighbors(q, q, k, num_probes_,
+    nn_query_->find_k_nearest_neighbors(lsh_point(q), q, k, num_probes_,
                                         max_num_candidates_, result);
   }
 
+  void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
+                                std::vector<KeyType>* result,
+                                std::vector<DistanceType>* distances) {
+    nn_query_->find_k_nearest_neighbors(lsh_point(q), q, k, num_probes_,
+                                        max_num_candidates_, result,
+                                        distances);
+  }
+
+  bool find_k_nearest_neighbors_bounded(const PointType& q, int_fast64_t k,
+                                        const QueryLimits& limits,
+                                        std::vector<KeyType>* result) {
+    return nn_query_->find_k_nearest_neighbors_bounded(
+        lsh_point(q), q, k, num_probes_, max_num_candidates_, limits, result);
+  }
+
+  void find_k_nearest_neighbors_filtered(const PointType& q, int_fast64_t k,
+                                         const KeyFilter& filter,
+                                         int_fast64_t max_num_probes,
+                                         std::vector<KeyType>* result,
+                                         std::vector<DistanceType>* distances) {
+    nn_query_->find_k_nearest_neighbors_filtered(
+        lsh_point(q), q, k, num_probes_, max_num_probes, max_num_candidates_,
+        filter, result, distances);
+  }
+
   void find_near_neighbors(const PointType& q, DistanceType threshold,
                            std::vector<KeyType>* result) {
-    nn_query_->find_near_neighbors(q, q, threshold, num_probes_,
+    nn_query_->find_near_neighbors(lsh_point(q), q, threshold, num_probes_,
                                    max_num_candidates_, result);
   }
 
+  void find_near_neighbors(const PointType& q, DistanceType threshold,
+                           std::vector<KeyType>* result,
+                           std::vector<DistanceType>* distances) {
+    nn_query_->find_near_neighbors(lsh_point(q), q, threshold, num_probes_,
+                                   max_num_candidates_, result, distances);
+  }
+
   void get_candidates_with_duplicates(const PointType& q,
                                       std::vector<KeyType>* result) {
-    query_->get_candidates_with_duplicates(q, num_probes_, max_num_candidates_,
-                                           result);
+    query_->get_candidates_with_duplicates(lsh_point(q), num_probes_,
+                                           max_num_candidates_, result);
   }
 
   void get_unique_candidates(const PointType& q, std::vector<KeyType>* result) {
-    query_->get_unique_candidates(q, num_probes_, max_num_candidates_, result);
+    query_->get_unique_candidates(lsh_point(q), num_probes_,
+                                  max_num_candidates_, result);
+  }
+
+  int_fast64_t get_num_probes_to_find(const PointType& q, KeyType key,
+                                      int_fast64_t max_num_probes) {
+    return query_->get_num_probes_to_find(lsh_point(q), key, max_num_probes);
+  }
+
+  CandidateCursor<KeyType>& get_candidate_sequence(const PointType& q) {
+    cursor_.sequence_ =
+        &query_->get_candidate_sequence(lsh_point(q), num_probes_);
+    return cursor_;
+  }
+
+  CandidateCursor<KeyType>& get_unique_candidate_sequence(const PointType& q) {
+    cursor_.sequence_ =
+        &query_->get_unique_candidate_sequence(lsh_point(q), num_probes_);
+    return cursor_;
+  }
+
+  void prefetch(const PointType& q) {
+    if (max_num_candidates_ < 0) {
+      query_->prefetch(lsh_point(q), num_probes_);
+    }
+  }
+
+  void get_hashes(const PointType& q, std::vector<uint64_t>* hashes) {
+    query_->get_hashes(lsh_point(q), hashes);
+  }
+
+  void get_unique_candidates_by_hashes(const std::vector<uint64_t>& hashes,
+                                       std::vector<KeyType>* result) {
+    query_->get_unique_candidates_by_hashes(hashes, result);
   }
 
   void reset_query_statistics() { nn_query_->reset_query_statistics(); }
@@ -387,34 +477,673 @@ class LSHNNTableWrapper : public LSHNearestNeighborTable<PointType, KeyType> {
     return nn_query_->get_query_statistics();
   }
 
+  int_fast64_t get_num_queries() { return nn_query_->get_num_queries(); }
+
+  void set_instrumentation(const QueryInstrumentation& instrumentation) {
+    nn_query_->set_instrumentation(instrumentation);
+  }
+
+  int_fast64_t get_memory_usage() const {
+    return nn_query_->get_memory_usage();
+  }
+
+  ~LSHNNQueryWrapper() {}
+
+ protected:
+  // The candidate sequence of the table query behind the cursor interface
+  class Cursor : public CandidateCursor<KeyType> {
+   public:
+    bool next(KeyType* key) { return sequence_->next(key); }
+    int_fast64_t get_num_probes() const { return sequence_->get_num_probes(); }
+    int_fast64_t get_num_candidates() const {
+      return sequence_->get_num_candidates();
+    }
+
+    typename LSHTable::Query::CandidateSequenceType* sequence_ = nullptr;
+  };
+
+  const PointType& lsh_point(const PointType& q) {
+    return transformation_.apply_to_query(q, &lsh_point_);
+  }
+
+  std::unique_ptr<typename LSHTable::Query> query_;
+  std::unique_ptr<NNQuery> nn_query_;
+  Cursor cursor_;
+  Transformation transformation_;
+  PointType lsh_point_;
+
+  int_fast64_t num_probes_;
+  int_fast64_t max_num_candidates_;
+};
+
+template <typename PointType, typename KeyType, typename DistanceType,
+          typename QueryWrapper>
+class LSHNNQueryPool : public LSHNearestNeighborQueryPool<PointType, KeyType> {
+ public:
+  LSHNNQueryPool(std::vector<std::unique_ptr<QueryWrapper>> query_objects,
+                 int_fast64_t num_probes, int_fast64_t max_num_candidates)
+      : query_objects_(std::move(query_objects)),
+        locks_(new std::atomic_flag[query_objects_.size()]),
+        num_probes_(num_probes),
+        max_num_candidates_(max_num_candidates) {
+    if (query_objects_.empty()) {
+      throw LSHNearestNeighborTableError(
+          "Number of query objects in a pool must be at least 1.");
+    }
+    for (size_t ii = 0; ii < query_objects_.size(); ++ii) {
+      locks_[ii].clear();
+    }
+  }
+
+  void set_num_probes(int_fast64_t num_probes) {
+    for (auto& query_object : query_objects_) {
+      query_object->set_num_probes(num_probes);
+    }
+    num_probes_ = num_probes;
+  }
+
+  int_fast64_t get_num_probes() { return num_probes_; }
+
+  void set_max_num_candidates(int_fast64_t max_num_candidates) {
+    for (auto& query_object : query_objects_) {
+      query_object->set_max_num_candidates(max_num_candidates);
+    }
+    max_num_candidates_ = max_num_candidates;
+  }
+
+  int_fast64_t get_max_num_candidates() { return max_num_candidates_; }
+
+  int_fast64_t get_num_query_objects() { return query_objects_.size(); }
+
+  KeyType find_nearest_neighbor(const PointType& q) {
+    LockedQuery locked(this);
+    return locked.query_object().find_nearest_neighbor(q);
+  }
+
+  void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
+                                std::vector<KeyType>* result) {
+    LockedQuery locked(this);
+    locked.query_object().find_k_nearest_neighbors(q, k, result);
+  }
+
+  void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
+                                std::vector<KeyType>* result,
+                                std::vector<DistanceType>* distances) {
+    LockedQuery locked(this);
+    locked.query_object().find_k_nearest_neighbors(q, k, result, distances);
+  }
+
+  bool find_k_nearest_neighbors_bounded(const PointType& q, int_fast64_t k,
+                                        const QueryLimits& limits,
+                                        std::vector<KeyType>* result) {
+    LockedQuery locked(this);
+    return locked.query_object().find_k_nearest_neighbors_bounded(q, k, limits,
+                                                                  result);
+  }
+
+  void find_k_nearest_neighbors_filtered(const PointType& q, int_fast64_t k,
+                                         const KeyFilter& filter,
+                                         int_fast64_t max_num_probes,
+                                         std::vector<KeyType>* result,
+                                         std::vector<DistanceType>* distances) {
+    LockedQuery locked(this);
+    locked.query_object().find_k_nearest_neighbors_filtered(
+        q, k, filter, max_num_probes, result, distances);
+  }
+
+  void find_near_neighbors(const PointType& q, DistanceType threshold,
+                           std::vector<KeyType>* result) {
+    LockedQuery locked(this);
+    locked.query_object().find_near_neighbors(q, threshold, result);
+  }
+
+  void find_near_neighbors(const PointType& q, DistanceType threshold,
+                           std::vector<KeyType>* result,
+                           std::vector<DistanceType>* distances) {
+    LockedQuery locked(this);
+    locked.query_object().find_near_neighbors(q, threshold, result, distances);
+  }
+
+  void get_candidates_with_duplicates(const PointType& q,
+                                      std::vector<KeyType>* result) {
+    LockedQuery locked(this);
+    locked.query_object().get_candidates_with_duplicates(q, result);
+  }
+
+  void get_unique_candidates(const PointType& q, std::vector<KeyType>* result) {
+    LockedQuery locked(this);
+    locked.query_object().get_unique_candidates(q, result);
+  }
+
+  int_fast64_t get_num_probes_to_find(const PointType& q, KeyType key,
+                                      int_fast64_t max_num_probes) {
+    LockedQuery locked(this);
+    return locked.query_object().get_num_probes_to_find(q, key,
+                                                        max_num_probes);
+  }
+
+  void reset_query_statistics() {
+    for (size_t ii = 0; ii < query_objects_.size(); ++ii) {
+      LockedQuery locked(this, ii);
+      locked.query_object().reset_query_statistics();
+    }
+  }
+
+  // Each average is weighted by the number of measured queries that went
+  // through its phase, which its histogram counts.
+  QueryStatistics get_query_statistics() {
+    QueryStatistics res;
+    for (size_t ii = 0; ii < query_objects_.size(); ++ii) {
+      LockedQuery locked(this, ii);
+      QueryStatistics cur = locked.query_object().get_query_statistics();
+      res.average_total_query_time += cur.total_query_time_histogram.count() *
+                                      cur.average_total_query_time;
+      res.average_lsh_time +=
+          cur.lsh_time_histogram.count() * cur.average_lsh_time;
+      res.average_hash_table_time += cur.hash_table_time_histogram.count() *
+                                     cur.average_hash_table_time;
+      res.average_distance_time +=
+          cur.distance_time_histogram.count() * cur.average_distance_time;
+      res.average_num_candidates +=
+          cur.num_candidates_histogram.count() * cur.average_num_candidates;
+      res.average_num_unique_candidates +=
+          cur.num_unique_candidates_histogram.count() *
+          cur.average_num_unique_candidates;
+      res.merge_histograms(cur);
+      res.num_queries += cur.num_queries;
+    }
+    divide_by_count(&res.average_total_query_time,
+                    res.total_query_time_histogram);
+    divide_by_count(&res.average_lsh_time, res.lsh_time_histogram);
+    divide_by_count(&res.average_hash_table_time,
+                    res.hash_table_time_histogram);
+    divide_by_count(&res.average_distance_time, res.distance_time_histogram);
+    divide_by_count(&res.average_num_candidates, res.num_candidates_histogram);
+    divide_by_count(&res.average_num_unique_candidates,
+                    res.num_unique_candidates_histogram);
+    return res;
+  }
+
+  void set_instrumentation(const QueryInstrumentation& instrumentation) {
+    for (size_t ii = 0; ii < query_objects_.size(); ++ii) {
+      LockedQuery locked(this, ii);
+      QueryInstrumentation cur = instrumentation;
+      cur.query_object = static_cast<int_fast32_t>(ii);
+      locked.query_object().set_instrumentation(cur);
+    }
+  }
+
+  ~LSHNNQueryPool() {}
+
+ private:
+  // Holds the lock of one query object for the lifetime of the object.
+  class LockedQuery {
+   public:
+    LockedQuery(LSHNNQueryPool* parent) : parent_(parent) {
+      index_ = parent_->acquire_query_object();
+    }
+
+    LockedQuery(LSHNNQueryPool* parent, size_t index)
+        : parent_(parent), index_(index) {
+      while (parent_->locks_[index_].test_and_set(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+    }
+
+    ~LockedQuery() { parent_->locks_[index_].clear(std::memory_order_release); }
+
+    QueryWrapper& query_object() { return *(parent_->query_objects_[index_]); }
+
+   private:
+    LSHNNQueryPool* parent_;
+    size_t index_;
+  };
+
+  static void divide_by_count(double* sum, const QueryHistogram& histogram) {
+    if (histogram.count() > 0) {
+      *sum /= histogram.count();
+    }
+  }
+
+  size_t acquire_query_object() {
+    size_t num_objects = query_objects_.size();
+    // Start at a different query object for each call so that the pool does
+    // not contend on the first lock.
+    size_t start = next_start_.fetch_add(1, std::memory_order_relaxed);
+    while (true) {
+      for (size_t ii = 0; ii < num_objects; ++ii) {
+        size_t cur = (start + ii) % num_objects;
+        if (!locks_[cur].test_and_set(std::memory_order_acquire)) {
+          return cur;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  std::vector<std::unique_ptr<QueryWrapper>> query_objects_;
+  std::unique_ptr<std::atomic_flag[]> locks_;
+  std::atomic<size_t> next_start_{0};
+  int_fast64_t num_probes_;
+  int_fast64_t max_num_candidates_;
+};
+
+// File format of saved tables (see LSHNearestNeighborTable::save). A file
+// starts with a header that identifies the format and the types of the
+// table, followed by the construction parameters, the LSH functions, the
+// composite hash table, and a closing marker that detects truncated files.
+const char kTableFileMagic[8] = {'F', 'A', 'L', 'C', 'O', 'N', 'N', 'T'};
+// Version 2 added the data transformation after the feature hashing
+// dimension; files of version 1 are still read, as untransformed tables.
+const uint32_t kTableFileVersion = 2;
+const uint32_t kTableFileByteOrderMark = 0x01020304;
+
+template <typename PointType, typename KeyType>
+void write_table_header(const SavedTableInfo& header,
+                        core::BinaryWriter* output) {
+  typedef typename PointTypeTraits<PointType>::ScalarType ScalarType;
+  const LSHConstructionParameters& params = header.params;
+
+  for (char c : kTableFileMagic) {
+    output->write_value(c);
+  }
+  output->write_value<uint32_t>(kTableFileVersion);
+  output->write_value<uint32_t>(kTableFileByteOrderMark);
+  output->write_value<int32_t>(
+      PointTypeTraitsInternal<PointType>::serialization_tag());
+  output->write_value<int32_t>(sizeof(ScalarType));
+  output->write_value<int32_t>(sizeof(KeyType));
+
+  output->write_value<int64_t>(params.dimension);
+  output->write_value<int64_t>(static_cast<int64_t>(params.lsh_family));
+  output->write_value<int64_t>(static_cast<int64_t>(params.distance_function));
+  output->write_value<int64_t>(params.k);
+  output->write_value<int64_t>(params.l);
+  output->write_value<int64_t>(static_cast<int64_t>(params.storage_hash_table));
+  output->write_value<int64_t>(params.num_setup_threads);
+  output->write_value<uint64_t>(params.seed);
+  output->write_value<int64_t>(params.last_cp_dimension);
+  output->write_value<int64_t>(params.num_rotations);
+  output->write_value<int64_t>(params.feature_hashing_dimension);
+  output->write_value<int64_t>(
+      static_cast<int64_t>(params.data_transformation));
+
+  output->write_value<int64_t>(header.num_points);
+  output->write_value<int64_t>(header.num_probes);
+  output->write_value<int64_t>(header.max_num_candidates);
+}
+
+// Reads the header without checking the point and key types
+inline SavedTableInfo read_table_info(core::BinaryReader* input) {
+  for (char c : kTableFileMagic) {
+    if (input->read_value<char>() != c) {
+      throw LSHNNTableSetupError("Input file is not a saved FALCONN table.");
+    }
+  }
+  uint32_t version = input->read_value<uint32_t>();
+  if (version < 1 || version > kTableFileVersion) {
+    throw LSHNNTableSetupError("Unsupported version of the table file format.");
+  }
+  if (input->read_value<uint32_t>() != kTableFileByteOrderMark) {
+    throw LSHNNTableSetupError("Table file was saved with another byte order.");
+  }
+
+  SavedTableInfo info;
+  info.sparse = input->read_value<int32_t>() == 2;
+  info.coordinate_size = input->read_value<int32_t>();
+  info.key_size = input->read_value<int32_t>();
+
+  LSHConstructionParameters& params = info.params;
+  params.dimension = input->read_value<int64_t>();
+  params.lsh_family = static_cast<LSHFamily>(input->read_value<int64_t>());
+  params.distance_function =
+      static_cast<DistanceFunction>(input->read_value<int64_t>());
+  params.k = input->read_value<int64_t>();
+  params.l = input->read_value<int64_t>();
+  params.storage_hash_table =
+      static_cast<StorageHashTable>(input->read_value<int64_t>());
+  params.num_setup_threads = input->read_value<int64_t>();
+  params.seed = input->read_value<uint64_t>();
+  params.last_cp_dimension = input->read_value<int64_t>();
+  params.num_rotations = input->read_value<int64_t>();
+  params.feature_hashing_dimension = input->read_value<int64_t>();
+  if (version >= 2) {
+    params.data_transformation =
+        static_cast<DataTransformation>(input->read_value<int64_t>());
+  }
+
+  info.num_points = input->read_value<int64_t>();
+  info.num_probes = input->read_value<int64_t>();
+  info.max_num_candidates = input->read_value<int64_t>();
+  return info;
+}
+
+template <typename PointType, typename KeyType>
+SavedTableInfo read_table_header(core::BinaryReader* input) {
+  typedef typename PointTypeTraits<PointType>::ScalarType ScalarType;
+
+  SavedTableInfo info = read_table_info(input);
+  if (info.sparse !=
+          (PointTypeTraitsInternal<PointType>::serialization_tag() == 2) ||
+      info.coordinate_size != static_cast<int_fast32_t>(sizeof(ScalarType)) ||
+      info.key_size != static_cast<int_fast32_t>(sizeof(KeyType))) {
+    throw LSHNNTableSetupError(
+        "Point type or key type of the saved table does not match.");
+  }
+  return info;
+}
+
+inline void write_table_trailer(core::BinaryWriter* output) {
+  for (char c : kTableFileMagic) {
+    output->write_value(c);
+  }
+}
+
+inline void read_table_trailer(core::BinaryReader* input) {
+  for (char c : kTableFileMagic) {
+    if (input->read_value<char>() != c) {
+      throw LSHNNTableSetupError("Saved table is corrupted.");
+    }
+  }
+}
+
+template <typename PointType, typename KeyType, typename DistanceType,
+          typename DistanceFunction, typename LSHTable, typename LSHFunction,
+          typename HashTableFactory, typename CompositeHashTable,
+          typename NNQuery, typename DataStorage,
+          typename Interface = LSHNearestNeighborTable<PointType, KeyType>,
+          typename Transformation = core::IdentityTransformation<PointType>>
+class LSHNNTableWrapper : public Interface {
+ public:
+  typedef LSHNNQueryWrapper<PointType, KeyType, DistanceType, LSHTable, NNQuery,
+                            Transformation>
+      QueryWrapperType;
+  typedef LSHNNQueryPool<PointType, KeyType, DistanceType, QueryWrapperType>
+      QueryPoolType;
+
+  LSHNNTableWrapper(const LSHConstructionParameters& params,
+                    std::unique_ptr<LSHFunction> lsh,
+                    std::unique_ptr<LSHTable> lsh_table,
+                    std::unique_ptr<HashTableFactory> hash_table_factory,
+                    std::unique_ptr<CompositeHashTable> composite_hash_table,
+                    std::unique_ptr<DataStorage> data_storage,
+                    const Transformation& transformation = Transformation())
+      : params_(params),
+        lsh_(std::move(lsh)),
+        lsh_table_(std::move(lsh_table)),
+        hash_table_factory_(std::move(hash_table_factory)),
+        composite_hash_table_(std::move(composite_hash_table)),
+        data_storage_(std::move(data_storage)),
+        transformation_(transformation) {
+    num_probes_ = lsh_->get_l();
+    query_ = std::move(new_query_object(num_probes_, max_num_candidates_));
+  }
+
+  void set_num_probes(int_fast64_t num_probes) {
+    query_->set_num_probes(num_probes);
+    num_probes_ = num_probes;
+  }
+
+  int_fast64_t get_num_probes() { return num_probes_; }
+
+  void set_max_num_candidates(int_fast64_t max_num_candidates) {
+    query_->set_max_num_candidates(max_num_candidates);
+    max_num_candidates_ = max_num_candidates;
+  }
+
+  int_fast64_t get_max_num_candidates() { return max_num_candidates_; }
+
+  KeyType find_nearest_neighbor(const PointType& q) {
+    return query_->find_nearest_neighbor(q);
+  }
+
+  void find_k_nearest_neighbors(const PointType& q, int_fast64_t k,
+                                std::vector<KeyType>* result) {
+    query_->find_k_nearest_neighbors(q, k, result);
+  }
+
+  void find_near_neighbors(const PointType& q, DistanceType threshold,
+                           std::vector<KeyType>* result) {
+    query_->find_near_neighbors(q, threshold, result);
+  }
+
+  void get_candidates_with_duplicates(const PointType& q,
+                                      std::vector<KeyType>* result) {
+    query_->get_candidates_with_duplicates(q, result);
+  }
+
+  void get_unique_candidates(const PointType& q, std::vector<KeyType>* result) {
+    query_->get_unique_candidates(q, result);
+  }
+
+  void reset_query_statistics() { query_->reset_query_statistics(); }
+
+  QueryStatistics get_query_statistics() {
+    return query_->get_query_statistics();
+  }
+
+  MemoryUsage get_memory_usage() const {
+    MemoryUsage res;
+    res.data_storage = data_storage_->get_memory_usage();
+    res.hash_functions = lsh_->get_memory_usage();
+    composite_hash_table_->get_memory_usage(&res.hash_table_buckets,
+                                            &res.hash_table_entries);
+    res.query_scratch = query_->get_memory_usage();
+    return res;
+  }
+
+  void get_buckets(int_fast32_t table, std::vector<KeyType>* keys,
+                   std::vector<int_fast64_t>* bucket_starts) const {
+    if (table < 0 || table >= params_.l) {
+      throw LSHNearestNeighborTableError("Hash table index out of range.");
+    }
+    composite_hash_table_->get_buckets(table, keys, bucket_starts);
+  }
+
+  void get_bucket_sizes(int_fast32_t table,
+                        std::vector<int_fast64_t>* sizes) const {
+    if (table < 0 || table >= params_.l) {
+      throw LSHNearestNeighborTableError("Hash table index out of range.");
+    }
+    composite_hash_table_->get_bucket_sizes(table, sizes);
+  }
+
+  std::unique_ptr<LSHNearestNeighborQuery<PointType, KeyType>>
+  construct_query_object(int_fast64_t num_probes = -1,
+                         int_fast64_t max_num_candidates = -1) const {
+    return new_query_object(num_probes, max_num_candidates);
+  }
+
+  std::unique_ptr<LSHNearestNeighborQueryPool<PointType, KeyType>>
+  construct_query_pool(int_fast64_t num_probes = -1,
+                       int_fast64_t max_num_candidates = -1,
+                       int_fast64_t num_query_objects = 0) const {
+    if (num_query_objects < 0) {
+      throw LSHNearestNeighborTableError(
+          "Number of query objects in a pool cannot be negative.");
+    }
+    if (num_query_objects == 0) {
+      num_query_objects = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (num_probes < 0) {
+      num_probes = num_probes_;
+    }
+    if (max_num_candidates < 0) {
+      max_num_candidates = max_num_candidates_;
+    }
+
+    std::vector<std::unique_ptr<QueryWrapperType>> query_objects;
+    for (int_fast64_t ii = 0; ii < num_query_objects; ++ii) {
+      query_objects.push_back(
+          new_query_object(num_probes, max_num_candidates));
+    }
+    std::unique_ptr<LSHNearestNeighborQueryPool<PointType, KeyType>> res(
+        new QueryPoolType(std::move(query_objects), num_probes,
+                          max_num_candidates));
+    return res;
+  }
+
+  void save(const std::string& filename) const {
+    SavedTableInfo header;
+    header.params = params_;
+    header.num_points = data_storage_->size();
+    header.num_probes = num_probes_;
+    header.max_num_candidates = max_num_candidates_;
+
+    core::BinaryWriter output(filename);
+    write_table_header<PointType, KeyType>(header, &output);
+    lsh_->serialize(&output);
+    composite_hash_table_->serialize(&output);
+    write_table_trailer(&output);
+    output.close();
+  }
+
   ~LSHNNTableWrapper() {}
 
  protected:
+  LSHConstructionParameters params_;
   std::unique_ptr<LSHFunction> lsh_;
   std::unique_ptr<LSHTable> lsh_table_;
   std::unique_ptr<HashTableFactory> hash_table_factory_;
   std::unique_ptr<CompositeHashTable> composite_hash_table_;
-  std::unique_ptr<typename LSHTable::Query> query_;
-  std::unique_ptr<NNQuery> nn_query_;
   std::unique_ptr<DataStorage> data_storage_;
+  Transformation transformation_;  // of the queries, as they are hashed
+  std::unique_ptr<QueryWrapperType> query_;
 
   int_fast64_t num_probes_;
   int_fast64_t max_num_candidates_ = this->kNoMaxNumCandidates;
+
+  std::unique_ptr<QueryWrapperType> new_query_object(
+      int_fast64_t num_probes, int_fast64_t max_num_candidates) const {
+    if (num_probes < 0) {
+      num_probes = num_probes_;
+    }
+    if (max_num_candidates < 0) {
+      max_num_candidates = max_num_candidates_;
+    }
+    std::unique_ptr<QueryWrapperType> res(
+        new QueryWrapperType(*lsh_table_, *data_storage_, num_probes,
+                             max_num_candidates, transformation_));
+    return res;
+  }
 };
 
-template <typename PointType, typename KeyType, typename PointSet>
-class StaticTableFactory {
+template <typename PointType, typename KeyType, typename DistanceType,
+          typename DistanceFunction, typename LSHTable, typename LSHFunction,
+          typename HashTableFactory, typename CompositeHashTable,
+          typename NNQuery, typename DataStorage>
+class DynamicLSHNNTableWrapper
+    : public LSHNNTableWrapper<
+          PointType, KeyType, DistanceType, DistanceFunction, LSHTable,
+          LSHFunction, HashTableFactory, CompositeHashTable, NNQuery,
+          DataStorage, LSHNearestNeighborDynamicTable<PointType, KeyType>> {
  public:
-  typedef typename PointTypeTraits<PointType>::ScalarType ScalarType;
+  typedef LSHNNTableWrapper<
+      PointType, KeyType, DistanceType, DistanceFunction, LSHTable,
+      LSHFunction, HashTableFactory, CompositeHashTable, NNQuery, DataStorage,
+      LSHNearestNeighborDynamicTable<PointType, KeyType>>
+      Base;
+
+  DynamicLSHNNTableWrapper(
+      const LSHConstructionParameters& params,
+      std::unique_ptr<LSHFunction> lsh, std::unique_ptr<LSHTable> lsh_table,
+      std::unique_ptr<HashTableFactory> hash_table_factory,
+      std::unique_ptr<CompositeHashTable> composite_hash_table,
+      std::unique_ptr<DataStorage> data_storage)
+      : Base(params, std::move(lsh), std::move(lsh_table),
+             std::move(hash_table_factory), std::move(composite_hash_table),
+             std::move(data_storage)) {
+    num_points_ = this->data_storage_->size();
+    removed_.assign(num_points_, false);
+  }
 
-  typedef typename DataStorageAdapter<PointSet>::template DataStorage<KeyType>
-      DataStorageType;
+  KeyType insert(const PointType& p) {
+    if (p.size() != this->params_.dimension) {
+      throw LSHNearestNeighborTableError(
+          "Point dimension does not match the table.");
+    }
+    int_fast64_t key = this->data_storage_->size();
+    if (key >= std::numeric_limits<KeyType>::max()) {
+      throw LSHNearestNeighborTableError("Too many points for the key type.");
+    }
+    this->data_storage_->append(p);
+    this->lsh_table_->insert(p, static_cast<KeyType>(key));
+    removed_.push_back(false);
+    num_points_ += 1;
+    return static_cast<KeyType>(key);
+  }
+
+  void remove(KeyType key) {
+    if (!contains(key)) {
+      throw LSHNearestNeighborTableError("Key does not belong to a point.");
+    }
+    tmp_point_ = this->data_storage_->get_point(key);
+    this->lsh_table_->remove(tmp_point_, key);
+    removed_[key] = true;
+    num_points_ -= 1;
+  }
+
+  bool contains(KeyType key) const {
+    return key >= 0 && static_cast<size_t>(key) < removed_.size() &&
+           !removed_[key];
+  }
+
+  int_fast64_t get_num_points() const { return num_points_; }
+
+  int_fast64_t get_key_range() const { return removed_.size(); }
+
+  void get_point(KeyType key, PointType* result) const {
+    if (key < 0 || static_cast<size_t>(key) >= removed_.size()) {
+      throw LSHNearestNeighborTableError("Key out of range.");
+    }
+    *result = this->data_storage_->get_point(key);
+  }
+
+  void save(const std::string&) const {
+    throw LSHNearestNeighborTableError("Dynamic tables cannot be saved.");
+  }
+
+ private:
+  std::vector<bool> removed_;
+  int_fast64_t num_points_;
+  PointType tmp_point_;
+};
+
+// Initial size of the dynamic linear probing hash tables for n points, and
+// size of the static ones
+inline int_fast64_t dynamic_probing_table_size(int_fast64_t n) {
+  return std::max<int_fast64_t>(16, 3 * n);
+}
+
+inline int_fast64_t static_probing_table_size(int_fast64_t n) { return 2 * n; }
 
-  StaticTableFactory(const PointSet& points,
-                     const LSHConstructionParameters& params)
-      : points_(points), params_(params) {}
+// Sets up the LSH table for the given points and parameters. With Dynamic,
+// the table is a DynamicLSHTable over linear probing hash tables that owns a
+// growable copy of the points.
+template <typename PointType, typename KeyType, typename PointSet,
+          bool Dynamic = false>
+class TableFactory {
+ public:
+  typedef typename PointTypeTraits<PointType>::ScalarType ScalarType;
 
-  std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> setup() {
+  typedef typename DataStorageAdapter<PointSet>::template DataStorage<KeyType>
+      PointSetStorageType;
+  typedef typename std::conditional<
+      Dynamic, core::DynamicArrayDataStorage<PointType, KeyType>,
+      PointSetStorageType>::type DataStorageType;
+  typedef typename std::conditional<
+      Dynamic, LSHNearestNeighborDynamicTable<PointType, KeyType>,
+      LSHNearestNeighborTable<PointType, KeyType>>::type TableType;
+
+  // If header is not null, the LSH functions and hash tables are read from
+  // input (positioned just after the header) instead of being computed.
+  TableFactory(const PointSet& points,
+                     const LSHConstructionParameters& params,
+                     const SavedTableInfo* header = nullptr,
+                     core::BinaryReader* input = nullptr)
+      : points_(points), params_(params), header_(header), input_(input) {}
+
+  std::unique_ptr<TableType> setup() {
     if (params_.dimension < 1) {
       throw LSHNNTableSetupError(
           "Point dimension must be at least 1. Maybe "
@@ -438,21 +1167,64 @@ class StaticTableFactory {
           "the maximum number of available hardware threads.");
     }
 
-    data_storage_ = std::move(
-        DataStorageAdapter<PointSet>::template construct_data_storage<KeyType>(
-            points_));
+    // The hash functions see the points as transformed (see
+    // DataTransformation), which may change their dimension.
+    hash_params_ = params_;
+    if (params_.data_transformation == DataTransformation::AsymmetricMips) {
+      if (!kIsDense) {
+        throw LSHNNTableSetupError(
+            "The asymmetric MIPS transformation needs dense points.");
+      }
+      if (Dynamic) {
+        throw LSHNNTableSetupError(
+            "The asymmetric MIPS transformation needs a static table, since "
+            "it depends on the largest norm of the points.");
+      }
+      if (params_.distance_function != DistanceFunction::NegativeInnerProduct) {
+        throw LSHNNTableSetupError(
+            "The asymmetric MIPS transformation needs the negative inner "
+            "product distance.");
+      }
+      hash_params_.dimension += 1;
+    } else if (params_.data_transformation != DataTransformation::Identity) {
+      throw LSHNNTableSetupError("Unknown data transformation.");
+    }
+
+    construct_data_storage(std::integral_constant<bool, Dynamic>());
 
     ComputeNumberOfHashBits<PointType> helper;
-    num_bits_ = helper.compute(params_);
+    num_bits_ = helper.compute(hash_params_);
 
     n_ = data_storage_->size();
 
+    if (header_ != nullptr && n_ != header_->num_points) {
+      throw LSHNNTableSetupError(
+          "Number of points does not match the saved table.");
+    }
+
     setup0();
 
     return std::move(table_);
   }
 
  private:
+  void construct_data_storage(std::false_type) {
+    data_storage_ = std::move(
+        DataStorageAdapter<PointSet>::template construct_data_storage<KeyType>(
+            points_));
+  }
+
+  void construct_data_storage(std::true_type) {
+    std::unique_ptr<PointSetStorageType> points(std::move(
+        DataStorageAdapter<PointSet>::template construct_data_storage<KeyType>(
+            points_)));
+    data_storage_.reset(new DataStorageType(params_.dimension));
+    data_storage_->reserve(points->size());
+    for (auto iter = points->get_full_sequence(); iter.is_valid(); ++iter) {
+      data_storage_->append(iter.get_point());
+    }
+  }
+
   void setup0() {
     if (num_bits_ <= 32) {
       typedef uint32_t HashType;
@@ -477,8 +1249,11 @@ class StaticTableFactory {
       typedef typename wrapper::PointTypeTraitsInternal<
           PointType>::template HPHash<HashType>
           LSH;
-      std::unique_ptr<LSH> lsh(new LSH(params_.dimension, params_.k, params_.l,
-                                       params_.seed ^ 93384688));
+      std::unique_ptr<LSH> lsh(new LSH(hash_params_.dimension, params_.k,
+                                       params_.l, params_.seed ^ 93384688));
+      if (input_ != nullptr) {
+        lsh->deserialize(input_);
+      }
       setup2(std::tuple_cat(vals, std::make_tuple(std::move(lsh))));
     } else if (params_.lsh_family == LSHFamily::CrossPolytope) {
       if (params_.num_rotations < 0) {
@@ -501,9 +1276,12 @@ class StaticTableFactory {
       typedef typename wrapper::PointTypeTraitsInternal<
           PointType>::template CPHash<HashType>
           LSH;
-      std::unique_ptr<LSH> lsh(
-          std::move(wrapper::PointTypeTraitsInternal<
-                    PointType>::template construct_cp_hash<HashType>(params_)));
+      std::unique_ptr<LSH> lsh(std::move(
+          wrapper::PointTypeTraitsInternal<
+              PointType>::template construct_cp_hash<HashType>(hash_params_)));
+      if (input_ != nullptr) {
+        lsh->deserialize(input_);
+      }
       setup2(std::tuple_cat(vals, std::make_tuple(std::move(lsh))));
     } else {
       throw LSHNNTableSetupError(
@@ -535,6 +1313,31 @@ class StaticTableFactory {
 
   template <typename V>
   void setup3(V vals) {
+    setup3(std::move(vals), std::integral_constant<bool, Dynamic>());
+  }
+
+  template <typename V>
+  void setup3(V vals, std::true_type) {
+    typedef typename std::tuple_element<kHashTypeIndex, V>::type HashType;
+
+    // The tables are rehashed to a load of 1/3 whenever their load exceeds
+    // 1/2 or a quarter of their cells hold deleted entries.
+    typedef core::DynamicLinearProbingHashTable<HashType, KeyType> HashTable;
+    std::unique_ptr<typename HashTable::Factory> factory(
+        new typename HashTable::Factory(0.5, 0.25, 3.0,
+                                        dynamic_probing_table_size(n_)));
+
+    typedef core::DynamicCompositeHashTable<HashType, KeyType, HashTable>
+        CompositeTable;
+    std::unique_ptr<CompositeTable> composite_table(
+        new CompositeTable(params_.l, factory.get()));
+    setup4(std::tuple_cat(std::move(vals),
+                          std::make_tuple(std::move(factory)),
+                          std::make_tuple(std::move(composite_table))));
+  }
+
+  template <typename V>
+  void setup3(V vals, std::false_type) {
     typedef typename std::tuple_element<kHashTypeIndex, V>::type HashType;
 
     if (params_.storage_hash_table == StorageHashTable::FlatHashTable) {
@@ -555,6 +1358,32 @@ class StaticTableFactory {
       std::unique_ptr<typename HashTable::Factory> factory(
           new typename HashTable::Factory(1 << num_bits_, n_));
 
+      typedef core::StaticCompositeHashTable<HashType, KeyType, HashTable>
+          CompositeTable;
+      std::unique_ptr<CompositeTable> composite_table(
+          new CompositeTable(params_.l, factory.get()));
+      setup4(std::tuple_cat(std::move(vals),
+                            std::make_tuple(std::move(factory)),
+                            std::make_tuple(std::move(composite_table))));
+    } else if (params_.storage_hash_table ==
+               StorageHashTable::CompressedFlatHashTable) {
+      typedef core::CompressedFlatHashTable<HashType> HashTable;
+      std::unique_ptr<typename HashTable::Factory> factory(
+          new typename HashTable::Factory(1 << num_bits_, n_));
+
+      typedef core::StaticCompositeHashTable<HashType, KeyType, HashTable>
+          CompositeTable;
+      std::unique_ptr<CompositeTable> composite_table(
+          new CompositeTable(params_.l, factory.get()));
+      setup4(std::tuple_cat(std::move(vals),
+                            std::make_tuple(std::move(factory)),
+                            std::make_tuple(std::move(composite_table))));
+    } else if (params_.storage_hash_table ==
+               StorageHashTable::InlineFlatHashTable) {
+      typedef core::InlineFlatHashTable<HashType> HashTable;
+      std::unique_ptr<typename HashTable::Factory> factory(
+          new typename HashTable::Factory(1 << num_bits_, n_));
+
       typedef core::StaticCompositeHashTable<HashType, KeyType, HashTable>
           CompositeTable;
       std::unique_ptr<CompositeTable> composite_table(
@@ -578,7 +1407,7 @@ class StaticTableFactory {
                StorageHashTable::LinearProbingHashTable) {
       typedef core::StaticLinearProbingHashTable<HashType, KeyType> HashTable;
       std::unique_ptr<typename HashTable::Factory> factory(
-          new typename HashTable::Factory(2 * n_));
+          new typename HashTable::Factory(static_probing_table_size(n_)));
 
       typedef core::StaticCompositeHashTable<HashType, KeyType, HashTable>
           CompositeTable;
@@ -601,6 +1430,11 @@ class StaticTableFactory {
 
   template <typename V>
   void setup_final(V vals) {
+    setup_final(std::move(vals), std::integral_constant<bool, Dynamic>());
+  }
+
+  template <typename V>
+  void setup_final(V vals, std::true_type) {
     typedef typename std::tuple_element<kHashTypeIndex, V>::type HashType;
 
     typedef
@@ -626,33 +1460,168 @@ class StaticTableFactory {
     std::unique_ptr<CompositeHashTableType>& composite_table =
         std::get<kCompositeHashTableIndex>(vals);
 
-    typedef core::StaticLSHTable<PointType, KeyType, LSHType, HashType,
-                                 CompositeHashTableType, DataStorageType>
+    typedef core::DynamicLSHTable<PointType, KeyType, LSHType, HashType,
+                                  CompositeHashTableType, DataStorageType>
         LSHTableType;
     std::unique_ptr<LSHTableType> lsh_table(
         new LSHTableType(lsh.get(), composite_table.get(), *data_storage_,
                          params_.num_setup_threads));
 
-    std::unique_ptr<typename LSHTableType::Query> query(
-        new typename LSHTableType::Query(*lsh_table));
+    typedef core::NearestNeighborQuery<typename LSHTableType::Query, PointType,
+                                       KeyType, PointType, ScalarType,
+                                       DistanceFunctionType, DataStorageType>
+        NNQueryType;
+
+    table_.reset(
+        new DynamicLSHNNTableWrapper<PointType, KeyType, ScalarType,
+                                     DistanceFunctionType, LSHTableType,
+                                     LSHType, HashTableFactoryType,
+                                     CompositeHashTableType, NNQueryType,
+                                     DataStorageType>(
+            params_, std::move(lsh), std::move(lsh_table), std::move(factory),
+            std::move(composite_table), std::move(data_storage_)));
+  }
+
+  template <typename V>
+  void setup_final(V vals, std::false_type) {
+    if (params_.data_transformation == DataTransformation::AsymmetricMips) {
+      setup_final_transformed(std::move(vals),
+                              std::integral_constant<bool, kIsDense>());
+      return;
+    }
+
+    typedef typename std::tuple_element<kHashTypeIndex, V>::type HashType;
+
+    typedef
+        typename std::tuple_element<kLSHFamilyIndex, V>::type LSHPointerType;
+    typedef typename LSHPointerType::element_type LSHType;
+
+    typedef typename std::tuple_element<kDistanceFunctionIndex, V>::type
+        DistanceFunctionType;
+
+    typedef typename std::tuple_element<kHashTableFactoryIndex, V>::type
+        HashTableFactoryPointerType;
+    typedef
+        typename HashTableFactoryPointerType::element_type HashTableFactoryType;
+
+    typedef typename std::tuple_element<kCompositeHashTableIndex, V>::type
+        CompositeHashTablePointerType;
+    typedef typename CompositeHashTablePointerType::element_type
+        CompositeHashTableType;
+
+    std::unique_ptr<LSHType>& lsh = std::get<kLSHFamilyIndex>(vals);
+    std::unique_ptr<HashTableFactoryType>& factory =
+        std::get<kHashTableFactoryIndex>(vals);
+    std::unique_ptr<CompositeHashTableType>& composite_table =
+        std::get<kCompositeHashTableIndex>(vals);
+
+    typedef core::StaticLSHTable<PointType, KeyType, LSHType, HashType,
+                                 CompositeHashTableType, DataStorageType>
+        LSHTableType;
+    std::unique_ptr<LSHTableType> lsh_table;
+    if (input_ != nullptr) {
+      composite_table->deserialize(input_);
+      read_table_trailer(input_);
+      lsh_table.reset(
+          new LSHTableType(lsh.get(), composite_table.get(), *data_storage_));
+    } else {
+      lsh_table.reset(new LSHTableType(lsh.get(), composite_table.get(),
+                                       *data_storage_,
+                                       params_.num_setup_threads));
+    }
 
     typedef core::NearestNeighborQuery<typename LSHTableType::Query, PointType,
                                        KeyType, PointType, ScalarType,
                                        DistanceFunctionType, DataStorageType>
         NNQueryType;
-    std::unique_ptr<NNQueryType> nn_query(
-        new NNQueryType(query.get(), *data_storage_));
 
     table_.reset(
         new LSHNNTableWrapper<PointType, KeyType, ScalarType,
                               DistanceFunctionType, LSHTableType, LSHType,
                               HashTableFactoryType, CompositeHashTableType,
                               NNQueryType, DataStorageType>(
-            std::move(lsh), std::move(lsh_table), std::move(factory),
-            std::move(composite_table), std::move(query), std::move(nn_query),
-            std::move(data_storage_)));
+            params_, std::move(lsh), std::move(lsh_table), std::move(factory),
+            std::move(composite_table), std::move(data_storage_)));
+  }
+
+  // A static table over dense points whose hash functions see the points as
+  // transformed by the asymmetric MIPS transformation. The transformation
+  // takes the largest norm of the points, also when the table is loaded, and
+  // the points are transformed one at a time as they are hashed.
+  template <typename V>
+  void setup_final_transformed(V vals, std::true_type) {
+    typedef typename std::tuple_element<kHashTypeIndex, V>::type HashType;
+
+    typedef
+        typename std::tuple_element<kLSHFamilyIndex, V>::type LSHPointerType;
+    typedef typename LSHPointerType::element_type LSHType;
+
+    typedef typename std::tuple_element<kDistanceFunctionIndex, V>::type
+        DistanceFunctionType;
+
+    typedef typename std::tuple_element<kHashTableFactoryIndex, V>::type
+        HashTableFactoryPointerType;
+    typedef
+        typename HashTableFactoryPointerType::element_type HashTableFactoryType;
+
+    typedef typename std::tuple_element<kCompositeHashTableIndex, V>::type
+        CompositeHashTablePointerType;
+    typedef typename CompositeHashTablePointerType::element_type
+        CompositeHashTableType;
+
+    std::unique_ptr<LSHType>& lsh = std::get<kLSHFamilyIndex>(vals);
+    std::unique_ptr<HashTableFactoryType>& factory =
+        std::get<kHashTableFactoryIndex>(vals);
+    std::unique_ptr<CompositeHashTableType>& composite_table =
+        std::get<kCompositeHashTableIndex>(vals);
+
+    typedef core::AsymmetricMipsTransformation<PointType> Transformation;
+    Transformation transformation(*data_storage_);
+
+    typedef core::StaticLSHTable<PointType, KeyType, LSHType, HashType,
+                                 CompositeHashTableType, DataStorageType>
+        LSHTableType;
+    std::unique_ptr<LSHTableType> lsh_table;
+    if (input_ != nullptr) {
+      composite_table->deserialize(input_);
+      read_table_trailer(input_);
+      lsh_table.reset(
+          new LSHTableType(lsh.get(), composite_table.get(), *data_storage_));
+    } else {
+      core::TransformedDataStorage<PointType, Transformation, DataStorageType,
+                                   KeyType>
+          transformed_points(transformation, *data_storage_);
+      lsh_table.reset(new LSHTableType(lsh.get(), composite_table.get(),
+                                       transformed_points,
+                                       params_.num_setup_threads));
+    }
+
+    typedef core::NearestNeighborQuery<typename LSHTableType::Query, PointType,
+                                       KeyType, PointType, ScalarType,
+                                       DistanceFunctionType, DataStorageType>
+        NNQueryType;
+
+    table_.reset(
+        new LSHNNTableWrapper<PointType, KeyType, ScalarType,
+                              DistanceFunctionType, LSHTableType, LSHType,
+                              HashTableFactoryType, CompositeHashTableType,
+                              NNQueryType, DataStorageType, TableType,
+                              Transformation>(
+            params_, std::move(lsh), std::move(lsh_table), std::move(factory),
+            std::move(composite_table), std::move(data_storage_),
+            transformation));
   }
 
+  // Not reached: setup() rejects transformations of sparse points
+  template <typename V>
+  void setup_final_transformed(V, std::false_type) {
+    throw LSHNNTableSetupError(
+        "The asymmetric MIPS transformation needs dense points.");
+  }
+
+  static const bool kIsDense =
+      std::is_same<PointType, DenseVector<ScalarType>>::value;
+
   const static int_fast32_t kHashTypeIndex = 0;
   const static int_fast32_t kLSHFamilyIndex = 1;
   const static int_fast32_t kDistanceFunctionIndex = 2;
@@ -661,10 +1630,127 @@ class StaticTableFactory {
 
   const PointSet& points_;
   const LSHConstructionParameters& params_;
+  LSHConstructionParameters hash_params_;
+  const SavedTableInfo* header_;
+  core::BinaryReader* input_;
   std::unique_ptr<DataStorageType> data_storage_;
   int_fast32_t num_bits_;
   int_fast64_t n_;
-  std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> table_ = nullptr;
+  std::unique_ptr<TableType> table_ = nullptr;
+};
+
+// Predicts the memory usage of the table that TableFactory sets up for n
+// points from the sizes of the structures it allocates, assuming that every
+// point is in each of the low-level hash tables.
+template <typename PointType, typename KeyType>
+class MemoryUsageEstimator {
+ public:
+  typedef typename PointTypeTraits<PointType>::ScalarType ScalarType;
+
+  // The hash functions of a transformed table have the dimension of the
+  // transformed points (see TableFactory::setup).
+  MemoryUsageEstimator(int_fast64_t n, const LSHConstructionParameters& params,
+                       bool dynamic)
+      : n_(n), params_(params), dynamic_(dynamic) {
+    if (params.data_transformation == DataTransformation::AsymmetricMips) {
+      params_.dimension += 1;
+    }
+  }
+
+  MemoryUsage estimate() const {
+    if (n_ < 0) {
+      throw LSHNNTableSetupError("Number of points cannot be negative.");
+    }
+    if (params_.l < 1) {
+      throw LSHNNTableSetupError(
+          "The number of hash tables l must be at least 1.");
+    }
+    int_fast32_t num_bits =
+        ComputeNumberOfHashBits<PointType>::compute(params_);
+    if (num_bits <= 32) {
+      return estimate<uint32_t>(num_bits);
+    } else if (num_bits <= 64) {
+      return estimate<uint64_t>(num_bits);
+    } else {
+      throw LSHNNTableSetupError(
+          "More than 64 hash bits are currently not "
+          "supported.");
+    }
+  }
+
+ private:
+  int_fast64_t n_;
+  LSHConstructionParameters params_;
+  bool dynamic_;
+
+  template <typename HashType>
+  MemoryUsage estimate(int_fast32_t num_bits) const {
+    MemoryUsage res;
+    if (dynamic_) {
+      res.data_storage = n_ * params_.dimension * sizeof(ScalarType);
+    }
+
+    if (params_.lsh_family == LSHFamily::Hyperplane) {
+      res.hash_functions = PointTypeTraitsInternal<PointType>::template HPHash<
+          HashType>::estimate_memory_usage(params_.dimension, params_.k,
+                                           params_.l);
+    } else if (params_.lsh_family == LSHFamily::CrossPolytope) {
+      res.hash_functions = PointTypeTraitsInternal<
+          PointType>::template estimate_cp_hash_memory_usage<HashType>(params_);
+    } else {
+      throw LSHNNTableSetupError(
+          "Unknown hash family. Maybe you forgot to set "
+          "the hash family in the parameter struct?");
+    }
+
+    int_fast64_t num_buckets = static_cast<int_fast64_t>(1) << num_bits;
+    int_fast64_t buckets = 0;
+    int_fast64_t entries = 0;
+    if (dynamic_) {
+      buckets = core::DynamicLinearProbingHashTable<HashType, KeyType>::
+          estimate_bucket_memory_usage(dynamic_probing_table_size(n_));
+    } else if (params_.storage_hash_table == StorageHashTable::FlatHashTable) {
+      typedef core::FlatHashTable<HashType> HashTable;
+      buckets = HashTable::estimate_bucket_memory_usage(num_buckets);
+      entries = HashTable::estimate_entry_memory_usage(n_);
+    } else if (params_.storage_hash_table ==
+               StorageHashTable::BitPackedFlatHashTable) {
+      typedef core::BitPackedFlatHashTable<HashType> HashTable;
+      buckets = HashTable::estimate_bucket_memory_usage(num_buckets, n_);
+      entries = HashTable::estimate_entry_memory_usage(n_);
+    } else if (params_.storage_hash_table ==
+               StorageHashTable::CompressedFlatHashTable) {
+      typedef core::CompressedFlatHashTable<HashType> HashTable;
+      buckets = HashTable::estimate_bucket_memory_usage(num_buckets, n_);
+      entries = HashTable::estimate_entry_memory_usage(num_buckets, n_);
+    } else if (params_.storage_hash_table ==
+               StorageHashTable::InlineFlatHashTable) {
+      typedef core::InlineFlatHashTable<HashType> HashTable;
+      buckets = HashTable::estimate_bucket_memory_usage(num_buckets);
+      entries = HashTable::estimate_entry_memory_usage(num_buckets, n_);
+    } else if (params_.storage_hash_table == StorageHashTable::STLHashTable) {
+      typedef core::STLHashTable<HashType> HashTable;
+      buckets = HashTable::estimate_bucket_memory_usage(n_);
+      entries = HashTable::estimate_entry_memory_usage(n_);
+    } else if (params_.storage_hash_table ==
+               StorageHashTable::LinearProbingHashTable) {
+      typedef core::StaticLinearProbingHashTable<HashType, KeyType> HashTable;
+      buckets = HashTable::estimate_bucket_memory_usage(
+          static_probing_table_size(n_));
+      entries = HashTable::estimate_entry_memory_usage(n_);
+    } else {
+      throw LSHNNTableSetupError(
+          "Unknown storage hash table type. Maybe you "
+          "forgot to set the hash table type in the parameter struct?");
+    }
+    res.hash_table_buckets.assign(params_.l, buckets);
+    res.hash_table_entries.assign(params_.l, entries);
+
+    // the set for deduplicating candidates
+    res.query_scratch =
+        core::CandidateSet<KeyType>::estimate_memory_usage(n_);
+    return res;
+  }
 };
 
 }  // namespace wrapper
@@ -690,11 +1776,50 @@ LSHConstructionParameters get_default_parameters(
 template <typename PointType, typename KeyType, typename PointSet>
 std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> construct_table(
     const PointSet& points, const LSHConstructionParameters& params) {
-  wrapper::StaticTableFactory<PointType, KeyType, PointSet> factory(points,
+  wrapper::TableFactory<PointType, KeyType, PointSet> factory(points, params);
+  return std::move(factory.setup());
+}
+
+template <typename PointType, typename KeyType, typename PointSet>
+std::unique_ptr<LSHNearestNeighborDynamicTable<PointType, KeyType>>
+construct_dynamic_table(const PointSet& points,
+                        const LSHConstructionParameters& params) {
+  wrapper::TableFactory<PointType, KeyType, PointSet, true> factory(points,
                                                                     params);
   return std::move(factory.setup());
 }
 
+template <typename PointType, typename KeyType>
+MemoryUsage estimate_memory_usage(int_fast64_t num_points,
+                                  const LSHConstructionParameters& params,
+                                  bool dynamic) {
+  wrapper::MemoryUsageEstimator<PointType, KeyType> estimator(num_points,
+                                                              params, dynamic);
+  return estimator.estimate();
+}
+
+inline SavedTableInfo inspect_saved_table(const std::string& filename) {
+  std::shared_ptr<const core::MappedFile> file(new core::MappedFile(filename));
+  core::BinaryReader input(file);
+  return wrapper::read_table_info(&input);
+}
+
+template <typename PointType, typename KeyType, typename PointSet>
+std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> load_table(
+    const PointSet& points, const std::string& filename) {
+  std::shared_ptr<const core::MappedFile> file(new core::MappedFile(filename));
+  core::BinaryReader input(file);
+  SavedTableInfo header = wrapper::read_table_header<PointType, KeyType>(&input);
+
+  wrapper::TableFactory<PointType, KeyType, PointSet> factory(
+      points, header.params, &header, &input);
+  std::unique_ptr<LSHNearestNeighborTable<PointType, KeyType>> table(
+      std::move(factory.setup()));
+  table->set_num_probes(header.num_probes);
+  table->set_max_num_candidates(header.max_num_candidates);
+  return table;
+}
+
 }  // namespace falconn
 
 #endif
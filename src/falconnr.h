@@ -9,6 +9,40 @@
 
 typedef falconn::DenseVector<double> Point;
 
+namespace falconnr {
+
+/// Represent a memory usage breakdown as an R list
+///
+/// The byte counts are doubles, as they may exceed the range of R
+/// integers.
+///
+/// @param usage -- bytes by component
+///
+/// @return a list with the bytes of the data (data_storage), of the
+///         hash functions (hash_functions), of the bucket directory
+///         and of the point indices of each hash table
+///         (hash_table_buckets and hash_table_entries, with one
+///         element per table), of the query scratch (query_scratch),
+///         of the replicas on other NUMA nodes (numa_replicas), and
+///         their total
+///
+inline Rcpp::List memory_usage_list(const falconn::MemoryUsage& usage) {
+    return Rcpp::List::create(
+        Rcpp::_["data_storage"] = static_cast<double>(usage.data_storage),
+        Rcpp::_["hash_functions"] = static_cast<double>(usage.hash_functions),
+        Rcpp::_["hash_table_buckets"] =
+            Rcpp::NumericVector(usage.hash_table_buckets.begin(),
+                                usage.hash_table_buckets.end()),
+        Rcpp::_["hash_table_entries"] =
+            Rcpp::NumericVector(usage.hash_table_entries.begin(),
+                                usage.hash_table_entries.end()),
+        Rcpp::_["query_scratch"] = static_cast<double>(usage.query_scratch),
+        Rcpp::_["numa_replicas"] = static_cast<double>(usage.numa_replicas),
+        Rcpp::_["total"] = static_cast<double>(usage.total()));
+}
+
+}  // namespace falconnr
+
 
 #endif
 
@@ -0,0 +1,83 @@
+//! R-exposed set of data points that queries can be restricted to
+
+#include "filter.h"
+
+using namespace Rcpp;
+
+// Builds a filter over size points that accepts the given points
+//
+// @param size    -- number of data points the filter is over
+// @param indices -- indices (1-based) of the points it accepts
+//
+LshFilter::LshFilter(int size, const IntegerVector& indices)
+    : _size(size) {
+    if ( size < 0 ) {
+        stop("filter size cannot be negative");
+    }
+    _words.assign((static_cast<size_t>(size) + 63) / 64, 0);
+    set(indices, true);
+}
+
+// Returns the number of data points the filter is over
+int LshFilter::size() const {
+    return _size;
+}
+
+// Returns the number of points the filter accepts
+int LshFilter::count() const {
+    int result = 0;
+    for ( uint64_t word : _words ) {
+        result += __builtin_popcountll(word);
+    }
+    return result;
+}
+
+// Accepts the given points (1-based indices) too
+//
+// @return a reference to the filter object to enable chaining
+//
+LshFilter& LshFilter::add(const IntegerVector& indices) {
+    set(indices, true);
+    return *this;
+}
+
+// Stops accepting the given points (1-based indices)
+//
+// @return a reference to the filter object to enable chaining
+//
+LshFilter& LshFilter::remove(const IntegerVector& indices) {
+    set(indices, false);
+    return *this;
+}
+
+// Returns whether the filter accepts each of the given points
+// (1-based indices); points beyond its size are not accepted
+LogicalVector LshFilter::contains(const IntegerVector& indices) const {
+    falconn::KeyFilter filter = keyFilter();
+    LogicalVector result(indices.size());
+    for ( int ii = 0; ii < indices.size(); ++ii ) {
+        int index = indices[ii];
+        result[ii] = index != NA_INTEGER && filter.accepts(index - 1);
+    }
+    return result;
+}
+
+falconn::KeyFilter LshFilter::keyFilter() const {
+    return falconn::KeyFilter(_words.data(), _size);
+}
+
+void LshFilter::set(const IntegerVector& indices, bool value) {
+    for ( int index : indices ) {
+        if ( index == NA_INTEGER || index < 1 || index > _size ) {
+            stop("filter indices must be between 1 and the size of the filter");
+        }
+    }
+    for ( int index : indices ) {
+        uint64_t bit = uint64_t(1) << ((index - 1) & 63);
+        if ( value ) {
+            _words[(index - 1) >> 6] |= bit;
+        } else {
+            _words[(index - 1) >> 6] &= ~bit;
+        }
+    }
+}
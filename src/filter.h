@@ -0,0 +1,40 @@
+//! R-exposed set of data points that queries can be restricted to
+
+#ifndef FALCONNR_FILTER_H
+#define FALCONNR_FILTER_H
+
+#include <cstdint>
+#include <vector>
+
+#include <Rcpp.h>
+#include "falconn/falconn_global.h"
+
+// A set of data points, by index, held as a bitset with one bit per
+// point, for the filtered queries of a table (see
+// LshNnTable::find_k_nearest_neighbors_filtered). A filter is built
+// once, say per tenant, and reused by any number of queries and
+// tables over the same data.
+class LshFilter {
+  public:
+    // @param size    -- number of data points the filter is over
+    // @param indices -- indices (1-based) of the points it accepts
+    LshFilter(int size, const Rcpp::IntegerVector& indices);
+
+    int                 size() const;
+    int                 count() const;
+    LshFilter&          add(const Rcpp::IntegerVector& indices);
+    LshFilter&          remove(const Rcpp::IntegerVector& indices);
+    Rcpp::LogicalVector contains(const Rcpp::IntegerVector& indices) const;
+
+    // A view of the bitset over 0-based keys, valid while this filter
+    // is alive and unchanged
+    falconn::KeyFilter  keyFilter() const;
+
+  private:
+    int                   _size;
+    std::vector<uint64_t> _words;
+
+    void set(const Rcpp::IntegerVector& indices, bool value);
+};
+
+#endif
@@ -0,0 +1,197 @@
+/// \file knn_graph.h
+/// \brief Approximate k-nearest-neighbor graph of all points of a table
+///
+/// Querying the table once per point hashes every point again and
+/// walks its probing sequence, although the buckets holding the point
+/// are already known: a point's candidates are the other points of
+/// its buckets. knn_graph walks the buckets of each hash table instead
+/// and scores every pair of points sharing a bucket once, for both
+/// points. The inner products of the points of a bucket come from one
+/// matrix product (for dense data) or pairwise passes over the
+/// nonzeros (for sparse data), and a heap per point keeps its k best
+/// neighbors so far.
+///
+/// Every point is in exactly one bucket of each hash table, so the
+/// buckets of a hash table are spread across the worker threads with
+/// no two threads touching the heap of the same point; the hash tables
+/// are walked one after the other. The result does not depend on the
+/// number of threads.
+///
+/// A bucket with more than max_bucket_size points would cost a number
+/// of distances quadratic in its size, so its points are shuffled and
+/// split into groups of at most max_bucket_size points, and only the
+/// pairs within a group are scored. The shuffle depends only on the
+/// seed, the hash table and the bucket.
+
+#ifndef FALCONNR_KNN_GRAPH_H
+#define FALCONNR_KNN_GRAPH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "brute_force.h"
+#include "parallel.h"
+
+namespace falconnr {
+
+// Number of buckets claimed at a time by a worker thread
+const int kKnnGraphBucketChunk = 16;
+
+// The k best neighbors found so far for each point, as max-heaps of
+// (score, index) pairs, so the top of a heap is its worst neighbor
+template <typename CoordinateType>
+class NeighborHeaps {
+  public:
+    typedef std::pair<CoordinateType, int32_t> Entry;
+
+    NeighborHeaps(int num_points, int k)
+        : _k(k), _entries(static_cast<size_t>(num_points) * k),
+          _sizes(num_points, 0) {}
+
+    // Offer a neighbor with the given score to a point; points already
+    // among its neighbors (from another hash table) are skipped
+    void offer(int32_t point, CoordinateType score, int32_t neighbor) {
+        Entry* heap = _entries.data() + static_cast<size_t>(point) * _k;
+        int&   size = _sizes[point];
+        if ( size == _k && !(score < heap[0].first) ) {
+            return;
+        }
+        for ( int ii = 0; ii < size; ++ii ) {
+            if ( heap[ii].second == neighbor ) {
+                return;
+            }
+        }
+        if ( size == _k ) {
+            std::pop_heap(heap, heap + size);
+            heap[size - 1] = Entry(score, neighbor);
+        } else {
+            heap[size++] = Entry(score, neighbor);
+        }
+        std::push_heap(heap, heap + size);
+    }
+
+    // Write the neighbors of a point in order of increasing score to a
+    // row of a column-major matrix, -1 where there are fewer than k
+    void write(int32_t point, int num_rows, int32_t* out) {
+        Entry* heap = _entries.data() + static_cast<size_t>(point) * _k;
+        int    size = _sizes[point];
+        std::sort_heap(heap, heap + size);
+        for ( int ii = 0; ii < _k; ++ii ) {
+            out[point + static_cast<size_t>(ii) * num_rows] =
+                ii < size ? heap[ii].second : -1;
+        }
+    }
+
+  private:
+    int                 _k;
+    std::vector<Entry>  _entries;
+    std::vector<int>    _sizes;
+};
+
+// Scratch of a worker thread
+template <typename CoordinateType>
+struct KnnGraphScratch {
+    std::vector<int32_t>        group;
+    ScoreMatrix<CoordinateType> tile;
+    ScoreMatrix<CoordinateType> products;
+};
+
+// Build the graph from the buckets of a table
+//
+// @param data        -- one of the data tile sources of brute_force.h,
+//                       over the points of the table
+// @param table       -- the FALCONN table, for its buckets
+// @param num_tables  -- number of hash tables of the table
+// @param squared_euclidean -- true for the squared Euclidean distance,
+//                       false for the negative inner product
+// @param k           -- number of neighbors to find per point
+// @param max_bucket_size -- largest group of points of a bucket whose
+//                       pairs are all scored, at least 2
+// @param seed        -- seed of the shuffles of large buckets
+// @param num_threads -- number of worker threads
+// @param out         -- set to a column-major matrix with one row per
+//                       index of data and k columns, holding the 0-based
+//                       indices of the neighbors of each point in order
+//                       of increasing distance, and -1 where fewer than
+//                       k neighbors were found
+//
+template <typename CoordinateType, typename DataTiles, typename Table>
+void knn_graph(DataTiles& data, const Table& table, int num_tables,
+               bool squared_euclidean, int k, int max_bucket_size,
+               uint64_t seed, int num_threads, std::vector<int32_t>* out) {
+    int num_points = data.num_points();
+    num_threads = std::max(1, num_threads);
+    out->resize(static_cast<size_t>(num_points) * k);
+
+    std::vector<CoordinateType> norms(num_points, 0);
+    if ( squared_euclidean ) {
+        for ( int ii = 0; ii < num_points; ++ii ) {
+            norms[ii] = data.contains(ii) ? data.squared_norm(ii) : 0;
+        }
+    }
+
+    NeighborHeaps<CoordinateType>                  heaps(num_points, k);
+    std::vector<KnnGraphScratch<CoordinateType> >  scratch(num_threads);
+    std::vector<int32_t>                           keys;
+    std::vector<int_fast64_t>                      starts;
+
+    // Score all pairs of a group of points, which share a bucket
+    auto score_group = [&](int thread_index, const int32_t* group, int size) {
+        KnnGraphScratch<CoordinateType>& current = scratch[thread_index];
+        data.group_inner_products(thread_index, group, size, &current.tile,
+                                  &current.products);
+        for ( int ii = 0; ii < size; ++ii ) {
+            for ( int jj = ii + 1; jj < size; ++jj ) {
+                CoordinateType product = current.products(ii, jj);
+                CoordinateType score = squared_euclidean
+                    ? norms[group[ii]] + norms[group[jj]] - 2 * product
+                    : -product;
+                heaps.offer(group[ii], score, group[jj]);
+                heaps.offer(group[jj], score, group[ii]);
+            }
+        }
+    };
+
+    for ( int tt = 0; tt < num_tables; ++tt ) {
+        table.get_buckets(tt, &keys, &starts);
+        int num_buckets = static_cast<int>(starts.size()) - 1;
+
+        parallel_for(num_buckets, num_threads, kKnnGraphBucketChunk,
+                     [&](int thread_index, int bucket) {
+            const int32_t* members = keys.data() + starts[bucket];
+            int size = static_cast<int>(starts[bucket + 1] - starts[bucket]);
+            if ( size <= max_bucket_size ) {
+                score_group(thread_index, members, size);
+                return;
+            }
+
+            std::vector<int32_t>& group = scratch[thread_index].group;
+            group.assign(members, members + size);
+            std::mt19937_64 generator(seed ^ (static_cast<uint64_t>(tt) << 40)
+                                           ^ static_cast<uint64_t>(bucket));
+            std::shuffle(group.begin(), group.end(), generator);
+
+            int num_groups = (size + max_bucket_size - 1) / max_bucket_size;
+            for ( int gg = 0; gg < num_groups; ++gg ) {
+                int first = static_cast<int>(static_cast<int64_t>(size) * gg / num_groups);
+                int end = static_cast<int>(static_cast<int64_t>(size) * (gg + 1) / num_groups);
+                score_group(thread_index, group.data() + first, end - first);
+            }
+        });
+    }
+
+    parallel_for(num_points, num_threads, 1024, [&](int, int index) {
+        heaps.write(index, num_points, out->data());
+    });
+}
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,277 @@
+/// \file numa.h
+/// \brief NUMA topology, thread binding and memory placement
+///
+/// On Linux, the nodes and their CPUs are read from sysfs and memory
+/// policies are set with the mbind and set_mempolicy system calls, so
+/// no library is needed. Elsewhere (and on machines without NUMA)
+/// there is a single node and binding and placement do nothing.
+///
+/// None of these functions use the R API, so they may be called from
+/// worker threads.
+///
+/// The memory policy of a thread only applies to its own allocations,
+/// but parallel work (e.g., building a table) runs on the threads of a
+/// shared pool. The placement set by NodeBinding and
+/// InterleavedAllocation is therefore recorded per thread, and the
+/// tasks of the pool run with the placement of the thread that
+/// submitted them (see falconn::core::ThreadPool::set_state_hooks).
+
+#ifndef FALCONNR_NUMA_H
+#define FALCONNR_NUMA_H
+
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "falconn/core/thread_pool.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace falconnr {
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_set_mempolicy)
+#define FALCONNR_HAVE_NUMA 1
+
+// Memory policy modes and flags from <linux/mempolicy.h>
+const int kMpolDefault    = 0;
+const int kMpolPreferred  = 1;
+const int kMpolInterleave = 3;
+const unsigned kMpolMfMove = 1u << 1;
+#endif
+
+// A NUMA node with CPUs, by its kernel number
+struct NumaNode {
+    int              id;
+    std::vector<int> cpus;
+};
+
+/// The NUMA nodes with CPUs, in order of node number
+///
+/// @return the nodes; a single node with no CPUs, meaning any CPU,
+///         when the topology is not available
+///
+inline const std::vector<NumaNode>& numa_nodes() {
+    static const std::vector<NumaNode> nodes = [] {
+        std::vector<NumaNode> result;
+#ifdef FALCONNR_HAVE_NUMA
+        for ( int id = 0; id < 64; ++id ) {
+            std::ifstream file("/sys/devices/system/node/node" +
+                               std::to_string(id) + "/cpulist");
+            if ( !file ) {
+                continue;   // node numbers may have gaps
+            }
+            // A list of ranges such as "0-7,16-23"
+            NumaNode    node = {id, std::vector<int>()};
+            std::string range;
+            while ( std::getline(file, range, ',') ) {
+                std::istringstream parts(range);
+                int first, last;
+                char dash;
+                if ( !(parts >> first) ) continue;
+                last = (parts >> dash >> last) ? last : first;
+                for ( int cpu = first; cpu <= last; ++cpu ) {
+                    node.cpus.push_back(cpu);
+                }
+            }
+            if ( !node.cpus.empty() ) {
+                result.push_back(node);
+            }
+        }
+#endif
+        if ( result.empty() ) {
+            result.push_back(NumaNode{-1, std::vector<int>()});
+        }
+        return result;
+    }();
+    return nodes;
+}
+
+/// Number of NUMA nodes with CPUs, 1 without NUMA
+inline int num_numa_nodes() {
+    return static_cast<int>(numa_nodes().size());
+}
+
+/// Mask of all nodes with CPUs, for the memory policy system calls
+inline unsigned long all_numa_nodes_mask() {
+    unsigned long mask = 0;
+    for ( const NumaNode& node : numa_nodes() ) {
+        if ( node.id >= 0 ) mask |= 1ul << node.id;
+    }
+    return mask;
+}
+
+/// Memory placement of the calling thread: 0 by default, the node id
+/// plus 1 while preferring a node, and -1 while interleaving
+inline int_fast64_t& thread_placement() {
+    static thread_local int_fast64_t placement = 0;
+    return placement;
+}
+
+/// Sets the memory policy of the calling thread to a placement
+///
+/// @param placement -- as returned by thread_placement()
+///
+/// @return the previous placement
+///
+inline int_fast64_t apply_placement(int_fast64_t placement) {
+    int_fast64_t previous = thread_placement();
+#ifdef FALCONNR_HAVE_NUMA
+    if ( placement != previous ) {
+        unsigned long nodemask = placement > 0 ? 1ul << (placement - 1)
+                                               : all_numa_nodes_mask();
+        if ( placement == 0 ) {
+            syscall(SYS_set_mempolicy, kMpolDefault, nullptr, 0);
+        } else {
+            syscall(SYS_set_mempolicy, placement > 0 ? kMpolPreferred : kMpolInterleave,
+                    &nodemask, sizeof(nodemask) * 8);
+        }
+    }
+#endif
+    thread_placement() = placement;
+    return previous;
+}
+
+/// Makes the tasks of the thread pool run with the placement of the
+/// thread that submitted them; called before a placement is first set
+inline void use_placement_in_thread_pool() {
+    static const bool installed = [] {
+        falconn::core::thread_pool().set_state_hooks(
+            [] { return thread_placement(); }, &apply_placement);
+        return true;
+    }();
+    (void) installed;
+}
+
+/// Binds the calling thread to the CPUs of a node for its lifetime
+///
+/// New pages touched by the thread (and by the tasks it submits to
+/// the thread pool) are placed on the node where possible. The
+/// previous CPU affinity and memory policy are restored on
+/// destruction, which must happen on the same thread.
+///
+/// @param node -- index of the node in numa_nodes(), taken modulo the
+///                number of nodes
+///
+class NodeBinding {
+  public:
+    explicit NodeBinding(int node) : _bound(false), _placed(false), _previous(0) {
+#ifdef FALCONNR_HAVE_NUMA
+        const NumaNode& target = numa_nodes()[node % num_numa_nodes()];
+        if ( target.cpus.empty() || sched_getaffinity(0, sizeof(_saved), &_saved) != 0 ) {
+            return;
+        }
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for ( int cpu : target.cpus ) {
+            if ( cpu < CPU_SETSIZE ) CPU_SET(cpu, &mask);
+        }
+        _bound = sched_setaffinity(0, sizeof(mask), &mask) == 0;
+
+        use_placement_in_thread_pool();
+        _previous = apply_placement(target.id + 1);
+        _placed = true;
+#else
+        (void) node;
+#endif
+    }
+
+    ~NodeBinding() {
+#ifdef FALCONNR_HAVE_NUMA
+        if ( _bound ) {
+            sched_setaffinity(0, sizeof(_saved), &_saved);
+        }
+#endif
+        if ( _placed ) {
+            apply_placement(_previous);
+        }
+    }
+
+    NodeBinding(const NodeBinding&) = delete;
+    NodeBinding& operator=(const NodeBinding&) = delete;
+
+  private:
+    bool         _bound;
+    bool         _placed;
+    int_fast64_t _previous;   // placement to restore
+#ifdef FALCONNR_HAVE_NUMA
+    cpu_set_t _saved;
+#endif
+};
+
+/// Interleaves the pages allocated by the calling thread across all
+/// nodes for its lifetime
+///
+/// Tasks submitted to the thread pool meanwhile (e.g., the setup of
+/// a table under construction) run with the same policy.
+///
+/// @param enable -- if false, this does nothing
+///
+class InterleavedAllocation {
+  public:
+    explicit InterleavedAllocation(bool enable = true) : _set(false), _previous(0) {
+#ifdef FALCONNR_HAVE_NUMA
+        _set = enable && num_numa_nodes() > 1;
+        if ( _set ) {
+            use_placement_in_thread_pool();
+            _previous = apply_placement(-1);
+        }
+#else
+        (void) enable;
+#endif
+    }
+
+    ~InterleavedAllocation() {
+        if ( _set ) {
+            apply_placement(_previous);
+        }
+    }
+
+    InterleavedAllocation(const InterleavedAllocation&) = delete;
+    InterleavedAllocation& operator=(const InterleavedAllocation&) = delete;
+
+  private:
+    bool         _set;
+    int_fast64_t _previous;   // placement to restore
+};
+
+/// Moves the pages of an existing block of memory so that they are
+/// interleaved across all nodes
+///
+/// Only the whole pages inside the block are moved; pages shared with
+/// other processes stay where they are.
+///
+/// @param data  -- start of the block
+/// @param bytes -- size of the block
+///
+inline void interleave_pages(const void* data, size_t bytes) {
+#ifdef FALCONNR_HAVE_NUMA
+    if ( num_numa_nodes() < 2 ) {
+        return;
+    }
+    uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t start = (reinterpret_cast<uintptr_t>(data) + page - 1) / page * page;
+    uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes) / page * page;
+    if ( end > start ) {
+        unsigned long nodemask = all_numa_nodes_mask();
+        syscall(SYS_mbind, start, end - start, kMpolInterleave, &nodemask,
+                sizeof(nodemask) * 8, kMpolMfMove);
+    }
+#else
+    (void) data;
+    (void) bytes;
+#endif
+}
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,147 @@
+/// \file parallel.h
+/// \brief Minimal helpers for running loops across worker threads
+///
+/// The loops run on the persistent thread pool shared by the whole
+/// package (see falconn/core/thread_pool.h), which also builds the
+/// tables, so no threads are started per call and the pool size caps
+/// the threads in use. The functions here never touch the R API from
+/// the worker threads, so the loop bodies must only read and write raw
+/// memory (e.g., the data pointers of R vectors allocated beforehand on
+/// the main thread).
+
+#ifndef FALCONNR_PARALLEL_H
+#define FALCONNR_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "falconn/core/thread_pool.h"
+#include "numa.h"
+
+namespace falconnr {
+
+/// Resolve a requested number of threads
+///
+/// @param num_threads -- requested number of threads; 0 means use
+///                       all threads of the pool
+///
+/// @return the number of threads to use, always at least 1
+///
+inline int resolve_num_threads(int num_threads) {
+    if ( num_threads <= 0 ) {
+        num_threads = static_cast<int>(falconn::core::thread_pool().size());
+    }
+    return num_threads;
+}
+
+/// Resize the thread pool
+///
+/// Must not be called while a loop runs.
+///
+/// @param num_threads -- number of threads, counting the thread that
+///                       starts a loop; 0 means one per hardware thread
+///
+inline void set_pool_size(int num_threads) {
+    if ( num_threads <= 0 ) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    falconn::core::thread_pool().resize(num_threads);
+}
+
+/// Run body(thread_index, item) for each item in [0, num_items),
+/// with setup(thread_index) run first by each thread index
+///
+/// Each thread index is a task of the thread pool, so thread indices
+/// run on the pool's threads, as many at once as the pool has, and
+/// never two tasks with the same index at once. The value returned by
+/// setup is kept until the task has finished its items, so it can be a
+/// guard that changes the state of the thread (e.g., a NodeBinding)
+/// and restores it when destroyed.
+///
+/// @param num_items   -- number of loop iterations
+/// @param num_threads -- number of thread indices to use, at least 1
+/// @param chunk_size  -- number of consecutive items claimed at a time
+/// @param setup       -- callable taking (int thread_index)
+/// @param body        -- callable taking (int thread_index, int item)
+///
+template <typename Setup, typename Body>
+void parallel_for_with_setup(int num_items, int num_threads, int chunk_size,
+                             Setup setup, Body body) {
+    num_threads = std::max(1, std::min(num_threads, num_items));
+    chunk_size = std::max(1, chunk_size);
+
+    std::atomic<int>  next_item(0);
+    std::atomic<bool> failed(false);
+
+    falconn::core::thread_pool().run(num_threads, [&](int_fast32_t task) {
+        int thread_index = static_cast<int>(task);
+        try {
+            auto guard = setup(thread_index);
+            (void) guard;
+            while ( !failed.load(std::memory_order_relaxed) ) {
+                int start = next_item.fetch_add(chunk_size);
+                if ( start >= num_items ) {
+                    break;
+                }
+                int end = std::min(num_items, start + chunk_size);
+                for ( int item = start; item < end; ++item ) {
+                    body(thread_index, item);
+                }
+            }
+        } catch ( ... ) {
+            failed = true;
+            throw;
+        }
+    });
+}
+
+/// Run body(thread_index, item) for each item in [0, num_items)
+///
+/// Items are handed out to the thread indices dynamically in chunks of
+/// chunk_size, so uneven per-item costs (e.g., queries landing in
+/// large buckets) are balanced across threads. The thread indices
+/// passed to the body are in [0, num_threads), which lets the caller
+/// keep one scratch object (e.g., a query object) per thread.
+///
+/// The first exception thrown by any body is rethrown on the calling
+/// thread after all workers have finished.
+///
+/// @param num_items   -- number of loop iterations
+/// @param num_threads -- number of threads to use, at least 1
+/// @param chunk_size  -- number of consecutive items claimed at a time
+/// @param body        -- callable taking (int thread_index, int item)
+///
+template <typename Body>
+void parallel_for(int num_items, int num_threads, int chunk_size, Body body) {
+    parallel_for_with_setup(num_items, num_threads, chunk_size,
+                            [](int) { return 0; }, body);
+}
+
+/// As parallel_for, with thread i bound to NUMA node i % num_nodes
+/// (see NodeBinding) while it runs its items
+///
+/// @param num_nodes -- number of nodes to spread the threads over; 1
+///                     leaves the threads unbound
+///
+template <typename Body>
+void parallel_for_on_nodes(int num_items, int num_threads, int num_nodes,
+                           int chunk_size, Body body) {
+    parallel_for_with_setup(num_items, num_threads, chunk_size,
+                            [num_nodes](int thread_index) {
+        return std::unique_ptr<NodeBinding>(
+            num_nodes > 1 ? new NodeBinding(thread_index % num_nodes) : nullptr);
+    }, body);
+}
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
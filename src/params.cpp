@@ -1,13 +1,18 @@
 #include "falconnr.h"
 #include "params.h"
+#include "numa.h"
+#include "quantized.h"
+#include "reorder.h"
 
 using namespace Rcpp;
 
+using falconn::DataTransformation;
 using falconn::DistanceFunction;
 using falconn::LSHFamily;
 using falconn::StorageHashTable;
 using falconn::LSHConstructionParameters;
 using falconn::get_default_parameters;
+using falconn::compute_number_of_hash_functions;
 
 
 /// Get value from string-keyed map with default value if key is missing
@@ -66,7 +71,9 @@ const LshParameterSetter::storageTypesMap LshParameterSetter::storageTypes = {
     {"flat_hash_table",            StorageHashTable::FlatHashTable},
     {"bit_packed_flat_hash_table", StorageHashTable::BitPackedFlatHashTable},
     {"stl_hash_table",             StorageHashTable::STLHashTable},
-    {"linear_probing_hash_table",  StorageHashTable::LinearProbingHashTable}
+    {"linear_probing_hash_table",  StorageHashTable::LinearProbingHashTable},
+    {"compressed_flat_hash_table", StorageHashTable::CompressedFlatHashTable},
+    {"inline_flat_hash_table",     StorageHashTable::InlineFlatHashTable}
 };
 
 const LshParameterSetter::familiesMap LshParameterSetter::families = {
@@ -75,16 +82,42 @@ const LshParameterSetter::familiesMap LshParameterSetter::families = {
     {"cross_polytope", LSHFamily::CrossPolytope}
 };
 
+const LshParameterSetter::transformationsMap LshParameterSetter::transformations = {
+    {"identity",        DataTransformation::Identity},
+    {"asymmetric_mips", DataTransformation::AsymmetricMips}
+};
+
 
 // Construct an instance of an \code{LshParameterSetter}
 //
 // @param n  -- number of data points
 // @param d  -- dimension of the data points
 //
-LshParameterSetter::LshParameterSetter(int n, int d) : _n(n), _d(d) {
+LshParameterSetter::LshParameterSetter(int n, int d)
+    : _n(n), _d(d), _precision("double"), _dynamic(false), _numa("none"),
+      _quantization("none"), _rerank_factor(kDefaultRerankFactor),
+      _reorder(false), _num_probes(-1), _max_num_candidates(-1) {
     withDefaults();
 }
 
+// Constructs a setter holding the given parameters
+//
+// This is used to describe existing tables, e.g., tables loaded from a
+// file, and is not exposed as a constructor to R.
+//
+// @param n         -- number of data points
+// @param d         -- dimension of the data points
+// @param p         -- the parameters
+// @param precision -- precision of the stored coordinates
+//
+LshParameterSetter::LshParameterSetter(int n, int d,
+                                       const LSHConstructionParameters& p,
+                                       std::string precision)
+    : _n(n), _d(d), _p(p), _precision(precision), _dynamic(false),
+      _numa("none"), _quantization("none"),
+      _rerank_factor(kDefaultRerankFactor), _reorder(false),
+      _num_probes(-1), _max_num_candidates(-1) {}
+
 
 // Returns a copy of the underlying parameters structure
 //
@@ -116,6 +149,24 @@ LshParameterSetter& LshParameterSetter::withDefaults(std::string distance) {
     return *this;
 }
 
+// Sets all parameters to their default values for sparse data
+//
+// Like \code{withDefaults}, but for tables over sparse data (a
+// \code{dgCMatrix}): the cross-polytope hash uses two rotations and
+// a feature hashing dimension of 1024.
+//
+// @param distance -- as for \code{withDefaults}
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::withSparseDefaults(std::string distance) {
+    _p = get_default_parameters<falconn::SparseVector<double> >(
+        _n, _d,
+        get<DistanceFunction>(distances, distance, DistanceFunction::Unknown),
+        false);
+    return *this;
+}
+
 // Sets the distance function used in similarity search
 //
 // @param distance -- one of the strings: "negative_inner_product", 
@@ -158,7 +209,9 @@ LshParameterSetter& LshParameterSetter::numHashTables(int tables) {
 //
 // @param storage -- one of the strings: "flat_hash_table",
 //                   "bit_packed_flat_hash_table", "stl_hash_table",
-//                   "linear_probing_hash_table", or "unknown"; 
+//                   "linear_probing_hash_table",
+//                   "compressed_flat_hash_table",
+//                   "inline_flat_hash_table", or "unknown"; 
 //                   all other values lead to a setting of "unknown".
 //
 // @return a reference to the original object, enabling chaining
@@ -197,27 +250,525 @@ LshParameterSetter& LshParameterSetter::rotations(int numRotations) {
     return *this;
 }
 
+// Sets the feature hashing dimension used with sparse data
+//
+// The cross-polytope hash of a sparse point first maps it, by feature
+// hashing, to a dense vector of this dimension, so each hash costs
+// time proportional to the number of nonzeros plus this dimension
+// (times its logarithm), however large the dimension of the data.
+// Larger values preserve distances better. The setting is ignored
+// for dense data and for the hyperplane family.
+//
+// For the cross-polytope family, this also recomputes the number of
+// hash functions and the last cross-polytope dimension to give the
+// default number of hash bits for the data size, so call
+// \code{numHashFunctions} afterwards to override them.
+//
+// @param dimension -- a positive power of two
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::featureHashingDimension(int dimension) {
+    if ( dimension < 1 || (dimension & (dimension - 1)) != 0 ) {
+        stop("feature hashing dimension must be a positive power of two");
+    }
+    _p.feature_hashing_dimension = dimension;
+
+    if ( _p.lsh_family == LSHFamily::CrossPolytope ) {
+        int bits = 1;
+        while ( (1 << (bits + 2)) <= _n ) {
+            ++bits;
+        }
+        compute_number_of_hash_functions<falconn::SparseVector<double> >(bits, &_p);
+    }
+    return *this;
+}
+
+// Sets the transformation of the points and queries before they are hashed
+//
+// With "asymmetric_mips", a table built with the "negative_inner_product"
+// distance finds the points with the largest inner products with a
+// query, whatever their norms: each point p is scaled by the largest
+// norm M of the data and extended by the coordinate
+// sqrt(1 - |p|^2 / M^2), and each query by 0, so that the extended
+// points lie on the unit sphere and their angles to an extended query
+// order them by inner product. The extension is computed while the
+// points are hashed, so no copy of the data is made, and distances are
+// still the negative inner products of the original points. Only
+// static tables over dense data can be transformed. With "identity"
+// (the default), points and queries are hashed as they are.
+//
+// The hash functions then have dimension d + 1, so for the
+// cross-polytope family, changing the transformation also recomputes the number of hash
+// functions and the last cross-polytope dimension to give the default
+// number of hash bits for the data size; call \code{numHashFunctions}
+// afterwards to override them.
+//
+// @param transformation -- one of the strings: "identity" or
+//                          "asymmetric_mips"
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::transformation(std::string transformation) {
+    transformationsMap::const_iterator it = transformations.find(transformation);
+    if ( it == transformations.end() ) {
+        stop("transformation must be \"identity\" or \"asymmetric_mips\"");
+    }
+    if ( it->second == _p.data_transformation ) {
+        return *this;
+    }
+    _p.data_transformation = it->second;
+
+    if ( _p.lsh_family == LSHFamily::CrossPolytope ) {
+        int bits = 1;
+        while ( (1 << (bits + 2)) <= _n ) {
+            ++bits;
+        }
+        LSHConstructionParameters hash_params = _p;
+        if ( _p.data_transformation == DataTransformation::AsymmetricMips ) {
+            hash_params.dimension = _d + 1;
+        }
+        compute_number_of_hash_functions<falconn::DenseVector<double> >(bits,
+                                                                        &hash_params);
+        _p.k = hash_params.k;
+        _p.last_cp_dimension = hash_params.last_cp_dimension;
+    }
+    return *this;
+}
+
+// Returns the transformation of the points and queries before they
+// are hashed
+//
+// @return "identity" or "asymmetric_mips"
+//
+std::string LshParameterSetter::getTransformation() const {
+    return invert(transformations, _p.data_transformation, "unknown");
+}
+
+// Sets the precision of the coordinates stored in the search table
+//
+// A float table converts the data once, at construction, and stores
+// it in half the memory of a double table; queries are still passed
+// as R numeric vectors and converted on the fly. Distances are then
+// computed in single precision.
+//
+// @param precision -- one of the strings: "double" or "float"
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::precision(std::string precision) {
+    if ( precision != "double" && precision != "float" ) {
+        stop("precision must be \"double\" or \"float\"");
+    }
+    _precision = precision;
+    return *this;
+}
+
+// Returns the precision of the coordinates stored in the search table
+//
+// @return "double" or "float"
+//
+std::string LshParameterSetter::getPrecision() const {
+    return _precision;
+}
+
+// Sets whether the search table supports inserting and removing points
+//
+// A dynamic table keeps its own, growable copy of the data and uses
+// linear probing hash tables that resize as points come and go, so
+// the storage setting is ignored. Removed points are marked as
+// deleted in the hash tables and reclaimed when these are rehashed.
+// Dynamic tables cannot be saved to a file.
+//
+// @param dynamic -- TRUE for a dynamic table, FALSE (the default)
+//                   for a static one
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::dynamic(bool dynamic) {
+    _dynamic = dynamic;
+    return *this;
+}
+
+// Returns whether the search table supports inserting and removing points
+//
+// @return TRUE for a dynamic table
+//
+bool LshParameterSetter::isDynamic() const {
+    return _dynamic;
+}
+
+// Sets how a table built with these parameters is placed on the
+// NUMA nodes of the machine
+//
+// With "replicate", each node gets its own copy of the hash tables
+// and of the data, and the batch query threads are bound to the nodes
+// in turn, each querying the copy on its node. This multiplies the
+// memory used by the number of nodes (see the numa_replicas component
+// of \code{LshNnTable$memoryUsage}), and even a double table copies
+// the data. With "interleave", the single table and its data are
+// spread page by page across the nodes, so that no node's memory is
+// a bottleneck, and the query threads are bound to the nodes in
+// turn. With "none" (the default), the pages go wherever the threads
+// first touching them run. Only static tables can be replicated; on a
+// machine with one node, all modes build a single table.
+//
+// @param mode -- one of the strings: "none", "replicate" or "interleave"
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::numa(std::string mode) {
+    if ( mode != "none" && mode != "replicate" && mode != "interleave" ) {
+        stop("NUMA mode must be \"none\", \"replicate\" or \"interleave\"");
+    }
+    _numa = mode;
+    return *this;
+}
+
+// Returns how a table built with these parameters is placed on the
+// NUMA nodes
+//
+// @return "none", "replicate" or "interleave"
+//
+std::string LshParameterSetter::getNuma() const {
+    return _numa;
+}
+
+// Sets how the nearest-neighbor queries of a table built with these
+// parameters score their candidates
+//
+// With "int8", the table keeps a copy of the data with one byte per
+// coordinate, each dimension scaled over the range of its values
+// (see the data_storage component of \code{LshNnTable$memoryUsage}).
+// The k-nearest-neighbor queries rank their candidates by distances
+// to these codes, which read a fraction of the memory of the data,
+// and compute exact distances only for the best \code{rerankFactor}
+// times k candidates, of which they return the k nearest; a point
+// ranked too low by its codes can be missed. Bounded and near-neighbor
+// queries still use exact distances for all candidates. With "none"
+// (the default), all candidates are scored exactly. Only static tables
+// over dense data can be quantized, and tables loaded from a file are
+// not.
+//
+// @param mode -- one of the strings: "none" or "int8"
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::quantization(std::string mode) {
+    if ( mode != "none" && mode != "int8" ) {
+        stop("quantization must be \"none\" or \"int8\"");
+    }
+    _quantization = mode;
+    return *this;
+}
+
+// Returns how the queries of a table built with these parameters
+// score their candidates
+//
+// @return "none" or "int8"
+//
+std::string LshParameterSetter::getQuantization() const {
+    return _quantization;
+}
+
+// Sets the number of candidates that quantized queries score exactly
+// per neighbor asked for (see \code{quantization})
+//
+// @param factor -- a positive integer (4 by default); larger factors
+//                  miss fewer neighbors and read more of the data
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::rerankFactor(int factor) {
+    if ( factor < 1 ) {
+        stop("rerank factor must be positive");
+    }
+    _rerank_factor = factor;
+    return *this;
+}
+
+// Returns the number of candidates that quantized queries score
+// exactly per neighbor asked for
+//
+// @return the rerank factor
+//
+int LshParameterSetter::getRerankFactor() const {
+    return _rerank_factor;
+}
+
+// Sets whether a table built with these parameters stores its data
+// in a locality-preserving order
+//
+// The points are sorted by the signs of their projections on random
+// directions (drawn with the seed of the parameters), so that nearby
+// points, and thus the candidates of a query, lie close together in
+// memory and are read with fewer cache misses. The table keeps the
+// reordered copy of the data (even a double table) and translates
+// indices, so the indices seen from R are those of the data matrix.
+// Only static tables over dense data can be reordered, and reordered
+// tables cannot be saved.
+//
+// @param reorder -- TRUE to reorder, FALSE (the default) otherwise
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::reorder(bool reorder) {
+    _reorder = reorder;
+    return *this;
+}
+
+// Returns whether a table built with these parameters stores its data
+// in a locality-preserving order
+//
+// @return TRUE for a reordered table
+//
+bool LshParameterSetter::isReordered() const {
+    return _reorder;
+}
+
+// Sets the number of probes of tables built with these parameters
+//
+// Tables start with this number of probes (see
+// \code{LshNnTable$setNumProbes}), which must be at least the number
+// of hash tables when the table is built.
+//
+// @param num_probes -- a positive integer, or -1 (the default) for
+//                      one probe per hash table
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::numProbes(int num_probes) {
+    if ( num_probes < 1 && num_probes != -1 ) {
+        stop("number of probes must be positive, or -1 for the default");
+    }
+    _num_probes = num_probes;
+    return *this;
+}
+
+// Returns the number of probes of tables built with these parameters
+//
+// @return the number of probes, by default the number of hash tables
+//
+int LshParameterSetter::getNumProbes() const {
+    return _num_probes > 0 ? _num_probes : _p.l;
+}
+
+// Sets the maximum number of candidates of tables built with these
+// parameters (see \code{LshNnTable$setMaxNumCandidates})
+//
+// @param num_candidates -- a positive integer, or -1 (the default)
+//                          for no limit
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::maxNumCandidates(int num_candidates) {
+    if ( num_candidates < 1 && num_candidates != -1 ) {
+        stop("maximum number of candidates must be positive, or -1 for no limit");
+    }
+    _max_num_candidates = num_candidates;
+    return *this;
+}
+
+// Returns the maximum number of candidates of tables built with these
+// parameters
+//
+// @return the maximum number of candidates, -1 for no limit
+//
+int LshParameterSetter::getMaxNumCandidates() const {
+    return _max_num_candidates;
+}
+
+// Sets the number of threads that build a table with these parameters
+//
+// The build runs on the package's thread pool (see \code{setThreads}),
+// so at most as many threads as the pool has run at once.
+//
+// @param num_threads -- a positive integer, or 0 (the default) for all
+//                       threads of the pool
+//
+// @return a reference to the original object, enabling chaining
+//
+LshParameterSetter& LshParameterSetter::setupThreads(int num_threads) {
+    if ( num_threads < 0 ) {
+        stop("number of setup threads cannot be negative");
+    }
+    _p.num_setup_threads = num_threads;
+    return *this;
+}
+
+// Returns the number of threads that build a table with these
+// parameters, 0 for all threads of the pool
+//
+// @return the number of setup threads
+//
+int LshParameterSetter::getSetupThreads() const {
+    return _p.num_setup_threads;
+}
+
+// Returns an independent copy of these parameters
+//
+// Setters modify the object they are called on, which R shares by
+// reference, so use a copy to vary parameters without changing the
+// original.
+//
+// @return a new parameter setter with the same settings
+//
+LshParameterSetter LshParameterSetter::copy() const {
+    return *this;
+}
+
+// A table has a query object inside the FALCONN table and one for
+// queries from R (see LshNnTable::memoryUsage)
+static const int kNumQueryObjects = 2;
+
+// Predicts the memory used by a table over n points of the given type
+//
+// @param n           -- number of data points
+// @param p           -- the parameters
+// @param dynamic     -- whether the table is dynamic
+// @param data_bytes  -- bytes of the data held by the table outside of
+//                       FALCONN
+// @param num_replicas -- number of copies of the table, one per NUMA
+//                        node when replicated
+// @param shared_bytes -- bytes of the structures of which there is a
+//                        single copy even when the table is
+//                        replicated: the quantized data and the
+//                        translation of reordered indices
+//
+template <typename PointType>
+static List estimateTableMemoryUsage(int n, const LSHConstructionParameters& p,
+                                     bool dynamic, double data_bytes,
+                                     int num_replicas,
+                                     double shared_bytes = 0.0) {
+    falconn::MemoryUsage usage;
+    try {
+        usage = falconn::estimate_memory_usage<PointType>(n, p, dynamic);
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not estimate memory usage: ") + e.what());
+    }
+    usage.data_storage += static_cast<int_fast64_t>(data_bytes);
+    usage.query_scratch *= kNumQueryObjects;
+    usage.numa_replicas = (num_replicas - 1) * usage.total();
+    usage.data_storage += static_cast<int_fast64_t>(shared_bytes);
+    return falconnr::memory_usage_list(usage);
+}
+
+// Predicts the memory used by a table over dense data
+//
+// The prediction follows the sizes of the structures the table
+// allocates and matches \code{LshNnTable$memoryUsage} for a freshly
+// built table, except for the \code{stl_hash_table} storage, whose
+// nodes are counted without allocator overhead. Each thread used by
+// the batch query methods beyond the first adds the same query
+// scratch: 4 bytes per point for up to 2^20 points; for more, the
+// scratch starts empty and grows with the candidates of the queries
+// to at most n / 8 bytes.
+//
+// @return a list of byte counts: the data held by the table
+//         (data_storage; a double table keeps the data matrix, float
+//         and dynamic and reordered tables a copy, a quantized table
+//         also its codes and a reordered one its translation of
+//         indices), the hash functions (hash_functions), the bucket
+//         directory and point indices of each hash table
+//         (hash_table_buckets and hash_table_entries, one element per
+//         table), the query scratch (query_scratch),
+//         the copies of the table on other NUMA nodes when it is
+//         replicated (numa_replicas), and their total
+//
+List LshParameterSetter::estimateMemoryUsage() const {
+    double data_bytes = 0.0;
+    double shared_bytes = 0.0;
+    if ( _quantization != "none" ) {
+        shared_bytes += falconnr::QuantizedPoints::estimate_memory_usage(_n, _d);
+    }
+    if ( _reorder ) {
+        shared_bytes += falconnr::ReorderedTableBackend::estimate_memory_usage(_n);
+    }
+    if ( _precision == "float" ) {
+        if ( !_dynamic ) {
+            data_bytes = static_cast<double>(_n) * _d * sizeof(float);
+        }
+        return estimateTableMemoryUsage<falconn::DenseVector<float> >(
+            _n, _p, _dynamic, data_bytes, numReplicas(), shared_bytes);
+    }
+    if ( !_dynamic ) {
+        data_bytes = static_cast<double>(_n) * _d * sizeof(double);
+    }
+    return estimateTableMemoryUsage<falconn::DenseVector<double> >(
+        _n, _p, _dynamic, data_bytes, numReplicas(), shared_bytes);
+}
+
+// Predicts the memory used by a table over sparse data
+//
+// Like \code{estimateMemoryUsage}, for a \code{dgCMatrix} with the
+// given number of nonzero entries, which the table copies.
+//
+// @param nonzeros -- number of nonzero entries of the data
+//
+// @return a list of byte counts as for \code{estimateMemoryUsage}
+//
+List LshParameterSetter::estimateSparseMemoryUsage(double nonzeros) const {
+    if ( _dynamic ) {
+        stop("dynamic tables require dense data");
+    }
+    if ( nonzeros < 0 ) {
+        stop("number of nonzeros cannot be negative");
+    }
+    if ( _precision == "float" ) {
+        typedef falconn::SparseVector<float> SparsePoint;
+        double data_bytes = static_cast<double>(_n) * sizeof(SparsePoint) +
+            nonzeros * sizeof(SparsePoint::value_type);
+        return estimateTableMemoryUsage<SparsePoint>(_n, _p, false, data_bytes,
+                                                 numReplicas());
+    }
+    typedef falconn::SparseVector<double> SparsePoint;
+    double data_bytes = static_cast<double>(_n) * sizeof(SparsePoint) +
+        nonzeros * sizeof(SparsePoint::value_type);
+    return estimateTableMemoryUsage<SparsePoint>(_n, _p, false, data_bytes,
+                                                 numReplicas());
+}
+
+// Number of copies of a table built with these parameters
+//
+// @return the number of NUMA nodes for a replicated static table,
+//         otherwise 1
+//
+int LshParameterSetter::numReplicas() const {
+    return _numa == "replicate" && !_dynamic ? falconnr::num_numa_nodes() : 1;
+}
 
 // Represents parameters as an R list
 //
 // @return R-list with names corresponding to the parameters
 //
 Rcpp::List LshParameterSetter::asList() {
-    return List::create(_["points"] = _n,
-                        _["dimension"] = _d,
-                        _["hashFunctions"] = _p.k,
-                        _["hashTables"] = _p.l,
-                        _["seed"] = _p.seed,
-                        _["lshFamily"] = invert(families, _p.lsh_family,
-                                                "unknown"),
-                        _["distance"] = invert(distances, _p.distance_function,
-                                               "unknown"),
-                        _["storage"] = invert(storageTypes, _p.storage_hash_table,
-                                              "unknown"),
-                        _["rotations"] = _p.num_rotations,
-                        _["threads"] = _p.num_setup_threads,
-                        _["last_cp_dimension"] = _p.last_cp_dimension,
-                        _["feature_hashing_dimension"] = _p.feature_hashing_dimension);
+    List result = List::create(_["points"] = _n,
+                               _["dimension"] = _d,
+                               _["hashFunctions"] = _p.k,
+                               _["hashTables"] = _p.l,
+                               _["seed"] = _p.seed,
+                               _["lshFamily"] = invert(families, _p.lsh_family,
+                                                       "unknown"),
+                               _["distance"] = invert(distances, _p.distance_function,
+                                                      "unknown"),
+                               _["storage"] = invert(storageTypes, _p.storage_hash_table,
+                                                     "unknown"),
+                               _["rotations"] = _p.num_rotations,
+                               _["precision"] = _precision,
+                               _["dynamic"] = _dynamic,
+                               _["numa"] = _numa,
+                               _["quantization"] = _quantization,
+                               _["rerankFactor"] = _rerank_factor,
+                               _["reorder"] = _reorder,
+                               _["numProbes"] = getNumProbes(),
+                               _["maxNumCandidates"] = _max_num_candidates,
+                               _["threads"] = _p.num_setup_threads,
+                               _["last_cp_dimension"] = _p.last_cp_dimension,
+                               _["feature_hashing_dimension"] = _p.feature_hashing_dimension);
+    // List::create takes at most 20 elements
+    result.push_back(invert(transformations, _p.data_transformation, "unknown"),
+                     "transformation");
+    return result;
 }
 
 
@@ -232,6 +783,8 @@ RCPP_MODULE(mod_params) {
 
     .method("withDefaults", &LshParameterSetter::withDefaults,
             "Fill with defaults")
+    .method("withSparseDefaults", &LshParameterSetter::withSparseDefaults,
+            "Fill with defaults for sparse data")
     .method("distance", &LshParameterSetter::distance,
             "Set distance metric")
     .method("numHashFunctions",   &LshParameterSetter::numHashFunctions,
@@ -244,6 +797,54 @@ RCPP_MODULE(mod_params) {
             "Set LSH Family")
     .method("rotations",   &LshParameterSetter::rotations,
             "Number of rotations")
+    .method("featureHashingDimension", &LshParameterSetter::featureHashingDimension,
+            "Set feature hashing dimension for sparse data")
+    .method("transformation", &LshParameterSetter::transformation,
+            "Set transformation of points and queries before hashing")
+    .method("getTransformation", &LshParameterSetter::getTransformation,
+            "Transformation of points and queries before hashing")
+    .method("precision",   &LshParameterSetter::precision,
+            "Set precision of stored coordinates")
+    .method("getPrecision", &LshParameterSetter::getPrecision,
+            "Precision of stored coordinates")
+    .method("dynamic",     &LshParameterSetter::dynamic,
+            "Set whether the table supports inserting and removing points")
+    .method("isDynamic",   &LshParameterSetter::isDynamic,
+            "Whether the table supports inserting and removing points")
+    .method("numa",        &LshParameterSetter::numa,
+            "Set placement of the table on NUMA nodes")
+    .method("getNuma",     &LshParameterSetter::getNuma,
+            "Placement of the table on NUMA nodes")
+    .method("quantization", &LshParameterSetter::quantization,
+            "Set scoring of candidates against quantized data")
+    .method("getQuantization", &LshParameterSetter::getQuantization,
+            "Scoring of candidates against quantized data")
+    .method("rerankFactor", &LshParameterSetter::rerankFactor,
+            "Set candidates scored exactly per neighbor of quantized queries")
+    .method("getRerankFactor", &LshParameterSetter::getRerankFactor,
+            "Candidates scored exactly per neighbor of quantized queries")
+    .method("reorder",     &LshParameterSetter::reorder,
+            "Set whether the data are stored in a locality-preserving order")
+    .method("isReordered", &LshParameterSetter::isReordered,
+            "Whether the data are stored in a locality-preserving order")
+    .method("numProbes",   &LshParameterSetter::numProbes,
+            "Set number of probes of the table")
+    .method("getNumProbes", &LshParameterSetter::getNumProbes,
+            "Number of probes of the table")
+    .method("maxNumCandidates", &LshParameterSetter::maxNumCandidates,
+            "Set maximum number of candidates of the table")
+    .method("getMaxNumCandidates", &LshParameterSetter::getMaxNumCandidates,
+            "Maximum number of candidates of the table")
+    .method("setupThreads", &LshParameterSetter::setupThreads,
+            "Set number of threads that build the table")
+    .method("getSetupThreads", &LshParameterSetter::getSetupThreads,
+            "Number of threads that build the table")
+    .method("copy",        &LshParameterSetter::copy,
+            "Independent copy of the parameters")
+    .method("estimateMemoryUsage", &LshParameterSetter::estimateMemoryUsage,
+            "Predicted bytes used by a table over dense data, by component")
+    .method("estimateSparseMemoryUsage", &LshParameterSetter::estimateSparseMemoryUsage,
+            "Predicted bytes used by a table over sparse data, by component")
     .method("asList",        &LshParameterSetter::asList,
             "List of parameter values by name")
    ;
@@ -9,27 +9,63 @@
 #include <Rcpp.h>
 #include "falconn/lsh_nn_table.h"
 
+// Candidates scored exactly per neighbor by quantized queries, unless
+// set with LshParameterSetter::rerankFactor
+const int kDefaultRerankFactor = 4;
+
 class LshParameterSetter {
   public:
     typedef std::map<std::string, falconn::DistanceFunction> distancesMap;
     typedef std::map<std::string, falconn::StorageHashTable> storageTypesMap;
     typedef std::map<std::string, falconn::LSHFamily>        familiesMap;
+    typedef std::map<std::string, falconn::DataTransformation>
+                                                             transformationsMap;
 
-    static const familiesMap     families;
-    static const distancesMap    distances;
-    static const storageTypesMap storageTypes;
+    static const familiesMap        families;
+    static const distancesMap       distances;
+    static const storageTypesMap    storageTypes;
+    static const transformationsMap transformations;
 
     LshParameterSetter(int n, int d);
+    LshParameterSetter(int n, int d,
+                       const falconn::LSHConstructionParameters& p,
+                       std::string precision);
 
     falconn::LSHConstructionParameters params() const;
 
     LshParameterSetter& withDefaults(std::string distance  = "euclidean_squared");
+    LshParameterSetter& withSparseDefaults(std::string distance = "euclidean_squared");
     LshParameterSetter& distance(std::string distance);
     LshParameterSetter& numHashFunctions(int funcs);
     LshParameterSetter& numHashTables(int tables);
     LshParameterSetter& storage(std::string storage);
     LshParameterSetter& family(std::string family);
     LshParameterSetter& rotations(int numRotations);
+    LshParameterSetter& featureHashingDimension(int dimension);
+    LshParameterSetter& transformation(std::string transformation);
+    std::string         getTransformation() const;
+    LshParameterSetter& precision(std::string precision);
+    std::string         getPrecision() const;
+    LshParameterSetter& dynamic(bool dynamic);
+    bool                isDynamic() const;
+    LshParameterSetter& numa(std::string mode);
+    std::string         getNuma() const;
+    LshParameterSetter& quantization(std::string mode);
+    std::string         getQuantization() const;
+    LshParameterSetter& rerankFactor(int factor);
+    int                 getRerankFactor() const;
+    LshParameterSetter& reorder(bool reorder);
+    bool                isReordered() const;
+    LshParameterSetter& numProbes(int num_probes);
+    int                 getNumProbes() const;
+    LshParameterSetter& maxNumCandidates(int num_candidates);
+    int                 getMaxNumCandidates() const;
+    LshParameterSetter& setupThreads(int num_threads);
+    int                 getSetupThreads() const;
+    LshParameterSetter  copy() const;
+    Rcpp::List          estimateMemoryUsage() const;
+    Rcpp::List          estimateSparseMemoryUsage(double nonzeros) const;
+    int                 numReplicas() const;
     Rcpp::List asList();
 
   private:
@@ -37,6 +73,14 @@ class LshParameterSetter {
     int                                _n;
     int                                _d;
     falconn::LSHConstructionParameters _p;
+    std::string                        _precision;
+    bool                               _dynamic;
+    std::string                        _numa;           // placement mode
+    std::string                        _quantization;   // candidate scoring
+    int                                _rerank_factor;
+    bool                               _reorder;        // locality order
+    int                                _num_probes;     // -1: one per table
+    int                                _max_num_candidates;
 };
 
 #endif
@@ -0,0 +1,504 @@
+/// \file quantized.h
+/// \brief Candidate scoring against 8-bit codes of the data, with an
+///        exact re-rank of the best candidates
+///
+/// The distances from a query to its candidates read a full row of
+/// the data for each candidate, so with many candidates a query is
+/// bound by memory bandwidth. QuantizedPoints keeps a compact copy of
+/// the dense data: each coordinate is scaled to a byte over the range
+/// of its dimension, so a row takes dimension bytes instead of 4 or 8
+/// per coordinate. The query is not quantized (asymmetric distances):
+/// it is transformed once, so that the distance to a code is a sum of
+/// one multiply-add (or two) per coordinate, with AVX2 kernels when
+/// the CPU supports them.
+///
+/// QuantizedTableBackend puts the codes in front of any static dense
+/// table: the nearest-neighbor queries take the unique candidates of
+/// the table, rank them by their distances to the codes, and compute
+/// exact distances (in the table's data) only for the best
+/// rerank_factor * k, of which the k best are returned. The other
+/// queries go to the table unchanged.
+
+#ifndef FALCONNR_QUANTIZED_H
+#define FALCONNR_QUANTIZED_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "falconn/core/candidate_distances.h"
+#include "backend.h"
+
+namespace falconnr {
+
+namespace quantized_kernels {
+
+// A kernel returns the score of one row of codes for a transformed
+// query: sum_j weights[j] * (query[j] - codes[j])^2 for the squared
+// Euclidean distance, -sum_j query[j] * codes[j] for the negative
+// inner product (weights unused)
+typedef float (*Kernel)(const float* query, const float* weights,
+                        const uint8_t* codes, int dimension);
+
+inline float euclidean_portable(const float* query, const float* weights,
+                                const uint8_t* codes, int dimension) {
+    float result = 0.0f;
+    for ( int jj = 0; jj < dimension; ++jj ) {
+        float difference = query[jj] - codes[jj];
+        result += weights[jj] * difference * difference;
+    }
+    return result;
+}
+
+inline float inner_product_portable(const float* query, const float*,
+                                    const uint8_t* codes, int dimension) {
+    float result = 0.0f;
+    for ( int jj = 0; jj < dimension; ++jj ) {
+        result += query[jj] * codes[jj];
+    }
+    return -result;
+}
+
+#if defined(FALCONN_X86_DISTANCE_KERNELS)
+
+// Eight codes widened to floats
+__attribute__((target("avx2"))) inline __m256 load_codes(const uint8_t* codes) {
+    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+}
+
+__attribute__((target("avx2"))) inline float horizontal_sum(__m256 acc) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                            _mm256_extractf128_ps(acc, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma"))) inline float euclidean_avx2(
+    const float* query, const float* weights, const uint8_t* codes,
+    int dimension) {
+    __m256 acc = _mm256_setzero_ps();
+    int jj = 0;
+    for ( ; jj + 8 <= dimension; jj += 8 ) {
+        __m256 difference = _mm256_sub_ps(_mm256_loadu_ps(query + jj),
+                                          load_codes(codes + jj));
+        acc = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(weights + jj),
+                                            difference),
+                              difference, acc);
+    }
+    return horizontal_sum(acc) +
+           euclidean_portable(query + jj, weights + jj, codes + jj,
+                              dimension - jj);
+}
+
+__attribute__((target("avx2,fma"))) inline float inner_product_avx2(
+    const float* query, const float* weights, const uint8_t* codes,
+    int dimension) {
+    __m256 acc = _mm256_setzero_ps();
+    int jj = 0;
+    for ( ; jj + 8 <= dimension; jj += 8 ) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(query + jj),
+                              load_codes(codes + jj), acc);
+    }
+    return -horizontal_sum(acc) +
+           inner_product_portable(query + jj, weights + jj, codes + jj,
+                                  dimension - jj);
+}
+
+#endif
+
+// The fastest kernel for the distance and CPU
+inline Kernel select(bool squared_euclidean) {
+#if defined(FALCONN_X86_DISTANCE_KERNELS)
+    using falconn::core::distance_kernels::SimdLevel;
+    if ( falconn::core::distance_kernels::simd_level() != SimdLevel::None ) {
+        return squared_euclidean ? &euclidean_avx2 : &inner_product_avx2;
+    }
+#endif
+    return squared_euclidean ? &euclidean_portable : &inner_product_portable;
+}
+
+}  // namespace quantized_kernels
+
+// The points of a dense table as one byte per coordinate
+//
+// Coordinate j of a point x is stored as round((x_j - offset_j) /
+// step_j), where offset_j and offset_j + 255 step_j are the smallest
+// and largest coordinate j of all points.
+//
+class QuantizedPoints {
+  public:
+    // Quantize the points of a table
+    //
+    // @param table -- a static dense table, whose points are read with
+    //                 copy_point
+    // @param dimension -- dimension of the points
+    //
+    QuantizedPoints(const TableBackend& table, int dimension)
+        : _dimension(dimension), _num_points(table.size()),
+          _offsets(dimension, 0.0f), _steps(dimension, 0.0f),
+          _codes(static_cast<size_t>(dimension) * table.size()) {
+        std::vector<double> point(dimension);
+        std::vector<double> lower(dimension, HUGE_VAL);
+        std::vector<double> upper(dimension, -HUGE_VAL);
+        for ( int ii = 0; ii < _num_points; ++ii ) {
+            table.copy_point(ii, point.data(), 1);
+            for ( int jj = 0; jj < dimension; ++jj ) {
+                lower[jj] = std::min(lower[jj], point[jj]);
+                upper[jj] = std::max(upper[jj], point[jj]);
+            }
+        }
+        for ( int jj = 0; jj < dimension && _num_points > 0; ++jj ) {
+            _offsets[jj] = static_cast<float>(lower[jj]);
+            _steps[jj] = static_cast<float>((upper[jj] - lower[jj]) / 255.0);
+        }
+        for ( int ii = 0; ii < _num_points; ++ii ) {
+            table.copy_point(ii, point.data(), 1);
+            uint8_t* codes = _codes.data() + static_cast<size_t>(ii) * dimension;
+            for ( int jj = 0; jj < dimension; ++jj ) {
+                double code = _steps[jj] > 0
+                    ? std::round((point[jj] - _offsets[jj]) / _steps[jj]) : 0.0;
+                codes[jj] = static_cast<uint8_t>(std::min(255.0, std::max(0.0, code)));
+            }
+        }
+    }
+
+    int dimension() const { return _dimension; }
+
+    const uint8_t* codes(int32_t index) const {
+        return _codes.data() + static_cast<size_t>(index) * _dimension;
+    }
+
+    // Transform a query for the kernels: for the squared Euclidean
+    // distance, query_j becomes (q_j - offset_j) / step_j and the
+    // weights step_j^2 (0 for dimensions with a single value); for the
+    // negative inner product, query_j becomes q_j step_j, the term
+    // sum_j q_j offset_j being the same for all points
+    //
+    // @param q       -- the query, dense or sparse
+    // @param query   -- resized to the dimension
+    // @param weights -- resized to the dimension
+    //
+    void transform(const QueryVector& q, bool squared_euclidean,
+                   std::vector<float>* query, std::vector<float>* weights) const {
+        query->assign(_dimension, 0.0f);
+        weights->assign(_dimension, 0.0f);
+        std::vector<float>& result = *query;
+        if ( q.is_sparse() ) {
+            for ( int jj = 0; jj < q.nnz; ++jj ) {
+                result[q.indices[jj]] = static_cast<float>(q.values[jj]);
+            }
+        } else {
+            for ( int jj = 0; jj < _dimension; ++jj ) {
+                result[jj] = static_cast<float>(q.values[jj]);
+            }
+        }
+        for ( int jj = 0; jj < _dimension; ++jj ) {
+            if ( _steps[jj] <= 0 ) {
+                result[jj] = 0.0f;
+            } else if ( squared_euclidean ) {
+                result[jj] = (result[jj] - _offsets[jj]) / _steps[jj];
+                (*weights)[jj] = _steps[jj] * _steps[jj];
+            } else {
+                result[jj] *= _steps[jj];
+            }
+        }
+    }
+
+    size_t memory_usage() const {
+        return _codes.capacity() +
+               (_offsets.capacity() + _steps.capacity()) * sizeof(float);
+    }
+
+    // Bytes of the codes of n points of dimension d
+    static double estimate_memory_usage(double n, int d) {
+        return n * d + 2.0 * d * sizeof(float);
+    }
+
+  private:
+    int                  _dimension;
+    int                  _num_points;
+    std::vector<float>   _offsets;
+    std::vector<float>   _steps;
+    std::vector<uint8_t> _codes;     // one row of dimension bytes per point
+};
+
+// A static dense table whose nearest-neighbor queries score their
+// candidates with QuantizedPoints and re-rank the best exactly
+//
+// The scratch of each query object starts empty and grows with its
+// largest query. find_k_nearest_neighbors_bounded,
+// find_k_nearest_neighbors_filtered and find_near_neighbors compute
+// exact distances for all candidates, as the table does.
+//
+class QuantizedTableBackend : public TableBackend {
+  public:
+    typedef std::unique_ptr<TableBackend> TablePtr;
+
+    // @param table             -- the table, of which this takes ownership
+    // @param dimension         -- dimension of its points
+    // @param squared_euclidean -- whether its distance is the squared
+    //                             Euclidean distance (otherwise the
+    //                             negative inner product)
+    // @param rerank_factor     -- candidates re-ranked exactly per
+    //                             neighbor asked for, at least 1
+    //
+    QuantizedTableBackend(TablePtr table, int dimension, bool squared_euclidean,
+                          int rerank_factor)
+        : _table(std::move(table)), _points(*_table, dimension),
+          _squared_euclidean(squared_euclidean), _rerank_factor(rerank_factor),
+          _kernel(quantized_kernels::select(squared_euclidean)) {}
+
+    int rerank_factor() const { return _rerank_factor; }
+
+    std::string precision() const { return _table->precision(); }
+    bool        is_dynamic() const { return false; }
+    bool        is_sparse() const { return false; }
+    int         size() const { return _table->size(); }
+    bool        contains(int index) const { return _table->contains(index); }
+
+    int32_t insert(const double*) {
+        Rcpp::stop("points can only be inserted into dynamic tables");
+        return -1;
+    }
+
+    void remove(int) {
+        Rcpp::stop("points can only be removed from dynamic tables");
+    }
+
+    void reserve_query_objects(int num_threads) {
+        _table->reserve_query_objects(num_threads);
+        if ( static_cast<int>(_scratch.size()) < num_threads ) {
+            _scratch.resize(num_threads);
+        }
+    }
+
+    // The candidates are retrieved from the table as usual
+    void prefetch(int thread_index, const QueryVector& q) {
+        _table->prefetch(thread_index, q);
+    }
+
+    int32_t find_nearest_neighbor(int thread_index, const QueryVector& q) {
+        KeyVector& result = _scratch[thread_index].result;
+        find_k_nearest_neighbors(thread_index, q, 1, &result, nullptr);
+        return result.empty() ? -1 : result[0];
+    }
+
+    // The distances are the exact ones the best candidates are ranked by
+    void find_k_nearest_neighbors(int thread_index, const QueryVector& q, int k,
+                                  KeyVector* result,
+                                  std::vector<double>* distances) {
+        Scratch& scratch = _scratch[thread_index];
+        _table->get_unique_candidates(thread_index, q, &scratch.candidates);
+        int num_candidates = static_cast<int>(scratch.candidates.size());
+
+        _points.transform(q, _squared_euclidean, &scratch.query, &scratch.weights);
+        scratch.scores.resize(num_candidates);
+        for ( int ii = 0; ii < num_candidates; ++ii ) {
+            int32_t key = scratch.candidates[ii];
+            scratch.scores[ii] = std::make_pair(
+                _kernel(scratch.query.data(), scratch.weights.data(),
+                        _points.codes(key), _points.dimension()),
+                key);
+        }
+
+        int num_reranked = static_cast<int>(std::min<int64_t>(
+            num_candidates, static_cast<int64_t>(_rerank_factor) * k));
+        std::nth_element(scratch.scores.begin(),
+                         scratch.scores.begin() + num_reranked,
+                         scratch.scores.end());
+        scratch.candidates.resize(num_reranked);
+        for ( int ii = 0; ii < num_reranked; ++ii ) {
+            scratch.candidates[ii] = scratch.scores[ii].second;
+        }
+
+        _table->distances(q, scratch.candidates, _squared_euclidean,
+                          &scratch.distances);
+        scratch.ranked.resize(num_reranked);
+        for ( int ii = 0; ii < num_reranked; ++ii ) {
+            scratch.ranked[ii] = std::make_pair(scratch.distances[ii],
+                                                scratch.candidates[ii]);
+        }
+        int num_results = std::min(k, num_reranked);
+        std::partial_sort(scratch.ranked.begin(),
+                          scratch.ranked.begin() + num_results,
+                          scratch.ranked.end());
+        result->resize(num_results);
+        for ( int ii = 0; ii < num_results; ++ii ) {
+            (*result)[ii] = scratch.ranked[ii].second;
+        }
+        if ( distances != nullptr ) {
+            distances->resize(num_results);
+            for ( int ii = 0; ii < num_results; ++ii ) {
+                (*distances)[ii] = scratch.ranked[ii].first;
+            }
+        }
+    }
+
+    bool find_k_nearest_neighbors_bounded(int thread_index, const QueryVector& q,
+                                          int k, const falconn::QueryLimits& limits,
+                                          KeyVector* result) {
+        return _table->find_k_nearest_neighbors_bounded(thread_index, q, k,
+                                                        limits, result);
+    }
+
+    void find_k_nearest_neighbors_filtered(int thread_index, const QueryVector& q,
+                                           int k, const falconn::KeyFilter& filter,
+                                           int max_num_probes, KeyVector* result,
+                                           std::vector<double>* distances) {
+        _table->find_k_nearest_neighbors_filtered(thread_index, q, k, filter,
+                                                  max_num_probes, result,
+                                                  distances);
+    }
+
+    void find_near_neighbors(int thread_index, const QueryVector& q,
+                             double radius, KeyVector* result,
+                             std::vector<double>* distances) {
+        _table->find_near_neighbors(thread_index, q, radius, result, distances);
+    }
+
+    void get_candidates_with_duplicates(int thread_index, const QueryVector& q,
+                                        KeyVector* result) {
+        _table->get_candidates_with_duplicates(thread_index, q, result);
+    }
+
+    void get_unique_candidates(int thread_index, const QueryVector& q,
+                               KeyVector* result) {
+        _table->get_unique_candidates(thread_index, q, result);
+    }
+
+    void get_hashes(int thread_index, const QueryVector& q,
+                    std::vector<uint64_t>* result) {
+        _table->get_hashes(thread_index, q, result);
+    }
+
+    void get_unique_candidates_by_hashes(int thread_index,
+                                         const std::vector<uint64_t>& hashes,
+                                         KeyVector* result) {
+        _table->get_unique_candidates_by_hashes(thread_index, hashes, result);
+    }
+
+    void get_first_candidates(int thread_index, const QueryVector& q,
+                              int num_candidates, bool unique,
+                              KeyVector* result) {
+        _table->get_first_candidates(thread_index, q, num_candidates, unique,
+                                     result);
+    }
+
+    int64_t get_candidate_position(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_candidates) {
+        return _table->get_candidate_position(thread_index, q, key,
+                                              max_num_candidates);
+    }
+
+    int64_t get_num_probes_to_find(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_probes) {
+        return _table->get_num_probes_to_find(thread_index, q, key,
+                                              max_num_probes);
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        _table->brute_force_knn(queries, squared_euclidean, k, num_threads, out);
+    }
+
+    // The pairs of a bucket are scored exactly, since there is no query
+    // to quantize
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        _table->knn_graph(num_tables, squared_euclidean, k, max_bucket_size,
+                          seed, num_threads, out);
+    }
+
+    void get_bucket_sizes(int table, std::vector<int_fast64_t>* sizes) const {
+        _table->get_bucket_sizes(table, sizes);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        _table->distances(q, keys, squared_euclidean, out);
+    }
+
+    void set_num_probes(int num_probes) { _table->set_num_probes(num_probes); }
+    int  get_num_probes() const { return _table->get_num_probes(); }
+
+    void set_max_num_candidates(int num_candidates) {
+        _table->set_max_num_candidates(num_candidates);
+    }
+
+    int get_max_num_candidates() const {
+        return _table->get_max_num_candidates();
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        _table->copy_point(index, out, stride);
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        _table->copy_nonzeros(index, indices, values);
+    }
+
+    void save(const std::string& filename) const { _table->save(filename); }
+
+    falconn::QueryStatistics get_query_statistics() const {
+        return _table->get_query_statistics();
+    }
+
+    void reset_query_statistics() { _table->reset_query_statistics(); }
+
+    void set_instrumentation(const falconn::QueryInstrumentation& instrumentation,
+                             int stride) {
+        _table->set_instrumentation(instrumentation, stride);
+    }
+
+    // The codes count as data, the scoring buffers as query scratch
+    falconn::MemoryUsage get_memory_usage() const {
+        falconn::MemoryUsage result = _table->get_memory_usage();
+        result.data_storage += _points.memory_usage();
+        for ( const Scratch& scratch : _scratch ) {
+            result.query_scratch += scratch.memory_usage();
+        }
+        return result;
+    }
+
+  private:
+    // Buffers of one query object
+    struct Scratch {
+        KeyVector                                candidates;
+        KeyVector                                result;
+        std::vector<float>                       query;
+        std::vector<float>                       weights;
+        std::vector<std::pair<float, int32_t> >  scores;     // by codes
+        std::vector<double>                      distances;
+        std::vector<std::pair<double, int32_t> > ranked;     // exactly
+
+        size_t memory_usage() const {
+            return (candidates.capacity() + result.capacity()) * sizeof(int32_t) +
+                   (query.capacity() + weights.capacity()) * sizeof(float) +
+                   scores.capacity() * sizeof(scores[0]) +
+                   distances.capacity() * sizeof(double) +
+                   ranked.capacity() * sizeof(ranked[0]);
+        }
+    };
+
+    TablePtr                  _table;
+    QuantizedPoints           _points;
+    bool                      _squared_euclidean;
+    int                       _rerank_factor;
+    quantized_kernels::Kernel _kernel;
+    std::vector<Scratch>      _scratch;     // one per query object
+};
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,657 @@
+/// \file query_cache.h
+/// \brief Caches of query results and candidates in front of a table
+///
+/// Repeated queries pay for hashing, probing and scoring each time.
+/// CachedTableBackend keeps two bounded caches in front of any table:
+///
+///  - results: the neighbors (with their distances) of the nearest,
+///    k nearest and near neighbor queries, keyed on the query point,
+///    the kind of query and its k or radius. Only a query with exactly
+///    the same coordinates hits.
+///
+///  - candidates: the unique candidates of a query, keyed on the hash
+///    of the query in each hash table. With one probe per table (the
+///    number of probes equal to the number of hash tables) and no
+///    maximum number of candidates, the candidates of a query depend on
+///    these hashes only, so nearby queries with the same hashes share
+///    them; a hit skips the bucket retrieval and deduplication, and
+///    the candidates are scored exactly (see TableBackend::distances).
+///    With more probes the probes also depend on the coordinates, so
+///    this level is not used.
+///
+/// Both caches are split into shards by a fingerprint of the key, each
+/// shard a fixed number of slots evicted with the CLOCK algorithm
+/// (each hit sets a reference bit, which saves the slot once from the
+/// hand) and guarded by its own mutex, so concurrent queries of a
+/// batch rarely wait for each other. A key is compared in full before
+/// it hits, so distinct keys with the same fingerprint only cost a
+/// miss.
+///
+/// The caches are cleared whenever the results could change: when the
+/// number of probes or the maximum number of candidates is set, and
+/// when points are inserted or removed. Bounded and filtered queries,
+/// whose results also depend on their limits or filter, go straight to
+/// the table.
+
+#ifndef FALCONNR_QUERY_CACHE_H
+#define FALCONNR_QUERY_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "backend.h"
+
+namespace falconnr {
+
+// Largest number of shards of a cache
+const int kQueryCacheShards = 16;
+
+// Fingerprints of cache keys, mixing 64-bit words as in splitmix64
+inline uint64_t fingerprint_mix(uint64_t hash, uint64_t word) {
+    hash ^= word + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    return hash;
+}
+
+inline uint64_t fingerprint_double(uint64_t hash, double value) {
+    uint64_t word;
+    std::memcpy(&word, &value, sizeof(word));
+    return fingerprint_mix(hash, word);
+}
+
+// Bytes outside the object itself of the keys and values of the caches
+template <typename T>
+size_t heap_bytes(const std::vector<T>& values) {
+    return values.capacity() * sizeof(T);
+}
+
+// A bounded map from keys to values, safe for concurrent use
+//
+// Keys need operator== and a fingerprint computed by the caller; a
+// key evicts the entry of another key with the same fingerprint.
+//
+template <typename Key, typename Value>
+class ClockCache {
+  public:
+    explicit ClockCache(size_t capacity = 0) { resize(capacity); }
+
+    // Drop all entries and hold up to capacity of them from now on
+    void resize(size_t capacity) {
+        size_t num_shards = std::min<size_t>(std::max<size_t>(capacity, 1),
+                                             kQueryCacheShards);
+        _capacity = capacity;
+        _shards.clear();
+        for ( size_t ii = 0; ii < num_shards; ++ii ) {
+            // The first capacity % num_shards shards take one more slot
+            size_t slots = capacity / num_shards + (ii < capacity % num_shards);
+            _shards.emplace_back(new Shard(slots));
+        }
+    }
+
+    size_t capacity() const { return _capacity; }
+
+    void clear() {
+        for ( auto& shard : _shards ) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->slots.clear();
+            shard->index.clear();
+            shard->hand = 0;
+        }
+    }
+
+    // Copy the value of key to value and return true, or return false
+    // if key is not in the cache
+    bool find(uint64_t fingerprint, const Key& key, Value* value) {
+        Shard& shard = shard_of(fingerprint);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(fingerprint);
+        if ( found == shard.index.end() ) {
+            return false;
+        }
+        Slot& slot = shard.slots[found->second];
+        if ( !(slot.key == key) ) {
+            return false;
+        }
+        slot.referenced = true;
+        *value = slot.value;
+        return true;
+    }
+
+    void insert(uint64_t fingerprint, const Key& key, const Value& value) {
+        Shard& shard = shard_of(fingerprint);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if ( shard.max_slots == 0 ) {
+            return;
+        }
+        size_t position;
+        auto found = shard.index.find(fingerprint);
+        if ( found != shard.index.end() ) {
+            position = found->second;
+        } else if ( shard.slots.size() < shard.max_slots ) {
+            position = shard.slots.size();
+            shard.slots.emplace_back();
+        } else {
+            while ( shard.slots[shard.hand].referenced ) {
+                shard.slots[shard.hand].referenced = false;
+                shard.hand = (shard.hand + 1) % shard.max_slots;
+            }
+            position = shard.hand;
+            shard.hand = (shard.hand + 1) % shard.max_slots;
+            shard.index.erase(shard.slots[position].fingerprint);
+        }
+        Slot& slot = shard.slots[position];
+        slot.fingerprint = fingerprint;
+        slot.key = key;
+        slot.value = value;
+        slot.referenced = false;
+        shard.index[fingerprint] = position;
+    }
+
+    size_t memory_usage() {
+        size_t result = 0;
+        for ( auto& shard : _shards ) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            result += shard->slots.capacity() * sizeof(Slot) +
+                      shard->index.size() * (sizeof(uint64_t) + 2 * sizeof(size_t));
+            for ( const Slot& slot : shard->slots ) {
+                result += heap_bytes(slot.key) + heap_bytes(slot.value);
+            }
+        }
+        return result;
+    }
+
+  private:
+    struct Slot {
+        uint64_t fingerprint = 0;
+        Key      key;
+        Value    value;
+        bool     referenced = false;
+    };
+
+    struct Shard {
+        explicit Shard(size_t max_slots) : max_slots(max_slots), hand(0) {}
+
+        std::mutex                             mutex;
+        size_t                                 max_slots;
+        std::vector<Slot>                      slots;
+        std::unordered_map<uint64_t, size_t>   index;   // fingerprint to slot
+        size_t                                 hand;    // next slot to consider
+    };
+
+    size_t                               _capacity;
+    std::vector<std::unique_ptr<Shard> > _shards;
+
+    Shard& shard_of(uint64_t fingerprint) {
+        return *_shards[(fingerprint >> 32) % _shards.size()];
+    }
+};
+
+// What a cached result answers: the kind of query, its k or radius
+// and the query point (its nonzeros for a sparse query)
+struct ResultKey {
+    enum Kind { kNearest, kKNearest, kNear };
+
+    int                 kind = kNearest;
+    double              parameter = 0.0;
+    std::vector<int>    indices;
+    std::vector<double> values;
+
+    bool operator==(const ResultKey& other) const {
+        return kind == other.kind && parameter == other.parameter &&
+               indices == other.indices && values == other.values;
+    }
+};
+
+inline size_t heap_bytes(const ResultKey& key) {
+    return heap_bytes(key.indices) + heap_bytes(key.values);
+}
+
+// The neighbors found by a query, with their distances (none for a
+// nearest-neighbor query)
+struct ResultValue {
+    KeyVector           keys;
+    std::vector<double> distances;
+};
+
+inline size_t heap_bytes(const ResultValue& value) {
+    return heap_bytes(value.keys) + heap_bytes(value.distances);
+}
+
+// A table whose queries are answered from caches of results and of
+// candidates where possible
+//
+// The nearest, k nearest and near neighbor queries and the unique
+// candidates are cached (see the file comment); the other queries go
+// to the table unchanged. A neighbor
+// query that reaches the candidates level ranks all of its candidates
+// by their exact distances, also in front of a QuantizedTableBackend.
+// The ties of a k-nearest-neighbor query are broken by index there,
+// so they may differ from those of the table.
+//
+class CachedTableBackend : public TableBackend {
+  public:
+    typedef std::unique_ptr<TableBackend> TablePtr;
+
+    // @param table             -- the table, of which this takes ownership
+    // @param dimension         -- dimension of its points
+    // @param num_tables        -- number of its hash tables
+    // @param squared_euclidean -- whether its distance is the squared
+    //                             Euclidean distance (otherwise the
+    //                             negative inner product)
+    // @param capacity          -- entries of each cache, 0 to cache nothing
+    //
+    CachedTableBackend(TablePtr table, int dimension, int num_tables,
+                       bool squared_euclidean, size_t capacity)
+        : _table(std::move(table)), _dimension(dimension),
+          _num_tables(num_tables), _squared_euclidean(squared_euclidean),
+          _results(capacity), _candidates(capacity),
+          _num_result_hits(0), _num_candidate_hits(0), _num_misses(0) {}
+
+    size_t capacity() const { return _results.capacity(); }
+
+    // Drop all entries and hold up to capacity in each cache from now on
+    void set_capacity(size_t capacity) {
+        _results.resize(capacity);
+        _candidates.resize(capacity);
+    }
+
+    void clear() {
+        _results.clear();
+        _candidates.clear();
+    }
+
+    std::string precision() const { return _table->precision(); }
+    bool        is_dynamic() const { return _table->is_dynamic(); }
+    bool        is_sparse() const { return _table->is_sparse(); }
+    int         size() const { return _table->size(); }
+    bool        contains(int index) const { return _table->contains(index); }
+
+    int32_t insert(const double* p) {
+        clear();
+        return _table->insert(p);
+    }
+
+    void remove(int index) {
+        clear();
+        _table->remove(index);
+    }
+
+    void reserve_query_objects(int num_threads) {
+        _table->reserve_query_objects(num_threads);
+        if ( static_cast<int>(_scratch.size()) < num_threads ) {
+            _scratch.resize(num_threads);
+        }
+    }
+
+    // Queries answered from the caches would leave their prefetched
+    // probes queued in the query object, so nothing is prefetched while
+    // caching
+    void prefetch(int thread_index, const QueryVector& q) {
+        if ( capacity() == 0 ) {
+            _table->prefetch(thread_index, q);
+        }
+    }
+
+    int32_t find_nearest_neighbor(int thread_index, const QueryVector& q) {
+        if ( capacity() == 0 ) {
+            return _table->find_nearest_neighbor(thread_index, q);
+        }
+        Scratch& scratch = _scratch[thread_index];
+        uint64_t fingerprint = set_key(q, ResultKey::kNearest, 0.0, &scratch.key);
+        if ( _results.find(fingerprint, scratch.key, &scratch.value) ) {
+            _num_result_hits += 1;
+        } else {
+            scratch.value.keys.clear();
+            scratch.value.distances.clear();
+            if ( use_candidates() ) {
+                find_candidates(thread_index, q);
+                rank_k_nearest(q, 1, &scratch);
+            } else {
+                _num_misses += 1;
+                int32_t key = _table->find_nearest_neighbor(thread_index, q);
+                if ( key >= 0 ) {
+                    scratch.value.keys.push_back(key);
+                }
+            }
+            _results.insert(fingerprint, scratch.key, scratch.value);
+        }
+        return scratch.value.keys.empty() ? -1 : scratch.value.keys[0];
+    }
+
+    void find_k_nearest_neighbors(int thread_index, const QueryVector& q, int k,
+                                  KeyVector* result,
+                                  std::vector<double>* distances) {
+        if ( capacity() == 0 ) {
+            _table->find_k_nearest_neighbors(thread_index, q, k, result,
+                                             distances);
+            return;
+        }
+        Scratch& scratch = _scratch[thread_index];
+        uint64_t fingerprint = set_key(q, ResultKey::kKNearest, k, &scratch.key);
+        if ( _results.find(fingerprint, scratch.key, &scratch.value) ) {
+            _num_result_hits += 1;
+        } else {
+            if ( use_candidates() ) {
+                find_candidates(thread_index, q);
+                rank_k_nearest(q, k, &scratch);
+            } else {
+                _num_misses += 1;
+                _table->find_k_nearest_neighbors(thread_index, q, k,
+                                                 &scratch.value.keys,
+                                                 &scratch.value.distances);
+            }
+            _results.insert(fingerprint, scratch.key, scratch.value);
+        }
+        result->assign(scratch.value.keys.begin(), scratch.value.keys.end());
+        if ( distances != nullptr ) {
+            distances->assign(scratch.value.distances.begin(),
+                              scratch.value.distances.end());
+        }
+    }
+
+    bool find_k_nearest_neighbors_bounded(int thread_index, const QueryVector& q,
+                                          int k, const falconn::QueryLimits& limits,
+                                          KeyVector* result) {
+        return _table->find_k_nearest_neighbors_bounded(thread_index, q, k,
+                                                        limits, result);
+    }
+
+    void find_k_nearest_neighbors_filtered(int thread_index, const QueryVector& q,
+                                           int k, const falconn::KeyFilter& filter,
+                                           int max_num_probes, KeyVector* result,
+                                           std::vector<double>* distances) {
+        _table->find_k_nearest_neighbors_filtered(thread_index, q, k, filter,
+                                                  max_num_probes, result,
+                                                  distances);
+    }
+
+    void find_near_neighbors(int thread_index, const QueryVector& q,
+                             double radius, KeyVector* result,
+                             std::vector<double>* distances) {
+        if ( capacity() == 0 ) {
+            _table->find_near_neighbors(thread_index, q, radius, result,
+                                        distances);
+            return;
+        }
+        Scratch& scratch = _scratch[thread_index];
+        uint64_t fingerprint = set_key(q, ResultKey::kNear, radius, &scratch.key);
+        if ( _results.find(fingerprint, scratch.key, &scratch.value) ) {
+            _num_result_hits += 1;
+        } else {
+            if ( use_candidates() ) {
+                find_candidates(thread_index, q);
+                rank_near(q, radius, &scratch);
+            } else {
+                _num_misses += 1;
+                _table->find_near_neighbors(thread_index, q, radius,
+                                            &scratch.value.keys,
+                                            &scratch.value.distances);
+            }
+            _results.insert(fingerprint, scratch.key, scratch.value);
+        }
+        result->assign(scratch.value.keys.begin(), scratch.value.keys.end());
+        if ( distances != nullptr ) {
+            distances->assign(scratch.value.distances.begin(),
+                              scratch.value.distances.end());
+        }
+    }
+
+    void get_candidates_with_duplicates(int thread_index, const QueryVector& q,
+                                        KeyVector* result) {
+        _table->get_candidates_with_duplicates(thread_index, q, result);
+    }
+
+    void get_unique_candidates(int thread_index, const QueryVector& q,
+                               KeyVector* result) {
+        if ( capacity() == 0 || !use_candidates() ) {
+            _table->get_unique_candidates(thread_index, q, result);
+            return;
+        }
+        find_candidates(thread_index, q);
+        const KeyVector& candidates = _scratch[thread_index].candidates;
+        result->assign(candidates.begin(), candidates.end());
+    }
+
+    void get_hashes(int thread_index, const QueryVector& q,
+                    std::vector<uint64_t>* result) {
+        _table->get_hashes(thread_index, q, result);
+    }
+
+    void get_unique_candidates_by_hashes(int thread_index,
+                                         const std::vector<uint64_t>& hashes,
+                                         KeyVector* result) {
+        _table->get_unique_candidates_by_hashes(thread_index, hashes, result);
+    }
+
+    void get_first_candidates(int thread_index, const QueryVector& q,
+                              int num_candidates, bool unique,
+                              KeyVector* result) {
+        _table->get_first_candidates(thread_index, q, num_candidates, unique,
+                                     result);
+    }
+
+    int64_t get_candidate_position(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_candidates) {
+        return _table->get_candidate_position(thread_index, q, key,
+                                              max_num_candidates);
+    }
+
+    int64_t get_num_probes_to_find(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_probes) {
+        return _table->get_num_probes_to_find(thread_index, q, key,
+                                              max_num_probes);
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        _table->brute_force_knn(queries, squared_euclidean, k, num_threads, out);
+    }
+
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        _table->knn_graph(num_tables, squared_euclidean, k, max_bucket_size,
+                          seed, num_threads, out);
+    }
+
+    void get_bucket_sizes(int table, std::vector<int_fast64_t>* sizes) const {
+        _table->get_bucket_sizes(table, sizes);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        _table->distances(q, keys, squared_euclidean, out);
+    }
+
+    void set_num_probes(int num_probes) {
+        clear();
+        _table->set_num_probes(num_probes);
+    }
+
+    int get_num_probes() const { return _table->get_num_probes(); }
+
+    void set_max_num_candidates(int num_candidates) {
+        clear();
+        _table->set_max_num_candidates(num_candidates);
+    }
+
+    int get_max_num_candidates() const {
+        return _table->get_max_num_candidates();
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        _table->copy_point(index, out, stride);
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        _table->copy_nonzeros(index, indices, values);
+    }
+
+    void save(const std::string& filename) const { _table->save(filename); }
+
+    falconn::QueryStatistics get_query_statistics() const {
+        falconn::QueryStatistics result = _table->get_query_statistics();
+        result.num_cache_result_hits = _num_result_hits;
+        result.num_cache_candidate_hits = _num_candidate_hits;
+        result.num_cache_misses = _num_misses;
+        return result;
+    }
+
+    void reset_query_statistics() {
+        _table->reset_query_statistics();
+        _num_result_hits = 0;
+        _num_candidate_hits = 0;
+        _num_misses = 0;
+    }
+
+    void set_instrumentation(const falconn::QueryInstrumentation& instrumentation,
+                             int stride) {
+        _table->set_instrumentation(instrumentation, stride);
+    }
+
+    // The caches and the per-thread buffers count as query scratch
+    falconn::MemoryUsage get_memory_usage() const {
+        falconn::MemoryUsage result = _table->get_memory_usage();
+        result.query_scratch += _results.memory_usage() +
+                                _candidates.memory_usage();
+        for ( const Scratch& scratch : _scratch ) {
+            result.query_scratch += scratch.memory_usage();
+        }
+        return result;
+    }
+
+  private:
+    // Buffers of one query object
+    struct Scratch {
+        ResultKey                                key;
+        ResultValue                              value;
+        std::vector<uint64_t>                    hashes;
+        KeyVector                                candidates;
+        std::vector<double>                      distances;
+        std::vector<std::pair<double, int32_t> > ranked;
+
+        size_t memory_usage() const {
+            return heap_bytes(key) + heap_bytes(value) + heap_bytes(hashes) +
+                   heap_bytes(candidates) + heap_bytes(distances) +
+                   heap_bytes(ranked);
+        }
+    };
+
+    TablePtr              _table;
+    int                   _dimension;
+    int                   _num_tables;
+    bool                  _squared_euclidean;
+    // Mutable since looking at the caches takes their locks
+    mutable ClockCache<ResultKey, ResultValue>         _results;
+    mutable ClockCache<std::vector<uint64_t>, KeyVector> _candidates;
+    std::atomic<int_fast64_t> _num_result_hits;
+    std::atomic<int_fast64_t> _num_candidate_hits;
+    std::atomic<int_fast64_t> _num_misses;
+    std::vector<Scratch>  _scratch;     // one per query object
+
+    // Whether the candidates of a query depend on its hashes only
+    bool use_candidates() const {
+        return _table->get_num_probes() == _num_tables &&
+               _table->get_max_num_candidates() < 0;
+    }
+
+    // Set key to a query and return its fingerprint
+    uint64_t set_key(const QueryVector& q, int kind, double parameter,
+                     ResultKey* key) const {
+        key->kind = kind;
+        key->parameter = parameter;
+        uint64_t fingerprint = fingerprint_double(
+            fingerprint_mix(0, static_cast<uint64_t>(kind)), parameter);
+        if ( q.is_sparse() ) {
+            key->indices.assign(q.indices, q.indices + q.nnz);
+            key->values.assign(q.values, q.values + q.nnz);
+            for ( int jj = 0; jj < q.nnz; ++jj ) {
+                fingerprint = fingerprint_double(
+                    fingerprint_mix(fingerprint, static_cast<uint64_t>(q.indices[jj])),
+                    q.values[jj]);
+            }
+        } else {
+            key->indices.clear();
+            key->values.assign(q.values, q.values + _dimension);
+            for ( int jj = 0; jj < _dimension; ++jj ) {
+                fingerprint = fingerprint_double(fingerprint, q.values[jj]);
+            }
+        }
+        return fingerprint;
+    }
+
+    // The unique candidates of q, into the scratch of the thread, from
+    // the candidates cache or else from the table
+    void find_candidates(int thread_index, const QueryVector& q) {
+        Scratch& scratch = _scratch[thread_index];
+        _table->get_hashes(thread_index, q, &scratch.hashes);
+        uint64_t fingerprint = 0;
+        for ( uint64_t hash : scratch.hashes ) {
+            fingerprint = fingerprint_mix(fingerprint, hash);
+        }
+        if ( _candidates.find(fingerprint, scratch.hashes, &scratch.candidates) ) {
+            _num_candidate_hits += 1;
+            return;
+        }
+        _num_misses += 1;
+        _table->get_unique_candidates_by_hashes(thread_index, scratch.hashes,
+                                                &scratch.candidates);
+        _candidates.insert(fingerprint, scratch.hashes, scratch.candidates);
+    }
+
+    // The k candidates nearest to q, in order of increasing distance
+    // (then index), into the value of the scratch
+    void rank_k_nearest(const QueryVector& q, int k, Scratch* scratch) const {
+        _table->distances(q, scratch->candidates, _squared_euclidean,
+                          &scratch->distances);
+        size_t num_candidates = scratch->candidates.size();
+        scratch->ranked.resize(num_candidates);
+        for ( size_t ii = 0; ii < num_candidates; ++ii ) {
+            scratch->ranked[ii] = std::make_pair(scratch->distances[ii],
+                                                 scratch->candidates[ii]);
+        }
+        size_t num_results = std::min<size_t>(k, num_candidates);
+        std::partial_sort(scratch->ranked.begin(),
+                          scratch->ranked.begin() + num_results,
+                          scratch->ranked.end());
+        scratch->value.keys.resize(num_results);
+        scratch->value.distances.resize(num_results);
+        for ( size_t ii = 0; ii < num_results; ++ii ) {
+            scratch->value.distances[ii] = scratch->ranked[ii].first;
+            scratch->value.keys[ii] = scratch->ranked[ii].second;
+        }
+    }
+
+    // The candidates within radius of q, in candidate order, into the
+    // value of the scratch
+    void rank_near(const QueryVector& q, double radius, Scratch* scratch) const {
+        _table->distances(q, scratch->candidates, _squared_euclidean,
+                          &scratch->distances);
+        scratch->value.keys.clear();
+        scratch->value.distances.clear();
+        for ( size_t ii = 0; ii < scratch->candidates.size(); ++ii ) {
+            if ( scratch->distances[ii] < radius ) {
+                scratch->value.keys.push_back(scratch->candidates[ii]);
+                scratch->value.distances.push_back(scratch->distances[ii]);
+            }
+        }
+    }
+};
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
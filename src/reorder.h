@@ -0,0 +1,351 @@
+/// \file reorder.h
+/// \brief Tables over data stored in a locality-preserving order
+///
+/// The candidates of a query are near the query, and hence near each
+/// other, but their rows are scattered across the data matrix, so
+/// reading each one is a cache (and often a TLB) miss. locality_order
+/// sorts the points by the signs of their projections on random
+/// directions, most significant first; points close to each other
+/// share most leading signs, so each bucket of a hash table (and more
+/// generally the candidates of a query) takes few, mostly contiguous
+/// runs of rows.
+///
+/// A table over the data in this order knows the points by their
+/// positions in it. ReorderedTableBackend translates between these
+/// positions and the indices of the points in the data as given, so
+/// that the rest of the package never sees the order.
+
+#ifndef FALCONNR_REORDER_H
+#define FALCONNR_REORDER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "backend.h"
+
+namespace falconnr {
+
+// Number of random directions whose signs order the points
+const int kReorderDirections = 32;
+
+/// An order of the points that keeps nearby points close together
+///
+/// The points are centered on their mean before being projected, so
+/// that the directions split the data rather than pass beside it.
+/// The order only depends on the data and the seed.
+///
+/// @param data -- the points, one per column
+/// @param seed -- seed of the random directions
+///
+/// @return the indices of the points (0-based) in the new order
+///
+inline std::vector<int32_t> locality_order(const DenseColumns& data,
+                                           uint64_t seed) {
+    int dimension = data.nrow();
+    int num_points = data.ncol();
+
+    std::vector<double> mean(dimension, 0.0);
+    for ( int ii = 0; ii < num_points; ++ii ) {
+        const double* point = data[ii].values;
+        for ( int jj = 0; jj < dimension; ++jj ) {
+            mean[jj] += point[jj] / num_points;
+        }
+    }
+
+    std::mt19937_64                  generator(seed);
+    std::normal_distribution<double> normal;
+    std::vector<double> directions(static_cast<size_t>(kReorderDirections) * dimension);
+    for ( auto& value : directions ) {
+        value = normal(generator);
+    }
+
+    std::vector<std::pair<uint32_t, int32_t> > keys(num_points);
+    for ( int ii = 0; ii < num_points; ++ii ) {
+        const double* point = data[ii].values;
+        uint32_t key = 0;
+        for ( int bb = 0; bb < kReorderDirections; ++bb ) {
+            const double* direction = directions.data() +
+                static_cast<size_t>(bb) * dimension;
+            double projection = 0.0;
+            for ( int jj = 0; jj < dimension; ++jj ) {
+                projection += (point[jj] - mean[jj]) * direction[jj];
+            }
+            key = (key << 1) | (projection > 0 ? 1u : 0u);
+        }
+        keys[ii] = std::make_pair(key, ii);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<int32_t> order(num_points);
+    for ( int ii = 0; ii < num_points; ++ii ) {
+        order[ii] = keys[ii].second;
+    }
+    return order;
+}
+
+/// The points of a matrix in the given order
+///
+/// @param data  -- the points, one per column
+/// @param order -- indices of the points in the new order
+///
+/// @return the coordinates of the points, one after the other
+///
+inline std::vector<double> reordered_columns(const DenseColumns& data,
+                                             const std::vector<int32_t>& order) {
+    size_t dimension = data.nrow();
+    std::vector<double> result(dimension * order.size());
+    for ( size_t ii = 0; ii < order.size(); ++ii ) {
+        const double* point = data[order[ii]].values;
+        std::copy(point, point + dimension, result.begin() + ii * dimension);
+    }
+    return result;
+}
+
+// A static table over reordered data, whose points are known by their
+// indices in the data as given
+//
+// Keys from the table are translated on the way out, and keys from
+// the caller on the way in. Such a table cannot be saved, since the
+// saved hash tables would refer to the positions in the order.
+//
+class ReorderedTableBackend : public TableBackend {
+  public:
+    typedef std::unique_ptr<TableBackend> TablePtr;
+
+    // @param table -- the table over the reordered data, of which this
+    //                 takes ownership
+    // @param order -- indices in the data as given of the points of
+    //                 the table, see locality_order
+    //
+    ReorderedTableBackend(TablePtr table, std::vector<int32_t> order)
+        : _table(std::move(table)), _order(std::move(order)),
+          _position(_order.size()) {
+        for ( size_t ii = 0; ii < _order.size(); ++ii ) {
+            _position[_order[ii]] = static_cast<int32_t>(ii);
+        }
+    }
+
+    std::string precision() const { return _table->precision(); }
+    bool        is_dynamic() const { return false; }
+    bool        is_sparse() const { return _table->is_sparse(); }
+    int         size() const { return _table->size(); }
+
+    bool contains(int index) const {
+        return index >= 0 && index < static_cast<int>(_order.size());
+    }
+
+    int32_t insert(const double*) {
+        Rcpp::stop("points can only be inserted into dynamic tables");
+        return -1;
+    }
+
+    void remove(int) {
+        Rcpp::stop("points can only be removed from dynamic tables");
+    }
+
+    void reserve_query_objects(int num_threads) {
+        _table->reserve_query_objects(num_threads);
+    }
+
+    void prefetch(int thread_index, const QueryVector& q) {
+        _table->prefetch(thread_index, q);
+    }
+
+    int32_t find_nearest_neighbor(int thread_index, const QueryVector& q) {
+        int32_t key = _table->find_nearest_neighbor(thread_index, q);
+        return key < 0 ? key : _order[key];
+    }
+
+    void find_k_nearest_neighbors(int thread_index, const QueryVector& q, int k,
+                                  KeyVector* result,
+                                  std::vector<double>* distances) {
+        _table->find_k_nearest_neighbors(thread_index, q, k, result, distances);
+        translate(result);
+    }
+
+    bool find_k_nearest_neighbors_bounded(int thread_index, const QueryVector& q,
+                                          int k, const falconn::QueryLimits& limits,
+                                          KeyVector* result) {
+        bool truncated = _table->find_k_nearest_neighbors_bounded(
+            thread_index, q, k, limits, result);
+        translate(result);
+        return truncated;
+    }
+
+    // The filter is over the indices as given, which the table's
+    // positions are mapped to
+    void find_k_nearest_neighbors_filtered(int thread_index, const QueryVector& q,
+                                           int k, const falconn::KeyFilter& filter,
+                                           int max_num_probes, KeyVector* result,
+                                           std::vector<double>* distances) {
+        _table->find_k_nearest_neighbors_filtered(
+            thread_index, q, k, filter.with_key_map(_order.data()),
+            max_num_probes, result, distances);
+        translate(result);
+    }
+
+    void find_near_neighbors(int thread_index, const QueryVector& q,
+                             double radius, KeyVector* result,
+                             std::vector<double>* distances) {
+        _table->find_near_neighbors(thread_index, q, radius, result, distances);
+        translate(result);
+    }
+
+    void get_candidates_with_duplicates(int thread_index, const QueryVector& q,
+                                        KeyVector* result) {
+        _table->get_candidates_with_duplicates(thread_index, q, result);
+        translate(result);
+    }
+
+    void get_unique_candidates(int thread_index, const QueryVector& q,
+                               KeyVector* result) {
+        _table->get_unique_candidates(thread_index, q, result);
+        translate(result);
+    }
+
+    void get_hashes(int thread_index, const QueryVector& q,
+                    std::vector<uint64_t>* result) {
+        _table->get_hashes(thread_index, q, result);
+    }
+
+    void get_unique_candidates_by_hashes(int thread_index,
+                                         const std::vector<uint64_t>& hashes,
+                                         KeyVector* result) {
+        _table->get_unique_candidates_by_hashes(thread_index, hashes, result);
+        translate(result);
+    }
+
+    void get_first_candidates(int thread_index, const QueryVector& q,
+                              int num_candidates, bool unique,
+                              KeyVector* result) {
+        _table->get_first_candidates(thread_index, q, num_candidates, unique,
+                                     result);
+        translate(result);
+    }
+
+    int64_t get_candidate_position(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_candidates) {
+        return _table->get_candidate_position(thread_index, q, _position[key],
+                                              max_num_candidates);
+    }
+
+    int64_t get_num_probes_to_find(int thread_index, const QueryVector& q,
+                                   int32_t key, int64_t max_num_probes) {
+        return _table->get_num_probes_to_find(thread_index, q, _position[key],
+                                              max_num_probes);
+    }
+
+    void brute_force_knn(const DenseColumns& queries, bool squared_euclidean,
+                         int k, int num_threads, int32_t* out) {
+        _table->brute_force_knn(queries, squared_euclidean, k, num_threads, out);
+        int32_t* end = out + static_cast<size_t>(queries.ncol()) * k;
+        for ( int32_t* key = out; key != end; ++key ) {
+            if ( *key >= 0 ) {
+                *key = _order[*key];
+            }
+        }
+    }
+
+    // The rows of the graph of the table are positions, so they are
+    // moved to the indices of their points
+    void knn_graph(int num_tables, bool squared_euclidean, int k,
+                   int max_bucket_size, uint64_t seed, int num_threads,
+                   std::vector<int32_t>* out) {
+        size_t num_points = _order.size();
+        std::vector<int32_t> graph;
+        _table->knn_graph(num_tables, squared_euclidean, k, max_bucket_size,
+                          seed, num_threads, &graph);
+        out->resize(graph.size());
+        for ( size_t ii = 0; ii < num_points; ++ii ) {
+            for ( int jj = 0; jj < k; ++jj ) {
+                int32_t key = graph[ii + jj * num_points];
+                (*out)[_order[ii] + jj * num_points] = key < 0 ? key : _order[key];
+            }
+        }
+    }
+
+    void get_bucket_sizes(int table, std::vector<int_fast64_t>* sizes) const {
+        _table->get_bucket_sizes(table, sizes);
+    }
+
+    void distances(const QueryVector& q, const KeyVector& keys,
+                   bool squared_euclidean, std::vector<double>* out) const {
+        KeyVector positions(keys.size());
+        for ( size_t ii = 0; ii < keys.size(); ++ii ) {
+            positions[ii] = _position[keys[ii]];
+        }
+        _table->distances(q, positions, squared_euclidean, out);
+    }
+
+    void set_num_probes(int num_probes) { _table->set_num_probes(num_probes); }
+    int  get_num_probes() const { return _table->get_num_probes(); }
+
+    void set_max_num_candidates(int num_candidates) {
+        _table->set_max_num_candidates(num_candidates);
+    }
+
+    int get_max_num_candidates() const {
+        return _table->get_max_num_candidates();
+    }
+
+    void copy_point(int index, double* out, size_t stride) const {
+        _table->copy_point(_position[index], out, stride);
+    }
+
+    void copy_nonzeros(int index, std::vector<int>* indices,
+                       std::vector<double>* values) const {
+        _table->copy_nonzeros(_position[index], indices, values);
+    }
+
+    void save(const std::string&) const {
+        throw falconn::LSHNearestNeighborTableError(
+            "Reordered tables cannot be saved.");
+    }
+
+    falconn::QueryStatistics get_query_statistics() const {
+        return _table->get_query_statistics();
+    }
+
+    void reset_query_statistics() { _table->reset_query_statistics(); }
+
+    void set_instrumentation(const falconn::QueryInstrumentation& instrumentation,
+                             int stride) {
+        _table->set_instrumentation(instrumentation, stride);
+    }
+
+    // The translation counts as data
+    falconn::MemoryUsage get_memory_usage() const {
+        falconn::MemoryUsage result = _table->get_memory_usage();
+        result.data_storage += (_order.capacity() + _position.capacity()) *
+                               sizeof(int32_t);
+        return result;
+    }
+
+    // Bytes of the translation for n points
+    static double estimate_memory_usage(double n) {
+        return 2.0 * n * sizeof(int32_t);
+    }
+
+  private:
+    TablePtr             _table;
+    std::vector<int32_t> _order;      // index of the point at each position
+    std::vector<int32_t> _position;   // position of the point of each index
+
+    void translate(KeyVector* keys) const {
+        for ( auto& key : *keys ) {
+            key = _order[key];
+        }
+    }
+};
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
@@ -0,0 +1,512 @@
+//! Interface to a data set partitioned across several LSH tables
+
+// [[Rcpp::depends(RcppEigen)]]
+
+
+#include <algorithm>
+#include <functional>
+
+#include "sharded.h"
+#include "parallel.h"
+#include <RcppEigen.h>
+
+using namespace Rcpp;
+
+using falconnr::DenseColumns;
+using falconnr::KeyVector;
+using falconnr::QueryVector;
+
+
+// Constructs a sharded table with no shards built yet
+//
+// Each shard is a LshNnTable over a part of the data, built with
+// \code{setShard()} or loaded with \code{loadShard()}, and can later
+// be rebuilt or reloaded on its own. Queries go to all shards, in
+// parallel, and the neighbors found in each are merged by their
+// exact distances to the query, so all shards must be built first.
+//
+// With shared seeds, all shards use the same hash functions;
+// otherwise shard i uses the seed of \code{params} plus i - 1, so
+// the shards fail to find a point's neighbors independently.
+//
+// @param params         -- the LSH configuration parameters of the
+//                          shards, including the number of probes
+//                          and maximum number of candidates
+// @param num_shards     -- number of shards
+// @param distinct_seeds -- if TRUE, each shard gets its own hash
+//                          functions
+//
+ShardedLshNnTable::ShardedLshNnTable(const LshParameterSetter& params,
+                                     int num_shards, bool distinct_seeds)
+    : _params(params.copy()), _distinct_seeds(distinct_seeds),
+      _num_threads(1) {
+    if ( num_shards < 1 ) {
+        stop("number of shards must be positive");
+    }
+    _shards.resize(num_shards);
+    _ids.resize(num_shards);
+}
+
+// Dimension of the data points
+int ShardedLshNnTable::dimension() const {
+    return _params.params().dimension;
+}
+
+// Number of data points in all built shards
+int ShardedLshNnTable::size() const {
+    int result = 0;
+    for ( const auto& shard : _shards ) {
+        if ( shard ) {
+            result += shard->size();
+        }
+    }
+    return result;
+}
+
+// Number of shards, whether built or not
+int ShardedLshNnTable::numShards() const {
+    return static_cast<int>(_shards.size());
+}
+
+// Number of data points in a shard
+//
+// @param shard -- 1-based index of the shard
+//
+// @return the number of points, 0 if the shard is not built
+//
+int ShardedLshNnTable::shardSize(int shard) const {
+    int index = checkShard(shard);
+    return _shards[index] ? _shards[index]->size() : 0;
+}
+
+// Global indices of the points of a shard
+//
+// @param shard -- 1-based index of the shard
+//
+// @return the index of each point of the shard in the whole data set,
+//         in the order of the shard's data
+//
+IntegerVector ShardedLshNnTable::shardIds(int shard) const {
+    const std::vector<int32_t>& ids = _ids[checkShard(shard)];
+    return IntegerVector(ids.begin(), ids.end());
+}
+
+// Whether a shard is built
+//
+// @param shard -- 1-based index of the shard
+//
+bool ShardedLshNnTable::isBuilt(int shard) const {
+    return static_cast<bool>(_shards[checkShard(shard)]);
+}
+
+// Build (or rebuild) one shard over a part of the data
+//
+// The other shards are untouched, so a part of the data that changed
+// can be reindexed without rebuilding the whole table.
+//
+// @param shard       -- 1-based index of the shard
+// @param tDataMatrix -- the points of the shard, one per \emph{column}
+// @param ids         -- index of each of these points in the whole
+//                       data set, returned by the queries
+//
+// @return a reference to this object
+//
+ShardedLshNnTable& ShardedLshNnTable::setShard(int shard,
+                                               const NumericMatrix tDataMatrix,
+                                               const IntegerVector& ids) {
+    int index = checkShard(shard);
+    if ( tDataMatrix.ncol() < 1 ) {
+        stop("a shard needs at least one data point");
+    }
+    if ( ids.size() != tDataMatrix.ncol() ) {
+        stop("need one global index per point of the shard");
+    }
+
+    LSHConstructionParameters params = _params.params();
+    if ( _distinct_seeds ) {
+        params.seed += index;
+    }
+    LshParameterSetter shard_params(tDataMatrix.ncol(), params.dimension,
+                                    params, _params.getPrecision());
+    shard_params.dynamic(_params.isDynamic())
+                .numProbes(_params.getNumProbes())
+                .maxNumCandidates(_params.getMaxNumCandidates());
+
+    _shards[index].reset(new LshNnTable(tDataMatrix, shard_params));
+    _ids[index].assign(ids.begin(), ids.end());
+    return *this;
+}
+
+// Load one shard saved with \code{saveShard()}
+//
+// @param shard       -- 1-based index of the shard
+// @param tDataMatrix -- the points the shard was built with, one per
+//                       \emph{column}, in the same order
+// @param ids         -- index of each of these points in the whole
+//                       data set
+// @param filename    -- path of the saved shard
+//
+// @return a reference to this object
+//
+ShardedLshNnTable& ShardedLshNnTable::loadShard(int shard,
+                                                const NumericMatrix tDataMatrix,
+                                                const IntegerVector& ids,
+                                                const std::string filename) {
+    int index = checkShard(shard);
+    if ( ids.size() != tDataMatrix.ncol() ) {
+        stop("need one global index per point of the shard");
+    }
+
+    ShardPtr table(new LshNnTable(tDataMatrix, filename));
+    checkLoaded(*table);
+    table->setNumProbes(_params.getNumProbes());
+    table->setMaxNumCandidates(_params.getMaxNumCandidates());
+
+    _shards[index] = std::move(table);
+    _ids[index].assign(ids.begin(), ids.end());
+    return *this;
+}
+
+// Save one shard (without its data) to a file
+//
+// The global indices of the shard are not saved; keep them, e.g.,
+// from \code{shardIds()}, to pass to \code{loadShard()}.
+//
+// @param shard    -- 1-based index of the shard
+// @param filename -- path of the file to write
+//
+void ShardedLshNnTable::saveShard(int shard, const std::string filename) const {
+    int index = checkShard(shard);
+    if ( !_shards[index] ) {
+        stop("shard " + std::to_string(shard) + " is not built");
+    }
+    _shards[index]->save(filename);
+}
+
+// Find the data points nearest to the given query point
+//
+// Each shard is searched for its own k nearest neighbors, the shards
+// in parallel on up to \code{getNumThreads()} threads, and the lists
+// are merged by exact distance.
+//
+// @param q -- query point, an R numeric vector of dimension d
+//
+// @param k -- the number of nearest neighbors to return
+//
+// @return vector of the global indices of the data points nearest to
+//         \code{q} in order of increasing distance
+//
+IntegerVector ShardedLshNnTable::find_k_nearest_neighbors(const NumericVector& q,
+                                                          int k) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    if ( q.size() != dimension() ) {
+        stop("dimension mismatch between query point and LshTable data");
+    }
+    checkBuilt();
+
+    int num_shards = numShards();
+    int num_threads = std::max(1, std::min(_num_threads, num_shards));
+    prepareQueries(num_threads);
+
+    bool                 squared_euclidean = _shards[0]->squaredEuclidean();
+    std::vector<Scratch> scratch(num_threads);
+    Scratch              merged;
+    QueryVector          query(q.begin());
+
+    merged.neighbors.resize(num_shards);
+    falconnr::parallel_for(num_shards, num_threads, 1,
+                           [&](int thread_index, int shard) {
+        queryShard(shard, thread_index, query, k, squared_euclidean,
+                   &scratch[thread_index], &merged.neighbors[shard]);
+    });
+
+    std::vector<int> nearest(k, NA_INTEGER);
+    mergeNeighbors(k, &merged, nearest.data(), 1);
+    int found = static_cast<int>(std::find(nearest.begin(), nearest.end(),
+                                           NA_INTEGER) - nearest.begin());
+    return IntegerVector(nearest.begin(), nearest.begin() + found);
+}
+
+// Find the k data points nearest to each of several query points
+//
+// The queries are spread across \code{getNumThreads()} threads, each
+// searching all shards for its queries.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @param k -- the number of nearest neighbors to return for each query
+//
+// @return integer matrix with one row per query whose ith row holds
+//         the global indices of the neighbors of the ith query in
+//         order of increasing distance, padded with NA
+//
+IntegerMatrix ShardedLshNnTable::find_k_nearest_neighbors_batch(
+    const NumericMatrix& queries, int k) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    if ( queries.nrow() != dimension() ) {
+        stop("dimension mismatch between query points and LshTable data");
+    }
+    checkBuilt();
+
+    DenseColumns  columns(queries);
+    int           num_queries = columns.ncol();
+    int           num_threads = std::max(1, std::min(_num_threads, num_queries));
+    IntegerMatrix nearest_indices_r(num_queries, k);
+    int*          out = nearest_indices_r.begin();
+
+    std::fill(nearest_indices_r.begin(), nearest_indices_r.end(), NA_INTEGER);
+    prepareQueries(num_threads);
+
+    bool                 squared_euclidean = _shards[0]->squaredEuclidean();
+    std::vector<Scratch> scratch(num_threads);
+    for ( auto& thread_scratch : scratch ) {
+        thread_scratch.neighbors.resize(_shards.size());
+    }
+    falconnr::parallel_for(num_queries, num_threads, 16,
+                           [&](int thread_index, int column) {
+        Scratch& thread_scratch = scratch[thread_index];
+        for ( size_t shard = 0; shard < _shards.size(); ++shard ) {
+            queryShard(shard, thread_index, columns[column], k, squared_euclidean,
+                       &thread_scratch, &thread_scratch.neighbors[shard]);
+        }
+        mergeNeighbors(k, &thread_scratch, out + column, num_queries);
+    });
+    return nearest_indices_r;
+}
+
+// Set the number of probes of all shards, including shards built later
+//
+// @param num_probes -- number of probes per query and shard, or -1 for
+//                      one per hash table
+//
+// @return a reference to this object
+//
+ShardedLshNnTable& ShardedLshNnTable::setNumProbes(int num_probes) {
+    _params.numProbes(num_probes);
+    for ( const auto& shard : _shards ) {
+        if ( shard ) {
+            shard->setNumProbes(_params.getNumProbes());
+        }
+    }
+    return *this;
+}
+
+// Returns the number of probes of the shards
+int ShardedLshNnTable::getNumProbes() const {
+    return _params.getNumProbes();
+}
+
+// Set the maximum number of candidates of all shards
+//
+// @param num_candidates -- maximum number of candidates per query and
+//                          shard, or -1 for no limit
+//
+// @return a reference to this object
+//
+ShardedLshNnTable& ShardedLshNnTable::setMaxNumCandidates(int num_candidates) {
+    _params.maxNumCandidates(num_candidates);
+    for ( const auto& shard : _shards ) {
+        if ( shard ) {
+            shard->setMaxNumCandidates(num_candidates);
+        }
+    }
+    return *this;
+}
+
+// Returns the maximum number of candidates of the shards
+int ShardedLshNnTable::getMaxNumCandidates() const {
+    return _params.getMaxNumCandidates();
+}
+
+// Set the number of threads used by the queries
+//
+// @param num_threads -- number of threads; 0 means use all threads of
+//                       the shared thread pool
+//
+// @return a reference to this object
+//
+ShardedLshNnTable& ShardedLshNnTable::setNumThreads(int num_threads) {
+    if ( num_threads < 0 ) {
+        stop("number of threads cannot be negative");
+    }
+    _num_threads = falconnr::resolve_num_threads(num_threads);
+    return *this;
+}
+
+// Returns the number of threads used by the queries
+int ShardedLshNnTable::getNumThreads() const {
+    return _num_threads;
+}
+
+// Check a 1-based shard index from R
+//
+// @param shard -- the index
+//
+// @return the 0-based index of the shard
+//
+int ShardedLshNnTable::checkShard(int shard) const {
+    if ( shard < 1 || shard > numShards() ) {
+        stop("shard index out of range");
+    }
+    return shard - 1;
+}
+
+// Check that all shards are built before a query
+void ShardedLshNnTable::checkBuilt() const {
+    for ( size_t index = 0; index < _shards.size(); ++index ) {
+        if ( !_shards[index] ) {
+            stop("shard " + std::to_string(index + 1) + " is not built");
+        }
+    }
+}
+
+// Check that a loaded shard matches the other shards
+//
+// @param table -- the loaded shard
+//
+void ShardedLshNnTable::checkLoaded(const LshNnTable& table) const {
+    LSHConstructionParameters params = _params.params();
+    if ( table._params.dimension != params.dimension ||
+         table._params.distance_function != params.distance_function ) {
+        stop("saved shard does not match the dimension and distance of the table");
+    }
+}
+
+// Reserve the query objects of all shards for a number of threads
+//
+// @param num_threads -- number of threads that will query the shards
+//
+void ShardedLshNnTable::prepareQueries(int num_threads) {
+    for ( const auto& shard : _shards ) {
+        shard->_backend->reserve_query_objects(num_threads);
+    }
+}
+
+// Find the k nearest neighbors of a query in one shard, with their
+// exact distances, in order of increasing distance
+//
+// @param shard        -- 0-based index of the shard
+// @param thread_index -- index of the query object to use
+// @param q            -- the query
+// @param k            -- number of neighbors
+// @param squared_euclidean -- the distance function of the shards
+// @param scratch      -- scratch of the calling thread
+// @param neighbors    -- receives the (distance, shard key) pairs
+//
+void ShardedLshNnTable::queryShard(int shard, int thread_index,
+                                   const QueryVector& q, int k,
+                                   bool squared_euclidean, Scratch* scratch,
+                                   ShardNeighbors* neighbors) {
+    falconnr::TableBackend& backend = *_shards[shard]->_backend;
+    backend.find_k_nearest_neighbors(thread_index, q, k, &scratch->keys, nullptr);
+    backend.distances(q, scratch->keys, squared_euclidean, &scratch->distances);
+
+    // The shard ranks its neighbors in its own precision, so their
+    // order by exact distance may differ slightly
+    neighbors->resize(scratch->keys.size());
+    for ( size_t ii = 0; ii < scratch->keys.size(); ++ii ) {
+        (*neighbors)[ii] = std::make_pair(scratch->distances[ii],
+                                          scratch->keys[ii]);
+    }
+    std::sort(neighbors->begin(), neighbors->end());
+}
+
+// Merge the neighbors found in all shards into the k nearest overall
+//
+// A min-heap holds the nearest remaining neighbor of each shard, so
+// this takes O(k log(number of shards)) after the shard lists.
+//
+// @param k       -- number of neighbors
+// @param scratch -- holds the neighbors of each shard
+// @param out     -- receives the global indices of the neighbors,
+//                   advancing stride elements per neighbor; entries
+//                   beyond the neighbors found are left alone
+// @param stride  -- distance between consecutive entries of out
+//
+void ShardedLshNnTable::mergeNeighbors(int k, Scratch* scratch, int* out,
+                                       size_t stride) const {
+    typedef std::pair<double, int> Head;     // (distance, shard)
+
+    std::vector<ShardNeighbors>& neighbors = scratch->neighbors;
+    std::vector<Head>&           heads = scratch->heads;
+    std::vector<size_t>&         positions = scratch->positions;
+
+    heads.clear();
+    positions.assign(neighbors.size(), 0);
+    for ( size_t shard = 0; shard < neighbors.size(); ++shard ) {
+        if ( !neighbors[shard].empty() ) {
+            heads.push_back(Head(neighbors[shard][0].first, shard));
+        }
+    }
+    std::make_heap(heads.begin(), heads.end(), std::greater<Head>());
+
+    for ( int ii = 0; ii < k && !heads.empty(); ++ii ) {
+        std::pop_heap(heads.begin(), heads.end(), std::greater<Head>());
+        int     shard = heads.back().second;
+        size_t& position = positions[shard];
+        out[ii * stride] = _ids[shard][neighbors[shard][position].second];
+
+        position += 1;
+        if ( position < neighbors[shard].size() ) {
+            heads.back().first = neighbors[shard][position].first;
+            std::push_heap(heads.begin(), heads.end(), std::greater<Head>());
+        } else {
+            heads.pop_back();
+        }
+    }
+}
+
+RCPP_EXPOSED_CLASS(ShardedLshNnTable)
+RCPP_EXPOSED_CLASS(LshParameterSetter)
+
+// Module mod_sharded exposes the ShardedLshNnTable class to R
+
+RCPP_MODULE(mod_sharded) {
+    class_<ShardedLshNnTable>("ShardedLshNnTable")
+
+    .constructor<const LshParameterSetter&, int, bool>(
+        "Construct a table of a number of shards, none built yet")
+
+    .method("dimension", &ShardedLshNnTable::dimension,
+            "Dimension of the data points")
+    .method("size", &ShardedLshNnTable::size,
+            "Number of data points in all built shards")
+    .method("numShards", &ShardedLshNnTable::numShards,
+            "Number of shards")
+    .method("shardSize", &ShardedLshNnTable::shardSize,
+            "Number of data points in a shard")
+    .method("shardIds", &ShardedLshNnTable::shardIds,
+            "Global indices of the data points of a shard")
+    .method("isBuilt", &ShardedLshNnTable::isBuilt,
+            "Whether a shard is built")
+    .method("setShard", &ShardedLshNnTable::setShard,
+            "Builds or rebuilds a shard over points (columns) with global indices")
+    .method("loadShard", &ShardedLshNnTable::loadShard,
+            "Loads a shard saved to a file for the same points and indices")
+    .method("saveShard", &ShardedLshNnTable::saveShard,
+            "Saves a shard (without the data) to a file")
+
+    .method("find_k_nearest_neighbors", &ShardedLshNnTable::find_k_nearest_neighbors,
+            "Returns global indices of the (approximate) k nearest neighbors of a query")
+    .method("find_k_nearest_neighbors_batch", &ShardedLshNnTable::find_k_nearest_neighbors_batch,
+            "Returns matrix of global indices of the k nearest neighbors of each query (column)")
+
+    .method("getNumProbes", &ShardedLshNnTable::getNumProbes,
+            "Returns number of probes of each shard")
+    .method("setNumProbes", &ShardedLshNnTable::setNumProbes,
+            "Sets number of probes of each shard and returns self")
+    .method("getMaxNumCandidates", &ShardedLshNnTable::getMaxNumCandidates,
+            "Returns maximum number of candidates of each shard")
+    .method("setMaxNumCandidates", &ShardedLshNnTable::setMaxNumCandidates,
+            "Sets maximum number of candidates of each shard and returns self")
+    .method("getNumThreads", &ShardedLshNnTable::getNumThreads,
+            "Returns number of threads used by the queries")
+    .method("setNumThreads", &ShardedLshNnTable::setNumThreads,
+            "Sets number of threads used by the queries and returns self")
+    ;
+}
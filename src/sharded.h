@@ -0,0 +1,83 @@
+//! R-exposed table partitioning a data set across several LSH tables
+
+#ifndef FALCONNR_SHARDED_H
+#define FALCONNR_SHARDED_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "falconnr.h"
+#include "params.h"
+#include "table.h"
+
+class ShardedLshNnTable {
+  public:
+    typedef std::unique_ptr<LshNnTable> ShardPtr;
+
+    ShardedLshNnTable(const LshParameterSetter& params, int num_shards,
+                      bool distinct_seeds);
+
+    int dimension() const;
+    int size() const;
+    int numShards() const;
+    int shardSize(int shard) const;
+    IntegerVector shardIds(int shard) const;
+    bool isBuilt(int shard) const;
+
+    ShardedLshNnTable& setShard(int shard, const NumericMatrix tDataMatrix,
+                                const IntegerVector& ids);
+    ShardedLshNnTable& loadShard(int shard, const NumericMatrix tDataMatrix,
+                                 const IntegerVector& ids,
+                                 const std::string filename);
+    void               saveShard(int shard, const std::string filename) const;
+
+    IntegerVector find_k_nearest_neighbors(const NumericVector& q, int k);
+    IntegerMatrix find_k_nearest_neighbors_batch(const NumericMatrix& queries,
+                                                 int k);
+
+    ShardedLshNnTable& setNumProbes(int num_probes);
+    int                getNumProbes() const;
+    ShardedLshNnTable& setMaxNumCandidates(int num_candidates);
+    int                getMaxNumCandidates() const;
+    ShardedLshNnTable& setNumThreads(int num_threads);
+    int                getNumThreads() const;
+
+  private:
+    // Neighbors of a query in one shard, as (distance, shard key)
+    typedef std::vector<std::pair<double, int32_t> > ShardNeighbors;
+
+    // Per-thread scratch for querying the shards and merging their
+    // neighbors
+    struct Scratch {
+        falconnr::KeyVector                  keys;
+        std::vector<double>                  distances;
+        std::vector<ShardNeighbors>          neighbors;  // one per shard
+        std::vector<std::pair<double, int> > heads;      // merge heap
+        std::vector<size_t>                  positions;  // one per shard
+    };
+
+    LshParameterSetter                 _params;          // for new shards
+    bool                               _distinct_seeds;
+    std::vector<ShardPtr>              _shards;
+    std::vector<std::vector<int32_t> > _ids;             // 1-based, per shard
+    int                                _num_threads;
+
+    int         checkShard(int shard) const;
+    void        checkBuilt() const;
+    void        checkLoaded(const LshNnTable& table) const;
+    void        prepareQueries(int num_threads);
+    void        queryShard(int shard, int thread_index,
+                           const falconnr::QueryVector& q, int k,
+                           bool squared_euclidean, Scratch* scratch,
+                           ShardNeighbors* neighbors);
+    void        mergeNeighbors(int k, Scratch* scratch, int* out,
+                               size_t stride) const;
+};
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End:
@@ -3,142 +3,1295 @@
 // [[Rcpp::depends(RcppEigen)]]
 
 
+#include <algorithm>
+#include <cmath>
 #include <iterator>
+#include <limits>
 
 #include "table.h"
+#include "parallel.h"
 #include <RcppEigen.h>
 
 using namespace Rcpp;
 
-using falconn::construct_table;
-using falconn::compute_number_of_hash_functions;
-using falconn::LSHNearestNeighborTable;
+using falconnr::DenseColumns;
+using falconnr::DynamicTableBackend;
+using falconnr::KeyVector;
+using falconnr::QueryVector;
+using falconnr::SparseColumns;
+using falconnr::SparseTableBackend;
+using falconnr::TypedTableBackend;
 
-// typedef Eigen::MatrixXd  Md;
-// typedef Eigen::VectorXd  vd;
-// typedef Eigen::Map<Md>   MMd;
-// typedef Eigen::Map<Vd>   MVd;
+// Batch queries are handed to the threads in blocks of this many
+// columns, within which the buckets of each query are prefetched a
+// few queries ahead (see forEachQuery and setPipelineDepth)
+static const int kQueryBlockSize = 16;
+static const int kDefaultPipelineDepth = 4;
 
-typedef Eigen::Map<Point>    EPoint;
-typedef std::vector<int32_t> KeyVector;
+// A table replicated on each NUMA node, each replica built over its
+// own copy of the data on a thread bound to its node
+//
+// @param data   -- DenseColumns or SparseColumns of the data matrix
+// @param params -- the FALCONN construction parameters
+//
+template <typename Backend, typename Columns>
+static falconnr::TableBackend* replicatedBackend(
+    const Columns& data, const LSHConstructionParameters& params) {
+    return new falconnr::ReplicatedTableBackend([&]() {
+        return falconnr::ReplicatedTableBackend::ReplicaPtr(new Backend(data, params));
+    }, falconnr::num_numa_nodes());
+}
+
+// Constructs a LSH search table for a specified data set
+//
+// Note: The FALCONN LSH nearest-neighbor search uses a static table,
+// as contructed here. To add to or change the data set, a new
+// object needs to be constructed.
+//
+// A dynamic table (see \code{LshParameterSetter$dynamic}) instead
+// copies the data into its own growable storage, to which points can
+// later be added with \code{insert()} and removed with \code{remove()}.
+//
+// With double precision (the default), the table does not copy the
+// data: it keeps a reference to the R matrix, which stays protected for
+// the lifetime of this object, and indexes the points in place.
+// (Only a non-double matrix, e.g., an integer matrix, is copied, once,
+// when Rcpp coerces it to a NumericMatrix.) With float precision, the
+// data are converted once to single precision, halving the memory
+// used for the data and the bandwidth used when scanning candidates;
+// queries are converted as they arrive.
+//
+// With a NUMA mode (see \code{LshParameterSetter$numa}), a static
+// table is either replicated, each node holding its own copy of the
+// data and hash tables, or built with its pages interleaved across
+// the nodes; batch query threads then run bound to the nodes in turn.
+//
+// With quantization (see \code{LshParameterSetter$quantization}), a
+// static table also keeps one byte per coordinate of the data, by
+// which its nearest-neighbor queries rank their candidates before
+// computing exact distances for the best of them. A reordered table
+// (see \code{LshParameterSetter$reorder}) is built over a copy of
+// the data in which nearby points are stored together.
+//
+// @param tDataMatrix -- the data, an R numeric matrix where
+//                       each \emph{column} is a data point.
+//                       (Thus, pass the transpose of a typical data matrix.)
+//
+// @param params -- the LSH configuration parameters, including the
+//                  precision of the table
+//
+LshNnTable::LshNnTable(const NumericMatrix tDataMatrix,
+                       const LshParameterSetter& params)
+    : _numa("none"), _quantization("none"),
+      _rerank_factor(kDefaultRerankFactor), _reorder(false),
+      _num_threads(1), _num_nodes(1), _pipeline_depth(kDefaultPipelineDepth),
+      _cache(nullptr) {
+    _params = params.params();
+
+    if ( tDataMatrix.nrow() != _params.dimension ) {
+        stop("dimension mismatch between data matrix and LshTable parameters");
+    }
+
+    _numa = params.getNuma();
+    _quantization = params.getQuantization();
+    _rerank_factor = params.getRerankFactor();
+    _reorder = params.isReordered();
+    std::vector<int32_t> order;     // of the points, when reordered
+    if ( params.isDynamic() ) {
+        if ( _numa == "replicate" ) {
+            stop("only static tables can be replicated on NUMA nodes");
+        }
+        if ( _quantization != "none" ) {
+            stop("only static tables can be quantized");
+        }
+        if ( _reorder ) {
+            stop("only static tables can be reordered");
+        }
+        try {
+            falconnr::InterleavedAllocation interleaved(_numa == "interleave");
+            if ( params.getPrecision() == "float" ) {
+                _backend.reset(new DynamicTableBackend<float>(tDataMatrix, _params));
+            } else {
+                _backend.reset(new DynamicTableBackend<double>(tDataMatrix, _params));
+            }
+        } catch ( const falconn::FalconnError& e ) {
+            stop(std::string("could not build LshTable: ") + e.what());
+        }
+    } else if ( _reorder ) {
+        DenseColumns given(tDataMatrix);
+        order = falconnr::locality_order(given, _params.seed);
+        std::vector<double> values = falconnr::reordered_columns(given, order);
+        DenseColumns data(values.data(), given.nrow(), given.ncol());
+        try {
+            if ( _numa == "replicate" ) {
+                if ( params.getPrecision() == "float" ) {
+                    _backend.reset(replicatedBackend<TypedTableBackend<float> >(data, _params));
+                } else {
+                    _backend.reset(replicatedBackend<TypedTableBackend<double> >(data, _params));
+                }
+            } else {
+                falconnr::InterleavedAllocation interleaved(_numa == "interleave");
+                if ( params.getPrecision() == "float" ) {
+                    _backend.reset(new TypedTableBackend<float>(data, _params));
+                } else {
+                    _backend.reset(new TypedTableBackend<double>(data, _params));
+                }
+            }
+        } catch ( const falconn::FalconnError& e ) {
+            stop(std::string("could not build LshTable: ") + e.what());
+        }
+    } else if ( _numa == "replicate" ) {
+        DenseColumns data(tDataMatrix);
+        try {
+            if ( params.getPrecision() == "float" ) {
+                _backend.reset(replicatedBackend<TypedTableBackend<float> >(data, _params));
+            } else {
+                _backend.reset(replicatedBackend<TypedTableBackend<double> >(data, _params));
+            }
+        } catch ( const falconn::FalconnError& e ) {
+            stop(std::string("could not build LshTable: ") + e.what());
+        }
+    } else {
+        falconnr::InterleavedAllocation interleaved(_numa == "interleave");
+        if ( params.getPrecision() == "float" ) {
+            _backend.reset(new TypedTableBackend<float>(tDataMatrix, _params));
+        } else {
+            if ( _numa == "interleave" ) {
+                falconnr::interleave_pages(tDataMatrix.begin(),
+                                           tDataMatrix.size() * sizeof(double));
+            }
+            _backend.reset(new TypedTableBackend<double>(tDataMatrix, _params));
+        }
+    }
+    if ( _quantization != "none" ) {
+        _backend.reset(new falconnr::QuantizedTableBackend(
+            std::move(_backend), _params.dimension, squaredEuclidean(),
+            _rerank_factor));
+    }
+    if ( _reorder ) {
+        _backend.reset(new falconnr::ReorderedTableBackend(std::move(_backend),
+                                                           std::move(order)));
+    }
+    if ( _numa != "none" ) {
+        _num_nodes = falconnr::num_numa_nodes();
+    }
+    _backend->reserve_query_objects(1);
+    applyQuerySettings(params);
+}
+
+// Loads a LSH search table saved with \code{save()}
+//
+// The file holds the hash tables and parameters but not the data,
+// which must be the same matrix (same points, same order) from which
+// the saved table was built. The hash tables are memory-mapped rather
+// than read, so loading is much faster than constructing the table,
+// and processes loading the same file share its pages.
+//
+// @param tDataMatrix -- the data, an R numeric matrix where
+//                       each \emph{column} is a data point, as
+//                       passed when the table was built
+//
+// @param filename -- path of the saved table
+//
+LshNnTable::LshNnTable(const NumericMatrix tDataMatrix,
+                       const std::string filename)
+    : _numa("none"), _quantization("none"),
+      _rerank_factor(kDefaultRerankFactor), _reorder(false),
+      _num_threads(1), _num_nodes(1), _pipeline_depth(kDefaultPipelineDepth),
+      _cache(nullptr) {
+    falconn::SavedTableInfo info;
+
+    try {
+        info = falconn::inspect_saved_table(filename);
+        if ( info.sparse ) {
+            stop("saved table is not for dense data");
+        }
+        if ( info.params.dimension != tDataMatrix.nrow() ||
+             info.num_points != tDataMatrix.ncol() ) {
+            stop("data matrix does not match the saved LshTable");
+        }
+
+        if ( info.coordinate_size == static_cast<int>(sizeof(float)) ) {
+            _backend.reset(new TypedTableBackend<float>(tDataMatrix, filename));
+        } else {
+            _backend.reset(new TypedTableBackend<double>(tDataMatrix, filename));
+        }
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not load LshTable: ") + e.what());
+    }
+    _params = info.params;
+    _backend->reserve_query_objects(1);
+}
+
+// Constructs a LSH search table for a sparse data set
+//
+// The nonzero entries of the matrix are copied once into the table's
+// sparse points, so the data are never densified. Sparse points are
+// hashed through a random feature hashing of dimension
+// \code{LshParameterSetter$featureHashingDimension}, which bounds the
+// cost of the cross-polytope hash independently of the dimension of
+// the data. Queries may be dense or sparse. Sparse tables cannot be
+// dynamic.
+//
+// @param tDataMatrix -- the data, a \code{Matrix::dgCMatrix} where
+//                       each \emph{column} is a data point.
+//
+// @param params -- the LSH configuration parameters, which should
+//                  include a feature hashing dimension for the
+//                  cross-polytope family
+//                  (see \code{LshParameterSetter$withSparseDefaults})
+//
+LshNnTable::LshNnTable(const Rcpp::S4 tDataMatrix,
+                       const LshParameterSetter& params)
+    : _numa("none"), _quantization("none"),
+      _rerank_factor(kDefaultRerankFactor), _reorder(false),
+      _num_threads(1), _num_nodes(1), _pipeline_depth(kDefaultPipelineDepth),
+      _cache(nullptr) {
+    SparseColumns data(tDataMatrix);
+
+    _params = params.params();
+
+    if ( data.nrow() != _params.dimension ) {
+        stop("dimension mismatch between data matrix and LshTable parameters");
+    }
+    if ( params.isDynamic() ) {
+        stop("dynamic tables require dense data");
+    }
+    if ( params.getQuantization() != "none" ) {
+        stop("quantized tables require dense data");
+    }
+    if ( params.isReordered() ) {
+        stop("reordered tables require dense data");
+    }
+
+    _numa = params.getNuma();
+    try {
+        if ( _numa == "replicate" ) {
+            if ( params.getPrecision() == "float" ) {
+                _backend.reset(replicatedBackend<SparseTableBackend<float> >(data, _params));
+            } else {
+                _backend.reset(replicatedBackend<SparseTableBackend<double> >(data, _params));
+            }
+        } else {
+            falconnr::InterleavedAllocation interleaved(_numa == "interleave");
+            if ( params.getPrecision() == "float" ) {
+                _backend.reset(new SparseTableBackend<float>(data, _params));
+            } else {
+                _backend.reset(new SparseTableBackend<double>(data, _params));
+            }
+        }
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not build LshTable: ") + e.what());
+    }
+    if ( _numa != "none" ) {
+        _num_nodes = falconnr::num_numa_nodes();
+    }
+    _backend->reserve_query_objects(1);
+    applyQuerySettings(params);
+}
+
+// Loads a LSH search table for sparse data saved with \code{save()}
+//
+// @param tDataMatrix -- the data, a \code{Matrix::dgCMatrix} where
+//                       each \emph{column} is a data point, as
+//                       passed when the table was built
+//
+// @param filename -- path of the saved table
+//
+LshNnTable::LshNnTable(const Rcpp::S4 tDataMatrix,
+                       const std::string filename)
+    : _numa("none"), _quantization("none"),
+      _rerank_factor(kDefaultRerankFactor), _reorder(false),
+      _num_threads(1), _num_nodes(1), _pipeline_depth(kDefaultPipelineDepth),
+      _cache(nullptr) {
+    SparseColumns           data(tDataMatrix);
+    falconn::SavedTableInfo info;
+
+    try {
+        info = falconn::inspect_saved_table(filename);
+        if ( !info.sparse ) {
+            stop("saved table is not for sparse data");
+        }
+        if ( info.params.dimension != data.nrow() ||
+             info.num_points != data.ncol() ) {
+            stop("data matrix does not match the saved LshTable");
+        }
+
+        if ( info.coordinate_size == static_cast<int>(sizeof(float)) ) {
+            _backend.reset(new SparseTableBackend<float>(data, filename));
+        } else {
+            _backend.reset(new SparseTableBackend<double>(data, filename));
+        }
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not load LshTable: ") + e.what());
+    }
+    _params = info.params;
+    _backend->reserve_query_objects(1);
+}
+
+// Constructs a LSH search table over the points of a vector file
+//
+// The file is memory-mapped rather than read into R (see
+// vector_file.h), so data sets larger than the R heap can be indexed.
+// A flat file of the precision of the table ("float" for float
+// precision, "double" for double precision) is used in place as the
+// data of the table, without any copy; other files are converted once
+// into the table's own copy. The table is static; it may be quantized
+// or placed on NUMA nodes by interleaving, but not replicated or
+// reordered.
+//
+// @param filename -- path of the file
+//
+// @param format -- "fvecs" or "bvecs" (each point stored as its
+//                  dimension, a 32-bit integer, followed by its
+//                  coordinates as 32-bit floats or as bytes), or
+//                  "float" or "double" (flat row-major arrays of
+//                  points)
+//
+// @param params -- the LSH configuration parameters, whose dimension
+//                  must match the points of the file
+//
+LshNnTable::LshNnTable(const std::string filename, const std::string format,
+                       const LshParameterSetter& params)
+    : _numa("none"), _quantization("none"),
+      _rerank_factor(kDefaultRerankFactor), _reorder(false),
+      _num_threads(1), _num_nodes(1), _pipeline_depth(kDefaultPipelineDepth),
+      _cache(nullptr) {
+    _params = params.params();
+
+    if ( params.isDynamic() ) {
+        stop("tables over vector files cannot be dynamic");
+    }
+    if ( params.isReordered() ) {
+        stop("tables over vector files cannot be reordered");
+    }
+    _numa = params.getNuma();
+    if ( _numa == "replicate" ) {
+        stop("tables over vector files cannot be replicated on NUMA nodes");
+    }
+    _quantization = params.getQuantization();
+    _rerank_factor = params.getRerankFactor();
+
+    try {
+        std::shared_ptr<const falconnr::VectorFile> file =
+            std::make_shared<falconnr::VectorFile>(filename, format,
+                                                   _params.dimension);
+        falconnr::InterleavedAllocation interleaved(_numa == "interleave");
+        if ( params.getPrecision() == "float" ) {
+            _backend.reset(new TypedTableBackend<float>(file, _params));
+        } else {
+            _backend.reset(new TypedTableBackend<double>(file, _params));
+        }
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not build LshTable: ") + e.what());
+    }
+    if ( _quantization != "none" ) {
+        _backend.reset(new falconnr::QuantizedTableBackend(
+            std::move(_backend), _params.dimension, squaredEuclidean(),
+            _rerank_factor));
+    }
+    if ( _numa != "none" ) {
+        _num_nodes = falconnr::num_numa_nodes();
+    }
+    _backend->reserve_query_objects(1);
+    applyQuerySettings(params);
+}
+
+// The number and dimension of the points of a vector file
+//
+// @param filename, format -- as for the constructor from a vector file
+// @param dimension -- the dimension of the points of a flat file;
+//                     ignored (if 0) or checked for fvecs and bvecs
+//
+// @return R list with components \code{num_points} and \code{dimension}
+//
+static List vectorFileShape(const std::string filename,
+                            const std::string format, int dimension) {
+    try {
+        falconnr::VectorFile file(filename, format, dimension);
+        return List::create(_["num_points"] = file.num_points(),
+                            _["dimension"] = file.dimension());
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not read vector file: ") + e.what());
+    }
+    return List();
+}
+
+// The dimension of the data points
+//
+// @return the dimension of points in the data matrix
+int LshNnTable::dimension() const {
+    return _params.dimension;
+}
+
+// The number of data points
+//
+// For a dynamic table, this counts the points currently in the table.
+//
+// @return the number points in the data matrix
+int LshNnTable::size() const {
+    return _backend->size();
+}
+
+// The precision of the coordinates stored in the table
+//
+// @return "double" or "float"
+std::string LshNnTable::precision() const {
+    return _backend->precision();
+}
+
+// Whether the table supports inserting and removing points
+//
+// @return TRUE for a dynamic table
+bool LshNnTable::isDynamic() const {
+    return _backend->is_dynamic();
+}
+
+// Whether the table was built over sparse data
+//
+// @return TRUE for a table built from a \code{dgCMatrix}
+bool LshNnTable::isSparse() const {
+    return _backend->is_sparse();
+}
+
+// The parameters with which the table was constructed
+//
+// @return a parameter setter holding the table's parameters
+LshParameterSetter LshNnTable::getParams() const {
+    LshParameterSetter params(_backend->size(), _params.dimension, _params,
+                              _backend->precision());
+    return params.dynamic(_backend->is_dynamic())
+                 .numa(_numa)
+                 .quantization(_quantization)
+                 .rerankFactor(_rerank_factor)
+                 .reorder(_reorder)
+                 .numProbes(getNumProbes())
+                 .maxNumCandidates(getMaxNumCandidates());
+}
+
+// Save the table to a file
+//
+// The hash tables, parameters, number of probes, and maximum number
+// of candidates are written, but the data points are not; to load the
+// table, pass the same data and the file name to the constructor.
+// The file uses the native byte order and is not portable across
+// platforms. Dynamic and reordered tables cannot be saved.
+//
+// @param filename -- path of the file to write
+//
+void LshNnTable::save(const std::string filename) const {
+    try {
+        _backend->save(filename);
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not save LshTable: ") + e.what());
+    }
+}
+
+// Extract data points from the table
+//
+// The points are read directly from the data on which the table was
+// built, so no separate copy of the data needs to be kept in R.
+//
+// @param indices -- 1-based indices of the data points to extract
+//
+// @return a matrix with one \emph{row} per index, in the given order
+//
+NumericMatrix LshNnTable::get_points(const IntegerVector& indices) const {
+    int           num_points = indices.size();
+    NumericMatrix points(num_points, _params.dimension);
+
+    for ( int ii = 0; ii < num_points; ++ii ) {
+        int index = indices[ii];
+        if ( index == NA_INTEGER || !_backend->contains(index - 1) ) {
+            stop("point index out of range");
+        }
+        _backend->copy_point(index - 1, points.begin() + ii, num_points);
+    }
+    return points;
+}
+
+// Extract data points from the table in sparse form
+//
+// This is the counterpart of \code{get_points} for sparse tables, whose
+// points are too high-dimensional to return densely, but it works for
+// any table.
+//
+// @param indices -- 1-based indices of the data points to extract
+//
+// @return R list with components \code{offsets}, \code{indices}, and
+//         \code{values} holding the points, one per \emph{row}, in
+//         compressed sparse row form with 0-based offsets and column
+//         indices, as taken by \code{Matrix::sparseMatrix}
+//
+List LshNnTable::get_sparse_points(const IntegerVector& indices) const {
+    int                 num_points = indices.size();
+    IntegerVector       offsets(num_points + 1);
+    std::vector<int>    columns;
+    std::vector<double> values;
+
+    offsets[0] = 0;
+    for ( int ii = 0; ii < num_points; ++ii ) {
+        int index = indices[ii];
+        if ( index == NA_INTEGER || !_backend->contains(index - 1) ) {
+            stop("point index out of range");
+        }
+        _backend->copy_nonzeros(index - 1, &columns, &values);
+        offsets[ii + 1] = columns.size();
+    }
+
+    return List::create(_["offsets"] = offsets,
+                        _["indices"] = IntegerVector(columns.begin(), columns.end()),
+                        _["values"] = NumericVector(values.begin(), values.end()));
+}
+
+// Add points to a dynamic table
+//
+// Each point gets the next unused index, so the indices of points
+// already in the table never change, and indices of removed points
+// are not reused. Each insertion costs a hash table update in each of
+// the l tables. The table must not be queried concurrently.
+//
+// @param tPoints -- the new points, one point per \emph{column}
+//
+// @return the 1-based indices assigned to the new points
+//
+IntegerVector LshNnTable::insert(const NumericMatrix& tPoints) {
+    if ( !_backend->is_dynamic() ) {
+        stop("points can only be inserted into dynamic tables");
+    }
+    if ( tPoints.nrow() != _params.dimension ) {
+        stop("dimension mismatch between inserted points and LshTable data");
+    }
+
+    int           num_points = tPoints.ncol();
+    IntegerVector indices(num_points);
+    size_t        d = tPoints.nrow();
+
+    try {
+        for ( int column = 0; column < num_points; ++column ) {
+            indices[column] = _backend->insert(tPoints.begin() + column * d) + 1;
+        }
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not insert point: ") + e.what());
+    }
+    return indices;
+}
+
+// Remove points from a dynamic table
+//
+// The points' hash table entries are marked as deleted and reclaimed
+// when the hash tables are next rehashed, which happens once deleted
+// entries make up a quarter of a table.
+//
+// @param indices -- 1-based indices of the points to remove
+//
+// @return a reference to the table object to enable chaining
+//
+LshNnTable& LshNnTable::remove(const IntegerVector& indices) {
+    if ( !_backend->is_dynamic() ) {
+        stop("points can only be removed from dynamic tables");
+    }
+    for ( int index : indices ) {
+        if ( index == NA_INTEGER || !_backend->contains(index - 1) ) {
+            stop("point index out of range or already removed");
+        }
+        _backend->remove(index - 1);
+    }
+    return *this;
+}
+
+// Find the data point nearest to the given query point
+//
+// Searches in the encapsulated data set with Locality-Sensitive Hashing.
+// This is an approximate nearest neighbor search.
+//
+// @param q -- query point, an R numeric vector of dimension d 
+//
+// @return index of the data point nearest to \code{q}, wrapped in
+//         an R integer vector
+//
+IntegerVector LshNnTable::find_nearest_neighbor(const NumericVector& q) {
+    int nearest_index;
+
+    checkQuery(q);
+    nearest_index = _backend->find_nearest_neighbor(0, q.begin()) + 1; // 1-indexed output
+
+    return IntegerVector::create(nearest_index);
+}
+
+// Find the data points nearest to the given query point
+//
+// Searches in the encapsulated data set with Locality-Sensitive Hashing.
+// This is an approximate nearest neighbor search.
+//
+// @param q -- query point, an R numeric vector of dimension d 
+// 
+// @param k -- the number of nearest neighbors to return
+//
+// @return vector of indicies of the data points nearest to \code{q},
+//         wrapped in an R integer vector
+//
+IntegerVector LshNnTable::find_k_nearest_neighbors(const NumericVector& q,
+                                                   int k) {
+    checkQuery(q);
+    _backend->find_k_nearest_neighbors(0, q.begin(), k, &_found, nullptr);
+    return indexVector(_found, 1);
+}
+
+// Find the data points nearest to the given query point, with their
+// distances
+//
+// Like \code{find_k_nearest_neighbors}, but also returns the distances
+// that the query computed to rank its candidates (the squared Euclidean
+// distance or the negative inner product, in the precision of the
+// table), so they need not be computed again from the points.
+//
+// @param q -- query point, an R numeric vector of dimension d
+//
+// @param k -- the number of nearest neighbors to return
+//
+// @return R list with components \code{indices}, the indices of the
+//         neighbors found in order of increasing distance, and
+//         \code{distances}, their distances to \code{q}
+//
+List LshNnTable::find_k_nearest_neighbors_with_distances(const NumericVector& q,
+                                                         int k) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    checkQuery(q);
+
+    _backend->find_k_nearest_neighbors(0, q.begin(), k, &_found,
+                                       &_found_distances);
+    return neighborList(_found, _found_distances);
+}
+
+// Find the k nearest data points of a query within limits on its work
+//
+// Like \code{find_k_nearest_neighbors}, but the candidates are walked
+// lazily and the search stops as soon as it reaches one of the
+// limits, returning the nearest candidates seen so far. The time limit
+// is checked every 64 distance computations, so a query may overrun it
+// by that much. A negative (or NA) limit means no limit.
+//
+// @param q -- query point, an R numeric vector of dimension d
+//
+// @param k -- the number of nearest neighbors to return
+//
+// @param max_seconds       -- limit on the time of the query in seconds
+// @param max_num_probes    -- limit on the number of probes
+// @param max_num_distances -- limit on the number of distance computations
+//
+// @return R list with components \code{indices}, the indices of the
+//         neighbors found in order of increasing distance, and
+//         \code{truncated}, TRUE if a limit stopped the query before it
+//         saw all of its candidates
+//
+List LshNnTable::find_k_nearest_neighbors_bounded(const NumericVector& q, int k,
+                                                  double max_seconds,
+                                                  double max_num_probes,
+                                                  double max_num_distances) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    checkQuery(q);
+
+    falconn::QueryLimits limits =
+        queryLimits(max_seconds, max_num_probes, max_num_distances);
+    bool truncated = _backend->find_k_nearest_neighbors_bounded(
+        0, q.begin(), k, limits, &_found);
+
+    return List::create(Rcpp::Named("indices") = indexVector(_found, 1),
+                        Rcpp::Named("truncated") = truncated);
+}
+
+// Find the k nearest data points of a query among those a filter accepts
+//
+// The filter is applied to the candidates as the probes retrieve them,
+// so no distance is computed for the others, and the query does not
+// come back short just because most of its usual candidates are
+// filtered out: if fewer than k candidates pass within
+// \code{getNumProbes()} probes, it keeps probing, up to
+// \code{max_num_probes} probes in all, until k do. The maximum number
+// of candidates of the table applies to the accepted candidates.
+// Points beyond the size of the filter are not accepted.
+//
+// @param q -- query point, an R numeric vector of dimension d
+//
+// @param k -- the number of nearest neighbors to return
+//
+// @param filter -- the points that may be returned
+//
+// @param max_num_probes -- limit on the probes made to find k accepted
+//                          points; at most \code{getNumProbes()} means
+//                          no more probes than usual
+//
+// @return R list as for \code{find_k_nearest_neighbors_with_distances}
+//
+List LshNnTable::find_k_nearest_neighbors_filtered(const NumericVector& q, int k,
+                                                   const LshFilter& filter,
+                                                   int max_num_probes) {
+    checkFilter(k, filter, max_num_probes);
+    checkQuery(q);
+
+    _backend->find_k_nearest_neighbors_filtered(0, q.begin(), k,
+                                                filter.keyFilter(),
+                                                max_num_probes,
+                                                &_found, &_found_distances);
+    return neighborList(_found, _found_distances);
+}
+
+// Find the data points within a specified radius of the given query point
+//
+// Searches in the encapsulated data set with Locality-Sensitive Hashing.
+// This is an approximate nearest neighbor search.
+//
+// @param q -- query point, an R numeric vector of dimension d 
+// 
+// @param radius -- radius around the query point in which to search
+//
+// @return vector of indicies of the data points within radius of \code{q},
+//         wrapped in an R integer vector
+//
+IntegerVector LshNnTable::find_near_neighbors(const NumericVector& q,
+                                              double radius) {
+    checkQuery(q);
+    _backend->find_near_neighbors(0, q.begin(), radius, &_found, nullptr);
+    return indexVector(_found, 1);
+}
+
+// Find the data points within a specified radius of the given query
+// point, with their distances
+//
+// @param q -- query point, an R numeric vector of dimension d
+//
+// @param radius -- radius around the query point in which to search
+//
+// @return R list as for \code{find_k_nearest_neighbors_with_distances},
+//         with the neighbors in no particular order
+//
+List LshNnTable::find_near_neighbors_with_distances(const NumericVector& q,
+                                                    double radius) {
+    checkQuery(q);
+
+    _backend->find_near_neighbors(0, q.begin(), radius, &_found,
+                                  &_found_distances);
+    return neighborList(_found, _found_distances);
+}
+
+// R list of the 1-based indices and the distances of some neighbors
+//
+// @param indices   -- 0-based indices of the neighbors
+// @param distances -- their distances, in the same order
+//
+List LshNnTable::neighborList(const KeyVector& indices,
+                              const std::vector<double>& distances) {
+    return List::create(Rcpp::Named("indices") = indexVector(indices, 1),
+                        Rcpp::Named("distances") =
+                            NumericVector(distances.begin(), distances.end()));
+}
+
+// R vector of some indices plus an offset (1 for 1-based indices)
+//
+// The vector is allocated once, at its size and without initializing
+// it, and written in a single pass.
+//
+// @param indices -- 0-based indices
+// @param offset  -- added to each index
+//
+IntegerVector LshNnTable::indexVector(const KeyVector& indices, int offset) {
+    IntegerVector indices_r = Rcpp::no_init(static_cast<int>(indices.size()));
+    int*          out = indices_r.begin();
+    for ( int32_t index : indices ) {
+        *out++ = index + offset;
+    }
+    return indices_r;
+}
+
+// Set the number of probes and maximum number of candidates of a new
+// table from its parameters
+//
+// @param params -- the parameters the table was built with
+//
+void LshNnTable::applyQuerySettings(const LshParameterSetter& params) {
+    if ( params.getNumProbes() < _params.l ) {
+        stop("number of probes must be at least the number of hash tables");
+    }
+    _backend->set_num_probes(params.getNumProbes());
+    _backend->set_max_num_candidates(params.getMaxNumCandidates());
+}
 
+// Whether the table uses the squared Euclidean distance rather than
+// the negative inner product, for computing exact distances
+bool LshNnTable::squaredEuclidean() const {
+    if ( _params.distance_function == falconn::DistanceFunction::EuclideanSquared ) {
+        return true;
+    } else if ( _params.distance_function != falconn::DistanceFunction::NegativeInnerProduct ) {
+        stop("exact distances need a known distance function");
+    }
+    return false;
+}
+
+// Limits of a bounded query from its R arguments
+//
+// @param max_seconds, max_num_probes, max_num_distances -- the limits;
+//        negative, NA or infinite values mean no limit
+//
+falconn::QueryLimits LshNnTable::queryLimits(double max_seconds,
+                                             double max_num_probes,
+                                             double max_num_distances) {
+    auto count = [](double limit) -> int_fast64_t {
+        if ( !std::isfinite(limit) || limit < 0 ) {
+            return -1;
+        }
+        return static_cast<int_fast64_t>(std::min(limit, 9.0e18));
+    };
+
+    falconn::QueryLimits limits;
+    limits.max_seconds = std::isfinite(max_seconds) && max_seconds >= 0
+        ? max_seconds : -1.0;
+    limits.max_num_probes = count(max_num_probes);
+    limits.max_num_distances = count(max_num_distances);
+    return limits;
+}
+
+// Check that a query point matches the dimension of the data
+//
+// @param q -- query point
+//
+void LshNnTable::checkQuery(const NumericVector& q) const {
+    if ( q.size() != _params.dimension ) {
+        stop("dimension mismatch between query point and LshTable data");
+    }
+}
+
+// Check that a query matrix matches the dimension of the data
+//
+// @param dimension -- number of rows of the matrix of query points
+//
+void LshNnTable::checkQueries(int dimension) const {
+    if ( dimension != _params.dimension ) {
+        stop("dimension mismatch between query matrix and LshTable data");
+    }
+}
+
+// Run a query function over each column of a query matrix
+//
+// The columns are spread over \code{getNumThreads()} worker threads,
+// each using its own query object (created on first use and reused
+// afterwards) on the shared, read-only table. For a table placed on
+// NUMA nodes, thread i runs bound to node i % (number of nodes). The query function is
+// called as \code{f(thread_index, query, column)}, where query is a
+// view of the column's coordinates, and must not use the R API; it
+// should only write into memory allocated beforehand, using
+// \code{thread_index} to pick the query object and any scratch space.
+//
+// Each thread takes blocks of consecutive columns. For query functions
+// that retrieve all candidates of their query at once (as the
+// nearest-neighbor searches do, unless the number of candidates is
+// bounded), the queries of a block can be pipelined: each query is
+// hashed and its buckets are prefetched \code{getPipelineDepth()}
+// queries ahead of its search, so that its cache misses overlap with
+// the searches before it.
+//
+// @param queries   -- DenseColumns or SparseColumns of a matrix of query
+//                     points, one point per column
+// @param f         -- function to apply to each query
+// @param pipelined -- whether to prefetch the buckets of later queries
+//
+template <typename Columns, typename QueryFunction>
+void LshNnTable::forEachQuery(const Columns& queries, QueryFunction f,
+                              bool pipelined) {
+    checkQueries(queries.nrow());
+
+    int num_queries = queries.ncol();
+    int num_threads = std::max(1, std::min(_num_threads, num_queries));
+    int num_blocks = (num_queries + kQueryBlockSize - 1) / kQueryBlockSize;
+    int depth = pipelined ? _pipeline_depth : 0;
+
+    _backend->reserve_query_objects(num_threads);
+
+    falconnr::parallel_for_on_nodes(num_blocks, num_threads, _num_nodes, 1,
+                                    [&](int thread_index, int block) {
+        int start = block * kQueryBlockSize;
+        int end = std::min(num_queries, start + kQueryBlockSize);
+        for ( int column = start; column < std::min(end, start + depth); ++column ) {
+            _backend->prefetch(thread_index, queries[column]);
+        }
+        for ( int column = start; column < end; ++column ) {
+            if ( depth > 0 && column + depth < end ) {
+                _backend->prefetch(thread_index, queries[column + depth]);
+            }
+            f(thread_index, queries[column], column);
+        }
+    });
+}
+
+// Find the data point nearest to each of several query points
+//
+// The queries are processed entirely in C++, reusing one query buffer
+// per thread, so this avoids the per-call overhead of repeated calls to
+// \code{find_nearest_neighbor}. The queries are spread across
+// \code{getNumThreads()} threads.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @return vector whose ith entry is the index of the data point
+//         nearest to the ith query
+//
+IntegerVector LshNnTable::find_nearest_neighbor_batch(const NumericMatrix& queries) {
+    return nearestNeighborBatch(DenseColumns(queries));
+}
+
+template <typename Columns>
+IntegerVector LshNnTable::nearestNeighborBatch(const Columns& queries) {
+    IntegerVector nearest_indices_r(queries.ncol());
+    int*          out = nearest_indices_r.begin();
+
+    forEachQuery(queries, [&](int thread_index, const QueryVector& query, int column) {
+        out[column] = _backend->find_nearest_neighbor(thread_index, query) + 1;
+    }, true);
+    return nearest_indices_r;
+}
+
+// Find the k data points nearest to each of several query points
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @param k -- the number of nearest neighbors to return for each query
+//
+// @return integer matrix with one row per query whose ith row holds
+//         the indices of the neighbors of the ith query in order of
+//         increasing distance; rows with fewer than k neighbors found
+//         are padded with NA
+//
+IntegerMatrix LshNnTable::find_k_nearest_neighbors_batch(const NumericMatrix& queries,
+                                                         int k) {
+    return kNearestNeighborsBatch(DenseColumns(queries), k, nullptr);
+}
+
+// Find the k data points nearest to each of several query points, with
+// their distances
+//
+// Both matrices are allocated before the queries start, and the worker
+// threads write the neighbors of each query straight into them.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @param k -- the number of nearest neighbors to return for each query
+//
+// @return R list with components \code{indices}, an integer matrix as
+//         for \code{find_k_nearest_neighbors_batch}, and
+//         \code{distances}, a numeric matrix of the same shape holding
+//         the distances of these neighbors (NA where there is none), as
+//         for \code{find_k_nearest_neighbors_with_distances}
+//
+List LshNnTable::find_k_nearest_neighbors_with_distances_batch(
+    const NumericMatrix& queries, int k) {
+    return kNearestNeighborsWithDistancesBatch(DenseColumns(queries), k);
+}
+
+template <typename Columns>
+List LshNnTable::kNearestNeighborsWithDistancesBatch(const Columns& queries,
+                                                     int k) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+
+    NumericMatrix distances_r(queries.ncol(), k);
+    std::fill(distances_r.begin(), distances_r.end(), NA_REAL);
+    IntegerMatrix indices_r = kNearestNeighborsBatch(queries, k, &distances_r);
+    return List::create(Rcpp::Named("indices") = indices_r,
+                        Rcpp::Named("distances") = distances_r);
+}
+
+// @param distances -- if not null, a matrix with one row per query and
+//                     k columns that receives the distances of the
+//                     neighbors found
+//
+template <typename Columns>
+IntegerMatrix LshNnTable::kNearestNeighborsBatch(const Columns& queries, int k,
+                                                 NumericMatrix* distances) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+
+    int                    num_queries = queries.ncol();
+    IntegerMatrix          nearest_indices_r(num_queries, k);
+    int*                   out = nearest_indices_r.begin();
+    double*                distances_out = distances ? distances->begin() : nullptr;
+    std::vector<KeyVector> nearest_indices(std::max(1, _num_threads));
+    std::vector<std::vector<double> > nearest_distances(std::max(1, _num_threads));
+
+    std::fill(nearest_indices_r.begin(), nearest_indices_r.end(), NA_INTEGER);
+
+    forEachQuery(queries, [&](int thread_index, const QueryVector& query, int column) {
+        KeyVector&           found = nearest_indices[thread_index];
+        std::vector<double>* found_distances =
+            distances_out ? &nearest_distances[thread_index] : nullptr;
+        _backend->find_k_nearest_neighbors(thread_index, query, k, &found,
+                                           found_distances);
+        for ( size_t ii = 0; ii < found.size(); ++ii ) {
+            out[column + ii * num_queries] = found[ii] + 1;
+        }
+        if ( found_distances ) {
+            for ( size_t ii = 0; ii < found.size(); ++ii ) {
+                distances_out[column + ii * num_queries] = (*found_distances)[ii];
+            }
+        }
+    }, true);
+    return nearest_indices_r;
+}
+
+// Find the k nearest data points of several queries within limits
+//
+// Each query is bounded separately, as in
+// \code{find_k_nearest_neighbors_bounded}; the queries are spread
+// across \code{getNumThreads()} threads.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @param k -- the number of nearest neighbors to return for each query
+//
+// @param max_seconds, max_num_probes, max_num_distances -- limits on
+//        each query as for \code{find_k_nearest_neighbors_bounded}
+//
+// @return R list with components \code{indices}, an integer matrix as
+//         for \code{find_k_nearest_neighbors_batch}, and
+//         \code{truncated}, a logical vector with one entry per query
+//
+List LshNnTable::find_k_nearest_neighbors_bounded_batch(const NumericMatrix& queries,
+                                                        int k, double max_seconds,
+                                                        double max_num_probes,
+                                                        double max_num_distances) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+
+    falconn::QueryLimits   limits =
+        queryLimits(max_seconds, max_num_probes, max_num_distances);
+    DenseColumns           columns(queries);
+    int                    num_queries = columns.ncol();
+    IntegerMatrix          nearest_indices_r(num_queries, k);
+    Rcpp::LogicalVector    truncated_r(num_queries);
+    int*                   out = nearest_indices_r.begin();
+    int*                   truncated = truncated_r.begin();
+    std::vector<KeyVector> nearest_indices(std::max(1, _num_threads));
+
+    std::fill(nearest_indices_r.begin(), nearest_indices_r.end(), NA_INTEGER);
+
+    forEachQuery(columns, [&](int thread_index, const QueryVector& query, int column) {
+        KeyVector& found = nearest_indices[thread_index];
+        truncated[column] = _backend->find_k_nearest_neighbors_bounded(
+            thread_index, query, k, limits, &found);
+        for ( size_t ii = 0; ii < found.size(); ++ii ) {
+            out[column + ii * num_queries] = found[ii] + 1;
+        }
+    });
+    return List::create(Rcpp::Named("indices") = nearest_indices_r,
+                        Rcpp::Named("truncated") = truncated_r);
+}
+
+// Find the k nearest data points of several queries among those a
+// filter accepts
+//
+// Each query is filtered as in \code{find_k_nearest_neighbors_filtered};
+// the queries are spread across \code{getNumThreads()} threads.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @param k, filter, max_num_probes -- as for
+//        \code{find_k_nearest_neighbors_filtered}
+//
+// @return R list as for \code{find_k_nearest_neighbors_with_distances_batch}
+//
+List LshNnTable::find_k_nearest_neighbors_filtered_batch(const NumericMatrix& queries,
+                                                         int k,
+                                                         const LshFilter& filter,
+                                                         int max_num_probes) {
+    checkFilter(k, filter, max_num_probes);
+
+    falconn::KeyFilter     key_filter = filter.keyFilter();
+    DenseColumns           columns(queries);
+    int                    num_queries = columns.ncol();
+    IntegerMatrix          nearest_indices_r(num_queries, k);
+    NumericMatrix          distances_r(num_queries, k);
+    int*                   out = nearest_indices_r.begin();
+    double*                distances_out = distances_r.begin();
+    std::vector<KeyVector> nearest_indices(std::max(1, _num_threads));
+    std::vector<std::vector<double> > nearest_distances(std::max(1, _num_threads));
+
+    std::fill(nearest_indices_r.begin(), nearest_indices_r.end(), NA_INTEGER);
+    std::fill(distances_r.begin(), distances_r.end(), NA_REAL);
+
+    forEachQuery(columns, [&](int thread_index, const QueryVector& query, int column) {
+        KeyVector&           found = nearest_indices[thread_index];
+        std::vector<double>& found_distances = nearest_distances[thread_index];
+        _backend->find_k_nearest_neighbors_filtered(thread_index, query, k,
+                                                    key_filter, max_num_probes,
+                                                    &found, &found_distances);
+        for ( size_t ii = 0; ii < found.size(); ++ii ) {
+            out[column + ii * num_queries] = found[ii] + 1;
+            distances_out[column + ii * num_queries] = found_distances[ii];
+        }
+    });
+    return List::create(Rcpp::Named("indices") = nearest_indices_r,
+                        Rcpp::Named("distances") = distances_r);
+}
+
+// Find the data points within a specified radius of each query point
+//
+// The result is a compact (CSR-style) list: the neighbors of the ith
+// query are \code{indices[(offsets[i] + 1):offsets[i + 1]]}, using the
+// same 0-based offset convention as the \code{p} slot of a
+// \code{dgCMatrix}.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+//
+// @param radius -- radius around each query point in which to search
+//
+// @return R list with components \code{offsets}, an integer vector of
+//         length one more than the number of queries, and
+//         \code{indices}, the concatenated indices of the neighbors
+//
+List LshNnTable::find_near_neighbors_batch(const NumericMatrix& queries,
+                                           double radius) {
+    return nearNeighborsBatch(DenseColumns(queries), radius, false);
+}
 
-// Constructs a LSH search table for a specified data set
+// Find the data points within a specified radius of each query point,
+// with their distances
 //
-// Note: The FALCONN LSH nearest-neighbor search uses a static table,
-// as contructed here. To add to or change the data set, a new
-// object needs to be constructed.
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
 //
-// @param tDataMatrix -- the data, an R numeric matrix where
-//                       each \emph{column} is a data point.
-//                       (Thus, pass the transpose of a typical data matrix.)
+// @param radius -- radius around each query point in which to search
 //
-// @param params -- the LSH configuration parameters
+// @return R list as for \code{find_near_neighbors_batch}, with one more
+//         component \code{distances}, the distances of the neighbors in
+//         \code{indices}
 //
-LshNnTable::LshNnTable(const NumericMatrix tDataMatrix,
-                       const LshParameterSetter& params) {
-    _params = params.params();
-    _n_points = tDataMatrix.ncol();
+List LshNnTable::find_near_neighbors_with_distances_batch(const NumericMatrix& queries,
+                                                          double radius) {
+    return nearNeighborsBatch(DenseColumns(queries), radius, true);
+}
 
-    if ( tDataMatrix.nrow() != _params.dimension ) {
-        stop("dimension mismatch between data matrix and LshTable parameters");
+template <typename Columns>
+List LshNnTable::nearNeighborsBatch(const Columns& queries, double radius,
+                                    bool with_distances) {
+    int                    num_queries = queries.ncol();
+    std::vector<KeyVector> nearest_indices(num_queries);
+    std::vector<std::vector<double> > nearest_distances(with_distances ? num_queries : 0);
+    IntegerVector          offsets(num_queries + 1);
+
+    forEachQuery(queries, [&](int thread_index, const QueryVector& query, int column) {
+        _backend->find_near_neighbors(thread_index, query, radius,
+                                      &nearest_indices[column],
+                                      with_distances ? &nearest_distances[column]
+                                                     : nullptr);
+    }, true);
+
+    offsets[0] = 0;
+    for ( int column = 0; column < num_queries; ++column ) {
+        offsets[column + 1] = offsets[column] + nearest_indices[column].size();
+    }
+
+    IntegerVector indices_r(offsets[num_queries]);
+    IntegerVector::iterator next = indices_r.begin();
+    for ( const KeyVector& found : nearest_indices ) {
+        next = std::transform(found.begin(), found.end(), next,
+                              [](int index) { return index + 1; });
     }
 
-    std::vector<double> asvec = Rcpp::as<std::vector<double> >(tDataMatrix);
-    const double* data = asvec.data();
+    if ( !with_distances ) {
+        return List::create(_["offsets"] = offsets,
+                            _["indices"] = indices_r);
+    }
 
-    DataPoints _data = {data,
-                        static_cast<int_fast32_t>(_n_points),
-                        _params.dimension};
-    _table = std::shared_ptr<FnnTable>(construct_table<Point,int32_t,DataPoints>
-                                       (_data, _params).release());
+    NumericVector distances_r(offsets[num_queries]);
+    NumericVector::iterator next_distance = distances_r.begin();
+    for ( const std::vector<double>& found : nearest_distances ) {
+        next_distance = std::copy(found.begin(), found.end(), next_distance);
+    }
+    return List::create(_["offsets"] = offsets,
+                        _["indices"] = indices_r,
+                        _["distances"] = distances_r);
 }
 
-// The dimension of the data points
+// Find the data point nearest to each of several sparse query points
 //
-// @return the dimension of points in the data matrix
-int LshNnTable::dimension() const {
-    return _params.dimension;
+// Like \code{find_nearest_neighbor_batch}, but the queries are the
+// columns of a \code{Matrix::dgCMatrix}, which are passed to the
+// table without densifying them (for a dense table, each query is
+// expanded in turn into the query buffer of its thread).
+//
+// @param queries -- dgCMatrix of query points, one point per \emph{column}
+//
+// @return vector whose ith entry is the index of the data point
+//         nearest to the ith query
+//
+IntegerVector LshNnTable::find_nearest_neighbor_batch_sparse(const Rcpp::S4& queries) {
+    return nearestNeighborBatch(SparseColumns(queries));
 }
 
-// The number of data points
+// Find the k data points nearest to each of several sparse query points
 //
-// @return the number points in the data matrix
-int LshNnTable::size() const {
-    return _n_points;
+// @param queries -- dgCMatrix of query points, one point per \emph{column}
+//
+// @param k -- the number of nearest neighbors to return for each query
+//
+// @return integer matrix as for \code{find_k_nearest_neighbors_batch}
+//
+IntegerMatrix LshNnTable::find_k_nearest_neighbors_batch_sparse(const Rcpp::S4& queries,
+                                                                int k) {
+    return kNearestNeighborsBatch(SparseColumns(queries), k, nullptr);
 }
 
-// Find the data point nearest to the given query point
+// Find the k data points nearest to each of several sparse query
+// points, with their distances
 //
-// Searches in the encapsulated data set with Locality-Sensitive Hashing.
-// This is an approximate nearest neighbor search.
+// @param queries -- dgCMatrix of query points, one point per \emph{column}
 //
-// @param q -- query point, an R numeric vector of dimension d 
+// @param k -- the number of nearest neighbors to return for each query
 //
-// @return index of the data point nearest to \code{q}, wrapped in
-//         an R integer vector
+// @return R list as for \code{find_k_nearest_neighbors_with_distances_batch}
 //
-IntegerVector LshNnTable::find_nearest_neighbor(const NumericVector& q) {
-    EPoint query(Rcpp::as<EPoint>(q));
-    int    nearest_index;
-
-    nearest_index = _table->find_nearest_neighbor(query) + 1; // 1-indexed output
-
-    return IntegerVector::create(nearest_index);
+List LshNnTable::find_k_nearest_neighbors_with_distances_batch_sparse(
+    const Rcpp::S4& queries, int k) {
+    return kNearestNeighborsWithDistancesBatch(SparseColumns(queries), k);
 }
 
-// Find the data points nearest to the given query point
+// Find the data points within a specified radius of each sparse query point
 //
-// Searches in the encapsulated data set with Locality-Sensitive Hashing.
-// This is an approximate nearest neighbor search.
+// @param queries -- dgCMatrix of query points, one point per \emph{column}
 //
-// @param q -- query point, an R numeric vector of dimension d 
-// 
-// @param k -- the number of nearest neighbors to return
+// @param radius -- radius around each query point in which to search
 //
-// @return vector of indicies of the data points nearest to \code{q},
-//         wrapped in an R integer vector
+// @return R list as for \code{find_near_neighbors_batch}
 //
-IntegerVector LshNnTable::find_k_nearest_neighbors(const NumericVector& q,
-                                                   int k) {
-    EPoint        query(Rcpp::as<EPoint>(q));
-    KeyVector     nearest_indices(k);
-    IntegerVector nearest_indices_r;
-
-    _table->find_k_nearest_neighbors(query, k, &nearest_indices);
-    nearest_indices_r.assign(nearest_indices.begin(), nearest_indices.end());
-    std::transform(nearest_indices_r.begin(),
-                   nearest_indices_r.end(),
-                   nearest_indices_r.begin(),
-                   [](int index) { return index + 1; });
-    return nearest_indices_r;
+List LshNnTable::find_near_neighbors_batch_sparse(const Rcpp::S4& queries,
+                                                  double radius) {
+    return nearNeighborsBatch(SparseColumns(queries), radius, false);
 }
 
-// Find the data points within a specified radius of the given query point
+// Find the data points within a specified radius of each sparse query
+// point, with their distances
 //
-// Searches in the encapsulated data set with Locality-Sensitive Hashing.
-// This is an approximate nearest neighbor search.
+// @param queries -- dgCMatrix of query points, one point per \emph{column}
 //
-// @param q -- query point, an R numeric vector of dimension d 
-// 
-// @param radius -- radius around the query point in which to search
+// @param radius -- radius around each query point in which to search
 //
-// @return vector of indicies of the data points within radius of \code{q},
-//         wrapped in an R integer vector
+// @return R list as for \code{find_near_neighbors_with_distances_batch}
 //
-IntegerVector LshNnTable::find_near_neighbors(const NumericVector& q,
-                                              double radius) {
-    EPoint        query(Rcpp::as<EPoint>(q));
-    KeyVector     nearest_indices;
-    IntegerVector nearest_indices_r;
-
-    _table->find_near_neighbors(query, radius, &nearest_indices);
-    nearest_indices_r.assign(nearest_indices.begin(), nearest_indices.end());
-    std::transform(nearest_indices_r.begin(),
-                   nearest_indices_r.end(),
-                   nearest_indices_r.begin(),
-                   [](int index) { return index + 1; });
-    return nearest_indices_r;
+List LshNnTable::find_near_neighbors_with_distances_batch_sparse(
+    const Rcpp::S4& queries, double radius) {
+    return nearNeighborsBatch(SparseColumns(queries), radius, true);
 }
 
 // Find all data points found in a single probing sequence
@@ -153,14 +1306,9 @@ IntegerVector LshNnTable::find_near_neighbors(const NumericVector& q,
 //         which may include duplicates, wrapped in an R integer vector
 //
 IntegerVector LshNnTable::get_candidates(const NumericVector& q) {
-    EPoint        query(Rcpp::as<EPoint>(q));
-    KeyVector     nearest_indices;
-    IntegerVector nearest_indices_r;
-
-    _table->get_candidates_with_duplicates(query, &nearest_indices);
-    nearest_indices_r.assign(nearest_indices.begin(), nearest_indices.end());
-
-    return nearest_indices_r;
+    checkQuery(q);
+    _backend->get_candidates_with_duplicates(0, q.begin(), &_found);
+    return indexVector(_found, 0);
 }
 
 // Find all data points found in a single probing sequence, duplicates removed
@@ -175,14 +1323,37 @@ IntegerVector LshNnTable::get_candidates(const NumericVector& q) {
 //         which will not include duplicates, wrapped in an R integer vector
 //
 IntegerVector LshNnTable::get_unique_candidates(const NumericVector& q) {
-    EPoint        query(Rcpp::as<EPoint>(q));
-    KeyVector     nearest_indices;
-    IntegerVector nearest_indices_r;
-
-    _table->get_unique_candidates(query, &nearest_indices);
-    nearest_indices_r.assign(nearest_indices.begin(), nearest_indices.end());
+    checkQuery(q);
+    _backend->get_unique_candidates(0, q.begin(), &_found);
+    return indexVector(_found, 0);
+}
 
-    return nearest_indices_r;
+// Find the first candidates of a query point
+//
+// The probing sequence is walked lazily: probes are generated and their
+// buckets retrieved only until num_candidates candidates are found, so
+// this is cheap for a few candidates even with many probes. All of
+// \code{getNumProbes()} probes are available, and the maximum number
+// of candidates of the table is ignored.
+//
+// @param q              -- query point, an R numeric vector of dimension d
+// @param num_candidates -- number of candidates to return
+// @param unique         -- if true, each data point is returned once
+//
+// @return vector of the 0-based indices of the first num_candidates
+//         candidates (fewer if the probing sequence has fewer), in the
+//         order in which a maximum number of candidates takes them, as
+//         for \code{get_candidates}
+//
+IntegerVector LshNnTable::get_first_candidates(const NumericVector& q,
+                                               int num_candidates,
+                                               bool unique) {
+    checkQuery(q);
+    if ( num_candidates < 0 ) {
+        stop("number of candidates must be nonnegative");
+    }
+    _backend->get_first_candidates(0, q.begin(), num_candidates, unique, &_found);
+    return indexVector(_found, 0);
 }
 
 // Set the number of probes used in multi-probe LSH
@@ -195,7 +1366,7 @@ IntegerVector LshNnTable::get_unique_candidates(const NumericVector& q) {
 // @return a reference to the table object to enable chaining
 // 
 LshNnTable&   LshNnTable::setNumProbes(int num_probes) {
-    _table->set_num_probes(num_probes);
+    _backend->set_num_probes(num_probes);
     return *this;
 }
 
@@ -203,17 +1374,24 @@ LshNnTable&   LshNnTable::setNumProbes(int num_probes) {
 // 
 // @return the number of probes 
 int           LshNnTable::getNumProbes() const {
-    return _table->get_num_probes();
+    return _backend->get_num_probes();
 }
 
 // Set the maximum number of candidates to consider during similarity search
 // 
+// The candidates are then taken from one bucket per hash table in
+// turn, 16 at a time, with the buckets opened in probe order; a
+// bucket that runs out is replaced by the next probe. A heavy bucket
+// thus gets its share of the candidates rather than all of them, and
+// the probes beyond the first num_candidates candidates are never
+// generated.
+//
 // @param num_candidates -- the maximum number of candidates
 //
 // @return a reference to the table object to enable chaining
 // 
 LshNnTable&   LshNnTable::setMaxNumCandidates(int num_candidates) {
-    _table->set_max_num_candidates(num_candidates);
+    _backend->set_max_num_candidates(num_candidates);
     return *this;
 }
 
@@ -221,51 +1399,637 @@ LshNnTable&   LshNnTable::setMaxNumCandidates(int num_candidates) {
 // 
 // @return the maximum number of candidates
 int           LshNnTable::getMaxNumCandidates() const {
-    return _table->get_max_num_candidates();
+    return _backend->get_max_num_candidates();
+}
+
+// Set the number of threads used by the batch query methods
+//
+// Each thread uses its own query object on the shared table, so
+// the batch methods (\code{find_*_batch}) scale with the number of
+// threads; single-query methods are unaffected. The threads come from
+// the package's thread pool (see setThreads), so no more of them run
+// at once than the pool has.
+//
+// @param num_threads -- the number of threads to use; 0 means use all
+//                       threads of the pool
+//
+// @return a reference to the table object to enable chaining
+//
+LshNnTable&   LshNnTable::setNumThreads(int num_threads) {
+    if ( num_threads < 0 ) {
+        stop("number of threads cannot be negative");
+    }
+    _num_threads = falconnr::resolve_num_threads(num_threads);
+    return *this;
+}
+
+// Returns the number of threads used by the batch query methods
+//
+// @return the number of threads
+int           LshNnTable::getNumThreads() const {
+    return _num_threads;
+}
+
+// Set how many queries ahead the batch query methods prefetch
+//
+// Within each block of 16 queries handed to a thread, the nearest and
+// near neighbor batch methods hash each query and start loading its
+// hash buckets this many queries before searching it, so the cache
+// misses of several queries are in flight at once. Queries with a
+// maximum number of candidates, and queries on dynamic tables, are
+// not prefetched. The results do not depend on the depth.
+//
+// @param depth -- the number of queries prefetched ahead, from 0 (no
+//                 prefetching) to 16
+//
+// @return a reference to the table object to enable chaining
+//
+LshNnTable&   LshNnTable::setPipelineDepth(int depth) {
+    if ( depth < 0 || depth > kQueryBlockSize ) {
+        stop("pipeline depth must be between 0 and " +
+             std::to_string(kQueryBlockSize));
+    }
+    _pipeline_depth = depth;
+    return *this;
+}
+
+// Returns how many queries ahead the batch query methods prefetch
+//
+// @return the pipeline depth
+int           LshNnTable::getPipelineDepth() const {
+    return _pipeline_depth;
+}
+
+// Set the number of entries of the query caches
+//
+// Repeated queries can be answered from two caches in front of the
+// table. The first holds the results of the nearest, k nearest and
+// near neighbor searches (and their batch versions), with their
+// distances, and answers queries with exactly the same coordinates,
+// kind and k or radius. The second holds the unique candidates of
+// queries, keyed on the hash of the query in each hash table, and is
+// only used with one probe per hash table and no maximum number of
+// candidates, where these hashes determine the candidates: nearby
+// queries with the same hashes reuse the candidates and only compute
+// their distances, exactly (a quantized table then ranks all of them
+// by their exact distances).
+//
+// Each cache holds up to \code{num_entries} entries and evicts the
+// least recently used ones (approximately, with the CLOCK algorithm).
+// The caches are safe for the threads of the batch queries, and are
+// cleared when the number of probes or the maximum number of
+// candidates is set and when points are inserted or removed. While
+// caching, the batch queries are not prefetched (see
+// \code{setPipelineDepth}). The hits and misses are counted in the
+// query statistics.
+//
+// @param num_entries -- entries of each cache; 0 (the default) turns
+//                       caching off and drops the cached entries
+//
+// @return a reference to the table object to enable chaining
+//
+LshNnTable&   LshNnTable::setCacheSize(int num_entries) {
+    if ( num_entries < 0 ) {
+        stop("cache size cannot be negative");
+    }
+    if ( _cache != nullptr ) {
+        _cache->set_capacity(num_entries);
+    } else if ( num_entries > 0 ) {
+        bool squared_euclidean = squaredEuclidean();
+        _cache = new falconnr::CachedTableBackend(
+            std::move(_backend), _params.dimension, _params.l,
+            squared_euclidean, num_entries);
+        _backend.reset(_cache);
+        _backend->reserve_query_objects(1);
+    }
+    return *this;
+}
+
+// Returns the number of entries of each query cache
+//
+// @return the cache size, 0 if caching is off
+int           LshNnTable::getCacheSize() const {
+    return _cache == nullptr ? 0 : static_cast<int>(_cache->capacity());
+}
+
+// Resize the thread pool shared by table construction, batch queries,
+// brute-force search and tuning
+//
+// @param num_threads -- the number of threads, counting the calling
+//                       thread; 0 means one per hardware thread
+//
+// @return the previous number of threads
+//
+static int setThreadPoolSize(int num_threads) {
+    if ( num_threads < 0 ) {
+        stop("number of threads cannot be negative");
+    }
+    int previous = static_cast<int>(falconn::core::thread_pool().size());
+    falconnr::set_pool_size(num_threads);
+    return previous;
+}
+
+// Returns the number of threads of the shared thread pool
+static int getThreadPoolSize() {
+    return static_cast<int>(falconn::core::thread_pool().size());
+}
+
+// The mean and tail quantiles of one per-query quantity
+static NumericVector summarizeHistogram(const falconn::QueryHistogram& histogram,
+                                 double mean) {
+    return NumericVector::create(_["mean"] = mean,
+                                 _["p50"]  = histogram.quantile(0.5),
+                                 _["p90"]  = histogram.quantile(0.9),
+                                 _["p99"]  = histogram.quantile(0.99),
+                                 _["max"]  = histogram.max());
 }
 
-// Calculates the search accuracy for a specified number of probes
+// Returns statistics of the queries made since the table was built or
+// the statistics were last reset
 //
-// @param queries -- matrix of queries, one per column
-//                   @seealso \code{\link{LshNnTable::tuneNumProbes}}
+// Queries from all threads are included. Times are in seconds. The
+// quantiles come from histograms with 8 buckets per power of two and
+// so are exact to within about 6 percent. They cover the measured
+// queries (see setInstrumentation), by default all of them.
 //
-// @param answers -- vector of data indices,
-//                   @seealso \code{\link{LshNnTable::tuneNumProbes}}
+// @return a list with the number of queries (num_queries) and of
+//         measured queries (measured_queries) and, for the total,
+//         hashing (lsh_time), bucket retrieval (hash_table_time) and
+//         distance computation times and the numbers of candidates and
+//         unique candidates, a named vector of the mean, p50, p90, p99
+//         and max over the measured queries; and the hits of the result
+//         and candidate caches and the misses of both (cache, see
+//         setCacheSize). Queries answered from a cache are not among
+//         num_queries; the misses of the candidate cache are, with only
+//         their hashing and bucket retrieval measured.
 //
-// @param num_probes -- the number of probes to use for this check
+List          LshNnTable::getQueryStatistics() const {
+    falconn::QueryStatistics stats = _backend->get_query_statistics();
+    return List::create(
+        _["num_queries"] = static_cast<double>(stats.num_queries),
+        _["measured_queries"] = static_cast<double>(stats.total_query_time_histogram.count()),
+        _["total_time"] = summarizeHistogram(stats.total_query_time_histogram,
+                                             stats.average_total_query_time),
+        _["lsh_time"] = summarizeHistogram(stats.lsh_time_histogram,
+                                           stats.average_lsh_time),
+        _["hash_table_time"] = summarizeHistogram(stats.hash_table_time_histogram,
+                                                  stats.average_hash_table_time),
+        _["distance_time"] = summarizeHistogram(stats.distance_time_histogram,
+                                                stats.average_distance_time),
+        _["num_candidates"] = summarizeHistogram(stats.num_candidates_histogram,
+                                                 stats.average_num_candidates),
+        _["num_unique_candidates"] = summarizeHistogram(stats.num_unique_candidates_histogram,
+                                                        stats.average_num_unique_candidates),
+        _["cache"] = NumericVector::create(
+            _["result_hits"] = static_cast<double>(stats.num_cache_result_hits),
+            _["candidate_hits"] = static_cast<double>(stats.num_cache_candidate_hits),
+            _["misses"] = static_cast<double>(stats.num_cache_misses)));
+}
+
+// Clears the query statistics
+//
+// @return a reference to the table object to enable chaining
+//
+LshNnTable&   LshNnTable::resetQueryStatistics() {
+    _backend->reset_query_statistics();
+    return *this;
+}
+
+// Sets what the queries measure about themselves
+//
+// Measuring a query reads the clock around each of its phases (the
+// cycle counter where there is one) and adds the phases to the query
+// statistics, which costs a few percent of the time of fast queries.
+// With "none", the queries are only counted; with "sampled", one in
+// every sample_period queries of each thread is measured; with
+// "trace", every query is, and its phases also go to a trace queue
+// for drainQueryTrace(). The queue holds trace_capacity records
+// (rounded up to a power of two); records that find it full are
+// dropped. Tables measure every query by default.
+//
+// @param level          -- "none", "sampled" or "trace"
+// @param sample_period  -- with "sampled", measure one in this many
+//                          queries, at least 1
+// @param trace_capacity -- with "trace", records the queue holds
+//
+// @return a reference to the table object to enable chaining
+//
+LshNnTable&   LshNnTable::setInstrumentation(const std::string& level,
+                                             int sample_period,
+                                             int trace_capacity) {
+    falconn::QueryInstrumentation instrumentation;
+    if ( level == "none" ) {
+        instrumentation.level = falconn::InstrumentationLevel::None;
+    } else if ( level == "sampled" ) {
+        if ( sample_period < 1 ) {
+            stop("sample period must be at least 1");
+        }
+        instrumentation.level = falconn::InstrumentationLevel::Sampled;
+        instrumentation.sample_period = sample_period;
+    } else if ( level == "trace" ) {
+        if ( trace_capacity < 1 ) {
+            stop("trace capacity must be at least 1");
+        }
+        instrumentation.level = falconn::InstrumentationLevel::Trace;
+        _trace = std::make_shared<falconn::QueryTrace>(trace_capacity);
+        instrumentation.trace = _trace;
+    } else {
+        stop("instrumentation level must be \"none\", \"sampled\" or \"trace\"");
+    }
+    _backend->set_instrumentation(instrumentation, 1);
+    return *this;
+}
+
+// Takes the records out of the trace queue of the "trace" level (see
+// setInstrumentation)
+//
+// @return a list with a data frame of the records, oldest first, and
+//         the number of records dropped since the queue was created
+//         (num_dropped). Each record has the thread of the query (1
+//         for queries of single points), its start in seconds since
+//         the queue was created, its total, hashing, bucket retrieval
+//         and distance times, and its numbers of candidates and unique
+//         candidates; phases the query did not go through are NA.
+//
+List          LshNnTable::drainQueryTrace() {
+    std::vector<falconn::QueryTraceRecord> records;
+    if ( _trace != nullptr ) {
+        _trace->drain(&records);
+    }
+    size_t n = records.size();
+    IntegerVector thread(n);
+    NumericVector start_time(n), total_time(n), lsh_time(n),
+                  hash_table_time(n), distance_time(n), num_candidates(n),
+                  num_unique_candidates(n);
+    // Phases the query did not go through are negative in the record
+    auto value = [](double x) { return x < 0 ? NA_REAL : x; };
+    for ( size_t ii = 0; ii < n; ++ii ) {
+        const falconn::QueryTraceRecord& record = records[ii];
+        thread[ii] = record.query_object + 1;
+        start_time[ii] = record.start_time;
+        total_time[ii] = record.total_time;
+        lsh_time[ii] = value(record.lsh_time);
+        hash_table_time[ii] = value(record.hash_table_time);
+        distance_time[ii] = value(record.distance_time);
+        num_candidates[ii] = value(static_cast<double>(record.num_candidates));
+        num_unique_candidates[ii] =
+            value(static_cast<double>(record.num_unique_candidates));
+    }
+    return List::create(
+        _["records"] = Rcpp::DataFrame::create(
+            _["thread"] = thread,
+            _["start_time"] = start_time,
+            _["total_time"] = total_time,
+            _["lsh_time"] = lsh_time,
+            _["hash_table_time"] = hash_table_time,
+            _["distance_time"] = distance_time,
+            _["num_candidates"] = num_candidates,
+            _["num_unique_candidates"] = num_unique_candidates),
+        _["num_dropped"] = static_cast<double>(
+            _trace == nullptr ? 0 : _trace->get_num_dropped()));
+}
+
+// Reports the memory used by the table, by component
+//
+// The data include the points the table holds: a double table keeps
+// the data matrix alive, and float, dynamic and sparse tables hold
+// their own copy. The arrays of a loaded table are pages of the saved
+// file, which are shared between processes. The query scratch is
+// that of all query objects: one inside the FALCONN table, one per
+// thread used by the batch query methods so far (at least one, which
+// also serves queries of single points), and the buffers in which
+// queries of single points return their results.
+//
+// @return a list of byte counts; see \code{LshParameterSetter$estimateMemoryUsage}
+//
+List          LshNnTable::memoryUsage() const {
+    falconn::MemoryUsage usage = _backend->get_memory_usage();
+    usage.query_scratch += _found.capacity() * sizeof(int32_t) +
+                           _found_distances.capacity() * sizeof(double);
+    return falconnr::memory_usage_list(usage);
+}
+
+// Reports how the points are spread over the buckets of each hash table
+//
+// On skewed (e.g., clustered) data, a few buckets may hold a large
+// share of the points. A query that probes such a bucket retrieves all
+// of its points, so these statistics tell whether more hash functions
+// per table (or a maximum number of candidates) are needed. Only the
+// sizes of the buckets are read, not their points.
+//
+// @return a list with a data frame with one row per hash table, giving
+//         its number of non-empty buckets (num_buckets), the number of
+//         points in its largest bucket (largest) and their fraction of
+//         all points (largest_fraction), and the mean size of the
+//         bucket of a point (mean_point_bucket, the number of
+//         candidates a query hashing like a data point gets from the
+//         table); and an integer matrix (histogram) with one row per
+//         hash table whose column j counts its buckets of 2^(j-1) to
+//         2^j - 1 points
 //
-// @return search accuracy for the given number of probes
+List          LshNnTable::bucketStatistics() const {
+    int                                    num_tables = _params.l;
+    std::vector<std::vector<int_fast64_t> > counts(num_tables);
+    IntegerVector                          num_buckets(num_tables);
+    NumericVector                          largest(num_tables);
+    NumericVector                          largest_fraction(num_tables);
+    NumericVector                          mean_point_bucket(num_tables);
+    std::vector<int_fast64_t>              sizes;
+    size_t                                 num_classes = 1;
+
+    for ( int tt = 0; tt < num_tables; ++tt ) {
+        _backend->get_bucket_sizes(tt, &sizes);
+        double num_points = 0.0;
+        double sum_squares = 0.0;
+        int_fast64_t max_size = 0;
+        for ( int_fast64_t size : sizes ) {
+            size_t size_class = 0;
+            while ( (size >> (size_class + 1)) > 0 ) {
+                ++size_class;
+            }
+            if ( counts[tt].size() <= size_class ) {
+                counts[tt].resize(size_class + 1, 0);
+            }
+            counts[tt][size_class] += 1;
+            num_points += size;
+            sum_squares += static_cast<double>(size) * size;
+            max_size = std::max(max_size, size);
+        }
+        num_classes = std::max(num_classes, counts[tt].size());
+        num_buckets[tt] = static_cast<int>(sizes.size());
+        largest[tt] = static_cast<double>(max_size);
+        largest_fraction[tt] = num_points > 0 ? max_size / num_points : 0.0;
+        mean_point_bucket[tt] = num_points > 0 ? sum_squares / num_points : 0.0;
+    }
+
+    IntegerMatrix histogram(num_tables, static_cast<int>(num_classes));
+    for ( int tt = 0; tt < num_tables; ++tt ) {
+        for ( size_t jj = 0; jj < counts[tt].size(); ++jj ) {
+            histogram[tt + jj * num_tables] = static_cast<int>(counts[tt][jj]);
+        }
+    }
+
+    IntegerVector table(num_tables);
+    for ( int tt = 0; tt < num_tables; ++tt ) {
+        table[tt] = tt + 1;
+    }
+    return List::create(
+        _["tables"] = Rcpp::DataFrame::create(
+            _["table"] = table,
+            _["num_buckets"] = num_buckets,
+            _["largest"] = largest,
+            _["largest_fraction"] = largest_fraction,
+            _["mean_point_bucket"] = mean_point_bucket),
+        _["histogram"] = histogram);
+}
+
+// Check that training answers match a matrix of queries and the data
 //
-double        LshNnTable::computeProbePrecision(const NumericMatrix queries,
-                                                IntegerVector answers,
-                                                int num_probes) {
-    int num_cols = queries.ncol();
-    int answer_index = 0;
-    int num_matches = 0;
-    std::vector<int32_t> candidates;
+// @param num_queries -- number of training queries
+// @param answers     -- 1-based indices of the answers to the queries
+//
+void LshNnTable::checkAnswers(int num_queries, const IntegerVector& answers) const {
+    if ( answers.size() != num_queries ) {
+        stop("number of answers does not match the number of queries");
+    }
+    for ( auto answer : answers ) {
+        if ( answer == NA_INTEGER || !_backend->contains(answer - 1) ) {
+            stop("answers must be indices of points in the table");
+        }
+    }
+}
+
+void LshNnTable::checkFilter(int k, const LshFilter&, int max_num_probes) const {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    if ( max_num_probes == NA_INTEGER ) {
+        stop("maximum number of probes for a filtered query must not be NA");
+    }
+}
 
-    _table->set_num_probes(num_probes);
+// Find the number of probes each query needs to find its answer
+//
+// The probing sequence of each query is walked once and only until the
+// answer turns up, in parallel over \code{getNumThreads()} threads.
+// Queries whose entry is already positive keep it, so raising the
+// limit only walks the queries not found before.
+//
+// @param queries -- training queries, one per column
+// @param answers -- 1-based indices of their answers
+// @param max_num_probes -- the largest number of probes to consider
+// @param ranks   -- the numbers of probes, -1 where the answer is not
+//                   found within max_num_probes probes; entries of
+//                   -1 (or all if the size does not match) are computed
+//
+void LshNnTable::findProbeRanks(const DenseColumns& queries,
+                                const IntegerVector& answers,
+                                int max_num_probes,
+                                std::vector<int64_t>* ranks) {
+    if ( static_cast<int>(ranks->size()) != queries.ncol() ) {
+        ranks->assign(queries.ncol(), -1);
+    }
+    int64_t* out = ranks->data();
 
-    for ( int column = 0; column < num_cols; ++column ) {
-        NumericVector col = queries(_, column); // ATTN: as fails with queries
-        EPoint query = Rcpp::as<EPoint>(col);   // directly in place of col
-        _table->get_candidates_with_duplicates(query, &candidates);
-        for ( auto candidate : candidates ) {
-            if ( candidate == answers[answer_index] ) {
-                ++num_matches;
-                break;
+    try {
+        forEachQuery(queries, [&](int thread_index, const QueryVector& query, int column) {
+            if ( out[column] < 0 ) {
+                out[column] = _backend->get_num_probes_to_find(
+                    thread_index, query, answers[column] - 1, max_num_probes);
             }
+        });
+    } catch ( const falconn::FalconnError& e ) {
+        stop(std::string("could not probe the table: ") + e.what());
+    }
+}
+
+// Smallest number of probes that finds the answers of a fraction of
+// the queries
+//
+// @param ranks  -- numbers of probes for each query, -1 if not found
+// @param target -- fraction of the queries to find
+//
+// @return the number of probes, or -1 if too few answers are found
+//
+static int64_t probesForPrecision(std::vector<int64_t> ranks, double target) {
+    size_t needed = static_cast<size_t>(std::ceil(target * ranks.size() - 1e-9));
+    needed = std::max<size_t>(needed, 1);
+    auto not_found = std::partition(ranks.begin(), ranks.end(),
+                                    [](int64_t rank) { return rank > 0; });
+    if ( static_cast<size_t>(not_found - ranks.begin()) < needed ) {
+        return -1;
+    }
+    std::nth_element(ranks.begin(), ranks.begin() + (needed - 1), not_found);
+    return ranks[needed - 1];
+}
+
+// Find the number of probes each query needs to find a given answer
+//
+// A query with a given number of probes finds the answer if and only
+// if the returned number is at most that number of probes, so this
+// gives the precision for every number of probes at once. The maximum
+// number of candidates is ignored.
+//
+// @param queries        -- matrix of query points, one point per
+//                          \emph{column} (pass transpose if necessary)
+// @param answers        -- vector of indices of the data points to find,
+//                          e.g., the nearest neighbors of the queries
+// @param max_num_probes -- the largest number of probes to consider
+//
+// @return integer vector of the numbers of probes, NA for the queries
+//         that do not find their answer within max_num_probes probes
+//
+IntegerVector LshNnTable::probesToFind(const NumericMatrix& queries,
+                                       const IntegerVector& answers,
+                                       int max_num_probes) {
+    DenseColumns columns(queries);
+    std::vector<int64_t> ranks;
+
+    checkQueries(columns.nrow());
+    checkAnswers(columns.ncol(), answers);
+    if ( max_num_probes < 1 ) {
+        stop("maximum number of probes must be positive");
+    }
+    findProbeRanks(columns, answers, max_num_probes, &ranks);
+
+    IntegerVector ranks_r(ranks.size());
+    for ( size_t ii = 0; ii < ranks.size(); ++ii ) {
+        ranks_r[ii] = ranks[ii] > 0 ? static_cast<int>(ranks[ii]) : NA_INTEGER;
+    }
+    return ranks_r;
+}
+
+// Find the position of a given answer among the candidates of each query
+//
+// This uses the current number of probes and counts candidates with
+// duplicates in the order the maximum number of candidates takes them:
+// a query finds the answer with a maximum of m candidates if and only
+// if the returned position is at most m. The current maximum number of
+// candidates is itself applied. Each query walks its probing sequence
+// lazily and stops at its answer. The queries are spread across
+// \code{getNumThreads()} threads.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+// @param answers -- vector of indices of the data points to find
+//
+// @return integer vector of the 1-based positions, NA for the queries
+//         whose candidates do not include the answer
+//
+IntegerVector LshNnTable::candidatesToFind(const NumericMatrix& queries,
+                                           const IntegerVector& answers) {
+    DenseColumns  columns(queries);
+    IntegerVector positions_r(columns.ncol(), NA_INTEGER);
+    int*          out = positions_r.begin();
+    const int*    keys = answers.begin();
+    int64_t       max_num_candidates = _backend->get_max_num_candidates();
+
+    checkQueries(columns.nrow());
+    checkAnswers(columns.ncol(), answers);
+
+    forEachQuery(columns, [&](int thread_index, const QueryVector& query, int column) {
+        int64_t position = _backend->get_candidate_position(
+            thread_index, query, keys[column] - 1, max_num_candidates);
+        if ( position > 0 ) {
+            out[column] = static_cast<int>(position);
         }
-        ++answer_index;
+    });
+    return positions_r;
+}
+
+// Find the exact k nearest neighbors of each query point
+//
+// Every point of the table is compared with every query, with the
+// table's distance function and precision, so this gives the ground
+// truth against which the results of the LSH queries are measured
+// (e.g., to choose the answers for \code{tuneNumProbes} or
+// \code{probesToFind}). The distances are computed a block of
+// queries and a tile of points at a time as a matrix product, and the
+// blocks of queries are spread across \code{getNumThreads()} threads.
+//
+// @param queries -- matrix of query points, one point per
+//                   \emph{column} (pass transpose if necessary)
+// @param k       -- the number of nearest neighbors to return for
+//                   each query
+//
+// @return integer matrix with one row per query whose ith row holds
+//         the indices of the k points nearest to the ith query in
+//         order of increasing distance; rows are padded with NA if
+//         the table has fewer than k points
+//
+IntegerMatrix LshNnTable::bruteForceKnn(const NumericMatrix& queries, int k) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    checkQueries(queries.nrow());
+    bool squared_euclidean = squaredEuclidean();
+
+    DenseColumns  columns(queries);
+    IntegerMatrix nearest_indices_r(columns.ncol(), k);
+    int*          out = nearest_indices_r.begin();
+
+    _backend->brute_force_knn(columns, squared_euclidean, k, _num_threads, out);
+    for ( auto& index : nearest_indices_r ) {
+        index = index < 0 ? NA_INTEGER : index + 1;
+    }
+    return nearest_indices_r;
+}
+
+// Find approximate k nearest neighbors of every point of the table
+//
+// Rather than querying the table once per point, the buckets of each
+// hash table are walked directly: every pair of points sharing a
+// bucket is scored once, for both points, and each point keeps the k
+// best. Buckets with more than \code{max_bucket_size} points are
+// shuffled and split into groups of at most that many points, whose
+// pairs are scored. The buckets of a hash table are spread across
+// \code{getNumThreads()} threads, and the result does not depend on
+// the number of threads. Multi-probing and the maximum number of
+// candidates do not apply.
+//
+// @param k               -- the number of neighbors of each point
+// @param max_bucket_size -- the largest group of points of a bucket
+//                           whose pairs are all scored, at least 2
+//
+// @return integer matrix with one row per point whose ith row holds
+//         the indices of the k nearest points found for the ith point
+//         (not counting the point itself) in order of increasing
+//         distance; rows are padded with NA if fewer were found. For
+//         a dynamic table, there is a row for every index used so far,
+//         removed points having only NA.
+//
+IntegerMatrix LshNnTable::knnGraph(int k, int max_bucket_size) {
+    if ( k < 1 ) {
+        stop("k-nearest-neighbor search for nonpositive k");
+    }
+    if ( max_bucket_size < 2 ) {
+        stop("maximum bucket size must be at least 2");
     }
-    return (num_matches + 0.0) / (num_cols + 0.0);
+
+    std::vector<int32_t> graph;
+    _backend->knn_graph(_params.l, squaredEuclidean(), k, max_bucket_size,
+                        _params.seed, _num_threads, &graph);
+
+    IntegerMatrix nearest_indices_r(static_cast<int>(graph.size() / k), k);
+    std::transform(graph.begin(), graph.end(), nearest_indices_r.begin(),
+                   [](int32_t index) {
+        return index < 0 ? NA_INTEGER : index + 1;
+    });
+    return nearest_indices_r;
 }
 
 // Find number of probes to achieve target precision on training data
 //
-// During the search for the optimal number of probes, this changes
-// the set number of probes via \code{setNumProbes()}. However, the
-// number originally set on entry is restored on exit.
+// The precision is the fraction of queries whose candidates include
+// their answer. Starting from \code{init_num_probes}, the limit on
+// the number of probes doubles until enough queries find their
+// answer; each query walks its probing sequence only until its answer
+// turns up, and queries found under one limit are not probed again
+// under the next. The smallest number of probes with the target
+// precision (but at least the number of hash tables) is then read off
+// the numbers of probes the queries needed, without a further search.
+// The maximum number of candidates is ignored, and the number of
+// probes of the table is not changed.
 //
 // @param queries          -- matrix of query points, one point per
 //                            \emph{column} (pass transpose if necessary)
@@ -273,64 +2037,153 @@ double        LshNnTable::computeProbePrecision(const NumericMatrix queries,
 //                            the nearest neighbor to the corresponding query
 // @param target_precision -- minimal correctness probability to achieve
 // @param init_num_probes  -- number of probes at which to start search
-// @param max_iterations   -- maximum number of iterations to consider;
-//                            default of -1 means no limit
+// @param max_iterations   -- maximum number of times to double the
+//                            number of probes; default of -1 means no limit
 //                            
-// @return number of probes to use to achieve
+// @return the smallest number of probes achieving the target precision
 //
 int           LshNnTable::tuneNumProbes(const NumericMatrix queries,
                                         IntegerVector answers,
                                         double target_precision,
                                         int init_num_probes,
                                         int max_iterations) {
-    int original_num_probes = getNumProbes();
-    int num_probes = init_num_probes;
-    int iter = max_iterations;
-  
-    for ( ; iter != 0; --iter ) {
-        double precision = computeProbePrecision(queries, answers, num_probes);
-        if (precision >= target_precision) {
+    DenseColumns columns(queries);
+    std::vector<int64_t> ranks;
+
+    checkQueries(columns.nrow());
+    checkAnswers(columns.ncol(), answers);
+    if ( init_num_probes < 1 ) {
+        stop("initial number of probes must be positive");
+    }
+    if ( target_precision > 1.0 ) {
+        stop("target precision cannot exceed 1");
+    }
+
+    int64_t limit = init_num_probes;
+    int64_t num_probes = -1;
+    for ( int iter = max_iterations; iter != 0; --iter ) {
+        findProbeRanks(columns, answers, static_cast<int>(limit), &ranks);
+        num_probes = probesForPrecision(ranks, target_precision);
+        if ( num_probes > 0 || 2 * limit > std::numeric_limits<int>::max() ) {
             break;
         }
-        num_probes *= 2;
+        limit *= 2;
     }
 
-    if ( iter == 0 ) {
+    if ( num_probes < 0 ) {
         stop("maximum iterations exceeded while tuning number of probes");
     }
+    return static_cast<int>(std::max<int64_t>(num_probes, _params.l));
+}
 
-    for ( int mid, lo = num_probes/2; num_probes - lo > 1; ) {
-        mid = (num_probes + lo) / 2;
-        double precision = computeProbePrecision(queries, answers, num_probes);
+RCPP_EXPOSED_CLASS(LshNnTable)
+RCPP_EXPOSED_CLASS(LshParameterSetter)
+RCPP_EXPOSED_CLASS(LshFilter)
 
-        if (precision >= target_precision) {
-            num_probes = mid;
-        } else {
-            lo = mid;
-        }
-    }
+// Constructor validators, which distinguish the two-argument constructors
+// by the kind of data (a numeric matrix, or an S4 dgCMatrix) and the
+// second argument (a file name, or parameters); the constructor from a
+// vector file is the only one with three arguments
 
-    setNumProbes(original_num_probes);
+static bool isFileConstructor(SEXP* args, int nargs) {
+    return nargs == 2 && !Rf_isS4(args[0]) && TYPEOF(args[1]) == STRSXP;
+}
 
-    return num_probes;
+static bool isParamsConstructor(SEXP* args, int nargs) {
+    return nargs == 2 && !Rf_isS4(args[0]) && TYPEOF(args[1]) != STRSXP;
 }
 
-RCPP_EXPOSED_CLASS(LshNnTable)
-RCPP_EXPOSED_CLASS(LshParameterSetter)
+static bool isSparseFileConstructor(SEXP* args, int nargs) {
+    return nargs == 2 && Rf_isS4(args[0]) && TYPEOF(args[1]) == STRSXP;
+}
+
+static bool isSparseParamsConstructor(SEXP* args, int nargs) {
+    return nargs == 2 && Rf_isS4(args[0]) && TYPEOF(args[1]) != STRSXP;
+}
+
+static bool isVectorFileConstructor(SEXP*, int nargs) {
+    return nargs == 3;
+}
 
-// Module mod_table exposes the LshNnTable class to R
+// Module mod_table exposes the LshNnTable class, and the LshFilter class
+// for its filtered queries, to R
 
 RCPP_MODULE(mod_table) {
     class_<LshNnTable>("LshNnTable")
 
-    .constructor<const NumericMatrix, const LshParameterSetter&>()
+    .constructor<const NumericMatrix, const std::string>(
+        "Load a table saved to a file", &isFileConstructor)
+    .constructor<const NumericMatrix, const LshParameterSetter&>(
+        "Construct a table with given parameters", &isParamsConstructor)
+    .constructor<const Rcpp::S4, const std::string>(
+        "Load a table for sparse data saved to a file", &isSparseFileConstructor)
+    .constructor<const Rcpp::S4, const LshParameterSetter&>(
+        "Construct a table for sparse data with given parameters",
+        &isSparseParamsConstructor)
+    .constructor<const std::string, const std::string, const LshParameterSetter&>(
+        "Construct a table over the points of a vector file", &isVectorFileConstructor)
 
+    .method("dimension", &LshNnTable::dimension,
+            "Dimension of the data points")
+    .method("size", &LshNnTable::size,
+            "Number of data points")
+    .method("precision", &LshNnTable::precision,
+            "Precision of the coordinates stored in the table")
+    .method("isDynamic", &LshNnTable::isDynamic,
+            "Whether the table supports inserting and removing points")
+    .method("isSparse", &LshNnTable::isSparse,
+            "Whether the table was built over sparse data")
+    .method("getParams", &LshNnTable::getParams,
+            "Returns the parameters with which the table was constructed")
+    .method("save", &LshNnTable::save,
+            "Saves the table (without the data) to a file")
+    .method("get_points", &LshNnTable::get_points,
+            "Extract data points, one per row, by 1-based index")
+    .method("get_sparse_points", &LshNnTable::get_sparse_points,
+            "Extract data points, one per row, by 1-based index in CSR form")
+    .method("insert", &LshNnTable::insert,
+            "Adds points (columns) to a dynamic table, returns their indices")
+    .method("remove", &LshNnTable::remove,
+            "Removes points by 1-based index from a dynamic table and returns self")
     .method("find_nearest_neighbor", &LshNnTable::find_nearest_neighbor,
             "Returns index of the (approximate) nearest neighbor to a given query point")
     .method("find_k_nearest_neighbors", &LshNnTable::find_k_nearest_neighbors,
             "Returns indices of the (approximate) k nearest neighbors to a given query point")
     .method("find_near_neighbors", &LshNnTable::find_near_neighbors,
             "Returns indices of (approximate) neighbors within a given radius of query point")
+    .method("find_k_nearest_neighbors_bounded", &LshNnTable::find_k_nearest_neighbors_bounded,
+            "Returns the k nearest neighbors found within limits on time, probes and distances")
+    .method("find_k_nearest_neighbors_with_distances", &LshNnTable::find_k_nearest_neighbors_with_distances,
+            "Returns indices and distances of the (approximate) k nearest neighbors to a given query point")
+    .method("find_k_nearest_neighbors_filtered", &LshNnTable::find_k_nearest_neighbors_filtered,
+            "Returns indices and distances of the (approximate) k nearest neighbors among the points a filter accepts")
+    .method("find_near_neighbors_with_distances", &LshNnTable::find_near_neighbors_with_distances,
+            "Returns indices and distances of (approximate) neighbors within a given radius of query point")
+
+    .method("find_nearest_neighbor_batch", &LshNnTable::find_nearest_neighbor_batch,
+            "Returns indices of the (approximate) nearest neighbors to each query (column)")
+    .method("find_k_nearest_neighbors_batch", &LshNnTable::find_k_nearest_neighbors_batch,
+            "Returns matrix of indices of the (approximate) k nearest neighbors to each query (column)")
+    .method("find_near_neighbors_batch", &LshNnTable::find_near_neighbors_batch,
+            "Returns CSR-style list of (approximate) neighbors within a given radius of each query (column)")
+    .method("find_k_nearest_neighbors_bounded_batch", &LshNnTable::find_k_nearest_neighbors_bounded_batch,
+            "Returns the k nearest neighbors of each query (column) found within limits")
+    .method("find_k_nearest_neighbors_with_distances_batch", &LshNnTable::find_k_nearest_neighbors_with_distances_batch,
+            "Returns matrices of indices and distances of the (approximate) k nearest neighbors to each query (column)")
+    .method("find_k_nearest_neighbors_filtered_batch", &LshNnTable::find_k_nearest_neighbors_filtered_batch,
+            "Returns matrices of indices and distances of the (approximate) k nearest neighbors among the points a filter accepts, for each query (column)")
+    .method("find_near_neighbors_with_distances_batch", &LshNnTable::find_near_neighbors_with_distances_batch,
+            "Returns CSR-style list of (approximate) neighbors within a given radius of each query (column), with distances")
+    .method("find_nearest_neighbor_batch_sparse", &LshNnTable::find_nearest_neighbor_batch_sparse,
+            "Returns indices of the (approximate) nearest neighbors to each sparse query (column)")
+    .method("find_k_nearest_neighbors_batch_sparse", &LshNnTable::find_k_nearest_neighbors_batch_sparse,
+            "Returns matrix of indices of the (approximate) k nearest neighbors to each sparse query (column)")
+    .method("find_near_neighbors_batch_sparse", &LshNnTable::find_near_neighbors_batch_sparse,
+            "Returns CSR-style list of (approximate) neighbors within a given radius of each sparse query (column)")
+    .method("find_k_nearest_neighbors_with_distances_batch_sparse", &LshNnTable::find_k_nearest_neighbors_with_distances_batch_sparse,
+            "Returns matrices of indices and distances of the (approximate) k nearest neighbors to each sparse query (column)")
+    .method("find_near_neighbors_with_distances_batch_sparse", &LshNnTable::find_near_neighbors_with_distances_batch_sparse,
+            "Returns CSR-style list of (approximate) neighbors within a given radius of each sparse query (column), with distances")
 
     .method("getNumProbes", &LshNnTable::getNumProbes,
             "Returns number of probes used for multi-probe LSH")
@@ -339,9 +2192,66 @@ RCPP_MODULE(mod_table) {
 
     .method("getMaxNumCandidates", &LshNnTable::getMaxNumCandidates,
             "Returns maximum number of candidates to consider in each query")
-    .method("setNumProbes", &LshNnTable::setNumProbes,
+    .method("setMaxNumCandidates", &LshNnTable::setMaxNumCandidates,
             "Sets maximum number of candidates to consider in each query and returns self")
+    .method("getNumThreads", &LshNnTable::getNumThreads,
+            "Returns number of threads used by the batch query methods")
+    .method("setNumThreads", &LshNnTable::setNumThreads,
+            "Sets number of threads used by the batch query methods and returns self")
+    .method("getPipelineDepth", &LshNnTable::getPipelineDepth,
+            "Returns how many queries ahead the batch query methods prefetch")
+    .method("setPipelineDepth", &LshNnTable::setPipelineDepth,
+            "Sets how many queries ahead the batch query methods prefetch and returns self")
+    .method("getCacheSize", &LshNnTable::getCacheSize,
+            "Returns the number of entries of each query cache")
+    .method("setCacheSize", &LshNnTable::setCacheSize,
+            "Sets the number of entries of each query cache and returns self")
     .method("tuneNumProbes", &LshNnTable::tuneNumProbes,
             "Trains number of probes to target specified precision, returns number of probes")
+    .method("probesToFind", &LshNnTable::probesToFind,
+            "Returns the number of probes each query (column) needs to find its answer")
+    .method("candidatesToFind", &LshNnTable::candidatesToFind,
+            "Returns the position of each query's (column's) answer among its candidates")
+    .method("get_first_candidates", &LshNnTable::get_first_candidates,
+            "Returns the first candidates of a query, stopping early")
+    .method("bruteForceKnn", &LshNnTable::bruteForceKnn,
+            "Returns the exact k nearest neighbors of each query (column), one row per query")
+    .method("knnGraph", &LshNnTable::knnGraph,
+            "Returns approximate k nearest neighbors of every point from its buckets, one row per point")
+    .method("getQueryStatistics", &LshNnTable::getQueryStatistics,
+            "Returns latency and candidate-count summaries of the queries since the last reset")
+    .method("resetQueryStatistics", &LshNnTable::resetQueryStatistics,
+            "Clears the query statistics and returns self")
+    .method("setInstrumentation", &LshNnTable::setInstrumentation,
+            "Sets which queries are measured (none, sampled or trace) and returns self")
+    .method("drainQueryTrace", &LshNnTable::drainQueryTrace,
+            "Takes the trace records of the measured queries out of the trace queue")
+    .method("memoryUsage", &LshNnTable::memoryUsage,
+            "Returns the bytes used by the table, by component")
+    .method("bucketStatistics", &LshNnTable::bucketStatistics,
+            "Returns the bucket sizes of each hash table: a summary and a histogram")
+    ;
+
+    class_<LshFilter>("LshFilter")
+
+    .constructor<int, IntegerVector>()
+
+    .method("size", &LshFilter::size,
+            "Returns the number of points the filter is over")
+    .method("count", &LshFilter::count,
+            "Returns the number of points the filter accepts")
+    .method("add", &LshFilter::add,
+            "Accepts the given points (indices) too and returns self")
+    .method("remove", &LshFilter::remove,
+            "Stops accepting the given points (indices) and returns self")
+    .method("contains", &LshFilter::contains,
+            "Returns whether the filter accepts each of the given points (indices)")
     ;
+
+    function("setThreadPoolSize", &setThreadPoolSize,
+             "Resizes the shared thread pool and returns its previous size");
+    function("getThreadPoolSize", &getThreadPoolSize,
+             "Returns the number of threads of the shared thread pool");
+    function("vectorFileShape", &vectorFileShape,
+             "Returns the number and dimension of the points of a vector file");
 }
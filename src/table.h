@@ -3,34 +3,104 @@
 #ifndef FALCONNR_TABLE_H
 #define FALCONNR_TABLE_H
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "falconnr.h"
 #include "params.h"
+#include "filter.h"
+#include "backend.h"
+#include "quantized.h"
+#include "query_cache.h"
+#include "reorder.h"
 
 using Rcpp::NumericMatrix;
 using Rcpp::NumericVector;
+using Rcpp::IntegerMatrix;
 using Rcpp::IntegerVector;
+using Rcpp::List;
 
 using falconn::LSHConstructionParameters;
-using falconn::PlainArrayPointSet;
 
 class LshNnTable {
   public:
     typedef falconn::LSHNearestNeighborTable<Point> FnnTable;
-    typedef std::shared_ptr<FnnTable>               FnnTablePtr;
-    typedef PlainArrayPointSet<double>              DataPoints;
+    typedef std::unique_ptr<falconnr::TableBackend> BackendPtr;
 
     LshNnTable(const NumericMatrix tDataMatrix,
                const LshParameterSetter& params);
+    LshNnTable(const NumericMatrix tDataMatrix,
+               const std::string filename);
+    LshNnTable(const Rcpp::S4 tDataMatrix,
+               const LshParameterSetter& params);
+    LshNnTable(const Rcpp::S4 tDataMatrix,
+               const std::string filename);
+    LshNnTable(const std::string filename, const std::string format,
+               const LshParameterSetter& params);
 
     int dimension() const;
     int size() const;
+    std::string precision() const;
+    bool        isDynamic() const;
+    bool        isSparse() const;
+    LshParameterSetter getParams() const;
+
+    void save(const std::string filename) const;
+
+    NumericMatrix get_points(const IntegerVector& indices) const;
+    List          get_sparse_points(const IntegerVector& indices) const;
+
+    IntegerVector insert(const NumericMatrix& tPoints);
+    LshNnTable&   remove(const IntegerVector& indices);
 
     IntegerVector find_nearest_neighbor(const NumericVector& q);
     IntegerVector find_k_nearest_neighbors(const NumericVector& q, int k);
     IntegerVector find_near_neighbors(const NumericVector& q, double radius);
+    List          find_k_nearest_neighbors_bounded(const NumericVector& q, int k,
+                                                   double max_seconds,
+                                                   double max_num_probes,
+                                                   double max_num_distances);
+    List          find_k_nearest_neighbors_with_distances(const NumericVector& q,
+                                                          int k);
+    List          find_k_nearest_neighbors_filtered(const NumericVector& q, int k,
+                                                    const LshFilter& filter,
+                                                    int max_num_probes);
+    List          find_near_neighbors_with_distances(const NumericVector& q,
+                                                     double radius);
+
+    IntegerVector find_nearest_neighbor_batch(const NumericMatrix& queries);
+    IntegerMatrix find_k_nearest_neighbors_batch(const NumericMatrix& queries,
+                                                 int k);
+    List          find_near_neighbors_batch(const NumericMatrix& queries,
+                                            double radius);
+    List          find_k_nearest_neighbors_bounded_batch(const NumericMatrix& queries,
+                                                         int k, double max_seconds,
+                                                         double max_num_probes,
+                                                         double max_num_distances);
+    List          find_k_nearest_neighbors_with_distances_batch(const NumericMatrix& queries,
+                                                                int k);
+    List          find_k_nearest_neighbors_filtered_batch(const NumericMatrix& queries,
+                                                          int k,
+                                                          const LshFilter& filter,
+                                                          int max_num_probes);
+    List          find_near_neighbors_with_distances_batch(const NumericMatrix& queries,
+                                                           double radius);
+
+    IntegerVector find_nearest_neighbor_batch_sparse(const Rcpp::S4& queries);
+    IntegerMatrix find_k_nearest_neighbors_batch_sparse(const Rcpp::S4& queries,
+                                                        int k);
+    List          find_near_neighbors_batch_sparse(const Rcpp::S4& queries,
+                                                   double radius);
+    List          find_k_nearest_neighbors_with_distances_batch_sparse(
+                      const Rcpp::S4& queries, int k);
+    List          find_near_neighbors_with_distances_batch_sparse(
+                      const Rcpp::S4& queries, double radius);
 
     IntegerVector get_candidates(const NumericVector& q);
     IntegerVector get_unique_candidates(const NumericVector& q);
+    IntegerVector get_first_candidates(const NumericVector& q,
+                                       int num_candidates, bool unique);
 
     LshNnTable& setNumProbes(int num_probes);
     int         getNumProbes() const;
@@ -39,18 +109,82 @@ class LshNnTable {
                               double target_precision,
                               int init_num_probes = 1,
                               int max_iterations = -1);
+    IntegerVector probesToFind(const NumericMatrix& queries,
+                               const IntegerVector& answers,
+                               int max_num_probes);
+    IntegerVector candidatesToFind(const NumericMatrix& queries,
+                                   const IntegerVector& answers);
+    IntegerMatrix bruteForceKnn(const NumericMatrix& queries, int k);
+    IntegerMatrix knnGraph(int k, int max_bucket_size);
 
     LshNnTable& setMaxNumCandidates(int num_candidates = FnnTable::kNoMaxNumCandidates);
     int         getMaxNumCandidates() const;
 
+    LshNnTable& setNumThreads(int num_threads);
+    int         getNumThreads() const;
+
+    LshNnTable& setPipelineDepth(int depth);
+    int         getPipelineDepth() const;
+
+    LshNnTable& setCacheSize(int num_entries);
+    int         getCacheSize() const;
+
+    List        getQueryStatistics() const;
+    LshNnTable& resetQueryStatistics();
+    LshNnTable& setInstrumentation(const std::string& level, int sample_period,
+                                   int trace_capacity);
+    List        drainQueryTrace();
+
+    List        memoryUsage() const;
+    List        bucketStatistics() const;
+
   private:
-    FnnTablePtr                 _table;
+    friend class ShardedLshNnTable;
+
+    BackendPtr                  _backend;     // table of the chosen precision
     LSHConstructionParameters   _params;
-    int                         _n_points;
+    std::string                 _numa;        // placement on NUMA nodes
+    std::string                 _quantization; // scoring of candidates
+    int                         _rerank_factor;
+    bool                        _reorder;     // data in locality order
+    int                         _num_threads;
+    int                         _num_nodes;   // nodes the queries run on
+    int                         _pipeline_depth; // queries prefetched ahead
+    falconnr::CachedTableBackend* _cache;     // in front of _backend, or null
+    std::shared_ptr<falconn::QueryTrace> _trace; // of the last "trace" level
+    falconnr::KeyVector         _found;       // result of a single query
+    std::vector<double>         _found_distances; // and its distances
 
-    double      computeProbePrecision(const NumericMatrix queries,
-                                      IntegerVector answers,
-                                      int num_probes);
+    void        checkQuery(const NumericVector& q) const;
+    void        checkQueries(int dimension) const;
+    void        checkAnswers(int num_queries, const IntegerVector& answers) const;
+    void        checkFilter(int k, const LshFilter& filter, int max_num_probes) const;
+    bool        squaredEuclidean() const;
+    void        applyQuerySettings(const LshParameterSetter& params);
+    static falconn::QueryLimits queryLimits(double max_seconds,
+                                            double max_num_probes,
+                                            double max_num_distances);
+    template <typename Columns, typename QueryFunction>
+    void        forEachQuery(const Columns& queries, QueryFunction f,
+                             bool pipelined = false);
+    template <typename Columns>
+    IntegerVector nearestNeighborBatch(const Columns& queries);
+    template <typename Columns>
+    IntegerMatrix kNearestNeighborsBatch(const Columns& queries, int k,
+                                         NumericMatrix* distances);
+    template <typename Columns>
+    List          kNearestNeighborsWithDistancesBatch(const Columns& queries, int k);
+    template <typename Columns>
+    List          nearNeighborsBatch(const Columns& queries, double radius,
+                                     bool with_distances);
+    static IntegerVector indexVector(const falconnr::KeyVector& indices,
+                                     int offset);
+    static List   neighborList(const falconnr::KeyVector& indices,
+                               const std::vector<double>& distances);
+    void        findProbeRanks(const falconnr::DenseColumns& queries,
+                               const IntegerVector& answers,
+                               int max_num_probes,
+                               std::vector<int64_t>* ranks);
 };
 
 #endif
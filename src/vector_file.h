@@ -0,0 +1,187 @@
+/// \file vector_file.h
+/// \brief Data points read straight from vector files
+///
+/// Large benchmark data sets usually come as fvecs or bvecs files,
+/// where each point is stored as its dimension (a 32-bit integer)
+/// followed by its coordinates as 32-bit floats or as bytes, or as
+/// flat row-major arrays of floats or doubles. Reading such a file
+/// into R first means holding it as a double matrix on the R heap,
+/// and copying it again when the table converts it.
+///
+/// VectorFile memory-maps the file instead (see
+/// falconn::core::MappedFile), so the data never pass through R. A
+/// flat file whose coordinates have the precision of the table is
+/// used in place as the data of the table, with its pages read in as
+/// the table is built and queried. Any other file is converted into
+/// the table's own copy a chunk of points at a time, in parallel, and
+/// its mapping is dropped once the table is built.
+///
+/// Files are read in the native byte order.
+
+#ifndef FALCONNR_VECTOR_FILE_H
+#define FALCONNR_VECTOR_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "falconn/falconn_global.h"
+#include "falconn/core/serialization.h"
+#include "parallel.h"
+
+namespace falconnr {
+
+// Number of points converted at a time by a worker thread
+const int kVectorFileChunk = 4096;
+
+class VectorFileError : public falconn::FalconnError {
+  public:
+    VectorFileError(const char* msg) : falconn::FalconnError(msg) {}
+};
+
+// The points of a vector file, one after the other
+class VectorFile {
+  public:
+    // @param filename  -- path of the file
+    // @param format    -- "fvecs", "bvecs", "float" or "double" (the
+    //                     last two for flat row-major arrays)
+    // @param dimension -- dimension of the points; the dimension of
+    //                     fvecs and bvecs files is read from the file,
+    //                     and must match unless this is 0
+    //
+    VectorFile(const std::string& filename, const std::string& format,
+               int dimension)
+        : _file(filename), _format(format), _dimension(dimension),
+          _header_size(0) {
+        if ( format == "fvecs" || format == "bvecs" ) {
+            _coordinate_size = format == "fvecs" ? sizeof(float) : 1;
+            _header_size = sizeof(int32_t);
+            if ( _file.size() < sizeof(int32_t) ) {
+                throw VectorFileError("The vector file is empty.");
+            }
+            int32_t stored;
+            std::memcpy(&stored, _file.data(), sizeof(stored));
+            if ( stored <= 0 || (dimension > 0 && stored != dimension) ) {
+                throw VectorFileError(
+                    "The dimension in the vector file does not match.");
+            }
+            _dimension = stored;
+        } else if ( format == "float" || format == "double" ) {
+            _coordinate_size = format == "float" ? sizeof(float) : sizeof(double);
+            if ( dimension <= 0 ) {
+                throw VectorFileError(
+                    "A flat vector file needs the dimension of its points.");
+            }
+        } else {
+            throw VectorFileError("Unknown vector file format.");
+        }
+
+        _record_size = _header_size + _coordinate_size * _dimension;
+        if ( _file.size() % _record_size != 0 ) {
+            throw VectorFileError(
+                "The size of the vector file is not a whole number of points.");
+        }
+        if ( _file.size() / _record_size >
+             static_cast<size_t>(std::numeric_limits<int32_t>::max()) ) {
+            throw VectorFileError("The vector file has too many points.");
+        }
+        _num_points = static_cast<int>(_file.size() / _record_size);
+        if ( _num_points == 0 ) {
+            throw VectorFileError("The vector file is empty.");
+        }
+        if ( _header_size > 0 ) {
+            check_headers();
+        }
+    }
+
+    const std::string& format() const { return _format; }
+    int dimension() const { return _dimension; }
+    int num_points() const { return _num_points; }
+
+    // Bytes of the mapped file
+    size_t size() const { return _file.size(); }
+
+    // The coordinates in place, if the file is a flat array of
+    // CoordinateType, and nullptr otherwise
+    template <typename CoordinateType>
+    const CoordinateType* flat_data() const {
+        bool flat = _header_size == 0 && _coordinate_size == sizeof(CoordinateType) &&
+            (_format == "float") == (sizeof(CoordinateType) == sizeof(float));
+        return flat ? reinterpret_cast<const CoordinateType*>(_file.data()) : nullptr;
+    }
+
+    // Convert all points to CoordinateType, one after the other
+    template <typename CoordinateType>
+    void copy_points(std::vector<CoordinateType>* out) const {
+        out->resize(static_cast<size_t>(_num_points) * _dimension);
+        int num_chunks = (_num_points + kVectorFileChunk - 1) / kVectorFileChunk;
+        parallel_for(num_chunks, resolve_num_threads(0), 1, [&](int, int chunk) {
+            int first = chunk * kVectorFileChunk;
+            int end = std::min(_num_points, first + kVectorFileChunk);
+            for ( int ii = first; ii < end; ++ii ) {
+                copy_point(ii, out->data() + static_cast<size_t>(ii) * _dimension);
+            }
+        });
+    }
+
+  private:
+    falconn::core::MappedFile _file;
+    std::string               _format;
+    int                       _dimension;
+    int                       _num_points;
+    size_t                    _header_size;      // bytes before each point
+    size_t                    _coordinate_size;  // bytes per coordinate
+    size_t                    _record_size;      // bytes per point
+
+    const char* record(int index) const {
+        return _file.data() + static_cast<size_t>(index) * _record_size;
+    }
+
+    // Every point of an fvecs or bvecs file must have the same dimension
+    void check_headers() const {
+        for ( int ii = 0; ii < _num_points; ++ii ) {
+            int32_t stored;
+            std::memcpy(&stored, record(ii), sizeof(stored));
+            if ( stored != _dimension ) {
+                throw VectorFileError(
+                    "The points of the vector file differ in dimension.");
+            }
+        }
+    }
+
+    // The coordinates are copied with memcpy, since those of fvecs
+    // records need not be aligned
+    template <typename CoordinateType>
+    void copy_point(int index, CoordinateType* out) const {
+        const char* values = record(index) + _header_size;
+        if ( _format == "bvecs" ) {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(values);
+            for ( int jj = 0; jj < _dimension; ++jj ) {
+                out[jj] = static_cast<CoordinateType>(bytes[jj]);
+            }
+        } else if ( _format == "double" ) {
+            for ( int jj = 0; jj < _dimension; ++jj ) {
+                double value;
+                std::memcpy(&value, values + jj * sizeof(double), sizeof(double));
+                out[jj] = static_cast<CoordinateType>(value);
+            }
+        } else {
+            for ( int jj = 0; jj < _dimension; ++jj ) {
+                float value;
+                std::memcpy(&value, values + jj * sizeof(float), sizeof(float));
+                out[jj] = static_cast<CoordinateType>(value);
+            }
+        }
+    }
+};
+
+}  // namespace falconnr
+
+#endif
+
+// Local Variables:
+// mode: c++
+// End: